@@ -4,11 +4,16 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
+#include <math.h>
 
+#include <algorithm>
 #include <atomic>
+#include <new>
+#include <vector>
 
 #include "threading.h"
 #include "timing.h"
+#include "blackhole.h"
 #include <chrono>
 using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
@@ -24,7 +29,6 @@ using std::chrono::nanoseconds;
 #endif
 
 #ifdef BOOST
-#include <vector>
 #include <boost/lockfree/queue.hpp>
 using boost_q_t = boost::lockfree::queue<double>;
 std::vector<boost_q_t*> boost_queues;
@@ -48,24 +52,23 @@ void get_neighbor(const int rank, const int pex, const int pey, const int x,
   *yDn = (y != 0) ? rank - pex : -1;
 }
 
-void get_queue_id(const int x, const int y, const int pex, const int pey,
-                  int *xUpRx, int *xUpTx, int *xDnRx, int *xDnTx,
-                  int *yUpRx, int *yUpTx, int *yDnRx, int *yDnTx) {
-  int tmp;
-  *xDnRx = x + y * (pex - 1);
-  *xUpTx = *xDnRx + 1;
-  tmp = pey * (pex - 1); /* number of horizontally up queues */
-  *xUpRx = *xUpTx + tmp;
-  *xDnTx = *xDnRx + tmp;
-  tmp *= 2; /* number of horizontal queues */
-  *yDnRx = y + x * (pey - 1) + tmp;
-  *yUpTx = *yDnRx + 1;
-  tmp = pex * (pey - 1); /* number of vertically up queues */
-  *yUpRx = *yUpTx + tmp;
-  *yDnTx = *yDnRx + tmp;
-}
-
-void compute(long sleep_nsec) {
+void get_position3d(const int rank, const int pex, const int pey, int *myX,
+                    int *myY, int *myZ) {
+  *myX = rank % pex;
+  *myY = (rank / pex) % pey;
+  *myZ = rank / (pex * pey);
+}
+
+/* rank at (x,y,z), or -1 outside of the grid (no periodic boundary) */
+int get_rank3d(const int pex, const int pey, const int pez, const int x,
+               const int y, const int z) {
+  if (0 > x || pex <= x || 0 > y || pey <= y || 0 > z || pez <= z) {
+    return -1;
+  }
+  return x + (y + z * pey) * pex;
+}
+
+void idle(long sleep_nsec) {
   struct timespec sleepTS;
   struct timespec remainTS;
   sleepTS.tv_sec = 0;
@@ -75,16 +78,180 @@ void compute(long sleep_nsec) {
   }
 }
 
+enum pattern_t {
+  INCAST,
+  SWEEP2D,
+  HALO2D,
+  SWEEP3D,
+  HALO3D,
+  HALO3D26,
+  ALLREDUCE_RING,
+  ALLREDUCE_RD,
+  ALLTOALL,
+  NPATTERNS
+};
+const char *pattern_names[NPATTERNS] = {
+  "incast", "sweep2d", "halo2d", "sweep3d", "halo3d", "halo3d26",
+  "allreduce_ring", "allreduce_rd", "alltoall"
+};
+
 /* Global variables */
-int pex, pey, nthreads;
+int pex, pey, pez, nthreads;
+int kblocks; /* sweep3d pipeline depth: k-blocks per octant */
+pattern_t pattern;
 int repeats;
 int msgSz;
 long sleep_nsec;
+unsigned long computeTokens; /* blackhole iterations for sleep_nsec */
+long worksetSz;
+thread_local double *workset = nullptr;
 std::atomic< int > ready;
 #ifdef ZMQ
 void *ctx;
 #endif
 
+/*
+ * The compute phase is a calibrated busy loop, so that it keeps the core
+ * like a real kernel would instead of yielding it to the OS.  With a
+ * working set, it also streams a 3-point stencil over it, to put the
+ * cache pressure of a real stencil kernel on the communication.
+ */
+void compute() {
+  if (workset) {
+    const long n = worksetSz / sizeof(double);
+    long i;
+    for (i = 1; (n - 1) > i; ++i) {
+      workset[i] = (workset[i - 1] + workset[i] + workset[i + 1]) / 3.0;
+    }
+  }
+  blackhole(computeTokens);
+}
+
+#ifdef SHM
+/*
+ * Zero-copy shared-memory links.  A link is a mailbox of two message
+ * buffers owned by the sender, i.e. its send buffer, double-buffered: the
+ * sender packs a message straight into the free buffer and publishes it,
+ * and the receiver reads it in place and hands the buffer back.  Nothing
+ * is copied or allocated in between, like the shared-memory transport of
+ * an MPI library.
+ */
+struct shm_mbox_t {
+  alignas(64) std::atomic< unsigned long > posted;   /* written by sender */
+  alignas(64) std::atomic< unsigned long > consumed; /* written by receiver */
+  alignas(64) double *buf[2];
+};
+std::vector<shm_mbox_t*> shm_mboxes;
+thread_local double shm_sink; /* keeps the receive reads alive */
+
+/* A posted send or receive, done once shm_test() returned true */
+struct shm_req_t {
+  shm_mbox_t *mbox;
+  int bytes;
+  bool send;
+  bool done;
+};
+/* Requests of exchange() and halo3d(), sized once per rank before the ROI */
+thread_local std::vector<shm_req_t> shm_reqs;
+
+/* operator new does not honor alignas(64) before C++17 */
+shm_mbox_t *shm_new_mbox() {
+  void *mem;
+  if (posix_memalign(&mem, alignof(shm_mbox_t), sizeof(shm_mbox_t))) {
+    fprintf(stderr, "ERROR: cannot allocate mailbox.\n");
+    exit(1);
+  }
+  return new (mem) shm_mbox_t();
+}
+
+/* The sending worker allocates the buffers, so they are local to it */
+void shm_open_sender(shm_mbox_t *mbox) {
+  const size_t bytes = (msgSz + 63) & ~63UL;
+  if (posix_memalign((void**)&mbox->buf[0], 64, bytes) ||
+      posix_memalign((void**)&mbox->buf[1], 64, bytes)) {
+    fprintf(stderr, "ERROR: cannot allocate mailbox buffers.\n");
+    exit(1);
+  }
+  memset(mbox->buf[0], 0, bytes);
+  memset(mbox->buf[1], 0, bytes);
+}
+
+static inline bool shm_test(shm_req_t *req) {
+  shm_mbox_t *mbox = req->mbox;
+  const int ndoubles = req->bytes / sizeof(double);
+  unsigned long seq;
+  double *buf;
+  int i;
+  if (req->done) {
+    return true;
+  }
+  if (req->send) {
+    seq = mbox->posted.load(std::memory_order_relaxed);
+    if (2 <= seq - mbox->consumed.load(std::memory_order_acquire)) {
+      return false; /* both buffers still being read */
+    }
+    buf = mbox->buf[seq & 1];
+    for (i = 0; ndoubles > i; ++i) { /* pack in place */
+      buf[i] = seq + i;
+    }
+    mbox->posted.store(seq + 1, std::memory_order_release);
+  } else {
+    seq = mbox->consumed.load(std::memory_order_relaxed);
+    if (seq == mbox->posted.load(std::memory_order_acquire)) {
+      return false; /* nothing published yet */
+    }
+    buf = mbox->buf[seq & 1];
+    for (i = 0; ndoubles > i; ++i) { /* unpack from the sender's buffer */
+      shm_sink += buf[i];
+    }
+    mbox->consumed.store(seq + 1, std::memory_order_release);
+  }
+  req->done = true;
+  return true;
+}
+
+static inline void shm_isend(shm_mbox_t *mbox, const int bytes,
+                             shm_req_t *req) {
+  req->mbox = mbox;
+  req->bytes = bytes;
+  req->send = true;
+  req->done = false;
+  shm_test(req);
+}
+
+static inline void shm_irecv(shm_mbox_t *mbox, const int bytes,
+                             shm_req_t *req) {
+  req->mbox = mbox;
+  req->bytes = bytes;
+  req->send = false;
+  req->done = false;
+  shm_test(req);
+}
+
+/* Polls all requests in turn, a blocked send must not stall a receive */
+static inline void shm_waitall(shm_req_t *reqs, const int nreqs) {
+  int i, ndone;
+  do {
+    ndone = 0;
+    for (i = 0; nreqs > i; ++i) {
+      ndone += shm_test(&reqs[i]);
+    }
+  } while (nreqs != ndone);
+}
+
+static inline void shm_send(shm_mbox_t *mbox, const int bytes) {
+  shm_req_t req;
+  shm_isend(mbox, bytes, &req);
+  shm_waitall(&req, 1);
+}
+
+static inline void shm_recv(shm_mbox_t *mbox, const int bytes) {
+  shm_req_t req;
+  shm_irecv(mbox, bytes, &req);
+  shm_waitall(&req, 1);
+}
+#endif
+
 void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
 #ifdef ZMQ
            zmq_msg_t *msg,
@@ -100,6 +267,11 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
            vlendpt_t *xUpSend, vlendpt_t *xDnSend, vlendpt_t *yUpSend,
            vlendpt_t *yDnSend, vlendpt_t *xUpRecv, vlendpt_t *xDnRecv,
            vlendpt_t *yUpRecv, vlendpt_t *yDnRecv
+#elif SHM
+           double *msg,
+           shm_mbox_t *xUpSend, shm_mbox_t *xDnSend, shm_mbox_t *yUpSend,
+           shm_mbox_t *yDnSend, shm_mbox_t *xUpRecv, shm_mbox_t *xDnRecv,
+           shm_mbox_t *yUpRecv, shm_mbox_t *yDnRecv
 #endif
            ) {
 
@@ -134,6 +306,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       }
 #elif VL
       line_vl_pop_weak(xDnRecv, (uint8_t*)buf, &cnt);
+#elif SHM
+      shm_recv(xDnRecv, msgSz);
 #endif
     }
     if (-1 < yDn) {
@@ -146,13 +320,15 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       }
 #elif VL
       line_vl_pop_weak(yDnRecv, (uint8_t*)buf, &cnt);
+#elif SHM
+      shm_recv(yDnRecv, msgSz);
 #endif
     }
 
 #ifdef VL
     if (0 == idx) { /* only compute with completed messages */
 #endif
-    compute(sleep_nsec);
+    compute();
 #ifdef VL
     }
 #endif
@@ -169,6 +345,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       *blkId = idx;
       cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
       line_vl_push_strong(xUpSend, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#elif SHM
+      shm_send(xUpSend, msgSz);
 #endif
     }
     if (-1 < yUp) {
@@ -183,6 +361,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       *blkId = idx;
       cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
       line_vl_push_strong(yUpSend, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#elif SHM
+      shm_send(yUpSend, msgSz);
 #endif
     }
 
@@ -197,6 +377,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       }
 #elif VL
       line_vl_pop_weak(xUpRecv, (uint8_t*)buf, &cnt);
+#elif SHM
+      shm_recv(xUpRecv, msgSz);
 #endif
     }
     if (-1 < yDn) {
@@ -209,13 +391,15 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       }
 #elif VL
       line_vl_pop_weak(yDnRecv, (uint8_t*)buf, &cnt);
+#elif SHM
+      shm_recv(yDnRecv, msgSz);
 #endif
     }
 
 #ifdef VL
     if (0 == idx) { /* only compute with completed messages */
 #endif
-    compute(sleep_nsec);
+    compute();
 #ifdef VL
     }
 #endif
@@ -232,6 +416,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       *blkId = idx;
       cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
       line_vl_push_strong(xDnSend, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#elif SHM
+      shm_send(xDnSend, msgSz);
 #endif
     }
     if (-1 < yUp) {
@@ -246,6 +432,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       *blkId = idx;
       cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
       line_vl_push_strong(yUpSend, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#elif SHM
+      shm_send(yUpSend, msgSz);
 #endif
     }
 
@@ -260,6 +448,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       }
 #elif VL
       line_vl_pop_weak(xUpRecv, (uint8_t*)buf, &cnt);
+#elif SHM
+      shm_recv(xUpRecv, msgSz);
 #endif
     }
     if (-1 < yUp) {
@@ -272,13 +462,15 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       }
 #elif VL
       line_vl_pop_weak(yUpRecv, (uint8_t*)buf, &cnt);
+#elif SHM
+      shm_recv(yUpRecv, msgSz);
 #endif
     }
 
 #ifdef VL
     if (0 == idx) { /* only compute with completed messages */
 #endif
-    compute(sleep_nsec);
+    compute();
 #ifdef VL
     }
 #endif
@@ -295,6 +487,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       *blkId = idx;
       cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
       line_vl_push_strong(xDnSend, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#elif SHM
+      shm_send(xDnSend, msgSz);
 #endif
     }
     if (-1 < yDn) {
@@ -309,6 +503,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       *blkId = idx;
       cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
       line_vl_push_strong(yDnSend, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#elif SHM
+      shm_send(yDnSend, msgSz);
 #endif
     }
 
@@ -323,6 +519,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       }
 #elif VL
       line_vl_pop_weak(xDnRecv, (uint8_t*)buf, &cnt);
+#elif SHM
+      shm_recv(xDnRecv, msgSz);
 #endif
     }
     if (-1 < yUp) {
@@ -335,13 +533,15 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       }
 #elif VL
       line_vl_pop_weak(yUpRecv, (uint8_t*)buf, &cnt);
+#elif SHM
+      shm_recv(yUpRecv, msgSz);
 #endif
     }
 
 #ifdef VL
     if (0 == idx) { /* only compute with completed messages */
 #endif
-    compute(sleep_nsec);
+    compute();
 #ifdef VL
     }
 #endif
@@ -358,6 +558,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       *blkId = idx;
       cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
       line_vl_push_strong(xUpSend, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#elif SHM
+      shm_send(xUpSend, msgSz);
 #endif
     }
     if (-1 < yDn) {
@@ -372,6 +574,8 @@ void sweep(const int xUp, const int xDn, const int yUp, const int yDn,
       *blkId = idx;
       cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
       line_vl_push_strong(yDnSend, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#elif SHM
+      shm_send(yDnSend, msgSz);
 #endif
     }
 
@@ -397,6 +601,11 @@ void halo(const int xUp, const int xDn, const int yUp, const int yDn,
           vlendpt_t *xUpSend, vlendpt_t *xDnSend, vlendpt_t *yUpSend,
           vlendpt_t *yDnSend, vlendpt_t *xUpRecv, vlendpt_t *xDnRecv,
           vlendpt_t *yUpRecv, vlendpt_t *yDnRecv
+#elif SHM
+          double *msg,
+          shm_mbox_t *xUpSend, shm_mbox_t *xDnSend, shm_mbox_t *yUpSend,
+          shm_mbox_t *yDnSend, shm_mbox_t *xUpRecv, shm_mbox_t *xDnRecv,
+          shm_mbox_t *yUpRecv, shm_mbox_t *yDnRecv
 #endif
           ) {
 
@@ -410,9 +619,35 @@ void halo(const int xUp, const int xDn, const int yUp, const int yDn,
   uint16_t *blkId = (uint16_t*)buf; /* used to reorder cache blocks */
   uint16_t idx;
   size_t cnt;
+#elif SHM
+  shm_req_t reqs[8];
+  int nreqs;
 #endif
   for (i = 0; repeats > i; ++i) {
-    compute(sleep_nsec);
+#ifdef SHM
+    /* post all eight transfers and overlap them with the compute phase,
+     * which then packs the halo for the next iteration */
+    nreqs = 0;
+    if (-1 < xUp) {
+      shm_isend(xUpSend, msgSz, &reqs[nreqs++]);
+      shm_irecv(xUpRecv, msgSz, &reqs[nreqs++]);
+    }
+    if (-1 < xDn) {
+      shm_isend(xDnSend, msgSz, &reqs[nreqs++]);
+      shm_irecv(xDnRecv, msgSz, &reqs[nreqs++]);
+    }
+    if (-1 < yUp) {
+      shm_isend(yUpSend, msgSz, &reqs[nreqs++]);
+      shm_irecv(yUpRecv, msgSz, &reqs[nreqs++]);
+    }
+    if (-1 < yDn) {
+      shm_isend(yDnSend, msgSz, &reqs[nreqs++]);
+      shm_irecv(yDnRecv, msgSz, &reqs[nreqs++]);
+    }
+    compute();
+    shm_waitall(reqs, nreqs);
+#else
+    compute();
 
 #ifdef VL
     for (idx = 0; nblks > idx; ++idx) {
@@ -529,6 +764,7 @@ void halo(const int xUp, const int xDn, const int yUp, const int yDn,
 #ifdef VL
     } /* endof for (idx = 0; nblks > idx; ++idx) */
 #endif
+#endif /* SHM */
 
   }
 }
@@ -540,6 +776,8 @@ void incast(const bool isMaster,
             double *msg, boost_q_t *queue
 #elif VL
             double *msg, vlendpt_t *queue
+#elif SHM
+            double *msg, shm_mbox_t **queue
 #endif
             ) {
   int i, j;
@@ -554,7 +792,7 @@ void incast(const bool isMaster,
   size_t cnt;
 #endif
   for (i = 0; repeats > i; ++i) {
-    compute(sleep_nsec);
+    compute();
 
     if (isMaster) {
       for (j = nthreads - 1; 0 < j; --j) {
@@ -568,6 +806,8 @@ void incast(const bool isMaster,
         for (idx = 0; nblks > idx; ++idx) {
           line_vl_pop_weak(queue, (uint8_t*)buf, &cnt);
         }
+#elif SHM
+        shm_recv(queue[j], msgSz); /* one mailbox per sender */
 #endif
       }
     } else {
@@ -584,206 +824,571 @@ void incast(const bool isMaster,
         cnt = ((nblks - 1) > idx ? 7 : nblks % 7) * sizeof(double);
         line_vl_push_strong(queue, (uint8_t*)buf, cnt + sizeof(uint16_t));
       }
+#elif SHM
+      shm_send(queue[0], msgSz);
 #endif
     }
   }
 }
 
-void *worker(void *arg) {
-  int *pid = (int*) arg;
-  setAffinity(*pid);
+/*
+ * Channels and endpoints.  Every ordered pair of communicating ranks gets
+ * its own channel, chanId[src * nthreads + dst]; on queue backends incast
+ * maps all senders onto the single channel of rank 0.  A worker opens the sending end of
+ * (rank, peer) and the receiving end of (peer, rank) for each of its peers.
+ */
+#ifdef ZMQ
+typedef void *endpt_t;
+#elif BOOST
+typedef boost_q_t *endpt_t;
+#elif VL
+typedef vlendpt_t *endpt_t;
+#elif SHM
+typedef shm_mbox_t *endpt_t;
+#endif
 
-#ifdef EMBER_INCAST
-  bool isMaster = (0 == *pid);
-  double *buffer;
-  if (isMaster) {
-    buffer = (double*)malloc(nthreads * msgSz);
-  } else {
-    buffer = (double*)malloc(msgSz);
+std::vector<int> chanId;
+
+/* Shared-memory mailboxes have a single producer, so there incast keeps
+ * one channel per sender like the other patterns. */
+#ifdef SHM
+const bool sharedIncast = false;
+#else
+const bool sharedIncast = true;
+#endif
+
+int new_channel() {
+#ifdef ZMQ
+  static int nchannels = 0;
+  return nchannels++;
+#elif BOOST
+  boost_queues.push_back(new boost_q_t(msgSz / sizeof(double)));
+  return boost_queues.size() - 1;
+#elif VL
+  return mkvl(0);
+#elif SHM
+  shm_mboxes.push_back(shm_new_mbox());
+  return shm_mboxes.size() - 1;
+#endif
+}
+
+/* Recursive doubling runs on the largest power of two ranks; the first
+ * 2 * rem ranks fold pairwise onto their odd member before and after. */
+int rd_pof2() {
+  int pof2 = 1;
+  while (nthreads >= 2 * pof2) {
+    pof2 *= 2;
+  }
+  return pof2;
+}
+
+int rd_newrank(const int rank, const int rem) {
+  if (2 * rem > rank) {
+    return (rank & 1) ? rank / 2 : -1;
   }
+  return rank - rem;
+}
+
+int rd_oldrank(const int newrank, const int rem) {
+  return (rem > newrank) ? newrank * 2 + 1 : newrank + rem;
+}
+
+/* Ranks this rank sends to and receives from, in the current pattern */
+void get_peers(const int rank, std::vector<int> &peers) {
+  int x, y, z, dx, dy, dz, r, i;
+  peers.clear();
+  switch (pattern) {
+  case INCAST:
+    if (0 == rank) {
+      for (r = 1; nthreads > r; ++r) {
+        peers.push_back(r);
+      }
+    } else {
+      peers.push_back(0);
+    }
+    break;
+  case SWEEP2D:
+  case HALO2D:
+  case SWEEP3D:
+  case HALO3D:
+  case HALO3D26:
+    get_position3d(rank, pex, pey, &x, &y, &z);
+    for (dz = -1; 1 >= dz; ++dz) {
+      for (dy = -1; 1 >= dy; ++dy) {
+        for (dx = -1; 1 >= dx; ++dx) {
+          const int dist = abs(dx) + abs(dy) + abs(dz);
+          if (0 == dist || (HALO3D26 != pattern && 1 < dist)) {
+            continue;
+          }
+          r = get_rank3d(pex, pey, pez, x + dx, y + dy, z + dz);
+          if (-1 < r) {
+            peers.push_back(r);
+          }
+        }
+      }
+    }
+    break;
+  case ALLREDUCE_RING:
+    if (1 < nthreads) {
+      peers.push_back((rank + 1) % nthreads);
+    }
+    if (2 < nthreads) {
+      peers.push_back((rank + nthreads - 1) % nthreads);
+    }
+    break;
+  case ALLREDUCE_RD: {
+    const int pof2 = rd_pof2();
+    const int rem = nthreads - pof2;
+    const int newrank = rd_newrank(rank, rem);
+    if (2 * rem > rank) {
+      peers.push_back(rank ^ 1);
+    }
+    if (-1 < newrank) {
+      for (i = 1; pof2 > i; i <<= 1) {
+        peers.push_back(rd_oldrank(newrank ^ i, rem));
+      }
+    }
+    break;
+  }
+  case ALLTOALL:
+    for (r = 0; nthreads > r; ++r) {
+      if (rank != r) {
+        peers.push_back(r);
+      }
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+#ifndef SHM
+/* Number of transfer units a message takes on this backend */
+static inline int units(const int bytes) {
+#ifdef ZMQ
+  return 1;
+#elif BOOST
+  return (bytes + sizeof(double) - 1) / sizeof(double);
+#elif VL
+  return (bytes + 55) / 56;
+#endif
+}
+
+static inline void push_unit(endpt_t ep, const int bytes, const int idx) {
 #ifdef ZMQ
-  void *queue;
   zmq_msg_t msg;
-  if (isMaster) {
-    queue = zmq_socket(ctx, ZMQ_PULL);
-    assert(0 == zmq_bind(queue, "inproc://0"));
-    assert(0 == zmq_msg_init(&msg));
-  } else {
-    queue = zmq_socket(ctx, ZMQ_PUSH);
-    assert(0 == zmq_connect(queue, "inproc://0"));
+  assert(0 == zmq_msg_init_size(&msg, bytes));
+  assert(bytes == zmq_msg_send(&msg, ep, 0));
+#elif BOOST
+  while (!ep->push((double)idx));
+#elif VL
+  char buf[64];
+  uint16_t *blkId = (uint16_t*)buf; /* used to reorder cache blocks */
+  size_t cnt = bytes - idx * 56;
+  *blkId = idx;
+  if (56 < cnt) {
+    cnt = 56;
   }
+  line_vl_push_strong(ep, (uint8_t*)buf, cnt + sizeof(uint16_t));
+#endif
+}
+
+static inline void pop_unit(endpt_t ep, const int bytes) {
+#ifdef ZMQ
+  zmq_msg_t msg;
+  assert(0 == zmq_msg_init(&msg));
+  assert(bytes == zmq_msg_recv(&msg, ep, 0));
+  zmq_msg_close(&msg);
 #elif BOOST
-  double msg;
-  boost_q_t *queue = boost_queues[0];
+  double d;
+  while (!ep->pop(d));
 #elif VL
-  double msg;
-  vlendpt_t endpt;
-  vlendpt_t *queue = &endpt;
-  if (isMaster) {
-    open_byte_vl_as_consumer(1, queue, 1);
+  char buf[64];
+  size_t cnt;
+  line_vl_pop_weak(ep, (uint8_t*)buf, &cnt);
+#endif
+}
+#endif /* SHM */
+
+/*
+ * Send nsend and receive nrecv messages at once.  Like halo(), the units
+ * are interleaved over all links, so that every rank sending before it
+ * receives cannot fill up a bounded channel and deadlock.
+ */
+void exchange(const int nsend, endpt_t *sendEps, const int *sendBytes,
+              const int nrecv, endpt_t *recvEps, const int *recvBytes) {
+#ifdef SHM
+  /* no units to interleave, post everything and let waitall poll */
+  shm_req_t *reqs = shm_reqs.data();
+  int i;
+  for (i = 0; nsend > i; ++i) {
+    shm_isend(sendEps[i], sendBytes[i], &reqs[i]);
+  }
+  for (i = 0; nrecv > i; ++i) {
+    shm_irecv(recvEps[i], recvBytes[i], &reqs[nsend + i]);
+  }
+  shm_waitall(reqs, nsend + nrecv);
+#else
+  int i, idx, nunits = 0;
+  for (i = 0; nsend > i; ++i) {
+    nunits = std::max(nunits, units(sendBytes[i]));
+  }
+  for (i = 0; nrecv > i; ++i) {
+    nunits = std::max(nunits, units(recvBytes[i]));
+  }
+  for (idx = 0; nunits > idx; ++idx) {
+    for (i = 0; nsend > i; ++i) {
+      if (units(sendBytes[i]) > idx) {
+        push_unit(sendEps[i], sendBytes[i], idx);
+      }
+    }
+    for (i = 0; nrecv > i; ++i) {
+      if (units(recvBytes[i]) > idx) {
+        pop_unit(recvEps[i], recvBytes[i]);
+      }
+    }
+  }
+#endif
+}
+
+static inline endpt_t link_to(const std::vector<endpt_t> &eps, const int r) {
+  return (-1 < r) ? eps[r] : nullptr;
+}
+
+/*
+ * 3D halo exchange with the 6 face neighbors, or with all 26 neighbors for
+ * halo3d26.  A face carries msgSz bytes; as in a cubic subdomain whose face
+ * is msgSz, an edge carries one row of sqrt(msgSz / 8) doubles and a corner
+ * a single double.
+ */
+void halo3d(const int rank, const std::vector<endpt_t> &sendEp,
+            const std::vector<endpt_t> &recvEp) {
+  int x, y, z, dx, dy, dz, i;
+  const int edge = sizeof(double) * std::max(1, (int)sqrt(msgSz / sizeof(double)));
+  std::vector<endpt_t> sendEps, recvEps;
+  std::vector<int> bytes;
+
+  get_position3d(rank, pex, pey, &x, &y, &z);
+  for (dz = -1; 1 >= dz; ++dz) {
+    for (dy = -1; 1 >= dy; ++dy) {
+      for (dx = -1; 1 >= dx; ++dx) {
+        const int dist = abs(dx) + abs(dy) + abs(dz);
+        const int r = get_rank3d(pex, pey, pez, x + dx, y + dy, z + dz);
+        if (0 == dist || -1 == r || (HALO3D == pattern && 1 < dist)) {
+          continue;
+        }
+        sendEps.push_back(sendEp[r]);
+        recvEps.push_back(recvEp[r]);
+        bytes.push_back(1 == dist ? msgSz : (2 == dist ? edge : sizeof(double)));
+      }
+    }
+  }
+
+#ifdef SHM
+  const int nlinks = sendEps.size();
+  shm_req_t *reqs = shm_reqs.data();
+  int l;
+#endif
+  for (i = 0; repeats > i; ++i) {
+#ifdef SHM
+    /* as in halo(), overlap all transfers with the compute phase */
+    for (l = 0; nlinks > l; ++l) {
+      shm_isend(sendEps[l], bytes[l], &reqs[2 * l]);
+      shm_irecv(recvEps[l], bytes[l], &reqs[2 * l + 1]);
+    }
+    compute();
+    shm_waitall(reqs, 2 * nlinks);
+#else
+    compute();
+    exchange(sendEps.size(), sendEps.data(), bytes.data(),
+             recvEps.size(), recvEps.data(), bytes.data());
+#endif
+  }
+}
+
+/*
+ * KBA wavefront sweep (Koch, Baker and Alcouffe) on the pex x pey grid.
+ * Each rank owns a column of kblocks k-blocks.  For each of the 8 octants,
+ * a k-block waits for the upstream x and y faces, computes, and passes its
+ * own faces downstream, so neighboring ranks work on successive k-blocks
+ * in a pipeline.  The z direction of an octant only reverses the order of
+ * the k-blocks within a column, which is invisible to the messages.
+ */
+void sweep3d(const int rank, const std::vector<endpt_t> &sendEp,
+             const std::vector<endpt_t> &recvEp) {
+  int x, y, z, i, octant, k, nin, nout;
+  const int bytes[2] = {msgSz, msgSz};
+  endpt_t in[2], out[2];
+
+  get_position3d(rank, pex, pey, &x, &y, &z);
+  for (i = 0; repeats > i; ++i) {
+    for (octant = 0; 8 > octant; ++octant) {
+      const int dx = (octant & 1) ? -1 : 1;
+      const int dy = (octant & 2) ? -1 : 1;
+      const int xIn = get_rank3d(pex, pey, pez, x - dx, y, z);
+      const int yIn = get_rank3d(pex, pey, pez, x, y - dy, z);
+      const int xOut = get_rank3d(pex, pey, pez, x + dx, y, z);
+      const int yOut = get_rank3d(pex, pey, pez, x, y + dy, z);
+      nin = nout = 0;
+      if (-1 < xIn) in[nin++] = recvEp[xIn];
+      if (-1 < yIn) in[nin++] = recvEp[yIn];
+      if (-1 < xOut) out[nout++] = sendEp[xOut];
+      if (-1 < yOut) out[nout++] = sendEp[yOut];
+      for (k = 0; kblocks > k; ++k) {
+        exchange(0, nullptr, nullptr, nin, in, bytes);
+        compute();
+        exchange(nout, out, bytes, 0, nullptr, nullptr);
+      }
+    }
+  }
+}
+
+/*
+ * Ring allreduce: a reduce-scatter then an allgather, each of nthreads - 1
+ * steps that pass one msgSz / nthreads chunk to the right neighbor.
+ */
+void allreduce_ring(const int rank, const std::vector<endpt_t> &sendEp,
+                    const std::vector<endpt_t> &recvEp) {
+  int i, step;
+  if (1 == nthreads) {
+    for (i = 0; repeats > i; ++i) {
+      compute();
+    }
+    return;
+  }
+  const int chunk = std::max((int)(msgSz / nthreads), (int)sizeof(double));
+  endpt_t right = sendEp[(rank + 1) % nthreads];
+  endpt_t left = recvEp[(rank + nthreads - 1) % nthreads];
+
+  for (i = 0; repeats > i; ++i) {
+    compute();
+    for (step = 0; 2 * (nthreads - 1) > step; ++step) {
+      exchange(1, &right, &chunk, 1, &left, &chunk);
+    }
+  }
+}
+
+/*
+ * Recursive doubling allreduce: log2(nthreads) steps exchanging the whole
+ * message with the partner at distance 1, 2, 4, ...  Beyond the largest
+ * power of two, the extra ranks hand their data to a neighbor first and
+ * get the result back at the end.
+ */
+void allreduce_rd(const int rank, const std::vector<endpt_t> &sendEp,
+                  const std::vector<endpt_t> &recvEp) {
+  int i, mask;
+  const int pof2 = rd_pof2();
+  const int rem = nthreads - pof2;
+  const int newrank = rd_newrank(rank, rem);
+  endpt_t send, recv;
+
+  for (i = 0; repeats > i; ++i) {
+    compute();
+    if (2 * rem > rank) {
+      send = sendEp[rank ^ 1];
+      recv = recvEp[rank ^ 1];
+      if (-1 == newrank) {
+        exchange(1, &send, &msgSz, 0, nullptr, nullptr);
+      } else {
+        exchange(0, nullptr, nullptr, 1, &recv, &msgSz);
+      }
+    }
+    if (-1 < newrank) {
+      for (mask = 1; pof2 > mask; mask <<= 1) {
+        const int partner = rd_oldrank(newrank ^ mask, rem);
+        send = sendEp[partner];
+        recv = recvEp[partner];
+        exchange(1, &send, &msgSz, 1, &recv, &msgSz);
+      }
+    }
+    if (2 * rem > rank) {
+      send = sendEp[rank ^ 1];
+      recv = recvEp[rank ^ 1];
+      if (-1 == newrank) {
+        exchange(0, nullptr, nullptr, 1, &recv, &msgSz);
+      } else {
+        exchange(1, &send, &msgSz, 0, nullptr, nullptr);
+      }
+    }
+  }
+}
+
+/* Pairwise alltoall: at step k, send msgSz to rank + k, receive from rank - k */
+void alltoall(const int rank, const std::vector<endpt_t> &sendEp,
+              const std::vector<endpt_t> &recvEp) {
+  int i, k;
+  endpt_t send, recv;
+  for (i = 0; repeats > i; ++i) {
+    compute();
+    for (k = 1; nthreads > k; ++k) {
+      send = sendEp[(rank + k) % nthreads];
+      recv = recvEp[(rank + nthreads - k) % nthreads];
+      exchange(1, &send, &msgSz, 1, &recv, &msgSz);
+    }
+  }
+}
+
+void *worker(void *arg) {
+  int *pid = (int*) arg;
+  const int rank = *pid;
+  setAffinity(rank);
+
+  if (worksetSz) {
+    long i;
+    workset = (double*)malloc(worksetSz);
+    if (!workset) {
+      fprintf(stderr, "ERROR: cannot allocate %ld-byte working set.\n",
+              worksetSz);
+      exit(1);
+    }
+    for (i = 0; (long)(worksetSz / sizeof(double)) > i; ++i) {
+      workset[i] = i; /* also faults the pages in before the ROI */
+    }
+  }
+
+#ifdef ZMQ
+  zmq_msg_t msg[8];
+  char queue_str[64];
+#else
+  double msg[8];
+#endif
+  std::vector<endpt_t> sendEp(nthreads, nullptr);
+  std::vector<endpt_t> recvEp(nthreads, nullptr);
+#ifdef VL
+  std::vector<vlendpt_t> endpts(2 * nthreads);
+#endif
+  std::vector<int> peers;
+  const bool isMaster = (0 == rank);
+#ifndef SHM
+  endpt_t queue = nullptr;
+#endif
+
+  if (sharedIncast && INCAST == pattern) {
+#ifdef ZMQ
+    sprintf(queue_str, "inproc://%d", chanId[rank * nthreads]);
+    if (isMaster) {
+      queue = zmq_socket(ctx, ZMQ_PULL);
+      assert(0 == zmq_bind(queue, queue_str));
+      assert(0 == zmq_msg_init(&msg[0]));
+    } else {
+      queue = zmq_socket(ctx, ZMQ_PUSH);
+      assert(0 == zmq_connect(queue, queue_str));
+    }
+#elif BOOST
+    queue = boost_queues[chanId[rank * nthreads]];
+#elif VL
+    queue = &endpts[0];
+    if (isMaster) {
+      open_byte_vl_as_consumer(chanId[rank * nthreads], queue, 1);
+    } else {
+      open_byte_vl_as_producer(chanId[rank * nthreads], queue, 1);
+    }
+#endif
   } else {
-    open_byte_vl_as_producer(1, queue, 1);
+    get_peers(rank, peers);
+    for (const int p : peers) {
+      const int tx = chanId[rank * nthreads + p];
+      const int rx = chanId[p * nthreads + rank];
+#ifdef ZMQ
+      sendEp[p] = zmq_socket(ctx, ZMQ_PUSH);
+      recvEp[p] = zmq_socket(ctx, ZMQ_PULL);
+      sprintf(queue_str, "inproc://%d", tx);
+      assert(0 == zmq_bind(sendEp[p], queue_str));
+      sprintf(queue_str, "inproc://%d", rx);
+      assert(0 == zmq_connect(recvEp[p], queue_str));
+#elif BOOST
+      sendEp[p] = boost_queues[tx];
+      recvEp[p] = boost_queues[rx];
+#elif VL
+      sendEp[p] = &endpts[p];
+      recvEp[p] = &endpts[nthreads + p];
+      open_byte_vl_as_producer(tx, sendEp[p], 1);
+      open_byte_vl_as_consumer(rx, recvEp[p], 1);
+#elif SHM
+      sendEp[p] = shm_mboxes[tx];
+      recvEp[p] = shm_mboxes[rx];
+      shm_open_sender(sendEp[p]);
+#endif
+    }
   }
+#ifdef SHM
+  /* a rank sends to and receives from at most every other rank at once */
+  shm_reqs.resize(2 * nthreads);
 #endif
-#else /* NOT EMBER_INCAST */
+
   int x, y, xUp, xDn, yUp, yDn;
-  int xUpRx, xUpTx, xDnRx, xDnTx, yUpRx, yUpTx, yDnRx, yDnTx;
-
-  get_position(*pid, pex, pey, &x, &y);
-  get_neighbor(*pid, pex, pey, x, y, &xUp, &xDn, &yUp, &yDn);
-  get_queue_id(x, y, pex, pey, &xUpRx, &xUpTx, &xDnRx, &xDnTx,
-               &yUpRx, &yUpTx, &yDnRx, &yDnTx);
-#ifdef ZMQ
-  void *xUpSend = zmq_socket(ctx, ZMQ_PUSH);
-  void *xDnSend = zmq_socket(ctx, ZMQ_PUSH);
-  void *yUpSend = zmq_socket(ctx, ZMQ_PUSH);
-  void *yDnSend = zmq_socket(ctx, ZMQ_PUSH);
-  void *xUpRecv = zmq_socket(ctx, ZMQ_PULL);
-  void *xDnRecv = zmq_socket(ctx, ZMQ_PULL);
-  void *yUpRecv = zmq_socket(ctx, ZMQ_PULL);
-  void *yDnRecv = zmq_socket(ctx, ZMQ_PULL);
-  char queue_str[64];
-  zmq_msg_t msg[8];
-  if (-1 < xUp) {
-    sprintf(queue_str, "inproc://%d", xUpTx);
-    assert(0 == zmq_bind(xUpSend, queue_str));
-    sprintf(queue_str, "inproc://%d", xUpRx);
-    assert(0 == zmq_connect(xUpRecv, queue_str));
-  }
-  if (-1 < xDn) {
-    sprintf(queue_str, "inproc://%d", xDnTx);
-    assert(0 == zmq_bind(xDnSend, queue_str));
-    sprintf(queue_str, "inproc://%d", xDnRx);
-    assert(0 == zmq_connect(xDnRecv, queue_str));
-  }
-  if (-1 < yUp) {
-    sprintf(queue_str, "inproc://%d", yUpTx);
-    assert(0 == zmq_bind(yUpSend, queue_str));
-    sprintf(queue_str, "inproc://%d", yUpRx);
-    assert(0 == zmq_connect(yUpRecv, queue_str));
-  }
-  if (-1 < yDn) {
-    sprintf(queue_str, "inproc://%d", yDnTx);
-    assert(0 == zmq_bind(yDnSend, queue_str));
-    sprintf(queue_str, "inproc://%d", yDnRx);
-    assert(0 == zmq_connect(yDnRecv, queue_str));
-  }
-#elif BOOST
-  double msg[msgSz];
-  boost_q_t *xUpSend = nullptr;
-  boost_q_t *xUpRecv = nullptr;
-  boost_q_t *xDnSend = nullptr;
-  boost_q_t *xDnRecv = nullptr;
-  boost_q_t *yUpSend = nullptr;
-  boost_q_t *yUpRecv = nullptr;
-  boost_q_t *yDnSend = nullptr;
-  boost_q_t *yDnRecv = nullptr;
-
-  if (-1 < xUp) {
-    xUpSend = boost_queues[xUpTx];
-    xUpRecv = boost_queues[xUpRx];
-  }
-  if (-1 < xDn) {
-    xDnSend = boost_queues[xDnTx];
-    xDnRecv = boost_queues[xDnRx];
-  }
-  if (-1 < yUp) {
-    yUpSend = boost_queues[yUpTx];
-    yUpRecv = boost_queues[yUpRx];
-  }
-  if (-1 < yDn) {
-    yDnSend = boost_queues[yDnTx];
-    yDnRecv = boost_queues[yDnRx];
-  }
-#elif VL
-  double msg[msgSz];
-  vlendpt_t endpts[8];
-  vlendpt_t *xUpSend = &endpts[0];
-  vlendpt_t *xDnSend = &endpts[1];
-  vlendpt_t *yUpSend = &endpts[2];
-  vlendpt_t *yDnSend = &endpts[3];
-  vlendpt_t *xUpRecv = &endpts[4];
-  vlendpt_t *xDnRecv = &endpts[5];
-  vlendpt_t *yUpRecv = &endpts[6];
-  vlendpt_t *yDnRecv = &endpts[7];
-  if (-1 < xUp) {
-    open_byte_vl_as_producer(xUpTx, xUpSend, 1);
-    open_byte_vl_as_consumer(xUpRx, xUpRecv, 1);
-  }
-  if (-1 < xDn) {
-    open_byte_vl_as_producer(xDnTx, xDnSend, 1);
-    open_byte_vl_as_consumer(xDnRx, xDnRecv, 1);
-  }
-  if (-1 < yUp) {
-    open_byte_vl_as_producer(yUpTx, yUpSend, 1);
-    open_byte_vl_as_consumer(yUpRx, yUpRecv, 1);
-  }
-  if (-1 < yDn) {
-    open_byte_vl_as_producer(yDnTx, yDnSend, 1);
-    open_byte_vl_as_consumer(yDnRx, yDnRecv, 1);
-  }
-#endif
-
-#endif /* EMBER_INCAST */
+  get_position(rank, pex, pey, &x, &y);
+  get_neighbor(rank, pex, pey, x, y, &xUp, &xDn, &yUp, &yDn);
 
   ready++;
   while( nthreads != ready ){ /** spin **/ };
 
-#ifdef EMBER_INCAST
-  incast(isMaster, &msg, queue);
-#elif EMBER_SWEEP2D
-  sweep(xUp, xDn, yUp, yDn, msg,
-       xUpSend, xDnSend, yUpSend, yDnSend, xUpRecv, xDnRecv, yUpRecv, yDnRecv);
-#elif EMBER_HALO2D
-  halo(xUp, xDn, yUp, yDn, msg,
-       xUpSend, xDnSend, yUpSend, yDnSend, xUpRecv, xDnRecv, yUpRecv, yDnRecv);
+  switch (pattern) {
+  case INCAST:
+#ifdef SHM
+    incast(isMaster, msg, isMaster ? recvEp.data() : sendEp.data());
+#else
+    incast(isMaster, msg, queue);
 #endif
+    break;
+  case SWEEP2D:
+    sweep(xUp, xDn, yUp, yDn, msg,
+          link_to(sendEp, xUp), link_to(sendEp, xDn),
+          link_to(sendEp, yUp), link_to(sendEp, yDn),
+          link_to(recvEp, xUp), link_to(recvEp, xDn),
+          link_to(recvEp, yUp), link_to(recvEp, yDn));
+    break;
+  case HALO2D:
+    halo(xUp, xDn, yUp, yDn, msg,
+         link_to(sendEp, xUp), link_to(sendEp, xDn),
+         link_to(sendEp, yUp), link_to(sendEp, yDn),
+         link_to(recvEp, xUp), link_to(recvEp, xDn),
+         link_to(recvEp, yUp), link_to(recvEp, yDn));
+    break;
+  case SWEEP3D:
+    sweep3d(rank, sendEp, recvEp);
+    break;
+  case HALO3D:
+  case HALO3D26:
+    halo3d(rank, sendEp, recvEp);
+    break;
+  case ALLREDUCE_RING:
+    allreduce_ring(rank, sendEp, recvEp);
+    break;
+  case ALLREDUCE_RD:
+    allreduce_rd(rank, sendEp, recvEp);
+    break;
+  case ALLTOALL:
+    alltoall(rank, sendEp, recvEp);
+    break;
+  default:
+    break;
+  }
 
   /* comment out on purpose to exclude this from ROI.
-#ifdef EMBER_INCAST
+  if (sharedIncast && INCAST == pattern) {
 #ifdef ZMQ
-  assert(0 == zmq_close(queue));
+    assert(0 == zmq_close(queue));
 #elif VL
-  if (isMaster) {
-    close_byte_vl_as_consumer(queue);
-  } else {
-    close_byte_vl_as_producer(queue);
-  }
+    if (isMaster) {
+      close_byte_vl_as_consumer(queue);
+    } else {
+      close_byte_vl_as_producer(queue);
+    }
 #endif
-#else
+  } else {
+    for (const int p : peers) {
 #ifdef ZMQ
-  assert(0 == zmq_close(xUpSend));
-  assert(0 == zmq_close(xUpRecv));
-  assert(0 == zmq_close(xDnSend));
-  assert(0 == zmq_close(xDnRecv));
-  assert(0 == zmq_close(yUpSend));
-  assert(0 == zmq_close(yUpRecv));
-  assert(0 == zmq_close(yDnSend));
-  assert(0 == zmq_close(yDnRecv));
+      assert(0 == zmq_close(sendEp[p]));
+      assert(0 == zmq_close(recvEp[p]));
 #elif VL
-  if (-1 < xUp) {
-    close_byte_vl_as_producer(xUpSend);
-    close_byte_vl_as_consumer(xUpRecv);
-  }
-  if (-1 < xDn) {
-    close_byte_vl_as_producer(xDnSend);
-    close_byte_vl_as_consumer(xDnRecv);
-  }
-  if (-1 < yUp) {
-    close_byte_vl_as_producer(yUpSend);
-    close_byte_vl_as_consumer(yUpRecv);
-  }
-  if (-1 < yDn) {
-    close_byte_vl_as_producer(yDnSend);
-    close_byte_vl_as_consumer(yDnRecv);
-  }
+      close_byte_vl_as_producer(sendEp[p]);
+      close_byte_vl_as_consumer(recvEp[p]);
 #endif
-
-  free(xRecvBuffer);
-  free(xSendBuffer);
-  free(yRecvBuffer);
-  free(ySendBuffer);
+    }
+  }
   */
+  free(workset);
 
   return NULL;
 }
@@ -791,9 +1396,19 @@ void *worker(void *arg) {
 int main(int argc, char* argv[]) {
   int i;
   pex = pey = 2; /* default values */
+  pez = 1;
+  kblocks = 4;
   repeats = 7;
   msgSz = 7 * sizeof(double);
   sleep_nsec = 1000;
+  worksetSz = 0;
+#ifdef EMBER_INCAST
+  pattern = INCAST;
+#elif EMBER_SWEEP2D
+  pattern = SWEEP2D;
+#else
+  pattern = HALO2D;
+#endif
   for (i = 0; argc > i; ++i) {
     if (0 == strcmp("-pex", argv[i])) {
       pex = atoi(argv[i + 1]);
@@ -801,6 +1416,29 @@ int main(int argc, char* argv[]) {
     } else if (0 == strcmp("-pey", argv[i])) {
       pey = atoi(argv[i + 1]);
       ++i;
+    } else if (0 == strcmp("-pez", argv[i])) {
+      pez = atoi(argv[i + 1]);
+      ++i;
+    } else if (0 == strcmp("-kblocks", argv[i])) {
+      kblocks = atoi(argv[i + 1]);
+      ++i;
+    } else if (0 == strcmp("-pattern", argv[i])) {
+      int p;
+      for (p = 0; NPATTERNS > p; ++p) {
+        if (0 == strcmp(pattern_names[p], argv[i + 1])) {
+          break;
+        }
+      }
+      if (NPATTERNS == p) {
+        fprintf(stderr, "Unknown pattern %s, choose from:", argv[i + 1]);
+        for (p = 0; NPATTERNS > p; ++p) {
+          fprintf(stderr, " %s", pattern_names[p]);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+      }
+      pattern = (pattern_t)p;
+      ++i;
     } else if (0 == strcmp("-iterations", argv[i])) {
       repeats = atoi(argv[i + 1]);
       ++i;
@@ -810,43 +1448,46 @@ int main(int argc, char* argv[]) {
     } else if (0 == strcmp("-msgSz", argv[i])) {
       msgSz = atoi(argv[i + 1]);
       ++i;
+    } else if (0 == strcmp("-workset", argv[i])) {
+      worksetSz = atol(argv[i + 1]);
+      ++i;
     }
   }
-  printf("Px x Py:        %4d x %4d\n", pex, pey);
+  if (SWEEP2D == pattern || HALO2D == pattern || SWEEP3D == pattern) {
+    pez = 1; /* these decompose over the pex x pey plane only */
+  }
+  printf("Pattern:     %14s\n", pattern_names[pattern]);
+  printf("Px x Py x Pz: %3d x %3d x %3d\n", pex, pey, pez);
+  if (SWEEP3D == pattern) {
+    printf("K-blocks:             %5d\n", kblocks);
+  }
   printf("Message Size:         %5d\n", msgSz);
   printf("Iterations:           %5d\n", repeats);
-  nthreads = pex * pey;
+  computeTokens = blackhole_tokens_ns(sleep_nsec, 0);
+  printf("Compute (ns):         %5ld (%lu tokens)\n", sleep_nsec, computeTokens);
+  printf("Working Set:          %5ld\n", worksetSz);
+  nthreads = pex * pey * pez;
   ready = -1;
 
-#ifdef EMBER_INCAST
-
 #ifdef ZMQ
   ctx = zmq_ctx_new();
   assert(ctx);
-#elif BOOST
-  boost_queues.resize(1);
-  boost_queues[0] = new boost_q_t(msgSz / sizeof(double));
-#elif VL
-  mkvl(0);
 #endif
-
-#else /* NOT EMBER_INCAST */
-
-#ifdef ZMQ
-  ctx = zmq_ctx_new();
-  assert(ctx);
-#elif BOOST
-  boost_queues.resize(pex * pey * 4 - (pex + pey) * 2 + 1);
-  for (i = 0; (pex * pey * 4) - (pex + pey) * 2 >= i; ++i) {
-    boost_queues[i] = new boost_q_t(msgSz / sizeof(double));
-  }
-#elif VL
-  for (i = 0; (pex * pey * 4) - (pex + pey) * 2 > i; ++i) {
-    mkvl(0);
+  chanId.assign(nthreads * nthreads, -1);
+  if (sharedIncast && INCAST == pattern) {
+    const int id = new_channel();
+    for (i = 0; nthreads > i; ++i) {
+      chanId[i * nthreads] = id;
+    }
+  } else {
+    std::vector<int> peers;
+    for (i = 0; nthreads > i; ++i) {
+      get_peers(i, peers);
+      for (const int p : peers) {
+        chanId[i * nthreads + p] = new_channel();
+      }
+    }
   }
-#endif
-
-#endif /* EMBER_INCAST */
 
   pthread_t threads[nthreads];
   int ids[nthreads];
@@ -854,7 +1495,7 @@ int main(int argc, char* argv[]) {
     ids[i] = i;
     pthread_create(&threads[i], NULL, worker, (void *)&ids[i]);
   }
-  compute(1000000);
+  idle(1000000);
 
   const uint64_t beg_tsc = rdtsc();
   const auto beg(high_resolution_clock::now());
@@ -12,6 +12,11 @@
 //#include <assert.h>
 #include <cassert>
 
+#include <sched.h>
+#ifdef NUMA_AVAILABLE
+#include <numa.h>
+#endif
+
 #include "fluid.hpp"
 #include "cellpool.hpp"
 
@@ -32,48 +37,77 @@
 //#define ENABLE_MALLOC_FALLBACK
 
 #ifndef ENABLE_MALLOC_FALLBACK
-//Allocate and initialize a new data block for `cells' number of cells
-//Data blocks will have the following format:
+//Allocate a new data block for `cells' number of cells, on the NUMA node of the pool
+//if it is bound to one. Data blocks will have the following format:
 //
 //   | struct datablockhdr | struct Cell | struct Cell | ..... |
 //
-//The cells inside the block will be connected to a NULL-terminated linked list
-//with the cell at the lowest memory location being the first of its elements.
-static struct datablockhdr *cellpool_allocblock(int cells) {
+//The cells are not touched until they are carved into runs, so without libnuma
+//the pages still end up on the node of the thread that uses them first.
+static void cellpool_allocblock(cellpool *pool, int cells) {
   struct datablockhdr *block = nullptr;
-  struct Cell *temp1, *temp2;
-  int i;
+  size_t size = sizeof(struct datablockhdr) + (size_t)cells * sizeof(struct Cell);
+  int node = -1;
 
   //allocate a full block
-  assert(cells > 0);
+  assert(cells > 0 && cells % CELLPOOL_RUN == 0);
+#ifdef NUMA_AVAILABLE
+  if(pool->node >= 0 && -1 != numa_available()) {
+    block = (struct datablockhdr *)numa_alloc_onnode(size, pool->node);
+    node = pool->node;
+  }
+#endif
+  if(block == nullptr) {
+    node = -1;
 #if defined(WIN32)
-  block = (struct datablockhdr *)_aligned_malloc(sizeof(struct datablockhdr) + cells * sizeof(struct Cell), CACHELINE_SIZE);
-  assert(block);
+    block = (struct datablockhdr *)_aligned_malloc(size, CACHELINE_SIZE);
 #elif defined(SPARC_SOLARIS)
-  block = (struct datablockhdr *)memalign(CACHELINE_SIZE, sizeof(struct datablockhdr) + cells * sizeof(struct Cell));
+    block = (struct datablockhdr *)memalign(CACHELINE_SIZE, size);
 #else
-  int rv = posix_memalign((void **)(&block), CACHELINE_SIZE, sizeof(struct datablockhdr) + cells * sizeof(struct Cell));
-  assert(!rv);
+    if(posix_memalign((void **)(&block), CACHELINE_SIZE, size) != 0)
+      block = nullptr;
 #endif
+  }
+  if(block == nullptr) {
+    std::cerr << "Error allocating " << size << " bytes for the cell pool. Aborting." << std::endl;
+    exit(1);
+  }
+
+  //initialize header, the cells are carved from it as needed
+  block->next = pool->datablocks;
+  block->size = size;
+  block->node = node;
+  pool->datablocks = block;
+  pool->fresh = (struct Cell *)(block+1);
+  pool->numFresh = cells;
+  pool->alloc += cells;
+}
 
-  //initialize header and cells
-  block->next = nullptr;
-  temp1 = (struct Cell *)(block+1);
-  for(i=0; i<cells; i++) {
+//Take an available run, or carve a new one from the last data block
+static Cell *cellpool_getrun(cellpool *pool) {
+  struct Cell *run = pool->runs;
+
+  if(run != nullptr) {
+    pool->runs = run->next;
+    return run;
+  }
+
+  //If no more cells available then allocate more
+  if(pool->numFresh == 0) {
+    //keep doubling the number of cells
+    cellpool_allocblock(pool, pool->grow);
+    pool->grow = 2 * pool->grow;
+  }
+  run = pool->fresh;
+  for(int i=0; i<CELLPOOL_RUN; i++) {
     //If all structures are correctly padded then all pointers should also be correctly aligned,
     //but let's verify that nevertheless because the padding might change.
-    assert((uint64_t)(temp1) % sizeof(void *) == 0);
-    if(i != cells-1) {
-      temp2 = temp1 + 1;
-      temp1->next = temp2;
-      temp1 = temp2;
-    } else {
-      //last Cell structure in block
-      temp1->next = nullptr;
-    }
+    assert((uint64_t)(&run[i]) % sizeof(void *) == 0);
+    run[i].run = i+1;
   }
-
-  return block;
+  pool->fresh += CELLPOOL_RUN;
+  pool->numFresh -= CELLPOOL_RUN;
+  return run;
 }
 
 //Initialize the memory pool
@@ -86,43 +120,59 @@ void cellpool_init(cellpool *pool, int particles) {
   assert(pool != nullptr);
   assert(particles > 0);
 
-  //Allocate the initial data, let's start with 4 times more cells than
-  //best case (ignoring statically allocated Cells structures)
-  pool->alloc = 4 * (particles/PARTICLES_PER_CELL); //PARTICLES_PER_CELL particles per cell structure
-  pool->alloc = pool->alloc < ALLOC_MIN_CELLS ? ALLOC_MIN_CELLS : pool->alloc;
-  pool->datablocks = cellpool_allocblock(pool->alloc);
-  pool->cells = (struct Cell *)(pool->datablocks + 1);
+  //The first data block is allocated by the first request. Let's start with 4
+  //times more cells than best case (ignoring statically allocated Cells structures)
+  pool->grow = 4 * (particles/PARTICLES_PER_CELL); //PARTICLES_PER_CELL particles per cell structure
+  pool->grow = pool->grow < ALLOC_MIN_CELLS ? ALLOC_MIN_CELLS : pool->grow;
+  pool->grow = (pool->grow + CELLPOOL_RUN-1) / CELLPOOL_RUN * CELLPOOL_RUN;
+  pool->runs = nullptr;
+  pool->fresh = nullptr;
+  pool->numFresh = 0;
+  pool->alloc = 0;
+  pool->node = -1;
+  pool->datablocks = nullptr;
 }
 
-//Get a Cell structure from the memory pool
-Cell *cellpool_getcell(cellpool *pool) {
+//Allocate the data blocks of pool on the NUMA node the calling thread runs on
+void cellpool_bind(cellpool *pool) {
+  assert(pool != nullptr);
+#ifdef NUMA_AVAILABLE
+  if(-1 != numa_available()) {
+    pool->node = numa_node_of_cpu(sched_getcpu());
+  }
+#endif
+}
+
+//Get a Cell structure from the memory pool to append to the list ending in last
+Cell *cellpool_getcell(cellpool *pool, Cell *last) {
   struct Cell *temp;
 
   assert(pool != nullptr);
-
-  //If no more cells available then allocate more
-  if(pool->cells == nullptr) {
-    //keep doubling the number of cells
-    struct datablockhdr *block = cellpool_allocblock(pool->alloc);
-    pool->alloc = 2 * pool->alloc;
-    block->next = pool->datablocks;
-    pool->datablocks = block;
-    pool->cells = (struct Cell *)(pool->datablocks + 1);
+  assert(last != nullptr);
+
+  //lists take the cells of a run in order, so the cell after last in its run
+  //is still free as long as last ends its list
+  if(last->run > 0 && last->run < CELLPOOL_RUN) {
+    temp = last + 1;
+  } else {
+    temp = cellpool_getrun(pool);
   }
-
-  //return first cell in list
-  temp = pool->cells;
-  pool->cells = temp->next;
   temp->next = nullptr;
   return temp;
 }
 
 //Return a Cell structure to the memory pool
+//Its run goes back once the last of its cells in the list is returned, until
+//then the cells before it can still be read
 void cellpool_returncell(cellpool *pool, Cell *cell) {
   assert(pool != nullptr);
   assert(cell != nullptr);
-  cell->next = pool->cells;
-  pool->cells = cell;
+  assert(cell->run > 0);
+  if(cell->run == CELLPOOL_RUN || cell->next != cell + 1) {
+    struct Cell *run = cell - (cell->run - 1);
+    run->next = pool->runs;
+    pool->runs = run;
+  }
 }
 
 //Destroy the memory pool
@@ -135,12 +185,19 @@ void cellpool_destroy(cellpool *pool) {
   while(ptr != nullptr) {
     temp = ptr;
     ptr = ptr->next;
+#ifdef NUMA_AVAILABLE
+    if(temp->node >= 0) {
+      numa_free(temp, temp->size);
+      continue;
+    }
+#endif
 #if defined(WIN32)
     _aligned_free(temp);
 #else
     free(temp);
 #endif
   }
+  pool->datablocks = nullptr;
 }
 
 #else //ENABLE_MALLOC_FALLBACK
@@ -150,12 +207,18 @@ void cellpool_init(cellpool *pool, int particles) {
   std::cout << "WARNING: Malloc fallback enabled for cell pool." << std::endl;
 }
 
+//Do nothing because there is no cell pool
+void cellpool_bind(cellpool *pool) {
+}
+
 //Get a Cell structure
-Cell *cellpool_getcell(cellpool *pool) {
+Cell *cellpool_getcell(cellpool *pool, Cell *last) {
   Cell *cell;
 
   cell = (struct Cell *)malloc(sizeof(struct Cell));
   assert(cell != nullptr);
+  cell->next = nullptr;
+  cell->run = 0;
   return cell;
 }
 
@@ -250,7 +313,7 @@ int main() {
   int nCells = 2 * 1000 * 1000; //test with 2 million cells
   const int size_array = 389; //number of statically allocated cells (a prime number)
   struct Cell cells[size_array]; //array of dummy cells, serves as entry points for lists
-  cellpool *pool;
+  cellpool pool;
   int i;
 
   printf("Initializing...\n");fflush(nullptr);
@@ -271,12 +334,12 @@ int main() {
     struct Cell *ptr, *temp;
 
     //get a new cell and append it to lists in round-robin way
-    temp = cellpool_getcell(pool);
-    write_cell(temp);
     ptr = &(cells[i % size_array]);
     while(ptr->next != nullptr) {
       ptr = ptr->next;
     }
+    temp = cellpool_getcell(&pool, ptr);
+    write_cell(temp);
     ptr->next = temp;
 
     //print a progress message every 1/10th of the work
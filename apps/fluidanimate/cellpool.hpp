@@ -4,33 +4,52 @@
 //   1.) To minimize calls to malloc and free as much as possible
 //   2.) To reuse cell structures as much as possible
 //   3.) To eliminate unnecessary synchronization for memory allocation
+//
+// Each thread has a pool of its own. Cells are handed out in runs of
+// CELLPOOL_RUN cells that are contiguous in memory: the cells appended to a
+// list come from the run of the cell they are appended to for as long as it
+// has room, so the cells of one list are adjacent. A run goes back to the pool
+// whole, once the last of its cells in the list is returned. The pool refills
+// in bulk from blocks of memory allocated on the NUMA node of its thread.
 
 #ifndef __CELLPOOL_HPP__
 #define __CELLPOOL_HPP__ 1
 
-#include "fluid.hpp"
+#include <stddef.h>
 
+#include "fluid.hpp"
 
+//Cells in a run. Most lists need no more than one or two cells beyond their
+//statically allocated head, so longer runs mostly waste memory
+#ifndef CELLPOOL_RUN
+#define CELLPOOL_RUN 2
+#endif
 
-//A simple list of data blocks headers, required for internal memory management of pool
-//NOTE: Do not add additional member variables or the padding might be wrong.
-struct datablockhdr {
+//Header of a block of memory allocated by a pool, the cells follow it
+struct alignas(CACHELINE_SIZE) datablockhdr {
   struct datablockhdr *next;
-  //NOTE: This form of padding will break if additional variables are added to the structure
-  //because it does not account for compiler-inserted padding between structure members.
-  char padding[CACHELINE_SIZE - sizeof(datablockhdr *) % CACHELINE_SIZE];
+  //bytes allocated, header included
+  size_t size;
+  //NUMA node the block was allocated on, -1 if left to the first touch
+  int node;
 };
 
 //The memory pool data structure
-//The allocated memory is accessible twice: As a linked list of cells and also as a linked
-//list of data blocks. The data blocks preserve the original block structure as returned
-//by malloc, the cell list breaks the blocks down into smaller cell structures which can
-//be used by the program as needed.
+//Free runs form a linked list through the first cell of each run. New runs
+//are carved from the last block allocated, so its memory is first touched by
+//the thread that uses the cells
 struct cellpool {
-  //linked list of available cells
-  struct Cell *cells;
+  //linked list of available runs
+  struct Cell *runs;
+  //cells of the last data block not yet carved into runs
+  struct Cell *fresh;
+  int numFresh;
   //number of cells allocated so far (NOT number of cells currently available in pool)
   int alloc;
+  //number of cells of the next data block
+  int grow;
+  //NUMA node of the thread using the pool, -1 until cellpool_bind
+  int node;
   //linked list of allocated data blocks (required for free operation)
   struct datablockhdr *datablocks;
 };
@@ -42,10 +61,14 @@ struct cellpool {
 //number of particles that the pool is expected to manage
 void cellpool_init(cellpool *pool, int particles);
 
-//Get a Cell structure from the memory pool
-Cell *cellpool_getcell(cellpool *pool);
+//Allocate the data blocks of pool on the NUMA node the calling thread runs on
+//from now on, meant for the thread that owns the pool
+void cellpool_bind(cellpool *pool);
+
+//Get a Cell structure from the memory pool to append to the list ending in last
+Cell *cellpool_getcell(cellpool *pool, Cell *last);
 
-//Return a Cell structure to the memory pool
+//Return a Cell structure to the memory pool, in the order of its list
 void cellpool_returncell(cellpool *pool, Cell *cell);
 
 //Destroy the memory pool
@@ -30,6 +30,10 @@ typedef unsigned __int8 uint8_t;
 //Maximum number of particles in a physical cell
 #define PARTICLES_PER_CELL 16
 
+//Enable to store the particles of a physical cell as structure of arrays, with
+//contiguous x[], y[] and z[] for each quantity, instead of arrays of Vec3
+//#define ENABLE_SOA
+
 
 
 #ifndef ENABLE_DOUBLE_PRECISION
@@ -73,9 +77,10 @@ static inline int bswap_int32(int x) {
 
 //#define VEC3_VECTORIZED
 
-#if defined (__ICC) && defined (VEC3_VECTORIZED)
+#if defined (VEC3_VECTORIZED) && (defined (__ICC) || defined (__SSE4_1__))
 
 #include "smmintrin.h"
+#include <string.h>
 
 #ifndef ENABLE_DOUBLE_PRECISION
 
@@ -378,6 +383,54 @@ public:
 // the particles in that region. A physical cell is the Cell structure defined
 // below. Each logical cell is implemented of a linked list of physical cells.
 
+#ifdef ENABLE_SOA
+
+// Reference to a Vec3 spread over the x[], y[] and z[] arrays of a Vec3Block,
+// so that code written for arrays of Vec3 works unchanged on either layout
+class Vec3Ref
+{
+public:
+  fptype &x, &y, &z;
+
+  Vec3Ref(fptype &_x, fptype &_y, fptype &_z) : x(_x), y(_y), z(_z) {}
+  operator Vec3() const                      { return Vec3(x, y, z); }
+
+  Vec3Ref & operator = (Vec3Ref const &v)    { return *this = Vec3(v); }
+  Vec3Ref & operator = (Vec3 const &v)       { x = v.x;  y = v.y; z = v.z; return *this; }
+  Vec3Ref & operator += (Vec3 const &v)      { x += v.x;  y += v.y; z += v.z; return *this; }
+  Vec3Ref & operator -= (Vec3 const &v)      { x -= v.x;  y -= v.y; z -= v.z; return *this; }
+  Vec3Ref & operator *= (fptype s)           { x *= s;  y *= s; z *= s; return *this; }
+
+  fptype  GetLengthSq() const                 { return x*x + y*y + z*z; }
+  Vec3    operator + (Vec3 const &v) const    { return Vec3(x+v.x, y+v.y, z+v.z); }
+  Vec3    operator - () const                 { return Vec3(-x, -y, -z); }
+  Vec3    operator - (Vec3 const &v) const    { return Vec3(x-v.x, y-v.y, z-v.z); }
+  Vec3    operator * (fptype s) const         { return Vec3(x*s, y*s, z*s); }
+};
+
+// PARTICLES_PER_CELL vectors stored as structure of arrays
+struct Vec3Block
+{
+  fptype x[PARTICLES_PER_CELL];
+  fptype y[PARTICLES_PER_CELL];
+  fptype z[PARTICLES_PER_CELL];
+
+  Vec3Ref operator [] (int i)       { return Vec3Ref(x[i], y[i], z[i]); }
+  Vec3    operator [] (int i) const { return Vec3(x[i], y[i], z[i]); }
+};
+
+//Actual particle data stored in the cells
+#define CELL_CONTENTS \
+  Vec3Block p; \
+  Vec3Block hv; \
+  Vec3Block v; \
+  Vec3Block a; \
+  fptype density[PARTICLES_PER_CELL];
+
+#define CELL_LAYOUT "soa"
+
+#else
+
 //Actual particle data stored in the cells
 #define CELL_CONTENTS \
   Vec3 p[PARTICLES_PER_CELL]; \
@@ -386,10 +439,15 @@ public:
   Vec3 a[PARTICLES_PER_CELL]; \
   fptype density[PARTICLES_PER_CELL];
 
+#define CELL_LAYOUT "aos"
+
+#endif //ENABLE_SOA
+
 //Helper structure for padding calculation, not used directly by the program
 struct Cell_aux {
   CELL_CONTENTS
   Cell_aux *next;
+  int run;
   //dummy variable so we can reference the end of the payload data
   char padding;
 };
@@ -398,10 +456,27 @@ struct Cell_aux {
 struct Cell {
   CELL_CONTENTS
   Cell *next;
+  //position of the cell in its run of the cell pool from 1, 0 if not from a pool
+  int run;
   //padding to force cell size to a multiple of estimated cache line size
 //#pragma warning( disable : 1684) // warning #1684: conversion from pointer to same-sized integral type (potential portability problem)
   char padding[CACHELINE_SIZE - (offsetof(struct Cell_aux, padding) % CACHELINE_SIZE)];
-  Cell() { next = nullptr; }
+  Cell() { next = nullptr; run = 0; }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+//Range of cells of the spatial partition a thread works on, padded to a cache
+//line to avoid false sharing
+union Grid
+{
+  struct
+  {
+    int sx, sy, sz;
+    int ex, ey, ez;
+  }ind;
+
+  unsigned char pp[CACHELINE_SIZE];
 };
 
 ////////////////////////////////////////////////////////////////////////////////
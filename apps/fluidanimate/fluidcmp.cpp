@@ -3,9 +3,16 @@
  * Use this program to verify correct execution of fluidanimate
  */
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <cstdlib>
 #include <iostream>
-#include <fstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 
 //#include <string.h>
 #include <cstring>
@@ -16,6 +23,8 @@
 
 #include "fluid.hpp"
 #include "fluidcmp.hpp"
+#include "fluidfile.hpp"
+#include "simd.hpp"
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -52,208 +61,332 @@ struct conf_t {
     bool doTest;
     float tol;
   } bbox;
+  //how the files are compared
+  struct {
+    int threads;    //0 for all cores
+    bool stop;      //at the first mismatch of a particle
+    bool match;     //pair particles by position instead of by index
+  } run;
 };
 
 
-//A fluid as read in from a fluid file
-struct fluid_t {
-  float restParticlesPerMeter;
-  int numParticles;
-  Vec3 *p;
-  Vec3 *hv;
-  Vec3 *v;
-  //Axis-aligned bounding box containing all particles
-  struct {
-    Vec3 min;
-    Vec3 max;
-  } bbox;
+//Particles compared at a time by each thread, few enough for the fields of
+//both files to stay in L2
+#define BLOCK_PARTICLES 1024
+//Blocks the kernel is asked to read ahead at a time
+#define READAHEAD_BLOCKS 64
+
+//The tests that compare particles one by one, each on three fields x, y, z
+enum { TEST_POS = 0, TEST_VEL = 1, NUM_TESTS = 2 };
+static const int testField[NUM_TESTS] = {0, 6};
+
+//What one thread found over its range of particles
+struct cmp_stats {
+  long compared;
+  //absolute error of each test, over all three components
+  double sum[NUM_TESTS];
+  float max[NUM_TESTS];
+  long mismatches[NUM_TESTS];
+  //first mismatching particles of each test, at most conf_t::output.max
+  std::vector<int> shown[NUM_TESTS];
+  //axis-aligned bounding box of the particles of each file
+  float lo[2][3];
+  float hi[2][3];
 };
 
-////////////////////////////////////////////////////////////////////////////////
+//Particle i of field k of v
+static inline float Field(const fluidfile_view *v, int k, int i) {
+  float x = v->field[k][(size_t)i*v->stride];
+  return v->swap ? bswap_float(x) : x;
+}
 
-//Allocates the arrays required to store a fluid of size `s'
-void malloc_fluid(fluid_t *f, size_t size) {
-  assert(f!=nullptr);
-  f->p = (Vec3 *)malloc(sizeof(Vec3) * size);
-  f->hv = (Vec3 *)malloc(sizeof(Vec3) * size);
-  f->v = (Vec3 *)malloc(sizeof(Vec3) * size);
-  if(f->p == nullptr || f->hv == nullptr || f->v == nullptr ) {
-    printf("Error allocating memory for fluid\n");
-    exit(1);
+//Ask the kernel to read the wanted fields of particles [first, first+n) of v
+//while the blocks before them are compared
+static void ReadAhead(const fluidfile_view *v, int first, int n, const bool *want) {
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k) {
+    if(!want[k]) continue;
+    uintptr_t beg = (uintptr_t)(v->field[k] + (size_t)first*v->stride) & ~(page-1);
+    uintptr_t end = (uintptr_t)(v->field[k] + (size_t)(first+n)*v->stride);
+    madvise((void *)beg, end - beg, MADV_WILLNEED);
+    //the particles of an interleaved file hold all fields
+    if(v->stride != 1) break;
   }
 }
 
-//Free all dynamically allocated storage for a fluid
-void free_fluid(fluid_t *f) {
-  assert(f!=nullptr);
-  free(f->p);
-  free(f->hv);
-  free(f->v);
+//Point blk[k] at particles [first, first+n) of each wanted field k of v,
+//copying them into scratch when the file interleaves or byte swaps them
+static void LoadBlock(const fluidfile_view *v, int first, int n, const bool *want,
+                      float *scratch, const float **blk) {
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k) {
+    if(!want[k]) continue;
+    if(v->stride == 1 && !v->swap) {
+      blk[k] = v->field[k] + first;
+      continue;
+    }
+    float *dst = scratch + k*BLOCK_PARTICLES;
+    for(int i = 0; i < n; ++i)
+      dst[i] = Field(v, k, first + i);
+    blk[k] = dst;
+  }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-void ReadFile(char const *fileName, fluid_t *f)
-{
-  assert(fileName);
-  assert(f);
+static inline void Mismatch(cmp_stats *s, int t, int index, int maxShown) {
+  if(s->mismatches[t]++ < maxShown) s->shown[t].push_back(index);
+}
 
-  std::ifstream file(fileName, std::ios::binary);
-  if(!file) {
-    std::cerr << "Error opening file. Aborting." << std::endl;
-    exit(1);
-  }
+#ifndef ENABLE_DOUBLE_PRECISION
+static inline simd::vfloat AbsDiff(simd::vfloat a, simd::vfloat b) {
+  return simd::max(simd::sub(a, b), simd::sub(b, a));
+}
+#endif
 
-  //Always use single precision float variables b/c file format uses single precision
-  float restParticlesPerMeter_le;
-  int numParticles_le;
-  file.read((char *)&restParticlesPerMeter_le, FILE_SIZE_FLOAT);
-  file.read((char *)&numParticles_le, FILE_SIZE_INT);
-  if(!isLittleEndian()) {
-    f->restParticlesPerMeter = bswap_float(restParticlesPerMeter_le);
-    f->numParticles          = bswap_int32(numParticles_le);
-  } else {
-    f->restParticlesPerMeter = restParticlesPerMeter_le;
-    f->numParticles          = numParticles_le;
+//Compare the three fields of test t of a block of n particles, the first of
+//which is particle first; a component is off if it is not within tol, NaN
+//included
+static void CompareBlock(const float *const *a, const float *const *b, int n, int first,
+                         int t, float tol, int maxShown, cmp_stats *s) {
+  const float *ax = a[testField[t]], *ay = a[testField[t]+1], *az = a[testField[t]+2];
+  const float *bx = b[testField[t]], *by = b[testField[t]+1], *bz = b[testField[t]+2];
+  double sum = 0.0;
+  float top = s->max[t];
+  int i = 0;
+#ifndef ENABLE_DOUBLE_PRECISION
+  const simd::vfloat vtol = simd::set1(tol);
+  simd::vfloat vsum = simd::set1(0.0f);
+  simd::vfloat vtop = simd::set1(0.0f);
+  for(; i + simd::WIDTH <= n; i += simd::WIDTH) {
+    simd::vfloat ex = AbsDiff(simd::load(ax+i), simd::load(bx+i));
+    simd::vfloat ey = AbsDiff(simd::load(ay+i), simd::load(by+i));
+    simd::vfloat ez = AbsDiff(simd::load(az+i), simd::load(bz+i));
+    vsum = simd::add(vsum, simd::add(ex, simd::add(ey, ez)));
+    vtop = simd::max(vtop, simd::max(ex, simd::max(ey, ez)));
+    uint32_t off = ~(simd::le(ex, vtol) & simd::le(ey, vtol) & simd::le(ez, vtol)) &
+                   simd::FirstLanes(simd::WIDTH);
+    for(int lane = 0; off != 0; ++lane, off >>= 1)
+      if(off & 1) Mismatch(s, t, first + i + lane, maxShown);
   }
-#if defined(SPARC_SOLARIS)
-  f->bbox.min.x = MAXFLOAT;
-  f->bbox.min.y = MAXFLOAT;
-  f->bbox.min.z = MAXFLOAT;
-  f->bbox.max.x = -MAXFLOAT;
-  f->bbox.max.y = -MAXFLOAT;
-  f->bbox.max.z = -MAXFLOAT;
-#else
-  f->bbox.min.x = INFINITY;
-  f->bbox.min.y = INFINITY;
-  f->bbox.min.z = INFINITY;
-  f->bbox.max.x = -INFINITY;
-  f->bbox.max.y = -INFINITY;
-  f->bbox.max.z = -INFINITY;
+  float lanes[simd::WIDTH];
+  simd::store(lanes, vsum);
+  for(int l = 0; l < simd::WIDTH; ++l) sum += lanes[l];
+  simd::store(lanes, vtop);
+  for(int l = 0; l < simd::WIDTH; ++l) top = std::max(top, lanes[l]);
 #endif
-  malloc_fluid(f, f->numParticles);
+  for(; i < n; ++i) {
+    float ex = std::fabs(ax[i] - bx[i]);
+    float ey = std::fabs(ay[i] - by[i]);
+    float ez = std::fabs(az[i] - bz[i]);
+    sum += ex + ey + ez;
+    top = std::max(top, std::max(ex, std::max(ey, ez)));
+    if(!(ex <= tol && ey <= tol && ez <= tol)) Mismatch(s, t, first + i, maxShown);
+  }
+  s->sum[t] += sum;
+  s->max[t] = top;
+}
 
-  //Always use single precision float variables b/c file format uses single precision
-  float px, py, pz, hvx, hvy, hvz, vx, vy, vz;
-  for(int i = 0; i < f->numParticles; ++i)
-  {
-    file.read((char *)&px, FILE_SIZE_FLOAT);
-    file.read((char *)&py, FILE_SIZE_FLOAT);
-    file.read((char *)&pz, FILE_SIZE_FLOAT);
-    file.read((char *)&hvx, FILE_SIZE_FLOAT);
-    file.read((char *)&hvy, FILE_SIZE_FLOAT);
-    file.read((char *)&hvz, FILE_SIZE_FLOAT);
-    file.read((char *)&vx, FILE_SIZE_FLOAT);
-    file.read((char *)&vy, FILE_SIZE_FLOAT);
-    file.read((char *)&vz, FILE_SIZE_FLOAT);
-    if(!isLittleEndian()) {
-      px  = bswap_float(px);
-      py  = bswap_float(py);
-      pz  = bswap_float(pz);
-      hvx = bswap_float(hvx);
-      hvy = bswap_float(hvy);
-      hvz = bswap_float(hvz);
-      vx  = bswap_float(vx);
-      vy  = bswap_float(vy);
-      vz  = bswap_float(vz);
+//Grow the bounding box lo - hi by the positions of a block of n particles
+static void BoundBlock(const float *const *p, int n, float *lo, float *hi) {
+  for(int k = 0; k < 3; ++k) {
+    int i = 0;
+#ifndef ENABLE_DOUBLE_PRECISION
+    simd::vfloat vlo = simd::set1(lo[k]);
+    simd::vfloat vhi = simd::set1(hi[k]);
+    for(; i + simd::WIDTH <= n; i += simd::WIDTH) {
+      simd::vfloat x = simd::load(p[k]+i);
+      vlo = simd::min(vlo, x);
+      vhi = simd::max(vhi, x);
+    }
+    float lanes[simd::WIDTH];
+    simd::store(lanes, vlo);
+    for(int l = 0; l < simd::WIDTH; ++l) lo[k] = std::min(lo[k], lanes[l]);
+    simd::store(lanes, vhi);
+    for(int l = 0; l < simd::WIDTH; ++l) hi[k] = std::max(hi[k], lanes[l]);
+#endif
+    for(; i < n; ++i) {
+      lo[k] = std::min(lo[k], p[k][i]);
+      hi[k] = std::max(hi[k], p[k][i]);
     }
-
-    //add particle to fluid structure
-    f->p[i].x = px;
-    f->p[i].y = py;
-    f->p[i].z = pz;
-    f->hv[i].x = hvx;
-    f->hv[i].y = hvy;
-    f->hv[i].z = hvz;
-    f->v[i].x = vx;
-    f->v[i].y = vy;
-    f->v[i].z = vz;
-
-    //update bounding box
-    if(px < f->bbox.min.x) f->bbox.min.x = px;
-    if(py < f->bbox.min.y) f->bbox.min.y = py;
-    if(pz < f->bbox.min.z) f->bbox.min.z = pz;
-    if(px > f->bbox.max.x) f->bbox.max.x = px;
-    if(py > f->bbox.max.y) f->bbox.max.y = py;
-    if(pz > f->bbox.max.z) f->bbox.max.z = pz;
   }
 }
 
-////////////////////////////////////////////////////////////////////////////////
+//Compare particles [first, last) of fluid f to those of reference r a block
+//at a time, until done or until some thread sets stop
+static void CompareRange(const fluidfile_view *f, const fluidfile_view *r, int first, int last,
+                         const conf_t *conf, const bool *want, std::atomic<bool> *stop,
+                         cmp_stats *s) {
+  std::vector<float> scratch(2 * FLUIDFILE_FIELDS * BLOCK_PARTICLES);
+  const float *fblk[FLUIDFILE_FIELDS];
+  const float *rblk[FLUIDFILE_FIELDS];
+  for(int i = first; i < last && !stop->load(std::memory_order_relaxed); i += BLOCK_PARTICLES) {
+    int n = std::min(BLOCK_PARTICLES, last - i);
+    if((i - first) % (BLOCK_PARTICLES * READAHEAD_BLOCKS) == 0) {
+      int ahead = std::min(BLOCK_PARTICLES * READAHEAD_BLOCKS, last - i);
+      ReadAhead(f, i, ahead, want);
+      ReadAhead(r, i, ahead, want);
+    }
+    LoadBlock(f, i, n, want, &scratch[0], fblk);
+    LoadBlock(r, i, n, want, &scratch[FLUIDFILE_FIELDS * BLOCK_PARTICLES], rblk);
+    if(conf->ptest.doTest)
+      CompareBlock(fblk, rblk, n, i, TEST_POS, conf->ptest.tol, conf->output.max, s);
+    if(conf->vtest.doTest)
+      CompareBlock(fblk, rblk, n, i, TEST_VEL, conf->vtest.tol, conf->output.max, s);
+    if(conf->bbox.doTest) {
+      BoundBlock(fblk, n, s->lo[0], s->hi[0]);
+      BoundBlock(rblk, n, s->lo[1], s->hi[1]);
+    }
+    s->compared += n;
+    if(conf->run.stop && (s->mismatches[TEST_POS] > 0 || s->mismatches[TEST_VEL] > 0))
+      stop->store(true, std::memory_order_relaxed);
+  }
+}
 
-// Test functions
-// All functions are independent from each other and return true if the test is passed, false otherwise.
+//Reference particles bucketed on a uniform grid over their bounding box,
+//about two to a bucket
+struct match_grid {
+  int dim[3];
+  float lo[3];
+  float size[3];
+  std::vector<int> start;   //first entry of each bucket in order, one past the end last
+  std::vector<int> order;   //reference particles, by bucket
+};
 
-// Verify positions
-bool verify_ptest(fluid_t *fluid, fluid_t *rfluid, conf_t *conf) {
-  bool result = true;
-  bool presult;
-  int ecount = 0;
-  int i;
+static inline int Bucket(const match_grid *g, int k, float x) {
+  int b = (int)((x - g->lo[k]) / g->size[k]);
+  return std::max(0, std::min(g->dim[k] - 1, b));
+}
 
-  for(i=0; i<fluid->numParticles; i++) {
-    presult = (fluid->p[i].x >= rfluid->p[i].x - conf->ptest.tol) &&
-              (fluid->p[i].y >= rfluid->p[i].y - conf->ptest.tol) &&
-              (fluid->p[i].z >= rfluid->p[i].z - conf->ptest.tol) &&
-              (fluid->p[i].x <= rfluid->p[i].x + conf->ptest.tol) &&
-              (fluid->p[i].y <= rfluid->p[i].y + conf->ptest.tol) &&
-              (fluid->p[i].z <= rfluid->p[i].z + conf->ptest.tol);
-    if(!presult && conf->output.verbose && (ecount < conf->output.max)) {
-      std::cout << "Position mismatch: Expected <" << rfluid->p[i].x << "," << rfluid->p[i].y << "," << rfluid->p[i].z << ">" << std::endl;
-      std::cout << "                   Received <" << fluid->p[i].x << "," << fluid->p[i].y << "," << fluid->p[i].z << ">" << std::endl;
+static void BuildMatchGrid(const fluidfile_view *r, match_grid *g) {
+  const int n = r->numParticles;
+  const int k0 = testField[TEST_POS];
+  const int dim = std::max(1, (int)std::cbrt(n / 2.0));
+  for(int k = 0; k < 3; ++k) {
+    float lo = INFINITY, hi = -INFINITY;
+    for(int i = 0; i < n; ++i) {
+      lo = std::min(lo, Field(r, k0+k, i));
+      hi = std::max(hi, Field(r, k0+k, i));
     }
-    if(!presult) ecount++;
-    result &= presult;
+    g->dim[k] = dim;
+    g->lo[k] = lo;
+    g->size[k] = hi > lo ? (hi - lo) / dim : 1.0f;
   }
-
-  return result;
+  std::vector<int> bucket(n);
+  g->start.assign(dim*dim*dim + 1, 0);
+  for(int i = 0; i < n; ++i) {
+    bucket[i] = (Bucket(g, 2, Field(r, k0+2, i))*dim + Bucket(g, 1, Field(r, k0+1, i)))*dim + Bucket(g, 0, Field(r, k0, i));
+    ++g->start[bucket[i] + 1];
+  }
+  for(size_t b = 1; b < g->start.size(); ++b)
+    g->start[b] += g->start[b-1];
+  g->order.resize(n);
+  std::vector<int> fill(g->start.begin(), g->start.end() - 1);
+  for(int i = 0; i < n; ++i)
+    g->order[fill[bucket[i]]++] = i;
 }
 
-// Verify velocities
-bool verify_vtest(fluid_t *fluid, fluid_t *rfluid, conf_t *conf) {
-  bool result = true;
-  bool presult;
-  int ecount = 0;
-  int i;
+//Reference particle closest to the position of particle i of f: searches
+//growing cubes of buckets around it until no closer one can be outside
+static int Closest(const fluidfile_view *f, int i, const fluidfile_view *r, const match_grid *g) {
+  const int k0 = testField[TEST_POS];
+  const float p[3] = {Field(f, k0, i), Field(f, k0+1, i), Field(f, k0+2, i)};
+  int c[3];
+  for(int k = 0; k < 3; ++k) c[k] = Bucket(g, k, p[k]);
+  const float step = std::min(g->size[0], std::min(g->size[1], g->size[2]));
+  const int maxRadius = std::max(g->dim[0], std::max(g->dim[1], g->dim[2]));
+  int best = -1;
+  float bestSq = INFINITY;
+  for(int radius = 0; radius <= maxRadius; ++radius) {
+    for(int bz = std::max(0, c[2]-radius); bz <= std::min(g->dim[2]-1, c[2]+radius); ++bz)
+      for(int by = std::max(0, c[1]-radius); by <= std::min(g->dim[1]-1, c[1]+radius); ++by)
+        for(int bx = std::max(0, c[0]-radius); bx <= std::min(g->dim[0]-1, c[0]+radius); ++bx) {
+          //the inner buckets were searched with a smaller radius
+          if(std::max(std::abs(bx-c[0]), std::max(std::abs(by-c[1]), std::abs(bz-c[2]))) != radius)
+            continue;
+          int b = (bz*g->dim[1] + by)*g->dim[0] + bx;
+          for(int e = g->start[b]; e < g->start[b+1]; ++e) {
+            int j = g->order[e];
+            float dx = Field(r, k0, j) - p[0];
+            float dy = Field(r, k0+1, j) - p[1];
+            float dz = Field(r, k0+2, j) - p[2];
+            float dSq = dx*dx + dy*dy + dz*dz;
+            if(dSq < bestSq) {
+              bestSq = dSq;
+              best = j;
+            }
+          }
+        }
+    //particles in buckets further out are at least radius * step away
+    if(best >= 0 && std::sqrt(bestSq) <= radius * step)
+      break;
+  }
+  return best;
+}
 
-  for(i=0; i<fluid->numParticles; i++) {
-    presult = (fluid->v[i].x >= rfluid->v[i].x - conf->vtest.tol) &&
-              (fluid->v[i].y >= rfluid->v[i].y - conf->vtest.tol) &&
-              (fluid->v[i].z >= rfluid->v[i].z - conf->vtest.tol) &&
-              (fluid->v[i].x <= rfluid->v[i].x + conf->vtest.tol) &&
-              (fluid->v[i].y <= rfluid->v[i].y + conf->vtest.tol) &&
-              (fluid->v[i].z <= rfluid->v[i].z + conf->vtest.tol);
-    if(!presult && conf->output.verbose && (ecount < conf->output.max)) {
-      std::cout << "Velocity mismatch: Expected <" << rfluid->v[i].x << "," << rfluid->v[i].y << "," << rfluid->v[i].z << ">" << std::endl;
-      std::cout << "                   Received <" << fluid->v[i].x << "," << fluid->v[i].y << "," << fluid->v[i].z << ">" << std::endl;
-    }
-    if(!presult) ecount++;
-    result &= presult;
+//Copy the particles of r into fields, in the order of the particles of f
+//they are closest to, and make m a view of them. Returns how many particles
+//of r are the closest to more than one of f, which leaves as many of them
+//unmatched
+static long MatchParticles(const fluidfile_view *f, const fluidfile_view *r, int threads,
+                           std::vector<float> &fields, fluidfile_view *m) {
+  const int n = f->numParticles;
+  match_grid grid;
+  BuildMatchGrid(r, &grid);
+  std::vector<int> closest(n);
+  std::vector<std::thread> pool;
+  for(int j = 0; j < threads; ++j) {
+    int first = (int)((long)n * j / threads);
+    int last  = (int)((long)n * (j+1) / threads);
+    pool.emplace_back([&, first, last]() {
+      for(int i = first; i < last; ++i)
+        closest[i] = Closest(f, i, r, &grid);
+    });
+  }
+  for(auto &t : pool)
+    t.join();
+
+  fields.resize((size_t)n * FLUIDFILE_FIELDS);
+  *m = *r;
+  m->stride = 1;
+  m->swap = false;
+  m->map = nullptr;
+  m->mapSize = 0;
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k) {
+    float *dst = fields.data() + (size_t)k*n;
+    for(int i = 0; i < n; ++i)
+      dst[i] = Field(r, k, closest[i]);
+    m->field[k] = dst;
   }
 
-  return result;
+  std::vector<char> used(r->numParticles, 0);
+  long repeated = 0;
+  for(int i = 0; i < n; ++i)
+    if(used[closest[i]]++) ++repeated;
+  return repeated;
+}
+
+//Print the first mismatches of test t, in the order of the particles
+static void PrintMismatches(const fluidfile_view *f, const fluidfile_view *r, int t,
+                            std::vector<cmp_stats> const &stats, int maxShown) {
+  static const char *const label[NUM_TESTS] = {"Position", "Velocity"};
+  const int k = testField[t];
+  int printed = 0;
+  for(size_t j = 0; j < stats.size(); ++j)
+    for(size_t m = 0; m < stats[j].shown[t].size() && printed < maxShown; ++m, ++printed) {
+      int i = stats[j].shown[t][m];
+      std::cout << label[t] << " mismatch: Expected <" << Field(r, k, i) << "," << Field(r, k+1, i) << "," << Field(r, k+2, i) << ">" << std::endl;
+      std::cout << "                   Received <" << Field(f, k, i) << "," << Field(f, k+1, i) << "," << Field(f, k+2, i) << ">" << std::endl;
+    }
 }
 
 // Verify spatial extent
-bool verify_bbox(fluid_t *fluid, fluid_t *rfluid, conf_t *conf) {
-  bool result;
-
-  result = (fluid->bbox.min.x >= rfluid->bbox.min.x - conf->bbox.tol) &&
-           (fluid->bbox.min.y >= rfluid->bbox.min.y - conf->bbox.tol) &&
-           (fluid->bbox.min.z >= rfluid->bbox.min.z - conf->bbox.tol) &&
-           (fluid->bbox.min.x <= rfluid->bbox.min.x + conf->bbox.tol) &&
-           (fluid->bbox.min.y <= rfluid->bbox.min.y + conf->bbox.tol) &&
-           (fluid->bbox.min.z <= rfluid->bbox.min.z + conf->bbox.tol) &&
-           (fluid->bbox.max.x >= rfluid->bbox.max.x - conf->bbox.tol) &&
-           (fluid->bbox.max.y >= rfluid->bbox.max.y - conf->bbox.tol) &&
-           (fluid->bbox.max.z >= rfluid->bbox.max.z - conf->bbox.tol) &&
-           (fluid->bbox.max.x <= rfluid->bbox.max.x + conf->bbox.tol) &&
-           (fluid->bbox.max.y <= rfluid->bbox.max.y + conf->bbox.tol) &&
-           (fluid->bbox.max.z <= rfluid->bbox.max.z + conf->bbox.tol);
+bool verify_bbox(const float lo[2][3], const float hi[2][3], conf_t *conf) {
+  bool result = true;
+  for(int k = 0; k < 3; ++k)
+    result = result && (lo[0][k] == lo[1][k] || std::fabs(lo[0][k] - lo[1][k]) <= conf->bbox.tol) &&
+                       (hi[0][k] == hi[1][k] || std::fabs(hi[0][k] - hi[1][k]) <= conf->bbox.tol);
 
   if(!result && conf->output.verbose) {
-    std::cout << "Bounding box mismatch: Expected <" << rfluid->bbox.min.x << "," << rfluid->bbox.min.y << "," << rfluid->bbox.min.z << "> - <" << rfluid->bbox.min.x << "," << rfluid->bbox.min.y << "," << rfluid->bbox.min.z << ">" << std::endl;
-    std::cout << "                       Received <" << fluid->bbox.min.x << "," << fluid->bbox.min.y << "," << fluid->bbox.min.z << "> - <" << fluid->bbox.min.x << "," << fluid->bbox.min.y << "," << fluid->bbox.min.z << ">" << std::endl;
+    std::cout << "Bounding box mismatch: Expected <" << lo[1][0] << "," << lo[1][1] << "," << lo[1][2] << "> - <" << hi[1][0] << "," << hi[1][1] << "," << hi[1][2] << ">" << std::endl;
+    std::cout << "                       Received <" << lo[0][0] << "," << lo[0][1] << "," << lo[0][2] << "> - <" << hi[0][0] << "," << hi[0][1] << "," << hi[0][2] << ">" << std::endl;
   }
 
   return result;
@@ -272,6 +405,10 @@ void print_usage(const char *name) {
   std::cout << "  --ptol FLOAT  Compare positions with absolute tolerance FLOAT" << std::endl; 
   std::cout << "  --vtol FLOAT  Compare velocities with absolute tolerance FLOAT" << std::endl;
   std::cout << "  --bbox FLOAT  Compare bounding boxes with absolute tolerance FLOAT" << std::endl;
+  std::cout << "  --threads INT Compare on INT threads, at most one for every " << BLOCK_PARTICLES << " particles (Default: all cores)" << std::endl;
+  std::cout << "  --stop        Stop at the first particle out of tolerance" << std::endl;
+  std::cout << "  --match       Compare each particle to the closest one of RFILE instead of the one at the same index," << std::endl;
+  std::cout << "                for runs that write the particles in a different order" << std::endl;
 }
 
 // Parse command line arguments
@@ -290,6 +427,9 @@ bool parse_args(conf_t *conf, int argc, char *argv[]) {
   conf->vtest.tol = 0.0;
   conf->bbox.doTest = false;
   conf->bbox.tol = 0.0;
+  conf->run.threads = 0;
+  conf->run.stop = false;
+  conf->run.match = false;
 
   //need at least two input files
   if(argc < 3) return false;
@@ -318,6 +458,15 @@ bool parse_args(conf_t *conf, int argc, char *argv[]) {
       conf->bbox.doTest = true;
       conf->bbox.tol = atof(argv[i+1]);
       i++;
+    } else if(!strcmp(argv[i],"--threads")) {
+      if(i+1>=argc) return false;
+      conf->run.threads = atoi(argv[i+1]);
+      if(conf->run.threads < 1) return false;
+      i++;
+    } else if(!strcmp(argv[i],"--stop")) {
+      conf->run.stop = true;
+    } else if(!strcmp(argv[i],"--match")) {
+      conf->run.match = true;
     } else {
       return false;
     }
@@ -332,8 +481,8 @@ bool parse_args(conf_t *conf, int argc, char *argv[]) {
 int fluidcmp(int argc, char *argv[]) {
   (void) timeStep;
   conf_t conf;
-  fluid_t rfluid;
-  fluid_t fluid;
+  fluidfile_view rfluid;
+  fluidfile_view fluid;
   struct {
     bool ptest;
     bool vtest;
@@ -347,11 +496,11 @@ int fluidcmp(int argc, char *argv[]) {
     return ERROR_OTHER;
   }
 
-  //load fluids
+  //map fluids, their particles are read in as they are compared
   if(conf.output.verbose) std::cout << "Loading fluid \"" << conf.file << "\"..." << std::endl;
-  ReadFile(conf.file, &fluid);
+  if(!fluidfile_map(conf.file, &fluid)) exit(1);
   if(conf.output.verbose) std::cout << "Loading reference fluid \"" << conf.rfile << "\"..." << std::endl;
-  ReadFile(conf.rfile, &rfluid);
+  if(!fluidfile_map(conf.rfile, &rfluid)) exit(1);
 
   //checking fluid compatibility
   if(fluid.restParticlesPerMeter != rfluid.restParticlesPerMeter) {
@@ -364,41 +513,115 @@ int fluidcmp(int argc, char *argv[]) {
     return ERROR_FAIL;
   }
 
-  //verify positions
-  if(conf.ptest.doTest) {
-    results.ptest = verify_ptest(&fluid, &rfluid, &conf);
-  } else {
-    results.ptest = true;
+  //threads beyond one for every block of particles would have nothing to do
+  const int wanted = conf.run.threads ? conf.run.threads : std::max(1u, std::thread::hardware_concurrency());
+  const int threads = std::max(1, std::min(wanted, fluid.numParticles / BLOCK_PARTICLES));
+  if(conf.run.threads > threads)
+    std::cout << "Comparing on " << threads << " threads, each takes blocks of " << BLOCK_PARTICLES << " particles" << std::endl;
+
+  //pair the particles by position instead: the reference becomes a copy of
+  //its particles in the order of those of fluid
+  const fluidfile_view *ref = &rfluid;
+  fluidfile_view matched;
+  std::vector<float> matchedFields;
+  long repeated = 0;
+  if(conf.run.match) {
+    repeated = MatchParticles(&fluid, &rfluid, wanted, matchedFields, &matched);
+    ref = &matched;
   }
 
-  //verify velocities
-  if(conf.vtest.doTest) {
-    results.vtest = verify_vtest(&fluid, &rfluid, &conf);
-  } else {
-    results.vtest = true;
+  //fields the tests read
+  bool want[FLUIDFILE_FIELDS] = {false};
+  for(int k = 0; k < 3; ++k) {
+    want[testField[TEST_POS] + k] = conf.ptest.doTest || conf.bbox.doTest;
+    want[testField[TEST_VEL] + k] = conf.vtest.doTest;
   }
 
-  //verify bounding box
-  if(conf.bbox.doTest) {
-    results.bbox = verify_bbox(&fluid, &rfluid, &conf);
-  } else {
-    results.bbox = true;
+  //verify positions, velocities and bounding box in one pass, a contiguous
+  //range of particles for each thread
+  std::vector<cmp_stats> stats(threads);
+  std::vector<std::thread> pool;
+  std::atomic<bool> stop(false);
+  const auto beg = std::chrono::high_resolution_clock::now();
+  for(int j = 0; j < threads; ++j) {
+    cmp_stats *s = &stats[j];
+    s->compared = 0;
+    for(int t = 0; t < NUM_TESTS; ++t) {
+      s->sum[t] = 0.0;
+      s->max[t] = 0.0f;
+      s->mismatches[t] = 0;
+    }
+    for(int k = 0; k < 3; ++k) {
+      s->lo[0][k] = s->lo[1][k] = INFINITY;
+      s->hi[0][k] = s->hi[1][k] = -INFINITY;
+    }
+    int first = (int)((long)fluid.numParticles * j / threads);
+    int last  = (int)((long)fluid.numParticles * (j+1) / threads);
+    pool.emplace_back(CompareRange, &fluid, ref, first, last, &conf, want, &stop, s);
+  }
+  for(auto &t : pool)
+    t.join();
+  const auto end = std::chrono::high_resolution_clock::now();
+
+  //reduce what the threads found
+  cmp_stats total = stats[0];
+  for(int j = 1; j < threads; ++j) {
+    total.compared += stats[j].compared;
+    for(int t = 0; t < NUM_TESTS; ++t) {
+      total.sum[t] += stats[j].sum[t];
+      total.max[t] = std::max(total.max[t], stats[j].max[t]);
+      total.mismatches[t] += stats[j].mismatches[t];
+    }
+    for(int f = 0; f < 2; ++f)
+      for(int k = 0; k < 3; ++k) {
+        total.lo[f][k] = std::min(total.lo[f][k], stats[j].lo[f][k]);
+        total.hi[f][k] = std::max(total.hi[f][k], stats[j].hi[f][k]);
+      }
   }
+  const bool stopped = stop.load();
 
-  free_fluid(&rfluid);
-  free_fluid(&fluid);
+  if(conf.output.verbose) {
+    if(conf.ptest.doTest) PrintMismatches(&fluid, ref, TEST_POS, stats, conf.output.max);
+    if(conf.vtest.doTest) PrintMismatches(&fluid, ref, TEST_VEL, stats, conf.output.max);
+  }
+  //a reference particle closest to two particles leaves another unmatched
+  results.ptest = total.mismatches[TEST_POS] == 0 && repeated == 0;
+  results.vtest = total.mismatches[TEST_VEL] == 0;
+  //the bounding boxes are only known once all particles are seen
+  results.bbox = !conf.bbox.doTest || (!stopped && verify_bbox(total.lo, total.hi, &conf));
+
+  if(conf.output.verbose) {
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count();
+    std::cout << "Compared " << total.compared << " of " << fluid.numParticles << " particles on "
+              << threads << " threads (" << SIMD_ISA << ") in " << elapsed << " ns" << std::endl;
+  }
 
-  //print result of verification
+  fluidfile_unmap(&rfluid);
+  fluidfile_unmap(&fluid);
+
+  //print result of verification, a test without mismatches is incomplete
+  //if the comparison stopped early
+  static const char *const label[NUM_TESTS] = {"Position error:       ", "Velocity error:       "};
+  const bool doTest[NUM_TESTS] = {conf.ptest.doTest, conf.vtest.doTest};
+  for(int t = 0; t < NUM_TESTS; ++t)
+    if(doTest[t]) {
+      double mean = total.compared ? total.sum[t] / (3.0 * total.compared) : 0.0;
+      std::cout << label[t] << "max " << total.max[t] << ", mean " << mean << ", "
+                << total.mismatches[t] << " particles out of tolerance" << std::endl;
+    }
+  if(repeated)
+    std::cout << repeated << " particles of the reference fluid matched more than once" << std::endl;
+  const char *incomplete = stopped ? "STOPPED" : "PASS";
   if(conf.ptest.doTest) {
-    std::cout << "Position test:        " << (results.ptest ? "PASS" : "FAIL") << std::endl;
+    std::cout << "Position test:        " << (results.ptest ? incomplete : "FAIL") << std::endl;
   }
   if(conf.vtest.doTest) {
-    std::cout << "Velocity test:        " << (results.vtest ? "PASS" : "FAIL") << std::endl;
+    std::cout << "Velocity test:        " << (results.vtest ? incomplete : "FAIL") << std::endl;
   }
   if(conf.bbox.doTest) {
-    std::cout << "Bounding box test:    " << (results.bbox ? "PASS" : "FAIL") << std::endl;
+    std::cout << "Bounding box test:    " << (stopped ? incomplete : (results.bbox ? "PASS" : "FAIL")) << std::endl;
   }
-  return (results.ptest && results.vtest &&results.bbox) ? ERROR_OK : ERROR_FAIL;
+  return (!stopped && results.ptest && results.vtest && results.bbox) ? ERROR_OK : ERROR_FAIL;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,36 @@
+// fluidconv: converts fluid files between the legacy PARSEC format and the
+// native one (see fluidfile.hpp). The input format is told by its magic
+// number and the output one by its extension, so
+//
+//   fluidconv in_300K.fluid in_300K.nfluid
+//
+// makes a native copy of an input set once, and every later run maps it.
+
+#include <cstdlib>
+#include <iostream>
+
+#include "fluidfile.hpp"
+
+int main(int argc, char *argv[])
+{
+  (void) timeStep;
+  if(argc != 3)
+  {
+    std::cout << "Usage: " << argv[0] << " <input file> <output file>" << std::endl;
+    std::cout << "  the output is native if its name ends in " << FLUIDFILE_EXT
+              << " and legacy .fluid otherwise" << std::endl;
+    return -1;
+  }
+
+  fluidfile file;
+  if(!fluidfile_open(argv[1], &file))
+    return EXIT_FAILURE;
+  bool native = fluidfile_native_name(argv[2]);
+  bool ok = fluidfile_write(argv[2], native, file.restParticlesPerMeter,
+                            file.numParticles, file.field);
+  std::cout << file.numParticles << " particles written to \"" << argv[2] << "\" ("
+            << (native ? "native" : "legacy") << " format)" << std::endl;
+  fluidfile_close(&file);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
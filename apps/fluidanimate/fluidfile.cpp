@@ -0,0 +1,379 @@
+// Reading and writing fluid files, see fluidfile.hpp
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+#include "fluidfile.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool fluidfile_native_name(char const *fileName)
+{
+  (void) timeStep;
+  size_t n = strlen(fileName);
+  size_t m = strlen(FLUIDFILE_EXT);
+  return n >= m && strcmp(fileName + n - m, FLUIDFILE_EXT) == 0;
+}
+
+//Offsets of the field arrays of a native file of numParticles particles, and
+//its size
+static size_t NativeLayout(uint64_t numParticles, uint64_t *offset)
+{
+  size_t size = (sizeof(fluidfile_header) + FLUIDFILE_ALIGN-1) & ~(size_t)(FLUIDFILE_ALIGN-1);
+  size_t bytes = numParticles * sizeof(float);
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k) {
+    offset[k] = size;
+    size += (bytes + FLUIDFILE_ALIGN-1) & ~(size_t)(FLUIDFILE_ALIGN-1);
+  }
+  return size;
+}
+
+static bool OpenNative(char const *fileName, int fd, size_t size, fluidfile *f)
+{
+  void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED) {
+    std::cerr << "Cannot map " << fileName << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  const fluidfile_header *hdr = (const fluidfile_header *)map;
+  uint64_t offset[FLUIDFILE_FIELDS];
+  if(hdr->version != FLUIDFILE_VERSION || hdr->endian != FLUIDFILE_ENDIAN ||
+     hdr->fieldSize != sizeof(float) || hdr->numParticles > (uint64_t)INT32_MAX ||
+     NativeLayout(hdr->numParticles, offset) > size ||
+     memcmp(offset, hdr->offset, sizeof(offset)) != 0) {
+    std::cerr << fileName << " is not a native fluid file of this machine" << std::endl;
+    munmap(map, size);
+    return false;
+  }
+  //the particles are read in one pass, in order
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  f->restParticlesPerMeter = hdr->restParticlesPerMeter;
+  f->numParticles = (int)hdr->numParticles;
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k)
+    f->field[k] = (const float *)((const char *)map + hdr->offset[k]);
+  f->map = map;
+  f->mapSize = size;
+  return true;
+}
+
+static bool OpenLegacy(char const *fileName, int fd, size_t size, fluidfile *f)
+{
+  //Always use single precision float variables b/c file format uses single precision
+  std::vector<char> buf(size);
+  size_t got = 0;
+  while(got < size) {
+    ssize_t n = read(fd, &buf[got], size - got);
+    if(n <= 0) {
+      std::cerr << "Cannot read " << fileName << ": " << strerror(errno) << std::endl;
+      return false;
+    }
+    got += n;
+  }
+  if(size < FILE_SIZE_FLOAT + FILE_SIZE_INT) {
+    std::cerr << fileName << " is too short for a fluid file" << std::endl;
+    return false;
+  }
+  float restParticlesPerMeter;
+  int numParticles;
+  memcpy(&restParticlesPerMeter, &buf[0], FILE_SIZE_FLOAT);
+  memcpy(&numParticles, &buf[FILE_SIZE_FLOAT], FILE_SIZE_INT);
+  if(!isLittleEndian()) {
+    restParticlesPerMeter = bswap_float(restParticlesPerMeter);
+    numParticles          = bswap_int32(numParticles);
+  }
+  const size_t particleSize = FLUIDFILE_FIELDS * FILE_SIZE_FLOAT;
+  if(numParticles < 0 ||
+     (size - FILE_SIZE_FLOAT - FILE_SIZE_INT) / particleSize < (size_t)numParticles) {
+    std::cerr << fileName << " is too short for " << numParticles << " particles" << std::endl;
+    return false;
+  }
+
+  //transpose the particles into one array for each field
+  f->data.resize((size_t)numParticles * FLUIDFILE_FIELDS);
+  const char *src = &buf[FILE_SIZE_FLOAT + FILE_SIZE_INT];
+  for(int i = 0; i < numParticles; ++i)
+    for(int k = 0; k < FLUIDFILE_FIELDS; ++k) {
+      float x;
+      memcpy(&x, src + i*particleSize + k*FILE_SIZE_FLOAT, FILE_SIZE_FLOAT);
+      if(!isLittleEndian())
+        x = bswap_float(x);
+      f->data[(size_t)k*numParticles + i] = x;
+    }
+
+  f->restParticlesPerMeter = restParticlesPerMeter;
+  f->numParticles = numParticles;
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k)
+    f->field[k] = &f->data[(size_t)k*numParticles];
+  return true;
+}
+
+//Open fileName for reading and tell its format by the magic number; -1 with a
+//message on std::cerr if it cannot be opened
+static int OpenFile(char const *fileName, size_t *size, bool *native)
+{
+  int fd = open(fileName, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    std::cerr << "Error opening file " << fileName << ": " << strerror(errno) << std::endl;
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  *size = st.st_size;
+  char magic[sizeof(((fluidfile_header *)0)->magic)];
+  *native = *size >= sizeof(fluidfile_header) &&
+            pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+            memcmp(magic, FLUIDFILE_MAGIC, sizeof(magic)) == 0;
+  return fd;
+}
+
+bool fluidfile_open(char const *fileName, fluidfile *f)
+{
+  f->map = nullptr;
+  f->mapSize = 0;
+  f->data.clear();
+
+  size_t size;
+  bool native;
+  int fd = OpenFile(fileName, &size, &native);
+  if(fd < 0)
+    return false;
+  bool ok = native ? OpenNative(fileName, fd, size, f) : OpenLegacy(fileName, fd, size, f);
+  close(fd);
+  return ok;
+}
+
+void fluidfile_close(fluidfile *f)
+{
+  if(f->map)
+    munmap(f->map, f->mapSize);
+  f->map = nullptr;
+  f->mapSize = 0;
+  std::vector<float>().swap(f->data);
+}
+
+//Map a legacy file, its particles interleaved after the 8 byte header
+static bool MapLegacy(char const *fileName, int fd, size_t size, fluidfile_view *v)
+{
+  const size_t headerSize = FILE_SIZE_FLOAT + FILE_SIZE_INT;
+  if(size < headerSize) {
+    std::cerr << fileName << " is too short for a fluid file" << std::endl;
+    return false;
+  }
+  void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED) {
+    std::cerr << "Cannot map " << fileName << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  float restParticlesPerMeter;
+  int numParticles;
+  memcpy(&restParticlesPerMeter, map, FILE_SIZE_FLOAT);
+  memcpy(&numParticles, (const char *)map + FILE_SIZE_FLOAT, FILE_SIZE_INT);
+  if(!isLittleEndian()) {
+    restParticlesPerMeter = bswap_float(restParticlesPerMeter);
+    numParticles          = bswap_int32(numParticles);
+  }
+  const size_t particleSize = FLUIDFILE_FIELDS * FILE_SIZE_FLOAT;
+  if(numParticles < 0 || (size - headerSize) / particleSize < (size_t)numParticles) {
+    std::cerr << fileName << " is too short for " << numParticles << " particles" << std::endl;
+    munmap(map, size);
+    return false;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  v->restParticlesPerMeter = restParticlesPerMeter;
+  v->numParticles = numParticles;
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k)
+    v->field[k] = (const float *)((const char *)map + headerSize + k*FILE_SIZE_FLOAT);
+  v->stride = FLUIDFILE_FIELDS;
+  v->swap = !isLittleEndian();
+  v->map = map;
+  v->mapSize = size;
+  return true;
+}
+
+bool fluidfile_map(char const *fileName, fluidfile_view *v)
+{
+  v->map = nullptr;
+  v->mapSize = 0;
+
+  size_t size;
+  bool native;
+  int fd = OpenFile(fileName, &size, &native);
+  if(fd < 0)
+    return false;
+  bool ok;
+  if(native) {
+    fluidfile f;
+    ok = OpenNative(fileName, fd, size, &f);
+    if(ok) {
+      v->restParticlesPerMeter = f.restParticlesPerMeter;
+      v->numParticles = f.numParticles;
+      for(int k = 0; k < FLUIDFILE_FIELDS; ++k)
+        v->field[k] = f.field[k];
+      v->stride = 1;
+      v->swap = false;
+      v->map = f.map;
+      v->mapSize = f.mapSize;
+    }
+  } else {
+    ok = MapLegacy(fileName, fd, size, v);
+  }
+  close(fd);
+  return ok;
+}
+
+void fluidfile_unmap(fluidfile_view *v)
+{
+  if(v->map)
+    munmap(v->map, v->mapSize);
+  v->map = nullptr;
+  v->mapSize = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool WriteNative(std::ofstream &file, float restParticlesPerMeter,
+                        int numParticles, const float *const *field)
+{
+  fluidfile_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, FLUIDFILE_MAGIC, sizeof(hdr.magic));
+  hdr.version = FLUIDFILE_VERSION;
+  hdr.endian = FLUIDFILE_ENDIAN;
+  hdr.fieldSize = sizeof(float);
+  hdr.restParticlesPerMeter = restParticlesPerMeter;
+  hdr.numParticles = numParticles;
+  NativeLayout(hdr.numParticles, hdr.offset);
+
+  static const char zeros[FLUIDFILE_ALIGN] = {0};
+  size_t pos = 0;
+  file.write((const char *)&hdr, sizeof(hdr));
+  pos += sizeof(hdr);
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k) {
+    file.write(zeros, hdr.offset[k] - pos);
+    file.write((const char *)field[k], numParticles * sizeof(float));
+    pos = hdr.offset[k] + numParticles * sizeof(float);
+  }
+  //pad the last array too, so the size matches NativeLayout
+  file.write(zeros, (FLUIDFILE_ALIGN - pos % FLUIDFILE_ALIGN) % FLUIDFILE_ALIGN);
+  return (bool)file;
+}
+
+static bool WriteLegacy(std::ofstream &file, float restParticlesPerMeter,
+                        int numParticles, const float *const *field)
+{
+  //Always use single precision float variables b/c file format uses single precision
+  if(!isLittleEndian()) {
+    restParticlesPerMeter = bswap_float(restParticlesPerMeter);
+    int numParticles_le = bswap_int32(numParticles);
+    file.write((char *)&restParticlesPerMeter, FILE_SIZE_FLOAT);
+    file.write((char *)&numParticles_le, FILE_SIZE_INT);
+  } else {
+    file.write((char *)&restParticlesPerMeter, FILE_SIZE_FLOAT);
+    file.write((char *)&numParticles, FILE_SIZE_INT);
+  }
+
+  //interleave the fields again, a block of particles at a time
+  const int block = 4096;
+  std::vector<float> buf((size_t)block * FLUIDFILE_FIELDS);
+  for(int i = 0; i < numParticles; i += block) {
+    int n = std::min(block, numParticles - i);
+    for(int j = 0; j < n; ++j)
+      for(int k = 0; k < FLUIDFILE_FIELDS; ++k) {
+        float x = field[k][i + j];
+        buf[(size_t)j*FLUIDFILE_FIELDS + k] = isLittleEndian() ? x : bswap_float(x);
+      }
+    file.write((const char *)&buf[0], (size_t)n * FLUIDFILE_FIELDS * FILE_SIZE_FLOAT);
+  }
+  return (bool)file;
+}
+
+bool fluidfile_write(char const *fileName, bool native, float restParticlesPerMeter,
+                     int numParticles, const float *const *field)
+{
+  std::ofstream file(fileName, std::ios::binary);
+  if(!file) {
+    std::cerr << "Error opening file " << fileName << " for writing" << std::endl;
+    return false;
+  }
+  bool ok = native ? WriteNative(file, restParticlesPerMeter, numParticles, field)
+                   : WriteLegacy(file, restParticlesPerMeter, numParticles, field);
+  if(!ok)
+    std::cerr << "Error writing file " << fileName << std::endl;
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CheckpointWriter::CheckpointWriter(std::string const &prefix, int interval, int depth)
+  : prefix(prefix), interval(interval < 1 ? 1 : interval), done(false)
+{
+  for(int i = 0; i < depth; ++i)
+    spare.push_back(new fluidfile_frame);
+  writer = std::thread(&CheckpointWriter::Run, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+  }
+  cond.notify_all();
+  writer.join();
+  for(size_t i = 0; i < spare.size(); ++i)
+    delete spare[i];
+}
+
+fluidfile_frame *CheckpointWriter::Acquire()
+{
+  std::unique_lock<std::mutex> guard(lock);
+  cond.wait(guard, [this] { return !spare.empty(); });
+  fluidfile_frame *frame = spare.back();
+  spare.pop_back();
+  return frame;
+}
+
+void CheckpointWriter::Submit(fluidfile_frame *frame)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    queued.push_back(frame);
+  }
+  cond.notify_all();
+}
+
+void CheckpointWriter::Run()
+{
+  std::unique_lock<std::mutex> guard(lock);
+  for(;;) {
+    cond.wait(guard, [this] { return done || !queued.empty(); });
+    if(queued.empty())
+      return;
+    fluidfile_frame *frame = queued.front();
+    queued.pop_front();
+    guard.unlock();
+
+    const float *field[FLUIDFILE_FIELDS];
+    for(int k = 0; k < FLUIDFILE_FIELDS; ++k)
+      field[k] = frame->field[k].data();
+    std::string name = prefix + "." + std::to_string(frame->frame) + FLUIDFILE_EXT;
+    fluidfile_write(name.c_str(), true, frame->restParticlesPerMeter,
+                    (int)frame->field[0].size(), field);
+
+    guard.lock();
+    spare.push_back(frame);
+    cond.notify_all();
+  }
+}
@@ -0,0 +1,134 @@
+// Fluid files in the legacy PARSEC format and in a native format that needs
+// no parsing.
+//
+// The legacy .fluid format is little-endian: restParticlesPerMeter, the
+// number of particles, then px, py, pz, hvx, hvy, hvz, vx, vy, vz as single
+// precision floats for each particle in turn.
+//
+// The native format (.nfluid) is a fluidfile_header followed by the same nine
+// fields as separate arrays of floats, each starting on a FLUIDFILE_ALIGN
+// boundary, in the byte order of the machine that wrote it. Opening one maps
+// the file and points field[] into the mapping, so loading costs no more than
+// the page faults of the first pass over the particles.
+
+#ifndef __FLUIDFILE_HPP__
+#define __FLUIDFILE_HPP__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "fluid.hpp"
+
+#define FLUIDFILE_MAGIC "NFLUID\r\n"
+#define FLUIDFILE_VERSION 1
+#define FLUIDFILE_ENDIAN 0x01020304
+//Extension of native files, the format SaveFile writes is chosen by it
+#define FLUIDFILE_EXT ".nfluid"
+//Number of floats for each particle, in the order of the legacy format
+#define FLUIDFILE_FIELDS 9
+#define FLUIDFILE_ALIGN 64
+
+struct fluidfile_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;        //FLUIDFILE_ENDIAN as written by the producer
+  uint32_t fieldSize;     //sizeof(float)
+  float restParticlesPerMeter;
+  uint64_t numParticles;
+  uint64_t offset[FLUIDFILE_FIELDS]; //of each field array from the start of the file
+};
+
+//A fluid file of either format, as one array of numParticles floats for each
+//field: px, py, pz, hvx, hvy, hvz, vx, vy, vz
+struct fluidfile {
+  float restParticlesPerMeter;
+  int numParticles;
+  const float *field[FLUIDFILE_FIELDS];
+
+  //native file: the mapping field[] points into
+  void *map;
+  size_t mapSize;
+  //legacy file: the decoded fields
+  std::vector<float> data;
+};
+
+//Whether fileName names a native file, by its extension
+bool fluidfile_native_name(char const *fileName);
+
+//Open a fluid file of either format, telling them apart by the magic number;
+//false with a message on std::cerr if it cannot be read
+bool fluidfile_open(char const *fileName, fluidfile *f);
+
+//Release what fluidfile_open acquired
+void fluidfile_close(fluidfile *f);
+
+//A fluid file of either format mapped as it is, without decoding: particle i
+//of field k is the float at field[k][i*stride], byte swapped if swap is set
+struct fluidfile_view {
+  float restParticlesPerMeter;
+  int numParticles;
+  const float *field[FLUIDFILE_FIELDS];
+  int stride;             //1 for native files, FLUIDFILE_FIELDS for legacy ones
+  bool swap;
+
+  void *map;
+  size_t mapSize;
+};
+
+//Map a fluid file of either format; false with a message on std::cerr if it
+//cannot be read
+bool fluidfile_map(char const *fileName, fluidfile_view *v);
+
+//Release what fluidfile_map acquired
+void fluidfile_unmap(fluidfile_view *v);
+
+//Write numParticles particles given as FLUIDFILE_FIELDS arrays, in the native
+//format if native is set and in the legacy format otherwise
+bool fluidfile_write(char const *fileName, bool native, float restParticlesPerMeter,
+                     int numParticles, const float *const *field);
+
+//The particles of one frame, as FLUIDFILE_FIELDS arrays
+struct fluidfile_frame {
+  int frame;
+  float restParticlesPerMeter;
+  std::vector<float> field[FLUIDFILE_FIELDS];
+};
+
+//Writes frames handed over by the simulation to <prefix>.<frame>.nfluid on a
+//thread of its own, so the simulation only stalls to copy the particles out.
+//At most depth frames wait to be written; Submit blocks when they are all
+//taken, which bounds the memory held by a slow disk.
+class CheckpointWriter {
+public:
+  CheckpointWriter(std::string const &prefix, int interval, int depth = 2);
+  //writes what is still queued
+  ~CheckpointWriter();
+
+  //whether frame is one to checkpoint
+  bool Due(int frame) const { return frame % interval == 0; }
+
+  //a frame to fill and Submit, reusing the arrays of one already written
+  fluidfile_frame *Acquire();
+  void Submit(fluidfile_frame *frame);
+
+private:
+  void Run();
+
+  std::string prefix;
+  int interval;
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<fluidfile_frame *> queued;
+  std::vector<fluidfile_frame *> spare;
+  bool done;
+  std::thread writer;
+};
+
+#endif //__FLUIDFILE_HPP__
@@ -0,0 +1,1138 @@
+//Code written by Richard O. Lee and Christian Bienia
+//Modified by Christian Fensch
+
+/**
+ * fluidsim.cpp
+ *
+ * Setup, I/O and the phases of a frame that fluidanimate_raftlib and
+ * fluidanimate_pthreads share, see fluidsim.hpp.
+ */
+
+
+#include <cstdlib>
+#include <cstring>
+
+#include <iostream>
+#include <cmath>
+#include <cassert>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "fluidsim.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+
+cellpool *pools; //each thread has its private cell pool
+
+fptype restParticlesPerMeter, h, hSq;
+fptype densityCoeff, pressureCoeff, viscosityCoeff;
+
+int nx, ny, nz;    // number of grid cells in each dimension
+Vec3 delta;        // cell dimensions
+int numParticles = 0;
+int numCells = 0;
+Cell *cells = 0;
+Cell *cells2 = 0;
+int *cnumPars = 0;
+int *cnumPars2 = 0;
+Cell **last_cells = nullptr; //helper array with pointers to last cell structure of "cells" array lists
+#ifdef ENABLE_VISUALIZATION
+Vec3 vMax(0.0,0.0,0.0);
+Vec3 vMin(0.0,0.0,0.0);
+#endif
+int numThreads = 0;
+CheckpointWriter *checkpoint = nullptr; //writes frames in the background, if asked to
+
+int XDIVS = 1;  // number of partitions in X
+int ZDIVS = 1;  // number of partitions in Z
+
+Grid *grids;
+bool  *border;
+#ifdef USE_MUTEX
+pthread_mutex_t **mutex;
+#endif
+
+#ifdef ENABLE_MORTON_ORDER
+int *cellOrder;
+int *cellAt;
+#endif
+
+int *neighCellCache;
+int *numNeighCellCache;
+
+#ifdef USE_GHOST_CELLS
+GhostBox *ghostBoxes;
+std::vector<std::pair<int, int> > *ghostsOf;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Spreads the low 21 bits of v to every third bit
+static inline uint64_t SpreadBits(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+  v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2)  & 0x1249249249249249ULL;
+  return v;
+}
+
+// Position of (x, y, z) along the Z-order curve
+static inline uint64_t MortonCode(uint32_t x, uint32_t y, uint32_t z)
+{
+  return SpreadBits(x) | (SpreadBits(y) << 1) | (SpreadBits(z) << 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * hmgweight
+ *
+ * Computes the hamming weight of x
+ *
+ * x      - input value
+ * lsb    - if x!=0 position of smallest bit set, else -1
+ *
+ * return - the hamming weight
+ */
+unsigned int hmgweight(unsigned int x, int *lsb) {
+  unsigned int weight=0;
+  unsigned int mask= 1;
+  unsigned int count=0;
+
+  *lsb=-1;
+  while(x > 0) {
+    //unsigned int temp;
+    //temp=(x&mask);
+    if((x&mask) == 1) {
+      weight++;
+      if(*lsb == -1) *lsb = count;
+    }
+    x >>= 1;
+    count++;
+  }
+
+  return weight;
+}
+
+// Fill neighCellCache with the neighbors of every cell, in the order
+// InitNeighCellList lists them
+static void BuildNeighCellCache()
+{
+  neighCellCache = new int[numCells * NUM_NEIGH_CELLS];
+  numNeighCellCache = new int[numCells];
+  for(int ck = 0; ck < nz; ++ck)
+    for(int cj = 0; cj < ny; ++cj)
+      for(int ci = 0; ci < nx; ++ci)
+      {
+        int my_index = CellIndex(ci, cj, ck);
+        int *neighCells = &neighCellCache[my_index * NUM_NEIGH_CELLS];
+        int numNeighCells = 0;
+        neighCells[numNeighCells] = my_index;
+        ++numNeighCells;
+
+        for(int di = -1; di <= 1; ++di)
+          for(int dj = -1; dj <= 1; ++dj)
+            for(int dk = -1; dk <= 1; ++dk)
+            {
+              int ii = ci + di;
+              int jj = cj + dj;
+              int kk = ck + dk;
+              if(ii >= 0 && ii < nx && jj >= 0 && jj < ny && kk >= 0 && kk < nz)
+              {
+                int index = CellIndex(ii, jj, kk);
+                if(index < my_index)
+                {
+                  neighCells[numNeighCells] = index;
+                  ++numNeighCells;
+                }
+              }
+            }
+        numNeighCellCache[my_index] = numNeighCells;
+      }
+}
+
+void InitSim(char const *fileName, unsigned int threadnum)
+{
+  //Compute partitioning based on square root of number of threads
+  //NOTE: Other partition sizes are possible as long as XDIVS * ZDIVS == threadnum,
+  //      but communication is minimal (and hence optimal) if XDIVS == ZDIVS
+  int lsb;
+  if(hmgweight(threadnum,&lsb) != 1) {
+    std::cerr << "Number of threads must be a power of 2" << std::endl;
+    exit(1);
+  }
+  XDIVS = 1<<(lsb/2);
+  ZDIVS = 1<<(lsb/2);
+  if((unsigned int)(XDIVS*ZDIVS) != threadnum) XDIVS*=2;
+  assert((unsigned int)(XDIVS * ZDIVS) == threadnum);
+
+  grids = new union Grid[NUM_GRIDS];
+  assert(sizeof(Grid) <= CACHELINE_SIZE); // as we put and aligh grid on the cacheline size to avoid false-sharing
+                                          // if asserts fails - increase pp union member in Grid declarationi
+                                          // and change this macro 
+  pools = new cellpool[NUM_GRIDS];
+
+  //Load input particles
+  std::cout << "Loading file \"" << fileName << "\"..." << std::endl;
+  fluidfile file;
+  if(!fluidfile_open(fileName, &file)) {
+    std::cerr << "Error opening file. Aborting." << std::endl;
+    exit(1);
+  }
+  restParticlesPerMeter = file.restParticlesPerMeter;
+  numParticles          = file.numParticles;
+  for(int i=0; i<NUM_GRIDS; i++) cellpool_init(&pools[i], numParticles/NUM_GRIDS);
+
+  h = kernelRadiusMultiplier / restParticlesPerMeter;
+  hSq = h*h;
+
+#ifndef ENABLE_DOUBLE_PRECISION
+  fptype coeff1 = 315.0 / (64.0*pi*powf(h,9.0));
+  fptype coeff2 = 15.0 / (pi*powf(h,6.0));
+  fptype coeff3 = 45.0 / (pi*powf(h,6.0));
+#else
+  fptype coeff1 = 315.0 / (64.0*pi*pow(h,9.0));
+  fptype coeff2 = 15.0 / (pi*pow(h,6.0));
+  fptype coeff3 = 45.0 / (pi*pow(h,6.0));
+#endif //ENABLE_DOUBLE_PRECISION
+  fptype particleMass = 0.5*doubleRestDensity / (restParticlesPerMeter*restParticlesPerMeter*restParticlesPerMeter);
+  densityCoeff = particleMass * coeff1;
+  pressureCoeff = 3.0*coeff2 * 0.50*stiffnessPressure * particleMass;
+  viscosityCoeff = viscosity * coeff3 * particleMass;
+
+  Vec3 range = domainMax - domainMin;
+  nx = (int)(range.x / h);
+  ny = (int)(range.y / h);
+  nz = (int)(range.z / h);
+  assert(nx >= 1 && ny >= 1 && nz >= 1);
+  numCells = nx*ny*nz;
+  std::cout << "Number of cells: " << numCells << std::endl;
+  delta.x = range.x / nx;
+  delta.y = range.y / ny;
+  delta.z = range.z / nz;
+  assert(delta.x >= h && delta.y >= h && delta.z >= h);
+
+  std::cout << "Grids steps over x, y, z: " << delta.x << " " << delta.y << " " << delta.z << std::endl;
+  
+  assert(nx >= XDIVS && nz >= ZDIVS);
+
+  #ifdef ENABLE_MORTON_ORDER
+
+  std::vector<uint64_t> codes(numCells);
+  cellOrder = new int[numCells];
+  cellAt = new int[numCells];
+  for(int i = 0; i < numCells; ++i)
+  {
+    codes[i] = MortonCode(i % nx, (i / nx) % ny, i / (nx*ny));
+    cellAt[i] = i;
+  }
+  std::sort(cellAt, cellAt + numCells, [&codes](int a, int b) { return codes[a] < codes[b]; });
+  for(int i = 0; i < numCells; ++i)
+    cellOrder[cellAt[i]] = i;
+
+  #endif
+
+  BuildNeighCellCache();
+
+  int gi = 0;
+  int sx, sz, ex, ez;
+  ex = 0;
+  for(int i = 0; i < XDIVS; ++i)
+  {
+    sx = ex;
+    ex = (int)((fptype)(nx)/(fptype)(XDIVS) * (i+1) + 0.5);
+    assert(sx < ex);
+
+    ez = 0;
+    for(int j = 0; j < ZDIVS; ++j, ++gi)
+    {
+      sz = ez;
+      ez = (int)((fptype)(nz)/(fptype)(ZDIVS) * (j+1) + 0.5);
+      assert(sz < ez);
+
+      grids[gi].ind.sx = sx;
+      grids[gi].ind.ex = ex;
+      grids[gi].ind.sy = 0;
+      grids[gi].ind.ey = ny;
+      grids[gi].ind.sz = sz;
+      grids[gi].ind.ez = ez;
+    }
+  }
+  assert(gi == NUM_GRIDS);
+
+  border = new bool[numCells];
+  for(int i = 0; i < NUM_GRIDS; ++i)
+    for(int iz = grids[i].ind.sz; iz < grids[i].ind.ez; ++iz)
+      for(int iy = grids[i].ind.sy; iy < grids[i].ind.ey; ++iy)
+        for(int ix = grids[i].ind.sx; ix < grids[i].ind.ex; ++ix)
+        {
+          int index = CellIndex(ix, iy, iz);
+          border[index] = false;
+          for(int dk = -1; dk <= 1; ++dk)
+	  {
+            for(int dj = -1; dj <= 1; ++dj)
+	    {
+              for(int di = -1; di <= 1; ++di)
+              {
+                int ci = ix + di;
+                int cj = iy + dj;
+                int ck = iz + dk;
+
+                if(ci < 0) ci = 0; else if(ci > (nx-1)) ci = nx-1;
+                if(cj < 0) cj = 0; else if(cj > (ny-1)) cj = ny-1;
+                if(ck < 0) ck = 0; else if(ck > (nz-1)) ck = nz-1;
+
+                if( ci < grids[i].ind.sx || ci >= grids[i].ind.ex ||
+                  cj < grids[i].ind.sy || cj >= grids[i].ind.ey ||
+                  ck < grids[i].ind.sz || ck >= grids[i].ind.ez ) {
+                      
+                    border[index] = true;
+		    break;
+		}
+              } // for(int di = -1; di <= 1; ++di)
+	      if(border[index])
+		break;
+	    } // for(int dj = -1; dj <= 1; ++dj)
+	    if(border[index])
+	       break;
+           } // for(int dk = -1; dk <= 1; ++dk)
+        }
+
+  #ifdef USE_GHOST_CELLS
+
+  ghostBoxes = new GhostBox[NUM_GRIDS];
+  ghostsOf = new std::vector<std::pair<int, int> >[NUM_GRIDS];
+  for(int i = 0; i < NUM_GRIDS; ++i)
+  {
+    GhostBox &box = ghostBoxes[i];
+    box.sx = std::max(grids[i].ind.sx - 1, 0);
+    box.sz = std::max(grids[i].ind.sz - 1, 0);
+    box.w = std::min(grids[i].ind.ex + 1, nx) - box.sx;
+    box.d = std::min(grids[i].ind.ez + 1, nz) - box.sz;
+    box.slot.assign(box.w * ny * box.d, -1);
+    for(int iz = box.sz; iz < box.sz + box.d; ++iz)
+      for(int iy = 0; iy < ny; ++iy)
+        for(int ix = box.sx; ix < box.sx + box.w; ++ix)
+        {
+          if(ix >= grids[i].ind.sx && ix < grids[i].ind.ex &&
+             iz >= grids[i].ind.sz && iz < grids[i].ind.ez)
+            continue;
+          int owner = 0;
+          while(ix < grids[owner].ind.sx || ix >= grids[owner].ind.ex ||
+                iz < grids[owner].ind.sz || iz >= grids[owner].ind.ez)
+            ++owner;
+          box.slot[((iz - box.sz)*ny + iy)*box.w + ix - box.sx] = box.ghosts.size();
+          ghostsOf[owner].push_back(std::make_pair(i, (int)box.ghosts.size()));
+          box.ghosts.push_back(GhostCell());
+          box.ghosts.back().index = CellIndex(ix, iy, iz);
+        }
+  }
+
+  #endif
+  
+  #ifdef USE_MUTEX
+
+  mutex = new pthread_mutex_t *[numCells];
+  for (int i = 0; i < numCells; ++i)
+  {
+    assert(CELL_MUTEX_ID < MUTEXES_PER_CELL);
+    int n = (border[i] ? MUTEXES_PER_CELL : CELL_MUTEX_ID+1);
+    mutex[i] = new pthread_mutex_t[n];
+    for (int j = 0; j < n; ++j)
+      pthread_mutex_init(&mutex[i][j], nullptr);
+  }
+
+  #endif
+
+  //make sure Cell structure is multiple of estiamted cache line size
+  assert(sizeof(Cell) % CACHELINE_SIZE == 0);
+  //make sure helper Cell structure is in sync with real Cell structure
+  assert(offsetof(struct Cell_aux, padding) == offsetof(struct Cell, padding));
+
+  if(posix_memalign((void **)(&cells), CACHELINE_SIZE, sizeof(struct Cell) * numCells) ||
+     posix_memalign((void **)(&cells2), CACHELINE_SIZE, sizeof(struct Cell) * numCells) ||
+     posix_memalign((void **)(&cnumPars), CACHELINE_SIZE, sizeof(int) * numCells) ||
+     posix_memalign((void **)(&cnumPars2), CACHELINE_SIZE, sizeof(int) * numCells) ||
+     posix_memalign((void **)(&last_cells), CACHELINE_SIZE, sizeof(struct Cell *) * numCells)) {
+    std::cerr << "Error allocating cells. Aborting." << std::endl;
+    exit(1);
+  }
+
+  // because cells and cells2 are not allocated via new
+  // we construct them here
+  for(int i=0; i<numCells; ++i)
+  {
+	  new (&cells[i]) Cell;
+	  new (&cells2[i]) Cell;
+  }
+
+  memset(cnumPars, 0, numCells*sizeof(int));
+
+  //Always use single precision float variables b/c file format uses single precision float
+  int pool_id = 0;
+  for(int i = 0; i < numParticles; ++i)
+  {
+    float px  = file.field[0][i];
+    float py  = file.field[1][i];
+    float pz  = file.field[2][i];
+    float hvx = file.field[3][i];
+    float hvy = file.field[4][i];
+    float hvz = file.field[5][i];
+    float vx  = file.field[6][i];
+    float vy  = file.field[7][i];
+    float vz  = file.field[8][i];
+
+    int ci = (int)((px - domainMin.x) / delta.x);
+    int cj = (int)((py - domainMin.y) / delta.y);
+    int ck = (int)((pz - domainMin.z) / delta.z);
+
+    if(ci < 0) ci = 0; else if(ci > (nx-1)) ci = nx-1;
+    if(cj < 0) cj = 0; else if(cj > (ny-1)) cj = ny-1;
+    if(ck < 0) ck = 0; else if(ck > (nz-1)) ck = nz-1;
+
+    int index = CellIndex(ci, cj, ck);
+    Cell *cell = &cells[index];
+
+    //go to last cell structure in list
+    int np = cnumPars[index];
+    while(np > PARTICLES_PER_CELL) {
+      cell = cell->next;
+      np = np - PARTICLES_PER_CELL;
+    }
+    //add another cell structure if everything full
+    if( (np % PARTICLES_PER_CELL == 0) && (cnumPars[index] != 0) ) {
+      //Get cells from pools in round-robin fashion to balance load during parallel phase
+      cell->next = cellpool_getcell(&pools[pool_id], cell);
+      pool_id = (pool_id+1) % NUM_GRIDS;
+      cell = cell->next;
+      np = np - PARTICLES_PER_CELL;
+    }
+
+    cell->p[np].x = px;
+    cell->p[np].y = py;
+    cell->p[np].z = pz;
+    cell->hv[np].x = hvx;
+    cell->hv[np].y = hvy;
+    cell->hv[np].z = hvz;
+    cell->v[np].x = vx;
+    cell->v[np].y = vy;
+    cell->v[np].z = vz;
+#ifdef ENABLE_VISUALIZATION
+	vMin.x = std::min(vMin.x, cell->v[np].x);
+	vMax.x = std::max(vMax.x, cell->v[np].x);
+	vMin.y = std::min(vMin.y, cell->v[np].y);
+	vMax.y = std::max(vMax.y, cell->v[np].y);
+	vMin.z = std::min(vMin.z, cell->v[np].z);
+	vMax.z = std::max(vMax.z, cell->v[np].z);
+#endif
+    ++cnumPars[index];
+  }
+
+  fluidfile_close(&file);
+
+  std::cout << "Number of particles: " << numParticles << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Copy the particles out of the cells, one array for each field of a fluid
+// file, in row-major order of the cells
+void GatherParticles(float *const *field)
+{
+  int count = 0;
+  for(int i = 0; i < numCells; ++i)
+  {
+    int index = CellIndex(i % nx, (i / nx) % ny, i / (nx*ny));
+    Cell *cell = &cells[index];
+    int np = cnumPars[index];
+    for(int j = 0; j < np; ++j)
+    {
+      //Always use single precision float variables b/c file format uses single precision
+      field[0][count] = (float)(cell->p[j % PARTICLES_PER_CELL].x);
+      field[1][count] = (float)(cell->p[j % PARTICLES_PER_CELL].y);
+      field[2][count] = (float)(cell->p[j % PARTICLES_PER_CELL].z);
+      field[3][count] = (float)(cell->hv[j % PARTICLES_PER_CELL].x);
+      field[4][count] = (float)(cell->hv[j % PARTICLES_PER_CELL].y);
+      field[5][count] = (float)(cell->hv[j % PARTICLES_PER_CELL].z);
+      field[6][count] = (float)(cell->v[j % PARTICLES_PER_CELL].x);
+      field[7][count] = (float)(cell->v[j % PARTICLES_PER_CELL].y);
+      field[8][count] = (float)(cell->v[j % PARTICLES_PER_CELL].z);
+      ++count;
+
+      //move pointer to next cell in list if end of array is reached
+      if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+        cell = cell->next;
+      }
+    }
+  }
+  assert(count == numParticles);
+}
+
+// Write the particles to fileName, in the native format if it ends in
+// FLUIDFILE_EXT and in the legacy format otherwise
+void SaveFile(char const *fileName)
+{
+  std::cout << "Saving file \"" << fileName << "\"..." << std::endl;
+
+  std::vector<float> fields((size_t)numParticles * FLUIDFILE_FIELDS);
+  float *field[FLUIDFILE_FIELDS];
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k)
+    field[k] = fields.data() + (size_t)k*numParticles;
+  GatherParticles(field);
+  if(!fluidfile_write(fileName, fluidfile_native_name(fileName), restParticlesPerMeter, numParticles, field))
+    exit(1);
+}
+
+// Hand the particles to the checkpoint writer after frame, if one is due
+void CheckpointFrame(int frame)
+{
+  if(checkpoint == nullptr || !checkpoint->Due(frame))
+    return;
+  fluidfile_frame *snapshot = checkpoint->Acquire();
+  snapshot->frame = frame;
+  snapshot->restParticlesPerMeter = restParticlesPerMeter;
+  float *field[FLUIDFILE_FIELDS];
+  for(int k = 0; k < FLUIDFILE_FIELDS; ++k)
+  {
+    snapshot->field[k].resize(numParticles);
+    field[k] = snapshot->field[k].data();
+  }
+  GatherParticles(field);
+  checkpoint->Submit(snapshot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void CleanUpSim()
+{
+  // first return extended cells to cell pools
+  for(int i=0; i< numCells; ++i)
+  {
+    Cell& cell = cells[i];
+	while(cell.next)
+	{
+		Cell *temp = cell.next;
+		cell.next = temp->next;
+		cellpool_returncell(&pools[0], temp);
+	}
+  }
+  // now return cell pools
+  //NOTE: Cells from cell pools can migrate to different pools during the parallel phase.
+  //      This is no problem as long as all cell pools are destroyed together. Each pool
+  //      uses its internal meta information to free exactly the cells which it allocated
+  //      itself. This guarantees that all allocated cells will be freed but it might
+  //      render other cell pools unusable so they also have to be destroyed.
+  for(int i=0; i<NUM_GRIDS; i++) cellpool_destroy(&pools[i]);
+
+  #ifdef USE_MUTEX
+
+  for(int i = 0; i < numCells; ++i)
+  {
+    assert(CELL_MUTEX_ID < MUTEXES_PER_CELL);
+    int n = (border[i] ? MUTEXES_PER_CELL : CELL_MUTEX_ID+1);
+    for(int j = 0; j < n; ++j)
+      pthread_mutex_destroy(&mutex[i][j]);
+    delete[] mutex[i];
+  }
+  delete[] mutex;
+
+  #endif
+
+  delete[] border;
+  delete[] neighCellCache;
+  delete[] numNeighCellCache;
+
+  #ifdef ENABLE_MORTON_ORDER
+
+  delete[] cellOrder;
+  delete[] cellAt;
+
+  #endif
+
+  #ifdef USE_GHOST_CELLS
+
+  delete[] ghostBoxes;
+  delete[] ghostsOf;
+
+  #endif
+
+  free(cells);
+  free(cells2);
+  free(cnumPars);
+  free(cnumPars2);
+  free(last_cells);
+  delete[] grids;
+}
+
+// Print how long framenum frames took, elapsed ns in all
+void ReportTime(long long elapsed, int framenum)
+{
+#ifdef ENABLE_SOA
+  std::cout << "Cell layout: " << CELL_LAYOUT << "/" << SIMD_ISA;
+#else
+  std::cout << "Cell layout: " << CELL_LAYOUT;
+#endif
+#ifdef ENABLE_MORTON_ORDER
+  std::cout << ", cell order: morton";
+#else
+  std::cout << ", cell order: row-major";
+#endif
+  std::cout << ", " << elapsed << " ns elapsed, "
+            << (double)elapsed / framenum << " ns/frame, "
+            << (double)elapsed / ((double)numParticles * framenum) << " ns/particle-step" << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ClearParticlesMT(int tid)
+{
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+        int index = CellIndex(ix, iy, iz);
+        cnumPars[index] = 0;
+		    cells[index].next = nullptr;
+        last_cells[index] = &cells[index];
+      }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef USE_MUTEX
+
+void RebuildGridMT(int tid)
+{
+  //iterate through source cell lists
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+  {
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+    {
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+        int index2 = CellIndex(ix, iy, iz);
+        Cell *cell2 = &cells2[index2];
+        int np2 = cnumPars2[index2];
+        //iterate through source particles
+
+        for(int j = 0; j < np2; ++j)
+        {
+          //get destination for source particle
+          int ci = (int)((cell2->p[j % PARTICLES_PER_CELL].x - domainMin.x) / delta.x);
+          int cj = (int)((cell2->p[j % PARTICLES_PER_CELL].y - domainMin.y) / delta.y);
+          int ck = (int)((cell2->p[j % PARTICLES_PER_CELL].z - domainMin.z) / delta.z);
+
+          if(ci < 0) ci = 0; else if(ci > (nx-1)) ci = nx-1;
+          if(cj < 0) cj = 0; else if(cj > (ny-1)) cj = ny-1;
+          if(ck < 0) ck = 0; else if(ck > (nz-1)) ck = nz-1;
+          #ifdef ENABLE_CFL_CHECK
+          //check that source cell is a neighbor of destination cell
+          bool cfl_cond_satisfied=false;
+          for(int di = -1; di <= 1; ++di)
+            for(int dj = -1; dj <= 1; ++dj)
+              for(int dk = -1; dk <= 1; ++dk)
+              {
+                int ii = ci + di;
+                int jj = cj + dj;
+                int kk = ck + dk;
+                if(ii >= 0 && ii < nx && jj >= 0 && jj < ny && kk >= 0 && kk < nz)
+                {
+                  int index = CellIndex(ii, jj, kk);
+                  if(index == index2)
+                  {
+                    cfl_cond_satisfied=true;
+                    break;
+                  }
+                }
+              }
+          if(!cfl_cond_satisfied)
+          {
+            std::cerr << "FATAL ERROR: Courant–Friedrichs–Lewy condition not satisfied." << std::endl;
+            exit(1);
+          }
+          #endif //ENABLE_CFL_CHECK
+
+          int index = CellIndex(ci, cj, ck);
+          // this assumes that particles cannot travel more than one grid cell per time step
+
+          if (border[index])
+            pthread_mutex_lock(&mutex[index][CELL_MUTEX_ID]);
+
+          Cell *cell = last_cells[index];
+          int np = cnumPars[index];
+
+          if ( (np % PARTICLES_PER_CELL == 0) && (cnumPars[index] != 0) )
+          {
+            cell->next = cellpool_getcell(&pools[tid], cell);
+            cell = cell->next;
+            last_cells[index] = cell;
+          }
+
+          ++cnumPars[index];
+
+          if (border[index])
+            pthread_mutex_unlock(&mutex[index][CELL_MUTEX_ID]);
+
+          //copy source to destination particle
+              
+          cell->p[np % PARTICLES_PER_CELL]  = cell2->p[j % PARTICLES_PER_CELL];
+          cell->hv[np % PARTICLES_PER_CELL] = cell2->hv[j % PARTICLES_PER_CELL];
+          cell->v[np % PARTICLES_PER_CELL]  = cell2->v[j % PARTICLES_PER_CELL];
+
+          //move pointer to next source cell in list if end of array is reached
+          if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+            Cell *temp = cell2;
+            cell2 = cell2->next;
+            //return cells to pool that are not statically allocated head of lists
+            if(temp != &cells2[index2]) {
+              //NOTE: This is thread-safe because temp and pool are thread-private, no need to synchronize
+              cellpool_returncell(&pools[tid], temp);
+            }
+          }
+        } // for(int j = 0; j < np2; ++j)
+        //return cells to pool that are not statically allocated head of lists
+        if((cell2 != nullptr) && (cell2 != &cells2[index2]))
+          cellpool_returncell(&pools[tid], cell2);
+      }
+    }
+  }
+}
+
+#endif //USE_MUTEX
+
+////////////////////////////////////////////////////////////////////////////////
+
+int InitNeighCellList(int ci, int cj, int ck, int *neighCells)
+{
+  int my_index = CellIndex(ci, cj, ck);
+  const int *cached = &neighCellCache[my_index * NUM_NEIGH_CELLS];
+  int numCached = numNeighCellCache[my_index];
+
+  // have the nearest particles first -> help branch prediction
+  int numNeighCells = 0;
+  neighCells[numNeighCells] = my_index;
+  ++numNeighCells;
+
+  for(int inc = 1; inc < numCached; ++inc)
+    if(cnumPars[cached[inc]] != 0)
+    {
+      neighCells[numNeighCells] = cached[inc];
+      ++numNeighCells;
+    }
+  return numNeighCells;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef ENABLE_PARTICLE_SORT
+// Quantized position of p along axis within a cell of the given origin and
+// size, 10 bits
+static inline uint32_t CellFraction(fptype p, fptype min, fptype size, int origin)
+{
+  int q = (int)(((p - min) / size - origin) * 1024);
+  return q < 0 ? 0 : (q > 1023 ? 1023 : q);
+}
+
+// Put the particles of cell (ix, iy, iz) in Z-order of their position, so the
+// pairs the density and force loops find close to each other are also close
+// in memory
+static void SortCellParticles(int ix, int iy, int iz)
+{
+  struct Particle { uint64_t key; Vec3 p, hv, v; };
+  static thread_local std::vector<Particle> particles;
+
+  int index = CellIndex(ix, iy, iz);
+  int np = cnumPars[index];
+  if(np < 2)
+    return;
+  particles.resize(np);
+  Cell *cell = &cells[index];
+  for(int j = 0; j < np; ++j)
+  {
+    Particle &par = particles[j];
+    par.p = cell->p[j % PARTICLES_PER_CELL];
+    par.hv = cell->hv[j % PARTICLES_PER_CELL];
+    par.v = cell->v[j % PARTICLES_PER_CELL];
+    par.key = MortonCode(CellFraction(par.p.x, domainMin.x, delta.x, ix),
+                         CellFraction(par.p.y, domainMin.y, delta.y, iy),
+                         CellFraction(par.p.z, domainMin.z, delta.z, iz));
+    //move pointer to next cell in list if end of array is reached
+    if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+      cell = cell->next;
+    }
+  }
+  std::stable_sort(particles.begin(), particles.end(),
+                   [](Particle const &a, Particle const &b) { return a.key < b.key; });
+  cell = &cells[index];
+  for(int j = 0; j < np; ++j)
+  {
+    cell->p[j % PARTICLES_PER_CELL] = particles[j].p;
+    cell->hv[j % PARTICLES_PER_CELL] = particles[j].hv;
+    cell->v[j % PARTICLES_PER_CELL] = particles[j].v;
+    //move pointer to next cell in list if end of array is reached
+    if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+      cell = cell->next;
+    }
+  }
+}
+#endif //ENABLE_PARTICLE_SORT
+
+void InitDensitiesAndForcesMT(int tid)
+{
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+#ifdef ENABLE_PARTICLE_SORT
+        SortCellParticles(ix, iy, iz);
+#endif
+        int index = CellIndex(ix, iy, iz);
+        Cell *cell = &cells[index];
+        int np = cnumPars[index];
+        for(int j = 0; j < np; ++j)
+        {
+          cell->density[j % PARTICLES_PER_CELL] = 0.0;
+          cell->a[j % PARTICLES_PER_CELL] = externalAcceleration;
+          //move pointer to next cell in list if end of array is reached
+          if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+            cell = cell->next;
+          }
+        }
+      }
+
+#ifdef USE_GHOST_CELLS
+  //the particle counts are those of the grid just rebuilt
+  std::vector<GhostCell> &ghosts = ghostBoxes[tid].ghosts;
+  for(size_t i = 0; i < ghosts.size(); ++i)
+  {
+    int np = cnumPars[ghosts[i].index];
+    ghosts[i].density.assign(np, 0.0);
+    ghosts[i].a.assign(np, Vec3(0.0, 0.0, 0.0));
+  }
+#endif //USE_GHOST_CELLS
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef USE_GHOST_CELLS
+// Add the densities other workers computed for the particles of grid tid
+void ReduceGhostDensitiesMT(int tid)
+{
+  for(size_t i = 0; i < ghostsOf[tid].size(); ++i)
+  {
+    GhostCell &ghost = ghostBoxes[ghostsOf[tid][i].first].ghosts[ghostsOf[tid][i].second];
+    Cell *cell = &cells[ghost.index];
+    int np = ghost.density.size();
+    for(int j = 0; j < np; ++j)
+    {
+      cell->density[j % PARTICLES_PER_CELL] += ghost.density[j];
+      //move pointer to next cell in list if end of array is reached
+      if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+        cell = cell->next;
+      }
+    }
+  }
+}
+
+// Add the accelerations other workers computed for the particles of grid tid
+void ReduceGhostForcesMT(int tid)
+{
+  for(size_t i = 0; i < ghostsOf[tid].size(); ++i)
+  {
+    GhostCell &ghost = ghostBoxes[ghostsOf[tid][i].first].ghosts[ghostsOf[tid][i].second];
+    Cell *cell = &cells[ghost.index];
+    int np = ghost.a.size();
+    for(int j = 0; j < np; ++j)
+    {
+      cell->a[j % PARTICLES_PER_CELL] += ghost.a[j];
+      //move pointer to next cell in list if end of array is reached
+      if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+        cell = cell->next;
+      }
+    }
+  }
+}
+#endif //USE_GHOST_CELLS
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ComputeDensities2MT(int tid)
+{
+  const fptype tc = hSq*hSq*hSq;
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+        int index = CellIndex(ix, iy, iz);
+        Cell *cell = &cells[index];
+        int np = cnumPars[index];
+        for(int j = 0; j < np; ++j)
+        {
+          cell->density[j % PARTICLES_PER_CELL] += tc;
+          cell->density[j % PARTICLES_PER_CELL] *= densityCoeff;
+          //move pointer to next cell in list if end of array is reached
+          if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+            cell = cell->next;
+          }
+        }
+      }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// ProcessCollisions() with container walls
+// Under the assumptions that
+// a) a particle will not penetrate a wall
+// b) a particle will not migrate further than once cell
+// c) the parSize is smaller than a cell
+// then only the particles at the perimiters may be influenced by the walls
+#if 0
+void ProcessCollisionsMT(int tid)
+{
+  for(int iz = grids[tid].sz; iz < grids[tid].ez; ++iz)
+    for(int iy = grids[tid].sy; iy < grids[tid].ey; ++iy)
+      for(int ix = grids[tid].sx; ix < grids[tid].ex; ++ix)
+      {
+        int index = CellIndex(ix, iy, iz);
+        Cell *cell = &cells[index];
+        int np = cnumPars[index];
+        for(int j = 0; j < np; ++j)
+        {
+          Vec3 pos = cell->p[j % PARTICLES_PER_CELL] + cell->hv[j % PARTICLES_PER_CELL] * timeStep;
+
+          fptype diff = parSize - (pos.x - domainMin.x);
+          if(diff > epsilon)
+            cell->a[j % PARTICLES_PER_CELL].x += stiffnessCollisions*diff - damping*cell->v[j % PARTICLES_PER_CELL].x;
+
+          diff = parSize - (domainMax.x - pos.x);
+          if(diff > epsilon)
+            cell->a[j % PARTICLES_PER_CELL].x -= stiffnessCollisions*diff + damping*cell->v[j % PARTICLES_PER_CELL].x;
+
+          diff = parSize - (pos.y - domainMin.y);
+          if(diff > epsilon)
+            cell->a[j % PARTICLES_PER_CELL].y += stiffnessCollisions*diff - damping*cell->v[j % PARTICLES_PER_CELL].y;
+
+          diff = parSize - (domainMax.y - pos.y);
+          if(diff > epsilon)
+            cell->a[j % PARTICLES_PER_CELL].y -= stiffnessCollisions*diff + damping*cell->v[j % PARTICLES_PER_CELL].y;
+
+          diff = parSize - (pos.z - domainMin.z);
+          if(diff > epsilon)
+            cell->a[j % PARTICLES_PER_CELL].z += stiffnessCollisions*diff - damping*cell->v[j % PARTICLES_PER_CELL].z;
+
+          diff = parSize - (domainMax.z - pos.z);
+          if(diff > epsilon)
+            cell->a[j % PARTICLES_PER_CELL].z -= stiffnessCollisions*diff + damping*cell->v[j % PARTICLES_PER_CELL].z;
+
+          //move pointer to next cell in list if end of array is reached
+          if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+            cell = cell->next;
+          }
+        }
+      }
+}
+#else
+void ProcessCollisionsMT(int tid)
+{
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+  {
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+	{
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+	    if(!((ix==0)||(iy==0)||(iz==0)||(ix==(nx-1))||(iy==(ny-1))==(iz==(nz-1))))
+			continue;	// not on domain wall
+        int index = CellIndex(ix, iy, iz);
+        Cell *cell = &cells[index];
+        int np = cnumPars[index];
+        for(int j = 0; j < np; ++j)
+        {
+		  int ji = j % PARTICLES_PER_CELL;
+          Vec3 pos = cell->p[ji] + cell->hv[ji] * timeStep;
+
+		  if(ix==0)
+		  {
+            fptype diff = parSize - (pos.x - domainMin.x);
+		    if(diff > epsilon)
+              cell->a[ji].x += stiffnessCollisions*diff - damping*cell->v[ji].x;
+		  }
+		  if(ix==(nx-1))
+		  {
+            fptype diff = parSize - (domainMax.x - pos.x);
+            if(diff > epsilon)
+              cell->a[ji].x -= stiffnessCollisions*diff + damping*cell->v[ji].x;
+		  }
+		  if(iy==0)
+		  {
+            fptype diff = parSize - (pos.y - domainMin.y);
+            if(diff > epsilon)
+              cell->a[ji].y += stiffnessCollisions*diff - damping*cell->v[ji].y;
+		  }
+		  if(iy==(ny-1))
+		  {
+            fptype diff = parSize - (domainMax.y - pos.y);
+            if(diff > epsilon)
+              cell->a[ji].y -= stiffnessCollisions*diff + damping*cell->v[ji].y;
+		  }
+		  if(iz==0)
+		  {
+            fptype diff = parSize - (pos.z - domainMin.z);
+            if(diff > epsilon)
+              cell->a[ji].z += stiffnessCollisions*diff - damping*cell->v[ji].z;
+		  }
+		  if(iz==(nz-1))
+		  {
+            fptype diff = parSize - (domainMax.z - pos.z);
+            if(diff > epsilon)
+              cell->a[ji].z -= stiffnessCollisions*diff + damping*cell->v[ji].z;
+		  }
+          //move pointer to next cell in list if end of array is reached
+          if(ji == PARTICLES_PER_CELL-1) {
+            cell = cell->next;
+          }
+        }
+      }
+	}
+  }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+#if defined(USE_ImpeneratableWall)
+void ProcessCollisions2MT(int tid)
+{
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+  {
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+	{
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+#if 0
+// Chris, the following test should be valid
+// *** provided that a particle does not migrate more than 1 cell
+// *** per integration step. This does not appear to be the case
+// *** in the pthreads version. Serial version it seems to be OK
+	    if(!((ix==0)||(iy==0)||(iz==0)||(ix==(nx-1))||(iy==(ny-1))==(iz==(nz-1))))
+			continue;	// not on domain wall
+#endif
+        int index = CellIndex(ix, iy, iz);
+        Cell *cell = &cells[index];
+        int np = cnumPars[index];
+        for(int j = 0; j < np; ++j)
+        {
+		  int ji = j % PARTICLES_PER_CELL;
+          Vec3 pos = cell->p[ji];
+
+		  if(ix==0)
+		  {
+            fptype diff = pos.x - domainMin.x;
+		    if(diff < Zero)
+			{
+				cell->p[ji].x = domainMin.x - diff;
+				cell->v[ji].x = -cell->v[ji].x;
+				cell->hv[ji].x = -cell->hv[ji].x;
+			}
+		  }
+		  if(ix==(nx-1))
+		  {
+            fptype diff = domainMax.x - pos.x;
+ 			if(diff < Zero)
+			{
+				cell->p[ji].x = domainMax.x + diff;
+				cell->v[ji].x = -cell->v[ji].x;
+				cell->hv[ji].x = -cell->hv[ji].x;
+			}
+		  }
+		  if(iy==0)
+		  {
+            fptype diff = pos.y - domainMin.y;
+		    if(diff < Zero)
+			{
+				cell->p[ji].y = domainMin.y - diff;
+				cell->v[ji].y = -cell->v[ji].y;
+				cell->hv[ji].y = -cell->hv[ji].y;
+			}
+		  }
+		  if(iy==(ny-1))
+		  {
+            fptype diff = domainMax.y - pos.y;
+ 			if(diff < Zero)
+			{
+				cell->p[ji].y = domainMax.y + diff;
+				cell->v[ji].y = -cell->v[ji].y;
+				cell->hv[ji].y = -cell->hv[ji].y;
+			}
+		  }
+		  if(iz==0)
+		  {
+            fptype diff = pos.z - domainMin.z;
+		    if(diff < Zero)
+			{
+				cell->p[ji].z = domainMin.z - diff;
+				cell->v[ji].z = -cell->v[ji].z;
+				cell->hv[ji].z = -cell->hv[ji].z;
+			}
+		  }
+		  if(iz==(nz-1))
+		  {
+            fptype diff = domainMax.z - pos.z;
+ 			if(diff < Zero)
+			{
+				cell->p[ji].z = domainMax.z + diff;
+				cell->v[ji].z = -cell->v[ji].z;
+				cell->hv[ji].z = -cell->hv[ji].z;
+			}
+		  }
+          //move pointer to next cell in list if end of array is reached
+          if(ji == PARTICLES_PER_CELL-1) {
+            cell = cell->next;
+          }
+        }
+      }
+	}
+  }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+void AdvanceParticlesMT(int tid)
+{
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+        int index = CellIndex(ix, iy, iz);
+        Cell *cell = &cells[index];
+        int np = cnumPars[index];
+        for(int j = 0; j < np; ++j)
+        {
+          Vec3 v_half = cell->hv[j % PARTICLES_PER_CELL] + cell->a[j % PARTICLES_PER_CELL]*timeStep;
+#if defined(USE_ImpeneratableWall)
+		// N.B. The integration of the position can place the particle
+		// outside the domain. Although we could place a test in this loop
+		// we would be unnecessarily testing particles on interior cells.
+		// Therefore, to reduce the amount of computations we make a later
+		// pass on the perimiter cells to account for particle migration
+		// beyond domain
+#endif
+          cell->p[j % PARTICLES_PER_CELL] += v_half * timeStep;
+          cell->v[j % PARTICLES_PER_CELL] = cell->hv[j % PARTICLES_PER_CELL] + v_half;
+          cell->v[j % PARTICLES_PER_CELL] *= 0.5;
+          cell->hv[j % PARTICLES_PER_CELL] = v_half;
+  	  
+         
+          //move pointer to next cell in list if end of array is reached
+          if(j % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+            cell = cell->next;
+          }
+        }
+      }
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,519 @@
+//Code written by Richard O. Lee and Christian Bienia
+//Modified by Christian Fensch
+//
+// The simulation that fluidanimate_raftlib and fluidanimate_pthreads share:
+// the cells and their partition into one grid for each worker, loading and
+// saving particles, and the phases of a frame. A front end only decides how
+// the workers run the phases and how they get in each other's way.
+//
+// Each phase works on the cells of grid tid. The density and force phases
+// also add to particles of neighbor cells that may belong to another grid;
+// they are templates over the function a front end applies those additions
+// with, unless USE_ATOMIC_BORDER or USE_GHOST_CELLS has the workers apply
+// them directly.
+
+#ifndef __FLUIDSIM_HPP__
+#define __FLUIDSIM_HPP__ 1
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <pthread.h>
+
+#include "fluid.hpp"
+#include "cellpool.hpp"
+#include "fluidfile.hpp"
+#include "simd.hpp"
+
+//Uncomment to add code to check that Courant–Friedrichs–Lewy condition is satisfied at runtime
+//#define ENABLE_CFL_CHECK
+
+//Uncomment to rebuild the grid with RebuildGridMT, which appends particles
+//to the cells of other grids under a mutex of the cell, instead of through
+//the CellModificationKernel of fluidanimate_raftlib
+//#define USE_MUTEX
+
+//fluidanimate_pthreads always rebuilds the grid under the cell mutexes
+#if defined(ENABLE_PTHREADS) && !defined(USE_MUTEX)
+#define USE_MUTEX
+#endif
+
+//How workers add density and acceleration contributions to particles of
+//cells they may share with other workers. By default every contribution goes
+//to the function the front end passes in: fluidanimate_raftlib sends them to
+//DensityModificationKernel / AccelerationModificationKernel, which apply them
+//one at a time, fluidanimate_pthreads takes a mutex of the particle on border
+//cells. Uncomment one of the following to have the workers apply them
+//directly instead:
+//  USE_ATOMIC_BORDER - plain adds, CAS loops on cells on a partition border
+//  USE_GHOST_CELLS   - plain adds to the worker's own cells, the others go
+//                      to private ghost copies that the owner sums in after
+//                      the phase
+//#define USE_ATOMIC_BORDER
+//#define USE_GHOST_CELLS
+
+#if defined(USE_ATOMIC_BORDER) && defined(USE_GHOST_CELLS)
+#error "USE_ATOMIC_BORDER and USE_GHOST_CELLS are mutually exclusive"
+#endif
+
+//Uncomment to store the cells in Z-order (Morton order) instead of row-major
+//order, so the neighbors of a cell are mostly a few cells away in memory
+//#define ENABLE_MORTON_ORDER
+
+//Uncomment to sort the particles of each cell in Z-order of their position
+//every frame, after the grid is rebuilt. Changes the order of the particles
+//in the output file
+//#define ENABLE_PARTICLE_SORT
+
+//Particles that the integration moved past a wall are reflected back into
+//the domain by ProcessCollisions2MT
+#define USE_ImpeneratableWall
+
+////////////////////////////////////////////////////////////////////////////////
+
+extern cellpool *pools; //each thread has its private cell pool
+
+extern fptype restParticlesPerMeter, h, hSq;
+extern fptype densityCoeff, pressureCoeff, viscosityCoeff;
+
+extern int nx, ny, nz;    // number of grid cells in each dimension
+extern Vec3 delta;        // cell dimensions
+extern int numParticles;
+extern int numCells;
+extern Cell *cells;
+extern Cell *cells2;
+extern int *cnumPars;
+extern int *cnumPars2;
+extern Cell **last_cells; //helper array with pointers to last cell structure of "cells" array lists
+#ifdef ENABLE_VISUALIZATION
+extern Vec3 vMax;
+extern Vec3 vMin;
+#endif
+extern int numThreads;
+extern CheckpointWriter *checkpoint; //writes frames in the background, if asked to
+
+extern int XDIVS;  // number of partitions in X
+extern int ZDIVS;  // number of partitions in Z
+
+#define NUM_GRIDS  ((XDIVS) * (ZDIVS))
+#define MUTEXES_PER_CELL 128
+#define CELL_MUTEX_ID 0
+
+extern Grid *grids;
+extern bool *border;
+#ifdef USE_MUTEX
+extern pthread_mutex_t **mutex;
+#endif
+
+#ifdef ENABLE_MORTON_ORDER
+extern int *cellOrder;   //memory index of each cell, by row-major index
+extern int *cellAt;      //row-major index of each cell, by memory index
+#endif
+
+//Neighbor cells of each cell that come before it in memory, itself first,
+//NUM_NEIGH_CELLS entries per cell; computed once as the grid does not change
+#define NUM_NEIGH_CELLS (3*3*3)
+extern int *neighCellCache;
+extern int *numNeighCellCache;
+
+#ifdef USE_GHOST_CELLS
+// Private copy of the densities and accelerations a worker adds to the
+// particles of a cell owned by another worker
+struct GhostCell {
+  int index;                  //cell
+  std::vector<fptype> density;
+  std::vector<Vec3> a;
+};
+
+// Cells next to a grid that belong to other grids: the grid extended by a
+// cell on each side in x and z, and a ghost for each cell of it outside the
+// grid
+struct GhostBox {
+  int sx, sz, w, d;           //origin and size of the box in x and z
+  std::vector<int> slot;      //ghost of each cell of the box, -1 for cells of the grid
+  std::vector<GhostCell> ghosts;
+};
+
+extern GhostBox *ghostBoxes;
+//ghosts of the cells of each grid, as (grid, ghost) pairs
+extern std::vector<std::pair<int, int> > *ghostsOf;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Index of cell (ix, iy, iz) in cells, cells2, cnumPars, ...
+static inline int CellIndex(int ix, int iy, int iz)
+{
+#ifdef ENABLE_MORTON_ORDER
+  return cellOrder[(iz*ny + iy)*nx + ix];
+#else
+  return (iz*ny + iy)*nx + ix;
+#endif
+}
+
+// Row-major index of the cell at index in cells
+static inline int CellRowMajor(int index)
+{
+#ifdef ENABLE_MORTON_ORDER
+  return cellAt[index];
+#else
+  return index;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Partition the domain into threadnum grids and load the particles of
+// fileName into the cells
+void InitSim(char const *fileName, unsigned int threadnum);
+
+// Copy the particles out of the cells, one array for each field of a fluid
+// file, in row-major order of the cells
+void GatherParticles(float *const *field);
+
+// Write the particles to fileName, in the native format if it ends in
+// FLUIDFILE_EXT and in the legacy format otherwise
+void SaveFile(char const *fileName);
+
+// Hand the particles to the checkpoint writer after frame, if one is due
+void CheckpointFrame(int frame);
+
+void CleanUpSim();
+
+// Print how long framenum frames took, elapsed ns in all
+void ReportTime(long long elapsed, int framenum);
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ClearParticlesMT(int tid);
+#ifdef USE_MUTEX
+void RebuildGridMT(int tid);
+#endif
+// Neighbor cells of cell (ci, cj, ck) that hold particles, itself first;
+// returns how many
+int InitNeighCellList(int ci, int cj, int ck, int *neighCells);
+void InitDensitiesAndForcesMT(int tid);
+#ifdef USE_GHOST_CELLS
+// Add the densities other workers computed for the particles of grid tid
+void ReduceGhostDensitiesMT(int tid);
+// Add the accelerations other workers computed for the particles of grid tid
+void ReduceGhostForcesMT(int tid);
+#endif
+void ComputeDensities2MT(int tid);
+void ProcessCollisionsMT(int tid);
+void ProcessCollisions2MT(int tid);
+void AdvanceParticlesMT(int tid);
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef ENABLE_SOA
+// Number of the first n particles of block neigh that come before particle j
+// of block cell in memory, so each pair is handled once
+static inline int PairsBefore(const Cell *neigh, int n, const Cell *cell, int j)
+{
+  if(neigh < cell) return n;
+  if(neigh == cell) return std::min(n, j);
+  return 0;
+}
+
+// Density contributions between particle j of cell and the first n particles
+// of block, simd::WIDTH of them at a time: tc[k] for each, and a bit set in
+// the result for each one within the kernel radius
+static inline uint32_t BlockDensities(const Cell *block, int n, const Cell *cell, int j, fptype *tc)
+{
+  const simd::vfloat x = simd::set1(cell->p.x[j]);
+  const simd::vfloat y = simd::set1(cell->p.y[j]);
+  const simd::vfloat z = simd::set1(cell->p.z[j]);
+  const simd::vfloat radiusSq = simd::set1(hSq);
+  uint32_t near = 0;
+  for(int k = 0; k < n; k += simd::WIDTH)
+  {
+    simd::vfloat dx = simd::sub(x, simd::load(&block->p.x[k]));
+    simd::vfloat dy = simd::sub(y, simd::load(&block->p.y[k]));
+    simd::vfloat dz = simd::sub(z, simd::load(&block->p.z[k]));
+    simd::vfloat distSq = simd::add(simd::add(simd::mul(dx, dx), simd::mul(dy, dy)), simd::mul(dz, dz));
+    simd::vfloat t = simd::sub(radiusSq, distSq);
+    simd::store(&tc[k], simd::mul(simd::mul(t, t), t));
+    near |= simd::lt(distSq, radiusSq) << k;
+  }
+  return near & simd::FirstLanes(n);
+}
+
+// Accelerations between particle j of cell and the first n particles of
+// block, in the same order of operations as the Vec3 code: (ax, ay, az)[k]
+// for each, and a bit set in the result for each one within the kernel radius
+static inline uint32_t BlockForces(const Cell *block, int n, const Cell *cell, int j, fptype *ax, fptype *ay, fptype *az)
+{
+  const simd::vfloat x = simd::set1(cell->p.x[j]);
+  const simd::vfloat y = simd::set1(cell->p.y[j]);
+  const simd::vfloat z = simd::set1(cell->p.z[j]);
+  const simd::vfloat vx = simd::set1(cell->v.x[j]);
+  const simd::vfloat vy = simd::set1(cell->v.y[j]);
+  const simd::vfloat vz = simd::set1(cell->v.z[j]);
+  const simd::vfloat density = simd::set1(cell->density[j]);
+  const simd::vfloat radiusSq = simd::set1(hSq);
+  const simd::vfloat radius = simd::set1(h);
+  const simd::vfloat minDistSq = simd::set1(1e-12);
+  const simd::vfloat pressure = simd::set1(pressureCoeff);
+  const simd::vfloat viscosity = simd::set1(viscosityCoeff);
+  const simd::vfloat restDensity = simd::set1(doubleRestDensity);
+  const simd::vfloat one = simd::set1(1.0);
+  uint32_t near = 0;
+  for(int k = 0; k < n; k += simd::WIDTH)
+  {
+    simd::vfloat dx = simd::sub(x, simd::load(&block->p.x[k]));
+    simd::vfloat dy = simd::sub(y, simd::load(&block->p.y[k]));
+    simd::vfloat dz = simd::sub(z, simd::load(&block->p.z[k]));
+    simd::vfloat distSq = simd::add(simd::add(simd::mul(dx, dx), simd::mul(dy, dy)), simd::mul(dz, dz));
+    simd::vfloat dist = simd::sqrt(simd::max(distSq, minDistSq));
+    simd::vfloat hmr = simd::sub(radius, dist);
+    simd::vfloat neighDensity = simd::load(&block->density[k]);
+    simd::vfloat q = simd::div(simd::mul(hmr, hmr), dist);
+    simd::vfloat r = simd::sub(simd::add(density, neighDensity), restDensity);
+    simd::vfloat inv = simd::div(one, simd::mul(density, neighDensity));
+    simd::vfloat acc;
+    acc = simd::mul(simd::mul(simd::mul(dx, pressure), q), r);
+    acc = simd::add(acc, simd::mul(simd::mul(simd::sub(simd::load(&block->v.x[k]), vx), viscosity), hmr));
+    simd::store(&ax[k], simd::mul(acc, inv));
+    acc = simd::mul(simd::mul(simd::mul(dy, pressure), q), r);
+    acc = simd::add(acc, simd::mul(simd::mul(simd::sub(simd::load(&block->v.y[k]), vy), viscosity), hmr));
+    simd::store(&ay[k], simd::mul(acc, inv));
+    acc = simd::mul(simd::mul(simd::mul(dz, pressure), q), r);
+    acc = simd::add(acc, simd::mul(simd::mul(simd::sub(simd::load(&block->v.z[k]), vz), viscosity), hmr));
+    simd::store(&az[k], simd::mul(acc, inv));
+    near |= simd::lt(distSq, radiusSq) << k;
+  }
+  return near & simd::FirstLanes(n);
+}
+#endif //ENABLE_SOA
+
+////////////////////////////////////////////////////////////////////////////////
+
+#if defined(USE_ATOMIC_BORDER)
+// *addr += val, for particles of border cells that other workers add to
+static inline void AtomicAdd(fptype *addr, fptype val)
+{
+  fptype old, sum;
+  __atomic_load(addr, &old, __ATOMIC_RELAXED);
+  do {
+    sum = old + val;
+  } while(!__atomic_compare_exchange(addr, &old, &sum, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+#elif defined(USE_GHOST_CELLS)
+// Ghost of cell index in the box of grid tid, nullptr if the grid owns it
+static inline GhostCell *FindGhost(int tid, int index)
+{
+  GhostBox &box = ghostBoxes[tid];
+  int rowMajor = CellRowMajor(index);
+  int ix = rowMajor % nx;
+  int iy = (rowMajor / nx) % ny;
+  int iz = rowMajor / (nx*ny);
+  int slot = box.slot[((iz - box.sz)*ny + iy)*box.w + ix - box.sx];
+  return slot < 0 ? nullptr : &box.ghosts[slot];
+}
+#endif
+
+// Add tc to the density of particle j of block cell, the ordinal-th one of
+// logical cell index, or leave it to shared(index, cell, j, ordinal, tc)
+template<class Shared>
+static inline void AddDensity(int tid, int index, Cell *cell, int j, int ordinal, fptype tc, Shared &shared)
+{
+#if defined(USE_ATOMIC_BORDER)
+  (void) tid; (void) ordinal; (void) shared;
+  if(border[index])
+    AtomicAdd(&cell->density[j], tc);
+  else
+    cell->density[j] += tc;
+#elif defined(USE_GHOST_CELLS)
+  (void) shared;
+  GhostCell *ghost = FindGhost(tid, index);
+  if(ghost)
+    ghost->density[ordinal] += tc;
+  else
+    cell->density[j] += tc;
+#else
+  (void) tid;
+  shared(index, cell, j, ordinal, tc);
+#endif
+}
+
+// Add acc to the acceleration of particle j of block cell, the ordinal-th
+// one of logical cell index, or leave it to shared(index, cell, j, ordinal, acc)
+template<class Shared>
+static inline void AddAcceleration(int tid, int index, Cell *cell, int j, int ordinal, Vec3 const &acc, Shared &shared)
+{
+#if defined(USE_ATOMIC_BORDER)
+  (void) tid; (void) ordinal; (void) shared;
+  if(border[index])
+  {
+    AtomicAdd(&cell->a[j].x, acc.x);
+    AtomicAdd(&cell->a[j].y, acc.y);
+    AtomicAdd(&cell->a[j].z, acc.z);
+  }
+  else
+    cell->a[j] += acc;
+#elif defined(USE_GHOST_CELLS)
+  (void) shared;
+  GhostCell *ghost = FindGhost(tid, index);
+  if(ghost)
+    ghost->a[ordinal] += acc;
+  else
+    cell->a[j] += acc;
+#else
+  (void) tid;
+  shared(index, cell, j, ordinal, acc);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Add the density contributions of every pair of particles within the
+// kernel radius of each other, one of which is in grid tid
+template<class Shared>
+void ComputeDensitiesMT(int tid, Shared shared)
+{
+  int neighCells[3*3*3];
+
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+        int index = CellIndex(ix, iy, iz);
+        int np = cnumPars[index];
+        if(np == 0)
+          continue;
+
+        int numNeighCells = InitNeighCellList(ix, iy, iz, neighCells);
+        Cell *cell = &cells[index];
+        for(int ipar = 0; ipar < np; ++ipar)
+        {
+          for(int inc = 0; inc < numNeighCells; ++inc)
+          {
+            int indexNeigh = neighCells[inc];
+            Cell *neigh = &cells[indexNeigh];
+            int numNeighPars = cnumPars[indexNeigh];
+#ifdef ENABLE_SOA
+            const int ji = ipar % PARTICLES_PER_CELL;
+            for(int base = 0; base < numNeighPars; base += PARTICLES_PER_CELL, neigh = neigh->next)
+            {
+              int n = PairsBefore(neigh, std::min(numNeighPars - base, PARTICLES_PER_CELL), cell, ji);
+              fptype tc[PARTICLES_PER_CELL];
+              for(uint32_t near = BlockDensities(neigh, n, cell, ji, tc); near; near &= near - 1)
+              {
+                int k = __builtin_ctz(near);
+                AddDensity(tid, index, cell, ji, ipar, tc[k], shared);
+                AddDensity(tid, indexNeigh, neigh, k, base + k, tc[k], shared);
+              }
+            }
+#else
+            for(int iparNeigh = 0; iparNeigh < numNeighPars; ++iparNeigh)
+            {
+              //Check address to make sure densities are computed only once per pair
+              if(&neigh->p[iparNeigh % PARTICLES_PER_CELL] < &cell->p[ipar % PARTICLES_PER_CELL])
+              {
+                fptype distSq = (cell->p[ipar % PARTICLES_PER_CELL] - neigh->p[iparNeigh % PARTICLES_PER_CELL]).GetLengthSq();
+                if(distSq < hSq)
+                {
+                  fptype t = hSq - distSq;
+                  fptype tc = t*t*t;
+
+                  AddDensity(tid, index, cell, ipar % PARTICLES_PER_CELL, ipar, tc, shared);
+                  AddDensity(tid, indexNeigh, neigh, iparNeigh % PARTICLES_PER_CELL, iparNeigh, tc, shared);
+                }
+              }
+              //move pointer to next cell in list if end of array is reached
+              if(iparNeigh % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+                neigh = neigh->next;
+              }
+            }
+#endif //ENABLE_SOA
+          }
+          //move pointer to next cell in list if end of array is reached
+          if(ipar % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+            cell = cell->next;
+          }
+        }
+      }
+}
+
+// Add the pressure and viscosity forces of every pair of particles within
+// the kernel radius of each other, one of which is in grid tid
+template<class Shared>
+void ComputeForcesMT(int tid, Shared shared)
+{
+  int neighCells[3*3*3];
+
+  for(int iz = grids[tid].ind.sz; iz < grids[tid].ind.ez; ++iz)
+    for(int iy = grids[tid].ind.sy; iy < grids[tid].ind.ey; ++iy)
+      for(int ix = grids[tid].ind.sx; ix < grids[tid].ind.ex; ++ix)
+      {
+        int index = CellIndex(ix, iy, iz);
+        int np = cnumPars[index];
+        if(np == 0)
+          continue;
+
+        int numNeighCells = InitNeighCellList(ix, iy, iz, neighCells);
+        Cell *cell = &cells[index];
+        for(int ipar = 0; ipar < np; ++ipar)
+        {
+          for(int inc = 0; inc < numNeighCells; ++inc)
+          {
+            int indexNeigh = neighCells[inc];
+            Cell *neigh = &cells[indexNeigh];
+            int numNeighPars = cnumPars[indexNeigh];
+#ifdef ENABLE_SOA
+            const int ji = ipar % PARTICLES_PER_CELL;
+            for(int base = 0; base < numNeighPars; base += PARTICLES_PER_CELL, neigh = neigh->next)
+            {
+              int n = PairsBefore(neigh, std::min(numNeighPars - base, PARTICLES_PER_CELL), cell, ji);
+              fptype ax[PARTICLES_PER_CELL], ay[PARTICLES_PER_CELL], az[PARTICLES_PER_CELL];
+              for(uint32_t near = BlockForces(neigh, n, cell, ji, ax, ay, az); near; near &= near - 1)
+              {
+                int k = __builtin_ctz(near);
+                Vec3 acc(ax[k], ay[k], az[k]);
+                AddAcceleration(tid, index, cell, ji, ipar, acc, shared);
+                AddAcceleration(tid, indexNeigh, neigh, k, base + k, -acc, shared);
+              }
+            }
+#else
+            for(int iparNeigh = 0; iparNeigh < numNeighPars; ++iparNeigh)
+            {
+              //Check address to make sure forces are computed only once per pair
+              if(&neigh->p[iparNeigh % PARTICLES_PER_CELL] < &cell->p[ipar % PARTICLES_PER_CELL])
+              {
+                Vec3 disp = cell->p[ipar % PARTICLES_PER_CELL] - neigh->p[iparNeigh % PARTICLES_PER_CELL];
+                fptype distSq = disp.GetLengthSq();
+                if(distSq < hSq)
+                {
+                  #ifndef ENABLE_DOUBLE_PRECISION
+                  fptype dist = sqrtf(std::max(distSq, (fptype)1e-12));
+                  #else
+                  fptype dist = sqrt(std::max(distSq, 1e-12));
+                  #endif //ENABLE_DOUBLE_PRECISION
+                  fptype hmr = h - dist;
+
+                  Vec3 acc = disp * pressureCoeff * (hmr*hmr/dist) * (cell->density[ipar % PARTICLES_PER_CELL]+neigh->density[iparNeigh % PARTICLES_PER_CELL] - doubleRestDensity);
+                  acc += (neigh->v[iparNeigh % PARTICLES_PER_CELL] - cell->v[ipar % PARTICLES_PER_CELL]) * viscosityCoeff * hmr;
+                  acc /= cell->density[ipar % PARTICLES_PER_CELL] * neigh->density[iparNeigh % PARTICLES_PER_CELL];
+
+                  AddAcceleration(tid, index, cell, ipar % PARTICLES_PER_CELL, ipar, acc, shared);
+                  AddAcceleration(tid, indexNeigh, neigh, iparNeigh % PARTICLES_PER_CELL, iparNeigh, -acc, shared);
+                }
+              }
+              //move pointer to next cell in list if end of array is reached
+              if(iparNeigh % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+                neigh = neigh->next;
+              }
+            }
+#endif //ENABLE_SOA
+          }
+          //move pointer to next cell in list if end of array is reached
+          if(ipar % PARTICLES_PER_CELL == PARTICLES_PER_CELL-1) {
+            cell = cell->next;
+          }
+        }
+      }
+}
+
+#endif //__FLUIDSIM_HPP__
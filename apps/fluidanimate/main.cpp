@@ -19,13 +19,28 @@
  */
 
 #include <iostream>
+#include <algorithm>
+#ifdef ENABLE_PTHREADS
+#include "pthreads_src.hpp"
+#else
 #include "raftlib_src.hpp"
+#endif
 #include "fluidcmp.hpp"
 
+/** the RaftLib graph, or plain threads and barriers with ENABLE_PTHREADS **/
+static int fluidanimate(int argc, char* argv[]) {
+#ifdef ENABLE_PTHREADS
+    return fluidanimate_pthreads(argc, argv);
+#else
+    return fluidanimate_raftlib(argc, argv);
+#endif
+}
+
 static void print_usage(char* name) {
     std::cout << "Usages:\n";
     std::cout << "     1: " << name <<
-        " 1 <threadnum> <framenum> <.fluid input> [.fluid output]\n";
+        " 1 <threadnum> <framenum> <.fluid input> [.fluid output] "
+        "[checkpoint prefix] [checkpoint interval]\n";
     std::cout << "     2: " << name <<
         " 2 <FILE> <RFILE> [cmp options]\n";
     std::cout << "     3: " << name <<
@@ -43,10 +58,11 @@ int main(int argc, char* argv[])
     }
     int option = atoi(argv[1]);
     switch (option) {
-        case 1: fluidanimate_raftlib(argc - 1, &argv[1]); break;
+        case 1: fluidanimate(argc - 1, &argv[1]); break;
         case 2: fluidcmp(argc - 1, &argv[1]); break;
         case 3:
-                fluidanimate_raftlib(argc - 1, &argv[1]);
+                /** RFILE is no checkpoint prefix **/
+                fluidanimate(std::min(argc - 1, 5), &argv[1]);
                 fluidcmp(argc - 4, &argv[4]);
                 break;
         default:
@@ -0,0 +1,222 @@
+//Code written by Richard O. Lee and Christian Bienia
+//Modified by Christian Fensch
+
+/**
+ * pthreads_src.cpp
+ *
+ * fluidanimate without RaftLib, in the way of the PARSEC pthreads version:
+ * one thread for each grid of the spatial partition, running every phase of
+ * a frame on its grid, with a barrier between phases. Particles of cells on
+ * the border of a grid are updated under the per-particle mutexes of the
+ * cell. The simulation itself is the one of fluidsim.cpp, shared with
+ * raftlib_src.cpp, so the two can be timed against each other on the same
+ * input.
+ */
+
+
+#include <cstdlib>
+#include <cstring>
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include <pthread.h>
+
+#include "fluidsim.hpp"
+#include "pthreads_src.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct thread_args {
+  int tid;      //thread id, determines work partition
+  int frames;      //number of frames to compute
+};      //arguments for threads
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Sense-reversing barrier: the last thread to arrive resets the count and
+// flips the shared sense, the others spin until it matches their own, which
+// they flipped on the way in. A thread keeps its sense across barriers, so
+// the same barrier serves every phase without a second counter.
+class SenseBarrier
+{
+public:
+  SenseBarrier(int n) : total(n), count(n), sense(false) {}
+
+  void Wait(bool &localSense)
+  {
+    localSense = !localSense;
+    if(count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      count.store(total, std::memory_order_relaxed);
+      sense.store(localSense, std::memory_order_release);
+    }
+    else
+    {
+      while(sense.load(std::memory_order_acquire) != localSense)
+        std::this_thread::yield();
+    }
+  }
+
+private:
+  const int total;
+  std::atomic<int> count;
+  std::atomic<bool> sense;
+};
+
+SenseBarrier *barrier;
+
+// Add tc to the density of particle j of cell, which holds the ordinal-th
+// particle of logical cell index. Particles of border cells may get
+// contributions from a neighboring grid at the same time, so they are
+// updated under their mutex
+static void LockedAddDensity(int index, Cell *cell, int j, int ordinal, fptype tc)
+{
+  if(border[index])
+  {
+    pthread_mutex_lock(&mutex[index][ordinal % MUTEXES_PER_CELL]);
+    cell->density[j] += tc;
+    pthread_mutex_unlock(&mutex[index][ordinal % MUTEXES_PER_CELL]);
+  }
+  else
+    cell->density[j] += tc;
+}
+
+// Same as LockedAddDensity, for the acceleration
+static void LockedAddAcceleration(int index, Cell *cell, int j, int ordinal, Vec3 const &acc)
+{
+  if(border[index])
+  {
+    pthread_mutex_lock(&mutex[index][ordinal % MUTEXES_PER_CELL]);
+    cell->a[j] += acc;
+    pthread_mutex_unlock(&mutex[index][ordinal % MUTEXES_PER_CELL]);
+  }
+  else
+    cell->a[j] += acc;
+}
+
+void AdvanceFrameMT(int tid, bool &sense)
+{
+  //swap src and dest arrays with particles
+  if(tid == 0) {
+    std::swap(cells, cells2);
+    std::swap(cnumPars, cnumPars2);
+  }
+  barrier->Wait(sense);
+
+  ClearParticlesMT(tid);
+  barrier->Wait(sense);
+  RebuildGridMT(tid);
+  barrier->Wait(sense);
+  InitDensitiesAndForcesMT(tid);
+  barrier->Wait(sense);
+  ComputeDensitiesMT(tid, LockedAddDensity);
+  barrier->Wait(sense);
+#ifdef USE_GHOST_CELLS
+  ReduceGhostDensitiesMT(tid);
+  barrier->Wait(sense);
+#endif
+  ComputeDensities2MT(tid);
+  barrier->Wait(sense);
+  ComputeForcesMT(tid, LockedAddAcceleration);
+  barrier->Wait(sense);
+#ifdef USE_GHOST_CELLS
+  ReduceGhostForcesMT(tid);
+  barrier->Wait(sense);
+#endif
+  ProcessCollisionsMT(tid);
+  barrier->Wait(sense);
+  AdvanceParticlesMT(tid);
+  barrier->Wait(sense);
+#if defined(USE_ImpeneratableWall)
+  // N.B. The integration of the position can place the particle
+  // outside the domain. We now make a pass on the perimiter cells
+  // to account for particle migration beyond domain.
+  ProcessCollisions2MT(tid);
+  barrier->Wait(sense);
+#endif
+}
+
+void AdvanceFramesMT(thread_args *targs)
+{
+  bool sense = false;
+  //the cells this thread adds to lists come from memory local to it
+  cellpool_bind(&pools[targs->tid]);
+  for(int i = 0; i < targs->frames; ++i)
+  {
+    AdvanceFrameMT(targs->tid, sense);
+    //the other threads wait for thread 0 at the first barrier of the next
+    //frame, so the cells stay put while it copies them out
+    if(targs->tid == 0)
+      CheckpointFrame(i + 1);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int fluidanimate_pthreads(int argc, char *argv[])
+{
+  (void) timeStep;
+  if(argc < 4)
+  {
+    std::cout << "Usage: " << argv[0] << " <threadnum> <framenum> <.fluid input file> [.fluid output file]"
+              << " [checkpoint prefix] [checkpoint interval=1]" << std::endl;
+    return -1;
+  }
+
+  int threadnum = atoi(argv[1]);
+  numThreads = threadnum;
+  int framenum = atoi(argv[2]);
+
+  //Check arguments
+  if(threadnum < 1) {
+    std::cerr << "<threadnum> must at least be 1" << std::endl;
+    return -1;
+  }
+  if(framenum < 1) {
+    std::cerr << "<framenum> must at least be 1" << std::endl;
+    return -1;
+  }
+
+#ifdef ENABLE_CFL_CHECK
+  std::cout << "WARNING: Check for Courant–Friedrichs–Lewy condition enabled. Do not use for performance measurements." << std::endl;
+#endif
+
+  InitSim(argv[3], threadnum);
+  if(argc > 5)
+    checkpoint = new CheckpointWriter(argv[5], argc > 6 ? atoi(argv[6]) : 1);
+
+  barrier = new SenseBarrier(threadnum);
+  std::vector<thread_args> targs(threadnum);
+  std::vector<std::thread> threads;
+
+// *** PARALLEL PHASE *** //
+  const auto beg = std::chrono::high_resolution_clock::now();
+  for(int i = 0; i < threadnum; ++i) {
+    targs[i].tid    = i;
+    targs[i].frames = framenum;
+    threads.emplace_back(AdvanceFramesMT, &targs[i]);
+  }
+  for(auto &t : threads)
+    t.join();
+  const auto end = std::chrono::high_resolution_clock::now();
+  const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count();
+  ReportTime(elapsed, framenum);
+
+  delete barrier;
+
+  //waits for the checkpoints still queued
+  delete checkpoint;
+  checkpoint = nullptr;
+
+  if(argc > 4)
+    SaveFile(argv[4]);
+  CleanUpSim();
+
+  std::cout << "Fluidanimate complete!" << std::endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,17 @@
+/**
+ * pthreads_src.hpp - fluidanimate on plain threads, one for each grid of the
+ * spatial partition, with a barrier between phases; runs without RaftLib
+ */
+
+#ifndef __PTHREADS_SRC_HPP__
+#define __PTHREADS_SRC_HPP__ 1
+
+#include "fluid.hpp"
+
+/**
+ *  Executes fluidanimate with the given parameters, same as
+ *  fluidanimate_raftlib
+ */
+int fluidanimate_pthreads(int argc, char *argv[]);
+
+#endif //__PTHREADS_SRC_HPP__
@@ -22,10 +22,11 @@
 #define RAFTLIBSRC_H
 
 #include "fluid.hpp"
+#include "fluidsim.hpp"
 #include <raft>
 
-//Comment to disable use of mutex locks in RebuildGridMT execution
-//#define USE_MUTEX
+//The options that choose how the workers share cells, USE_MUTEX,
+//USE_ATOMIC_BORDER and USE_GHOST_CELLS, are in fluidsim.hpp
 
 // To avoid issues with ISO C++
 #define MAX_THREADS 128
@@ -35,17 +36,6 @@
  */
 int fluidanimate_raftlib(int argc, char *argv[]);
 
-union Grid
-{
-  struct
-  {
-    int sx, sy, sz;
-    int ex, ey, ez;
-  }ind;
-
-  unsigned char pp[CACHELINE_SIZE];
-};
-
 /**
  *  Data contained in other structs which identifies the kernel and its state
  */
@@ -0,0 +1,112 @@
+// Thin wrappers over the widest SIMD instruction set the compiler targets,
+// used by the block kernels of the structure of arrays layout (ENABLE_SOA)
+// and by the reductions of fluidcmp.
+// The width is picked at compile time: 16 lanes with AVX-512, 8 with AVX,
+// 4 with SSE and 1 otherwise or in double precision. Build with -march=...
+// (or -mavx2, -mavx512f) to get the wider paths.
+
+#ifndef __SIMD_HPP__
+#define __SIMD_HPP__ 1
+
+#include <stdint.h>
+#include <cmath>
+
+#include "fluid.hpp"
+
+#if !defined(ENABLE_DOUBLE_PRECISION) && (defined(__AVX512F__) || defined(__AVX__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
+
+namespace simd {
+
+#if !defined(ENABLE_DOUBLE_PRECISION) && defined(__AVX512F__)
+
+#define SIMD_ISA "avx512"
+static const int WIDTH = 16;
+typedef __m512 vfloat;
+
+static inline vfloat load(const fptype *p)           { return _mm512_loadu_ps(p); }
+static inline void   store(fptype *p, vfloat a)      { _mm512_storeu_ps(p, a); }
+static inline vfloat set1(fptype s)                  { return _mm512_set1_ps(s); }
+static inline vfloat add(vfloat a, vfloat b)         { return _mm512_add_ps(a, b); }
+static inline vfloat sub(vfloat a, vfloat b)         { return _mm512_sub_ps(a, b); }
+static inline vfloat mul(vfloat a, vfloat b)         { return _mm512_mul_ps(a, b); }
+static inline vfloat div(vfloat a, vfloat b)         { return _mm512_div_ps(a, b); }
+static inline vfloat max(vfloat a, vfloat b)         { return _mm512_max_ps(a, b); }
+static inline vfloat min(vfloat a, vfloat b)         { return _mm512_min_ps(a, b); }
+static inline vfloat sqrt(vfloat a)                  { return _mm512_sqrt_ps(a); }
+static inline uint32_t lt(vfloat a, vfloat b)        { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+static inline uint32_t le(vfloat a, vfloat b)        { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+
+#elif !defined(ENABLE_DOUBLE_PRECISION) && defined(__AVX__)
+
+#define SIMD_ISA "avx"
+static const int WIDTH = 8;
+typedef __m256 vfloat;
+
+static inline vfloat load(const fptype *p)           { return _mm256_loadu_ps(p); }
+static inline void   store(fptype *p, vfloat a)      { _mm256_storeu_ps(p, a); }
+static inline vfloat set1(fptype s)                  { return _mm256_set1_ps(s); }
+static inline vfloat add(vfloat a, vfloat b)         { return _mm256_add_ps(a, b); }
+static inline vfloat sub(vfloat a, vfloat b)         { return _mm256_sub_ps(a, b); }
+static inline vfloat mul(vfloat a, vfloat b)         { return _mm256_mul_ps(a, b); }
+static inline vfloat div(vfloat a, vfloat b)         { return _mm256_div_ps(a, b); }
+static inline vfloat max(vfloat a, vfloat b)         { return _mm256_max_ps(a, b); }
+static inline vfloat min(vfloat a, vfloat b)         { return _mm256_min_ps(a, b); }
+static inline vfloat sqrt(vfloat a)                  { return _mm256_sqrt_ps(a); }
+static inline uint32_t lt(vfloat a, vfloat b)        { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+static inline uint32_t le(vfloat a, vfloat b)        { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+
+#elif !defined(ENABLE_DOUBLE_PRECISION) && defined(__SSE2__)
+
+#define SIMD_ISA "sse"
+static const int WIDTH = 4;
+typedef __m128 vfloat;
+
+static inline vfloat load(const fptype *p)           { return _mm_loadu_ps(p); }
+static inline void   store(fptype *p, vfloat a)      { _mm_storeu_ps(p, a); }
+static inline vfloat set1(fptype s)                  { return _mm_set1_ps(s); }
+static inline vfloat add(vfloat a, vfloat b)         { return _mm_add_ps(a, b); }
+static inline vfloat sub(vfloat a, vfloat b)         { return _mm_sub_ps(a, b); }
+static inline vfloat mul(vfloat a, vfloat b)         { return _mm_mul_ps(a, b); }
+static inline vfloat div(vfloat a, vfloat b)         { return _mm_div_ps(a, b); }
+static inline vfloat max(vfloat a, vfloat b)         { return _mm_max_ps(a, b); }
+static inline vfloat min(vfloat a, vfloat b)         { return _mm_min_ps(a, b); }
+static inline vfloat sqrt(vfloat a)                  { return _mm_sqrt_ps(a); }
+static inline uint32_t lt(vfloat a, vfloat b)        { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+static inline uint32_t le(vfloat a, vfloat b)        { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+
+#else
+
+#define SIMD_ISA "scalar"
+static const int WIDTH = 1;
+typedef fptype vfloat;
+
+static inline vfloat load(const fptype *p)           { return *p; }
+static inline void   store(fptype *p, vfloat a)      { *p = a; }
+static inline vfloat set1(fptype s)                  { return s; }
+static inline vfloat add(vfloat a, vfloat b)         { return a + b; }
+static inline vfloat sub(vfloat a, vfloat b)         { return a - b; }
+static inline vfloat mul(vfloat a, vfloat b)         { return a * b; }
+static inline vfloat div(vfloat a, vfloat b)         { return a / b; }
+static inline vfloat max(vfloat a, vfloat b)         { return a > b ? a : b; }
+static inline vfloat min(vfloat a, vfloat b)         { return a < b ? a : b; }
+static inline vfloat sqrt(vfloat a)                  { return std::sqrt(a); }
+static inline uint32_t lt(vfloat a, vfloat b)        { return a < b; }
+static inline uint32_t le(vfloat a, vfloat b)        { return a <= b; }
+
+#endif
+
+//a block is a whole number of vectors, so the last vector of a partly filled
+//block reads slots of that same block, and the lanes past its particle count
+//are masked off
+static_assert(PARTICLES_PER_CELL % WIDTH == 0, "PARTICLES_PER_CELL must be a multiple of the SIMD width");
+
+//bits of the first n lanes of a block
+static inline uint32_t FirstLanes(int n) {
+  return n >= 32 ? ~(uint32_t)0 : ((uint32_t)1 << n) - 1;
+}
+
+} // namespace simd
+
+#endif //__SIMD_HPP__
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2017, The Linux Foundation. All rights reserved.
+ *
+ * SPDX-License-Identifier:    BSD-3-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * BRAVO biased reader lock, after Dice and Kogan, "BRAVO -- Biased Locking
+ * for Reader-Writer Locks".  While the lock is read-biased, readers only
+ * publish themselves in a visible readers table and never write the lock
+ * itself.  A writer revokes the bias, waits for the published readers to
+ * drain, and then inhibits the bias for a multiple (BRAVO_N) of the time
+ * the revocation took.  The underlying lock is the writer-preferring
+ * ticket lock from wp_rw_lock.h.
+ *
+ * By default the table is shared and indexed by a hash of the thread and
+ * lock address, as in the paper.  With BRAVO_PERCPU every thread owns a
+ * padded slot, i.e. a per-CPU reader indicator: no slot collisions, but a
+ * writer has to scan one cache line per thread.
+ */
+
+#ifdef initialize_lock
+#undef initialize_lock
+#endif
+#ifdef lock_acquire_read
+#undef lock_acquire_read
+#endif
+#ifdef lock_release_read
+#undef lock_release_read
+#endif
+
+#define initialize_lock(lock, threads) bravo_rw_lock_init(lock, threads)
+#define lock_acquire_read(lock, threadnum) bravo_rw_lock_acquire_read(lock, threadnum)
+#define lock_release_read(lock, threadnum) bravo_rw_lock_release_read(lock, threadnum)
+
+#define WP_RW_LOCK_NO_BINDING
+#include "wp_rw_lock.h"
+
+#define BRAVO_N 9
+#define BRAVO_TABLE_SIZE 4096
+
+struct bravo_rw_lock {
+	unsigned long rbias;
+	unsigned long inhibit_until;
+	unsigned long pad0[6];
+	struct wp_rw_lock underlying;
+} __attribute__((aligned(64)));
+
+#ifdef BRAVO_PERCPU
+struct bravo_slot {
+	struct bravo_rw_lock *owner;
+	unsigned long pad[7];
+} __attribute__((aligned(64)));
+#else
+struct bravo_slot {
+	struct bravo_rw_lock *owner;
+};
+#endif
+
+struct bravo_slot *bravo_table;
+unsigned long bravo_nslots;
+
+/* Per thread: the slot taken on the fast path, NULL on the slow path */
+__thread struct bravo_slot *bravo_myslot;
+__thread unsigned long bravo_wticket;
+
+void bravo_rw_lock_init(uint64_t *lock, uint64_t threads) {
+	struct bravo_rw_lock *l;
+
+#ifdef BRAVO_PERCPU
+	bravo_nslots = threads;
+#else
+	bravo_nslots = BRAVO_TABLE_SIZE;
+#endif
+	if (posix_memalign((void **) &l, 64, sizeof(struct bravo_rw_lock)) ||
+	    posix_memalign((void **) &bravo_table, 64, bravo_nslots * sizeof(struct bravo_slot))) {
+		fprintf(stderr, "ERROR: cannot allocate BRAVO lock.\n");
+		exit(1);
+	}
+	memset(bravo_table, 0, bravo_nslots * sizeof(struct bravo_slot));
+	/* all-zero is also the unlocked state of the underlying lock */
+	memset(l, 0, sizeof(struct bravo_rw_lock));
+	l->rbias = 1;
+	*lock = (uint64_t) l;
+}
+
+static inline struct bravo_slot *bravo_slot_of (struct bravo_rw_lock *l, unsigned long threadnum) {
+#ifdef BRAVO_PERCPU
+	return &bravo_table[threadnum];
+#else
+	/* Mix thread and lock address so different locks spread out */
+	uint64_t h = ((uint64_t) l ^ (threadnum * 0x9E3779B97F4A7C15ul)) * 0xFF51AFD7ED558CCDul;
+	return &bravo_table[(h >> 32) % bravo_nslots];
+#endif
+}
+
+static inline unsigned long bravo_rw_lock_acquire_read (uint64_t *lock, unsigned long threadnum) {
+	struct bravo_rw_lock *l = (struct bravo_rw_lock *) *lock;
+	unsigned long depth;
+
+	if (__atomic_load_n(&l->rbias, __ATOMIC_RELAXED)) {
+		struct bravo_slot *s = bravo_slot_of(l, threadnum);
+		struct bravo_rw_lock *expected = NULL;
+
+		if (__atomic_compare_exchange_n(&s->owner, &expected, l, false,
+		                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			/* Re-check the bias after publishing, a writer may be revoking */
+			if (__atomic_load_n(&l->rbias, __ATOMIC_SEQ_CST)) {
+				bravo_myslot = s;
+				return 0;
+			}
+			__atomic_store_n(&s->owner, NULL, __ATOMIC_RELAXED);
+		}
+	}
+
+	bravo_myslot = NULL;
+	depth = wp_rw_read_lock(&l->underlying);
+	if (!__atomic_load_n(&l->rbias, __ATOMIC_RELAXED) &&
+	    get_raw_counter() >= __atomic_load_n(&l->inhibit_until, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&l->rbias, 1, __ATOMIC_RELAXED);
+	}
+
+	return depth;
+}
+
+static inline int bravo_rw_lock_release_read (uint64_t *lock, unsigned long threadnum) {
+	struct bravo_rw_lock *l = (struct bravo_rw_lock *) *lock;
+
+	if (bravo_myslot) {
+		__atomic_store_n(&bravo_myslot->owner, NULL, __ATOMIC_RELEASE);
+	} else {
+		wp_rw_read_unlock(&l->underlying);
+	}
+	return 1;
+}
+
+static inline unsigned long lock_acquire (uint64_t *lock, unsigned long threadnum) {
+	struct bravo_rw_lock *l = (struct bravo_rw_lock *) *lock;
+	unsigned long depth, i, start, now;
+
+	depth = wp_rw_write_lock(&l->underlying, &bravo_wticket);
+
+	if (__atomic_load_n(&l->rbias, __ATOMIC_RELAXED)) {
+		/* Revoke the bias and wait for the fast-path readers to leave */
+		__atomic_store_n(&l->rbias, 0, __ATOMIC_SEQ_CST);
+		start = get_raw_counter();
+		for (i = 0; i < bravo_nslots; i++) {
+			while (__atomic_load_n(&bravo_table[i].owner, __ATOMIC_ACQUIRE) == l) {
+				spin_wait(1);
+			}
+		}
+		now = get_raw_counter();
+		__atomic_store_n(&l->inhibit_until, now + (now - start) * BRAVO_N, __ATOMIC_RELAXED);
+	}
+
+	return depth;
+}
+
+static inline void lock_release (uint64_t *lock, unsigned long threadnum) {
+	struct bravo_rw_lock *l = (struct bravo_rw_lock *) *lock;
+
+	wp_rw_write_unlock(&l->underlying, bravo_wticket);
+}
@@ -32,8 +32,21 @@
 #ifdef initialize_lock
 #undef initialize_lock
 #endif
+#ifdef lock_acquire_read
+#undef lock_acquire_read
+#endif
+#ifdef lock_release_read
+#undef lock_release_read
+#endif
+#ifdef DEFAULT_READ_PCT
+#undef DEFAULT_READ_PCT
+#endif
 
 #define initialize_lock(lock, threads) cas_rw_lock_init(lock, threads)
+#define lock_acquire_read(lock, threadnum) cas_rw_lock_acquire_read(lock, threadnum)
+#define lock_release_read(lock, threadnum) cas_rw_lock_release_read(lock, threadnum)
+/* This test has always been a pure reader test */
+#define DEFAULT_READ_PCT 100
 #define CAS_RW_INIT_VAL 0x20000000
 #define CAS_RW_THRESHOLD 0
 
@@ -43,26 +56,44 @@ void cas_rw_lock_init(uint64_t *lock, uint64_t threads) {
 	*lock = CAS_RW_INIT_VAL;
 }
 
-static inline unsigned long lock_acquire (uint64_t *lock, unsigned long threadnum) {
+static inline unsigned long cas_rw_lock_acquire_read (uint64_t *lock, unsigned long threadnum) {
 	unsigned long val, old;
 
-	old = *(volatile unsigned long *) lock;
-	val = old - 1;
-
-	while (*((long *) &old) > CAS_RW_THRESHOLD) {
+	while (1) {
 		old = *(volatile unsigned long *) lock;
 		val = old - 1;
+
+		/* wait out the writer holding the exclusive lock */
+		if (*((long *) &old) <= CAS_RW_THRESHOLD) {
+			continue;
+		}
+
 		val = cas64_acquire(lock, val, old);
 
 		if (val == old) {
 			return CAS_RW_INIT_VAL - val;
 		}
 	}
+}
 
-	/* exclusive lock is held (should never actually happen in this test) */
-	return 0;
+static inline int cas_rw_lock_release_read (uint64_t *lock, unsigned long threadnum) {
+	fetchadd64_release(lock, 1);
+	return 1;
+}
+
+/* A writer takes away all reader tokens at once */
+static inline unsigned long lock_acquire (uint64_t *lock, unsigned long threadnum) {
+	unsigned long depth = 0;
+
+	while (1) {
+		if (*(volatile unsigned long *) lock == CAS_RW_INIT_VAL &&
+		    cas64_acquire(lock, 0, CAS_RW_INIT_VAL) == CAS_RW_INIT_VAL) {
+			return depth;
+		}
+		depth++;
+	}
 }
 
 static inline void lock_release (uint64_t *lock, unsigned long threadnum) {
-	fetchadd64_release(lock, 1);
+	fetchadd64_release(lock, CAS_RW_INIT_VAL);
 }
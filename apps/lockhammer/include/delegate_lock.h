@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2017, The Linux Foundation. All rights reserved.
+ *
+ * SPDX-License-Identifier:    BSD-3-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Dedicated-server delegation lock in the style of RCL (Lozi et al.,
+ * "Remote Core Locking") and ffwd (Roghanchi et al., "ffwd: delegation is
+ * (much) faster than you think").  A server thread, started by
+ * initialize_lock, owns the protected data and runs every critical section.
+ * A client writes its request into its own cache line and flips a toggle;
+ * the server polls the request lines and answers a group of DLG_GROUP
+ * clients with a single write to the group's shared response line.
+ *
+ * The server is pinned to the core given after "--" on the command line,
+ * by default the first core after the client threads, and polls until
+ * finalize_lock stops it once the clients are done.  It must have a core
+ * to itself: run with at most one thread less than there are cores.
+ */
+
+#ifdef initialize_lock
+#undef initialize_lock
+#endif
+#ifdef parse_test_args
+#undef parse_test_args
+#endif
+#ifdef lock_delegate
+#undef lock_delegate
+#endif
+#ifdef finalize_lock
+#undef finalize_lock
+#endif
+
+#define initialize_lock(lock, threads) delegate_lock_init(lock, threads)
+#define parse_test_args(args, argc, argv) delegate_parse_args(argc, argv)
+#define lock_delegate(lock, threadnum, cs, arg) delegate_lock_delegate(lock, threadnum, cs, arg)
+#define finalize_lock(lock) delegate_lock_fini(lock)
+
+#include "atomics.h"
+
+#define DLG_GROUP 8
+
+struct dlg_request {
+	critical_fn cs;
+	void *arg;
+	unsigned long toggle;
+	unsigned long pad[5];
+} __attribute__((aligned(64)));
+
+struct dlg_response {
+	unsigned long toggle[DLG_GROUP];
+} __attribute__((aligned(64)));
+
+struct dlg_request *dlg_requests;
+struct dlg_response *dlg_responses;
+unsigned long dlg_nclients;
+long dlg_server_core = -1;
+pthread_t dlg_server;
+unsigned long dlg_stop;
+
+/* Toggle of this client's last request */
+__thread unsigned long dlg_toggle;
+
+void delegate_parse_args(int argc, char **argv) {
+	if (optind < argc) {
+		dlg_server_core = strtol(argv[optind], (char **) NULL, 10);
+	}
+}
+
+static inline void delegate_relax (void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ volatile ("pause" : : : "memory");
+#elif defined(__aarch64__)
+	__asm__ volatile ("yield" : : : "memory");
+#endif
+}
+
+static void *delegate_server (void *ptr) {
+	unsigned long ngroups = (dlg_nclients + DLG_GROUP - 1) / DLG_GROUP;
+	unsigned long g, i;
+
+	while (!__atomic_load_n(&dlg_stop, __ATOMIC_ACQUIRE)) {
+		unsigned long pending = 0;
+
+		for (g = 0; g < ngroups; g++) {
+			struct dlg_response resp = dlg_responses[g];
+			unsigned long served = 0;
+
+			for (i = 0; i < DLG_GROUP && g * DLG_GROUP + i < dlg_nclients; i++) {
+				struct dlg_request *r = &dlg_requests[g * DLG_GROUP + i];
+				unsigned long t = __atomic_load_n(&r->toggle, __ATOMIC_ACQUIRE);
+
+				if (t != resp.toggle[i]) {
+					r->cs(r->arg);
+					resp.toggle[i] = t;
+					served++;
+				}
+			}
+			/* One write-back of the response line per group */
+			if (served) {
+				__atomic_thread_fence(__ATOMIC_RELEASE);
+				dlg_responses[g] = resp;
+				pending += served;
+			}
+		}
+		/* Back off the request lines for a moment after an idle pass */
+		if (!pending) {
+			delegate_relax();
+		}
+	}
+
+	return NULL;
+}
+
+void delegate_lock_init(uint64_t *lock, uint64_t threads) {
+	unsigned long ngroups = (threads + DLG_GROUP - 1) / DLG_GROUP;
+	unsigned long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_attr_t attr;
+	cpu_set_t mask;
+
+	dlg_nclients = threads;
+	if (posix_memalign((void **) &dlg_requests, 64, threads * sizeof(struct dlg_request)) ||
+	    posix_memalign((void **) &dlg_responses, 64, ngroups * sizeof(struct dlg_response))) {
+		fprintf(stderr, "ERROR: cannot allocate delegation requests.\n");
+		exit(1);
+	}
+	memset(dlg_requests, 0, threads * sizeof(struct dlg_request));
+	memset(dlg_responses, 0, ngroups * sizeof(struct dlg_response));
+
+	if (dlg_server_core < 0) {
+		dlg_server_core = threads < ncores ? threads : ncores - 1;
+	}
+	if (dlg_server_core < threads) {
+		fprintf(stderr, "WARNING: delegation server shares core %ld with a client thread.\n",
+		        dlg_server_core);
+	}
+
+	/* Pinned from its first instruction, not after it has started */
+	dlg_stop = 0;
+	CPU_ZERO(&mask);
+	CPU_SET(dlg_server_core, &mask);
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &mask);
+	if (pthread_create(&dlg_server, &attr, delegate_server, NULL)) {
+		fprintf(stderr, "ERROR: cannot start the delegation server on core %ld.\n",
+		        dlg_server_core);
+		exit(1);
+	}
+	pthread_attr_destroy(&attr);
+	*lock = 0;
+}
+
+/* Called once every client has returned, no request is left outstanding */
+void delegate_lock_fini(uint64_t *lock) {
+	__atomic_store_n(&dlg_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(dlg_server, NULL);
+	free(dlg_requests);
+	free(dlg_responses);
+}
+
+static inline unsigned long delegate_lock_delegate (uint64_t *lock, unsigned long threadnum,
+                                                    critical_fn cs, void *arg) {
+	struct dlg_request *r = &dlg_requests[threadnum];
+	volatile unsigned long *resp = &dlg_responses[threadnum / DLG_GROUP].toggle[threadnum % DLG_GROUP];
+
+	dlg_toggle ^= 1;
+	r->cs = cs;
+	r->arg = arg;
+	__atomic_store_n(&r->toggle, dlg_toggle, __ATOMIC_RELEASE);
+
+	while (*resp != dlg_toggle) {
+		spin_wait(1);
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return 1;
+}
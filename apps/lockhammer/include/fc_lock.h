@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2017, The Linux Foundation. All rights reserved.
+ *
+ * SPDX-License-Identifier:    BSD-3-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Flat-combining lock, after Hendler, Incze, Shavit and Tzafrir, "Flat
+ * Combining and the Synchronization-Parallelism Tradeoff".  Every thread
+ * publishes its critical section in its own record, then either waits for
+ * the record to be served or takes the combiner lock and serves all
+ * pending records, its own included, in FC_PASSES scans.  The protected
+ * data then stays in the combiner's cache for a whole batch.
+ *
+ * The lock word is the combiner lock; the publication records live in a
+ * separate array with one cache line per thread.
+ */
+
+#ifdef initialize_lock
+#undef initialize_lock
+#endif
+#ifdef lock_delegate
+#undef lock_delegate
+#endif
+
+#define initialize_lock(lock, threads) fc_lock_init(lock, threads)
+#define lock_delegate(lock, threadnum, cs, arg) fc_lock_delegate(lock, threadnum, cs, arg)
+
+#include "atomics.h"
+
+#ifndef FC_PASSES
+#define FC_PASSES 2
+#endif
+
+struct fc_record {
+	critical_fn cs;
+	void *arg;
+	unsigned long pending;
+	unsigned long pad[5];
+} __attribute__((aligned(64)));
+
+struct fc_record *fc_records;
+unsigned long fc_nrecords;
+
+void fc_lock_init(uint64_t *lock, uint64_t threads) {
+	fc_nrecords = threads;
+	if (posix_memalign((void **) &fc_records, 64, threads * sizeof(struct fc_record))) {
+		fprintf(stderr, "ERROR: cannot allocate flat-combining records.\n");
+		exit(1);
+	}
+	memset(fc_records, 0, threads * sizeof(struct fc_record));
+	*lock = 0;
+}
+
+static inline unsigned long fc_combine (void) {
+	unsigned long i, pass, served = 0;
+
+	for (pass = 0; pass < FC_PASSES; pass++) {
+		for (i = 0; i < fc_nrecords; i++) {
+			struct fc_record *r = &fc_records[i];
+
+			if (__atomic_load_n(&r->pending, __ATOMIC_ACQUIRE)) {
+				r->cs(r->arg);
+				__atomic_store_n(&r->pending, 0, __ATOMIC_RELEASE);
+				served++;
+			}
+		}
+	}
+
+	return served;
+}
+
+static inline unsigned long fc_lock_delegate (uint64_t *lock, unsigned long threadnum,
+                                              critical_fn cs, void *arg) {
+	struct fc_record *r = &fc_records[threadnum];
+	unsigned long served;
+
+	r->cs = cs;
+	r->arg = arg;
+	__atomic_store_n(&r->pending, 1, __ATOMIC_RELEASE);
+
+	while (1) {
+		if (!__atomic_load_n(&r->pending, __ATOMIC_ACQUIRE)) {
+			/* Served by another combiner */
+			return 0;
+		}
+		if (*(volatile unsigned long *) lock == 0 && swap64(lock, 1) == 0) {
+			/* Our record was published before, so this pass serves it */
+			served = fc_combine();
+			__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+			return served;
+		}
+		spin_wait(1);
+	}
+}
@@ -39,6 +39,9 @@
 #ifndef parse_test_args
     #define parse_test_args(args, argc, argv)
 #endif
+#ifndef finalize_lock
+    #define finalize_lock(lock)
+#endif
 #ifndef thread_local_init
     #define thread_local_init(smtid)
 #endif
@@ -46,10 +49,32 @@
     #define thread_local_done(smtid)
 #endif
 
+/* Locks without a shared mode take the exclusive path for readers.
+   lock_release_read returns 0 if an optimistic read has to be retried. */
+#ifndef lock_acquire_read
+    #define lock_acquire_read(lock, threadnum) lock_acquire(lock, threadnum)
+#endif
+#ifndef lock_release_read
+    #define lock_release_read(lock, threadnum) (lock_release(lock, threadnum), 1)
+#endif
+#ifndef DEFAULT_READ_PCT
+    #define DEFAULT_READ_PCT 0
+#endif
+
+/* Delegation locks define lock_delegate(lock, threadnum, cs, arg) to run
+   the critical section cs(arg) wherever the lock lives instead of handing
+   the lock to the calling thread; lock_acquire/lock_release go unused. */
+typedef void (*critical_fn)(void *);
+
 enum units { NS,
              INSTS };
 typedef enum units Units;
 
+enum data_ops { DATA_READ,
+                DATA_WRITE,
+                DATA_RMW };
+typedef enum data_ops DataOps;
+
 struct thread_args {
     unsigned long ncores;
     unsigned long nthrds;
@@ -60,9 +85,16 @@ struct thread_args {
     unsigned long *nsec;
     unsigned long *real_nsec;
     unsigned long *depth;
+    unsigned long *nreads;
+    unsigned long *nretries;
     unsigned long *nstart;
     unsigned long hold, post;
     Units hold_unit, post_unit;
+    unsigned long read_pct;
+    unsigned long *data;
+    unsigned long ndata;
+    DataOps data_op;
+    unsigned char data_rand;
     double tickspns;
     int *pinorder;
 };
@@ -75,6 +107,11 @@ struct test_args {
     Units ncrit_units;
     unsigned long nparallel;
     Units nparallel_units;
+    unsigned long read_pct;
+    unsigned long ndata;
+    DataOps data_op;
+    unsigned char data_rand;
+    unsigned char colocate;
     unsigned long ileave;
     unsigned char safemode;
     int *pinorder;
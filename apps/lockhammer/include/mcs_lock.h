@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2017, The Linux Foundation. All rights reserved.
+ *
+ * SPDX-License-Identifier:    BSD-3-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * MCS queue lock (Mellor-Crummey and Scott).  The lock word is the tail of
+ * a queue of per-thread nodes; every waiter spins on its own node and the
+ * holder hands the lock directly to its successor.  This is the baseline
+ * the delegation locks (fc_lock.h, delegate_lock.h) are compared against.
+ */
+
+#ifdef initialize_lock
+#undef initialize_lock
+#endif
+
+#define initialize_lock(lock, threads) mcs_lock_init(lock, threads)
+
+#include "atomics.h"
+
+struct mcs_node {
+	struct mcs_node *next;
+	unsigned long locked;
+	unsigned long pad[6];
+} __attribute__((aligned(64)));
+
+struct mcs_node *mcs_nodes;
+
+void mcs_lock_init(uint64_t *lock, uint64_t threads) {
+	if (posix_memalign((void **) &mcs_nodes, 64, threads * sizeof(struct mcs_node))) {
+		fprintf(stderr, "ERROR: cannot allocate MCS nodes.\n");
+		exit(1);
+	}
+	memset(mcs_nodes, 0, threads * sizeof(struct mcs_node));
+	*lock = 0;
+}
+
+static inline unsigned long lock_acquire (uint64_t *lock, unsigned long threadnum) {
+	struct mcs_node *me = &mcs_nodes[threadnum];
+	struct mcs_node *pred;
+
+	me->next = NULL;
+	me->locked = 1;
+	pred = (struct mcs_node *) swap64(lock, (unsigned long) me);
+	if (!pred) {
+		return 0;
+	}
+
+	__atomic_store_n(&pred->next, me, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&me->locked, __ATOMIC_ACQUIRE)) {
+		spin_wait(1);
+	}
+
+	return 1;
+}
+
+static inline void lock_release (uint64_t *lock, unsigned long threadnum) {
+	struct mcs_node *me = &mcs_nodes[threadnum];
+	struct mcs_node *next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE);
+
+	if (!next) {
+		if (cas64_release(lock, 0, (unsigned long) me) == (unsigned long) me) {
+			return;
+		}
+		/* A successor swapped itself in but has not linked up yet */
+		while (!(next = __atomic_load_n(&me->next, __ATOMIC_ACQUIRE))) {
+			spin_wait(1);
+		}
+	}
+
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2017, The Linux Foundation. All rights reserved.
+ *
+ * SPDX-License-Identifier:    BSD-3-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Phase-fair ticket reader-writer lock (PF-T), after Brandenburg and
+ * Anderson, "Spin-Based Reader-Writer Synchronization for Multiprocessor
+ * Real-Time Systems".  Reader and writer phases alternate: a reader waits
+ * for at most one writer phase, and a writer waits for at most one reader
+ * phase in addition to the writers queued ahead of it.
+ *
+ * The lock word holds a pointer to the pf_rw_lock structure below.
+ */
+
+#ifdef initialize_lock
+#undef initialize_lock
+#endif
+#ifdef lock_acquire_read
+#undef lock_acquire_read
+#endif
+#ifdef lock_release_read
+#undef lock_release_read
+#endif
+
+#define initialize_lock(lock, threads) pf_rw_lock_init(lock, threads)
+#define lock_acquire_read(lock, threadnum) pf_rw_lock_acquire_read(lock, threadnum)
+#define lock_release_read(lock, threadnum) pf_rw_lock_release_read(lock, threadnum)
+
+#include "atomics.h"
+
+/* Reader increments go above the two writer bits of rin */
+#define PF_RINC  0x100
+#define PF_WBITS 0x3
+#define PF_PRES  0x2
+#define PF_PHID  0x1
+
+struct pf_rw_lock {
+	unsigned long rin;
+	unsigned long rout;
+	unsigned long pad0[6];
+	unsigned long win;
+	unsigned long wout;
+	unsigned long pad1[6];
+} __attribute__((aligned(64)));
+
+/* The ticket a writer got in lock_acquire, needed again in lock_release */
+__thread unsigned long pf_wticket;
+
+void pf_rw_lock_init(uint64_t *lock, uint64_t threads) {
+	struct pf_rw_lock *l;
+
+	if (posix_memalign((void **) &l, 64, sizeof(struct pf_rw_lock))) {
+		fprintf(stderr, "ERROR: cannot allocate phase-fair lock.\n");
+		exit(1);
+	}
+	memset(l, 0, sizeof(struct pf_rw_lock));
+	*lock = (uint64_t) l;
+}
+
+static inline unsigned long pf_rw_lock_acquire_read (uint64_t *lock, unsigned long threadnum) {
+	struct pf_rw_lock *l = (struct pf_rw_lock *) *lock;
+	unsigned long w, depth;
+
+	w = fetchadd64_acquire(&l->rin, PF_RINC);
+	depth = (w - *(volatile unsigned long *) &l->rout) / PF_RINC;
+	w &= PF_WBITS;
+
+	/* A writer is present, wait for its phase (PHID) to end */
+	if (w) {
+		while (w == (*(volatile unsigned long *) &l->rin & PF_WBITS)) {
+			spin_wait(1);
+		}
+	}
+
+	return depth;
+}
+
+static inline int pf_rw_lock_release_read (uint64_t *lock, unsigned long threadnum) {
+	struct pf_rw_lock *l = (struct pf_rw_lock *) *lock;
+
+	fetchadd64_release(&l->rout, PF_RINC);
+	return 1;
+}
+
+static inline unsigned long lock_acquire (uint64_t *lock, unsigned long threadnum) {
+	struct pf_rw_lock *l = (struct pf_rw_lock *) *lock;
+	unsigned long ticket, depth, w;
+
+	/* Writers are served in FIFO order among themselves */
+	ticket = fetchadd64_acquire(&l->win, 1);
+	depth = ticket - *(volatile unsigned long *) &l->wout;
+	while (ticket != *(volatile unsigned long *) &l->wout) {
+		spin_wait(1);
+	}
+	pf_wticket = ticket;
+
+	/* Block new readers and wait for the readers already inside */
+	w = PF_PRES | (ticket & PF_PHID);
+	ticket = fetchadd64_acquire(&l->rin, w);
+	while (ticket != *(volatile unsigned long *) &l->rout) {
+		spin_wait(1);
+	}
+
+	return depth;
+}
+
+static inline void lock_release (uint64_t *lock, unsigned long threadnum) {
+	struct pf_rw_lock *l = (struct pf_rw_lock *) *lock;
+
+	__atomic_fetch_and(&l->rin, ~((unsigned long) PF_WBITS), __ATOMIC_RELEASE);
+	__atomic_store_n(&l->wout, pf_wticket + 1, __ATOMIC_RELEASE);
+}
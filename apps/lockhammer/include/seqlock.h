@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2017, The Linux Foundation. All rights reserved.
+ *
+ * SPDX-License-Identifier:    BSD-3-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sequence lock with an optimistic read path.  The lock word is the
+ * sequence counter itself: a writer moves it from even to odd with a CAS,
+ * which also excludes other writers, and back to even on release.  Readers
+ * never write the lock; they snapshot an even sequence, run the critical
+ * section, and retry it if the sequence moved in the meantime.
+ */
+
+#ifdef lock_acquire_read
+#undef lock_acquire_read
+#endif
+#ifdef lock_release_read
+#undef lock_release_read
+#endif
+
+#define lock_acquire_read(lock, threadnum) seqlock_acquire_read(lock, threadnum)
+#define lock_release_read(lock, threadnum) seqlock_release_read(lock, threadnum)
+
+#include "atomics.h"
+
+/* Sequence seen by the reader when it entered its critical section */
+__thread unsigned long seqlock_snapshot;
+
+static inline unsigned long seqlock_acquire_read (uint64_t *lock, unsigned long threadnum) {
+	unsigned long seq, depth = 0;
+
+	while ((seq = __atomic_load_n(lock, __ATOMIC_ACQUIRE)) & 1) {
+		depth++;
+	}
+	seqlock_snapshot = seq;
+
+	return depth;
+}
+
+static inline int seqlock_release_read (uint64_t *lock, unsigned long threadnum) {
+	/* Order the critical section's loads before re-reading the sequence */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(lock, __ATOMIC_RELAXED) == seqlock_snapshot;
+}
+
+static inline unsigned long lock_acquire (uint64_t *lock, unsigned long threadnum) {
+	unsigned long seq, depth = 0;
+
+	while (1) {
+		seq = *(volatile unsigned long *) lock;
+		if (!(seq & 1) && cas64_acquire(lock, seq + 1, seq) == seq) {
+			/* Odd sequence must be visible before any protected store */
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			return depth;
+		}
+		depth++;
+	}
+}
+
+static inline void lock_release (uint64_t *lock, unsigned long threadnum) {
+	__atomic_store_n(lock, *lock + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2017, The Linux Foundation. All rights reserved.
+ *
+ * SPDX-License-Identifier:    BSD-3-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Writer-preferring ticket reader-writer lock.  Writers take tickets and
+ * are served in FIFO order; as soon as any writer holds a ticket, new
+ * readers back off until the writer queue drains.  Readers only share a
+ * counter, so they never order among themselves.
+ *
+ * The lock word holds a pointer to the wp_rw_lock structure below.  The
+ * wp_rw_* functions are also the slow path of bravo_rw_lock.h, which sets
+ * WP_RW_LOCK_NO_BINDING to keep its own lockhammer entry points.
+ */
+
+#ifndef __WP_RW_LOCK_H__
+#define __WP_RW_LOCK_H__
+
+#include "atomics.h"
+
+struct wp_rw_lock {
+	unsigned long wreq;     /* next writer ticket */
+	unsigned long wdone;    /* writer ticket being served */
+	unsigned long pad0[6];
+	unsigned long readers;  /* readers inside or trying to get in */
+	unsigned long pad1[7];
+} __attribute__((aligned(64)));
+
+struct wp_rw_lock *wp_rw_lock_alloc(void) {
+	struct wp_rw_lock *l;
+
+	if (posix_memalign((void **) &l, 64, sizeof(struct wp_rw_lock))) {
+		fprintf(stderr, "ERROR: cannot allocate writer-preferring lock.\n");
+		exit(1);
+	}
+	memset(l, 0, sizeof(struct wp_rw_lock));
+	return l;
+}
+
+static inline unsigned long wp_rw_read_lock (struct wp_rw_lock *l) {
+	unsigned long depth = 0;
+
+	while (1) {
+		while (__atomic_load_n(&l->wreq, __ATOMIC_RELAXED) !=
+		       __atomic_load_n(&l->wdone, __ATOMIC_RELAXED)) {
+			spin_wait(1);
+		}
+		/* Announce first, then re-check for writers (Dekker style) */
+		depth = __atomic_fetch_add(&l->readers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&l->wreq, __ATOMIC_SEQ_CST) ==
+		    __atomic_load_n(&l->wdone, __ATOMIC_SEQ_CST)) {
+			return depth;
+		}
+		__atomic_fetch_sub(&l->readers, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void wp_rw_read_unlock (struct wp_rw_lock *l) {
+	__atomic_fetch_sub(&l->readers, 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long wp_rw_write_lock (struct wp_rw_lock *l, unsigned long *ticket) {
+	unsigned long t, depth;
+
+	t = __atomic_fetch_add(&l->wreq, 1, __ATOMIC_SEQ_CST);
+	depth = t - __atomic_load_n(&l->wdone, __ATOMIC_RELAXED);
+	while (__atomic_load_n(&l->wdone, __ATOMIC_ACQUIRE) != t) {
+		spin_wait(1);
+	}
+	while (__atomic_load_n(&l->readers, __ATOMIC_SEQ_CST) != 0) {
+		spin_wait(1);
+	}
+
+	*ticket = t;
+	return depth;
+}
+
+static inline void wp_rw_write_unlock (struct wp_rw_lock *l, unsigned long ticket) {
+	__atomic_store_n(&l->wdone, ticket + 1, __ATOMIC_RELEASE);
+}
+
+#endif // __WP_RW_LOCK_H__
+
+#ifndef WP_RW_LOCK_NO_BINDING
+
+#ifdef initialize_lock
+#undef initialize_lock
+#endif
+#ifdef lock_acquire_read
+#undef lock_acquire_read
+#endif
+#ifdef lock_release_read
+#undef lock_release_read
+#endif
+
+#define initialize_lock(lock, threads) wp_rw_lock_init(lock, threads)
+#define lock_acquire_read(lock, threadnum) wp_rw_lock_acquire_read(lock, threadnum)
+#define lock_release_read(lock, threadnum) wp_rw_lock_release_read(lock, threadnum)
+
+__thread unsigned long wp_wticket;
+
+void wp_rw_lock_init(uint64_t *lock, uint64_t threads) {
+	*lock = (uint64_t) wp_rw_lock_alloc();
+}
+
+static inline unsigned long wp_rw_lock_acquire_read (uint64_t *lock, unsigned long threadnum) {
+	return wp_rw_read_lock((struct wp_rw_lock *) *lock);
+}
+
+static inline int wp_rw_lock_release_read (uint64_t *lock, unsigned long threadnum) {
+	wp_rw_read_unlock((struct wp_rw_lock *) *lock);
+	return 1;
+}
+
+static inline unsigned long lock_acquire (uint64_t *lock, unsigned long threadnum) {
+	return wp_rw_write_lock((struct wp_rw_lock *) *lock, &wp_wticket);
+}
+
+static inline void lock_release (uint64_t *lock, unsigned long threadnum) {
+	wp_rw_write_unlock((struct wp_rw_lock *) *lock, wp_wticket);
+}
+
+#endif // WP_RW_LOCK_NO_BINDING
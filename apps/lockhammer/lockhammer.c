@@ -43,6 +43,7 @@
 #include <limits.h>
 
 #include "lockhammer.h"
+#include "atomics.h"
 #include "perf_timer.h"
 
 #include ATOMIC_TEST
@@ -58,6 +59,9 @@ uint64_t ready_lock = 0;
 
 void* hmr(void *);
 
+#define CACHELINE_BYTES 64
+#define CACHELINE_WORDS (CACHELINE_BYTES / sizeof(unsigned long))
+
 void print_usage (char *invoc) {
     fprintf(stderr,
             "Usage: %s\n\t[-t <#> threads]\n\t[-a <#> acquires per thread]\n\t"
@@ -65,6 +69,13 @@ void print_usage (char *invoc) {
             "if no suffix, assumes instructions]\n\t"
             "[-p <#>[ns | in] parallelizable iterations measured in ns or (in)structions, "
             "if no suffix, assumes (in)structions]\n\t"
+            "[-r <#> percentage of acquires taken in read (shared) mode, "
+            "locks without a read mode always acquire exclusively]\n\t"
+            "[-m <#> cache lines of shared data touched in each critical section]\n\t"
+            "[-x <read | write | rmw> access to the shared data, read mode acquires only read]\n\t"
+            "[-g <seq | rand> order the shared data cache lines are touched in]\n\t"
+            "[-l co-locate the first shared data line with the lock word, "
+            "no effect on locks whose lock word only points to their state]\n\t"
             "[-s safe-mode operation for running as non-root by reducing priority]\n\t"
             "[-i <#> interleave value for SMT pinning, e.g. 1: core pinning / no SMT, "
             "2: 2-way SMT pinning, 4: 4-way SMT pinning, may not work for multisocket]\n\t"
@@ -81,6 +92,7 @@ int main(int argc, char** argv)
     unsigned long num_cores;
     unsigned long result;
     unsigned long sched_elapsed = 0, real_elapsed = 0, realcpu_elapsed = 0;
+    unsigned long total_reads = 0, total_retries = 0;
     unsigned long start_ns = 0;
     double avg_lock_depth = 0.0;
 
@@ -91,13 +103,18 @@ int main(int argc, char** argv)
                        .nacqrs = 50000,
                        .ncrit = 0,
                        .nparallel = 0,
+                       .read_pct = DEFAULT_READ_PCT,
+                       .ndata = 0,
+                       .data_op = DATA_RMW,
+                       .data_rand = 0,
+                       .colocate = 0,
                        .ileave = 1,
                        .safemode = 0,
                        .pinorder = NULL };
 
     opterr = 0;
 
-    while ((opt = getopt(argc, argv, "t:a:c:p:i:o:s")) != -1)
+    while ((opt = getopt(argc, argv, "t:a:c:p:r:m:x:g:li:o:s")) != -1)
     {
         long optval = 0;
         int len = 0;
@@ -169,6 +186,51 @@ int main(int argc, char** argv)
                 args.nparallel = optval;
             }
             break;
+          case 'r':
+            optval = strtol(optarg, (char **) NULL, 10);
+            if (optval < 0 || optval > 100) {
+                fprintf(stderr, "ERROR: read percentage must be between 0 and 100.\n");
+                return 1;
+            }
+            else {
+                args.read_pct = optval;
+            }
+            break;
+          case 'm':
+            optval = strtol(optarg, (char **) NULL, 10);
+            if (optval < 0) {
+                fprintf(stderr, "ERROR: shared data cache line count must be non-negative.\n");
+                return 1;
+            }
+            else {
+                args.ndata = optval;
+            }
+            break;
+          case 'x':
+            if (!strcmp(optarg, "read")) {
+                args.data_op = DATA_READ;
+            } else if (!strcmp(optarg, "write")) {
+                args.data_op = DATA_WRITE;
+            } else if (!strcmp(optarg, "rmw")) {
+                args.data_op = DATA_RMW;
+            } else {
+                fprintf(stderr, "ERROR: shared data access must be read, write or rmw.\n");
+                return 1;
+            }
+            break;
+          case 'g':
+            if (!strcmp(optarg, "seq")) {
+                args.data_rand = 0;
+            } else if (!strcmp(optarg, "rand")) {
+                args.data_rand = 1;
+            } else {
+                fprintf(stderr, "ERROR: shared data order must be seq or rand.\n");
+                return 1;
+            }
+            break;
+          case 'l':
+            args.colocate = 1;
+            break;
           case 'i':
             optval = strtol(optarg, (char **) NULL, 10);
             if (optval < 0) {
@@ -218,6 +280,8 @@ int main(int argc, char** argv)
     unsigned long hmrtime[args.nthrds]; /* can't touch this */
     unsigned long hmrrealtime[args.nthrds];
     unsigned long hmrdepth[args.nthrds];
+    unsigned long hmrreads[args.nthrds];
+    unsigned long hmrretries[args.nthrds];
     struct timespec tv_time;
 
     /* Select the FIFO scheduler.  This prevents interruption of the
@@ -243,10 +307,31 @@ int main(int argc, char** argv)
         pthread_attr_setschedparam(&hmr_attr, &sparam);
     }
 
+    /* The shared data is one word per cache line.  Co-located data
+       starts right behind the lock word, in the lock's own line. */
+    uint64_t *lock = &test_lock;
+    unsigned long *data = NULL;
+    if (args.colocate) {
+        if (posix_memalign((void **) &lock, CACHELINE_BYTES,
+                           (args.ndata + 1) * CACHELINE_BYTES)) {
+            fprintf(stderr, "ERROR: cannot allocate shared data.\n");
+            return 1;
+        }
+        memset(lock, 0, (args.ndata + 1) * CACHELINE_BYTES);
+        data = (unsigned long *) lock + 1;
+    } else if (args.ndata) {
+        if (posix_memalign((void **) &data, CACHELINE_BYTES,
+                           args.ndata * CACHELINE_BYTES)) {
+            fprintf(stderr, "ERROR: cannot allocate shared data.\n");
+            return 1;
+        }
+        memset(data, 0, args.ndata * CACHELINE_BYTES);
+    }
+
 #ifdef NTHRDS_READY
-    initialize_lock(&test_lock, args.nthrds);
+    initialize_lock(lock, args.nthrds);
 #else
-    initialize_lock(&test_lock, num_cores);
+    initialize_lock(lock, num_cores);
 #endif
     // Get frequency of clock, and divide by 1B to get # of ticks per ns
     tickspns = (double)timer_get_cnt_freq() / 1000000000.0; 
@@ -258,16 +343,23 @@ int main(int argc, char** argv)
         t_args[i].nthrds = args.nthrds;
         t_args[i].ileave = args.ileave;
         t_args[i].iter = args.nacqrs;
-        t_args[i].lock = &test_lock;
+        t_args[i].lock = lock;
         t_args[i].rst = &hmrs[i];
         t_args[i].nsec = &hmrtime[i];
         t_args[i].real_nsec = &hmrrealtime[i];
         t_args[i].depth = &hmrdepth[i];
+        t_args[i].nreads = &hmrreads[i];
+        t_args[i].nretries = &hmrretries[i];
         t_args[i].nstart = &start_ns;
         t_args[i].hold = args.ncrit;
         t_args[i].hold_unit = args.ncrit_units;
         t_args[i].post = args.nparallel;
         t_args[i].post_unit = args.nparallel_units;
+        t_args[i].read_pct = args.read_pct;
+        t_args[i].data = data;
+        t_args[i].ndata = args.ndata;
+        t_args[i].data_op = args.data_op;
+        t_args[i].data_rand = args.data_rand;
         t_args[i].tickspns = tickspns;
         t_args[i].pinorder = args.pinorder;
 
@@ -288,12 +380,15 @@ int main(int argc, char** argv)
     real_elapsed = (1000000000ul * tv_time.tv_sec + tv_time.tv_nsec) - start_ns;
 
     pthread_attr_destroy(&hmr_attr);
+    finalize_lock(lock);
 
     result = 0;
     for (i = 0; i < args.nthrds; ++i) {
         result += hmrs[i];
         sched_elapsed += hmrtime[i];
         realcpu_elapsed += hmrrealtime[i];
+        total_reads += hmrreads[i];
+        total_retries += hmrretries[i];
         /* Average lock "depth" is an algorithm-specific auxiliary metric
            whereby each algorithm can report an approximation of the level
            of contention it observes.  This estimate is returned from each
@@ -304,6 +399,21 @@ int main(int argc, char** argv)
     }
 
     fprintf(stderr, "%ld lock loops\n", result);
+    fprintf(stderr, "%ld read locks (%ld retried)\n", total_reads, total_retries);
+
+    /* Every exclusive rmw critical section adds one to each of the ndata
+       words it touches, so anything else means the lock did not protect
+       the data. */
+    if (args.ndata && args.data_op == DATA_RMW) {
+        unsigned long sum = 0;
+        for (i = 0; i < args.ndata; ++i) {
+            sum += data[i * CACHELINE_WORDS];
+        }
+        if (sum != (result - total_reads) * args.ndata) {
+            fprintf(stderr, "WARNING: shared data sum %ld, expected %ld.\n",
+                    sum, (result - total_reads) * args.ndata);
+        }
+    }
     fprintf(stderr, "%ld ns scheduled\n", sched_elapsed);
     fprintf(stderr, "%ld ns elapsed (~%f cores)\n", real_elapsed, ((float) sched_elapsed / (float) real_elapsed));
     fprintf(stderr, "%lf ns per access (scheduled)\n", ((double) sched_elapsed)/ ((double) result));
@@ -354,6 +464,61 @@ static void calibrate_timer(thread_args *x, unsigned long mycore)
 #endif
 }
 
+/* Touch ndata cache lines of the shared data inside a critical section,
+ * in order or at random (xorshift, one line index per access).
+ */
+static inline void touch_data(unsigned long *data, unsigned long ndata,
+                              DataOps op, unsigned char rand,
+                              unsigned long *seed)
+{
+    volatile unsigned long *d = data;
+    unsigned long i, idx, s = *seed;
+
+    for (i = 0; i < ndata; ++i) {
+        if (rand) {
+            s ^= s << 13;
+            s ^= s >> 7;
+            s ^= s << 17;
+            idx = s % ndata;
+        } else {
+            idx = i;
+        }
+        idx *= CACHELINE_WORDS;
+        switch (op) {
+          case DATA_READ:
+            (void) d[idx];
+            break;
+          case DATA_WRITE:
+            d[idx] = i;
+            break;
+          case DATA_RMW:
+            d[idx] = d[idx] + 1;
+            break;
+        }
+    }
+    *seed = s;
+}
+
+/* Critical section handed to delegation locks, which may run it on
+ * another thread than the one that asked for it.
+ */
+struct critical_args {
+    unsigned long *data;
+    unsigned long ndata;
+    DataOps op;
+    unsigned char rand;
+    unsigned long seed;
+    unsigned long hold;
+};
+
+static void __attribute__((unused)) critical_section(void *ptr)
+{
+    struct critical_args *c = (struct critical_args *) ptr;
+
+    touch_data(c->data, c->ndata, c->op, c->rand, &c->seed);
+    blackhole(c->hold);
+}
+
 void* hmr(void *ptr)
 {
     unsigned long nlocks = 0;
@@ -366,6 +531,11 @@ void* hmr(void *ptr)
     unsigned long nthrds = x->nthrds;
     unsigned long hold_count = x->hold;
     unsigned long post_count = x->post;
+    unsigned long read_pct = x->read_pct;
+    unsigned long *data = x->data;
+    unsigned long ndata = x->ndata;
+    DataOps data_op = x->data_op;
+    unsigned char data_rand = x->data_rand;
     //double tickspns = x->tickspns;
     int *pinorder = x->pinorder;
 
@@ -374,6 +544,10 @@ void* hmr(void *ptr)
     struct timespec tv_monot_start, tv_monot_end, tv_start, tv_end;
     unsigned long ns_elap, real_ns_elap;
     unsigned long total_depth = 0;
+    unsigned long nreads = 0, nretries = 0;
+    unsigned long read_acc;
+    unsigned long data_seed;
+    struct critical_args cs __attribute__((unused));
 
     cpu_set_t affin_mask;
 
@@ -467,6 +641,16 @@ void* hmr(void *ptr)
 
     thread_local_init(mycore);
 
+    /* Spread the reads evenly over the acquires, staggered per thread
+       so that not all threads enter read mode at the same time. */
+    read_acc = (mycore * 37) % 100;
+    data_seed = mycore + 1;
+    cs.data = data;
+    cs.ndata = ndata;
+    cs.rand = data_rand;
+    cs.seed = data_seed;
+    cs.hold = hold_count;
+
 #ifdef DDEBUG
     printf("%ld %ld\n", hold_count, post_count);
 #endif
@@ -481,10 +665,38 @@ void* hmr(void *ptr)
 
     while (!target_locks || nlocks < target_locks) {
         /* Do a lock thing */
-        prefetch64(lock);
-        total_depth += lock_acquire(lock, mycore);
-        blackhole(hold_count);
-        lock_release(lock, mycore);
+        read_acc += read_pct;
+        if (read_acc >= 100) {
+            read_acc -= 100;
+#ifdef lock_delegate
+            cs.op = DATA_READ;
+            total_depth += lock_delegate(lock, mycore, critical_section, &cs);
+#else
+            /* Optimistic readers redo the critical section on failure */
+            while (1) {
+                prefetch64(lock);
+                total_depth += lock_acquire_read(lock, mycore);
+                touch_data(data, ndata, DATA_READ, data_rand, &data_seed);
+                blackhole(hold_count);
+                if (lock_release_read(lock, mycore)) {
+                    break;
+                }
+                nretries++;
+            }
+#endif
+            nreads++;
+        } else {
+#ifdef lock_delegate
+            cs.op = data_op;
+            total_depth += lock_delegate(lock, mycore, critical_section, &cs);
+#else
+            prefetch64(lock);
+            total_depth += lock_acquire(lock, mycore);
+            touch_data(data, ndata, data_op, data_rand, &data_seed);
+            blackhole(hold_count);
+            lock_release(lock, mycore);
+#endif
+        }
         blackhole(post_count);
 
         nlocks++;
@@ -502,6 +714,8 @@ void* hmr(void *ptr)
     *(x->nsec) = ns_elap;
     *(x->real_nsec) = real_ns_elap;
     *(x->depth) = total_depth;
+    *(x->nreads) = nreads;
+    *(x->nretries) = nretries;
 
     thread_local_done(mycore);
 
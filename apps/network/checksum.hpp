@@ -0,0 +1,293 @@
+#ifndef _NETWORK_CHECKSUM_HPP__
+#define _NETWORK_CHECKSUM_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+// The AVX2 loops are compiled for AVX2 whatever the target flags are, and
+// taken when the CPU has it; SSE2 is part of x86-64
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_HAVE_AVX2 1
+#endif
+
+#include "utils.hpp"
+
+// RFC 1071 Internet checksums of the IPv4 header and of TCP over the pseudo
+// header, its header and the payload. The bench keeps header fields in host
+// order, so these are the checksums of the bytes as they sit in memory; the
+// sum does not care about byte order as long as the pseudo header is laid
+// out like the headers.
+
+// Window the write paths clamp TCP segments to, as a middlebox would
+#ifndef TCP_WINDOW_CLAMP
+#define TCP_WINDOW_CLAMP 16384
+#endif
+
+// the bulk APIs return one bit per packet
+STATIC_ASSERT(64 >= BULK_SIZE, BulkMask);
+
+#if defined(CSUM_HAVE_AVX2) || defined(__SSE2__)
+static inline uint64_t csum_lanes(const uint32_t *lanes, int n) {
+  uint64_t sum = 0;
+  for (int i = 0; n > i; ++i) {
+    sum += lanes[i];
+  }
+  return sum;
+}
+#endif
+
+#ifdef CSUM_HAVE_AVX2
+static inline bool csum_has_avx2() {
+  // may be asked from constructors, before the CPU model is set up
+  static const bool avx2 = (__builtin_cpu_init(),
+                            __builtin_cpu_supports("avx2"));
+  return avx2;
+}
+
+// The 32-byte blocks of the len bytes at *p added to sum; *p and *len are
+// left at the tail
+__attribute__((target("avx2")))
+static inline uint64_t csum_partial_avx2(const uint8_t **p, size_t *len,
+                                         uint64_t sum) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  uint32_t lanes[8];
+  for (size_t n = 1; 32 <= *len; *len -= 32, *p += 32, ++n) {
+    const __m256i v = _mm256_loadu_si256((const __m256i*)*p);
+    acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+    acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+    if (0 == (n & 0x7FFF)) {
+      _mm256_storeu_si256((__m256i*)lanes, acc);
+      sum += csum_lanes(lanes, 8);
+      acc = zero;
+    }
+  }
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  return sum + csum_lanes(lanes, 8);
+}
+#endif
+
+// One's complement sum of len bytes added to sum, carries left unfolded.
+// The vector loops zero-extend 16-bit words into 32-bit lanes, two words a
+// lane per load, so a lane cannot overflow within 2^15 loads; the scalar
+// tail adds 32-bit words into 64 bits, RFC 1071 parallel summation.
+static inline uint64_t csum_partial(const void *buf, size_t len,
+                                    uint64_t sum) {
+  const uint8_t *p = (const uint8_t*)buf;
+#ifdef CSUM_HAVE_AVX2
+  if (32 <= len && csum_has_avx2()) {
+    sum = csum_partial_avx2(&p, &len, sum);
+  }
+#endif
+#ifdef __SSE2__
+  if (16 <= len) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    uint32_t lanes[4];
+    for (size_t n = 1; 16 <= len; len -= 16, p += 16, ++n) {
+      const __m128i v = _mm_loadu_si128((const __m128i*)p);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+      if (0 == (n & 0x7FFF)) {
+        _mm_storeu_si128((__m128i*)lanes, acc);
+        sum += csum_lanes(lanes, 4);
+        acc = zero;
+      }
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum += csum_lanes(lanes, 4);
+  }
+#endif
+  for (; 4 <= len; len -= 4, p += 4) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    sum += w;
+  }
+  if (2 <= len) {
+    uint16_t w;
+    memcpy(&w, p, 2);
+    sum += w;
+    len -= 2;
+    p += 2;
+  }
+  if (len) { // an odd byte is padded with a zero byte after it
+    uint16_t w = 0;
+    memcpy(&w, p, 1);
+    sum += w;
+  }
+  return sum;
+}
+
+// Fold the carries of a partial sum back into 16 bits
+static inline uint16_t csum_fold(uint64_t sum) {
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)sum;
+}
+
+// Checksum of the IPv4 header, to be stored in checksumIP
+static inline uint16_t ipv4_checksum(const Packet *pkt) {
+  // summing the field in and its complement out leaves it out
+  const uint64_t sum = csum_partial(&pkt->ipheader.data, sizeof(IPv4Header),
+                                    (uint16_t)~pkt->ipheader.data.checksumIP);
+  return ~csum_fold(sum);
+}
+
+static inline bool ipv4_valid(const Packet *pkt) {
+  return 0xFFFF == csum_fold(csum_partial(&pkt->ipheader.data,
+                                          sizeof(IPv4Header), 0));
+}
+
+// Bytes of payload the TCP checksum covers: what the IP length leaves after
+// both headers, within the memory block of the packet
+static inline uint16_t tcp_payload_len(const Packet *pkt) {
+  const uint16_t hdrs = sizeof(IPv4Header) + sizeof(TCPHeader);
+  const uint16_t len = pkt->ipheader.data.len;
+  if (hdrs >= len) {
+    return 0;
+  }
+  return (MAX_PAYLOAD > len - hdrs) ? len - hdrs : MAX_PAYLOAD;
+}
+
+struct PseudoHeader {
+  uint32_t srcIP;
+  uint32_t dstIP;
+  uint8_t zero;
+  uint8_t protocol;
+  uint16_t len; // TCP header and payload
+} __attribute__((packed));
+
+// Sum of the TCP segment, checksum included
+static inline uint64_t tcp_sum(const Packet *pkt) {
+  const uint16_t payload = tcp_payload_len(pkt);
+  PseudoHeader ph;
+  ph.srcIP = pkt->ipheader.data.srcIP;
+  ph.dstIP = pkt->ipheader.data.dstIP;
+  ph.zero = 0;
+  ph.protocol = pkt->ipheader.data.protocol;
+  ph.len = sizeof(TCPHeader) + payload;
+  uint64_t sum = csum_partial(&ph, sizeof(ph), 0);
+  sum = csum_partial(&pkt->tcpheader.data, sizeof(TCPHeader), sum);
+  return csum_partial(pkt->payload, payload, sum);
+}
+
+// Checksum of the TCP segment, to be stored in checksumTCP
+static inline uint16_t tcp_checksum(const Packet *pkt) {
+  return ~csum_fold(tcp_sum(pkt) + (uint16_t)~pkt->tcpheader.data.checksumTCP);
+}
+
+static inline bool tcp_valid(const Packet *pkt) {
+  return 0xFFFF == csum_fold(tcp_sum(pkt));
+}
+
+// Fill in both checksums of a packet built from scratch
+static inline void set_checksums(Packet *pkt) {
+  pkt->ipheader.data.checksumIP = ipv4_checksum(pkt);
+  pkt->tcpheader.data.checksumTCP = tcp_checksum(pkt);
+}
+
+#ifdef CSUM_HAVE_AVX2
+// Sums of 8 vectors of dword lanes, lane j of the result for v[j]: two
+// levels of horizontal adds within 128-bit halves, then the halves added
+__attribute__((target("avx2")))
+static inline __m256i csum_transpose8(const __m256i *v) {
+  const __m256i h01 = _mm256_hadd_epi32(v[0], v[1]);
+  const __m256i h23 = _mm256_hadd_epi32(v[2], v[3]);
+  const __m256i h45 = _mm256_hadd_epi32(v[4], v[5]);
+  const __m256i h67 = _mm256_hadd_epi32(v[6], v[7]);
+  const __m256i h0123 = _mm256_hadd_epi32(h01, h23);
+  const __m256i h4567 = _mm256_hadd_epi32(h45, h67);
+  return _mm256_add_epi32(_mm256_permute2x128_si256(h0123, h4567, 0x20),
+                          _mm256_permute2x128_si256(h0123, h4567, 0x31));
+}
+
+// Validity of the IPv4 headers of the first multiple of 8 packets of a bulk
+// in valid, 8 headers side by side: each is loaded whole from its pad, its
+// 20 bytes reduced to dword lanes, the 8 vectors transposed into one vector
+// of 8 sums, folded and compared at once. Returns how many were checked
+__attribute__((target("avx2")))
+static inline size_t ipv4_valid_bulk_avx2(Packet **pkts, size_t cnt,
+                                          uint64_t *valid) {
+  const __m256i header = _mm256_setr_epi32(-1, -1, -1, -1, -1, 0, 0, 0);
+  const __m256i lo16 = _mm256_set1_epi32(0xFFFF);
+  size_t i = 0;
+  for (; cnt >= i + 8; i += 8) {
+    __m256i v[8];
+    for (int j = 0; 8 > j; ++j) {
+      const __m256i h = _mm256_and_si256(header, _mm256_loadu_si256(
+          (const __m256i*)pkts[i + j]->ipheader.pad));
+      v[j] = _mm256_add_epi32(_mm256_and_si256(h, lo16),
+                              _mm256_srli_epi32(h, 16));
+    }
+    // at most 20 bits a lane, two folds bring it to 16
+    __m256i s = csum_transpose8(v);
+    s = _mm256_add_epi32(_mm256_and_si256(s, lo16), _mm256_srli_epi32(s, 16));
+    s = _mm256_add_epi32(_mm256_and_si256(s, lo16), _mm256_srli_epi32(s, 16));
+    const __m256i ok = _mm256_cmpeq_epi32(s, lo16);
+    *valid |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(ok)) << i;
+  }
+  return i;
+}
+#endif
+
+// Validity of the IPv4 headers of a bulk, bit i set when pkts[i] is valid,
+// 8 headers at a time when the CPU has AVX2
+static inline uint64_t ipv4_valid_bulk(Packet **pkts, size_t cnt) {
+  uint64_t valid = 0;
+  size_t i = 0;
+#ifdef CSUM_HAVE_AVX2
+  if (csum_has_avx2()) {
+    i = ipv4_valid_bulk_avx2(pkts, cnt, &valid);
+  }
+#endif
+  for (; cnt > i; ++i) {
+    valid |= (uint64_t)ipv4_valid(pkts[i]) << i;
+  }
+  return valid;
+}
+
+// Validity of the TCP checksums of a bulk, bit i set when pkts[i] is valid.
+// The payloads dominate, each summed with the vector loops while the next
+// one is prefetched.
+static inline uint64_t tcp_valid_bulk(Packet **pkts, size_t cnt) {
+  uint64_t valid = 0;
+  for (size_t i = 0; cnt > i; ++i) {
+    if (cnt > i + 1) {
+      __builtin_prefetch(pkts[i + 1]->payload);
+    }
+    valid |= (uint64_t)tcp_valid(pkts[i]) << i;
+  }
+  return valid;
+}
+
+// Checksum after a 16-bit word it covers changes from old to val, without
+// summing again, RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m')
+static inline uint16_t csum_update16(uint16_t csum, uint16_t old,
+                                     uint16_t val) {
+  return ~csum_fold((uint64_t)(uint16_t)~csum + (uint16_t)~old + val);
+}
+
+// Forward as a router does, decrementing the TTL and patching checksumIP
+static inline void ipv4_dec_ttl(Packet *pkt) {
+  // TTL shares its word with the protocol
+  uint16_t old, val;
+  memcpy(&old, &pkt->ipheader.pad[offsetof(IPv4Header, TTL)], 2);
+  pkt->ipheader.data.TTL--;
+  memcpy(&val, &pkt->ipheader.pad[offsetof(IPv4Header, TTL)], 2);
+  pkt->ipheader.data.checksumIP =
+    csum_update16(pkt->ipheader.data.checksumIP, old, val);
+}
+
+// Rewrite the window of a segment, patching checksumTCP
+static inline void tcp_set_window(Packet *pkt, uint16_t win) {
+  const uint16_t old = pkt->tcpheader.data.winSize;
+  pkt->tcpheader.data.winSize = win;
+  pkt->tcpheader.data.checksumTCP =
+    csum_update16(pkt->tcpheader.data.checksumTCP, old, win);
+}
+
+#endif // end of ifndef _NETWORK_CHECKSUM_HPP__
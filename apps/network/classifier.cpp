@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+
+#include "classifier.hpp"
+
+static inline uint32_t xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static Rule wildcard_rule(uint8_t action) {
+  Rule r;
+  memset(&r, 0, sizeof(r));
+  r.srcPortHi = r.dstPortHi = 0xFFFF;
+  r.anyProtocol = true;
+  r.action = action;
+  return r;
+}
+
+bool load_rules(const char *path, std::vector<Rule> &rules) {
+  FILE *fp = fopen(path, "r");
+  char line[256];
+  unsigned s[4], d[4], slen, dlen, splo, sphi, dplo, dphi, proto, pmask;
+
+  if (NULL == fp) {
+    return false;
+  }
+  rules.clear();
+  while (fgets(line, sizeof(line), fp)) {
+    // @src/len dst/len sportlo : sporthi dportlo : dporthi proto/mask ...
+    if (16 != sscanf(line, "@%u.%u.%u.%u/%u %u.%u.%u.%u/%u %u : %u %u : %u %x/%x",
+                     &s[0], &s[1], &s[2], &s[3], &slen,
+                     &d[0], &d[1], &d[2], &d[3], &dlen,
+                     &splo, &sphi, &dplo, &dphi, &proto, &pmask)) {
+      continue;
+    }
+    Rule r;
+    r.srcLen = slen;
+    r.dstLen = dlen;
+    r.srcIP = ((s[0] << 24) | (s[1] << 16) | (s[2] << 8) | s[3]) &
+      prefix_mask(r.srcLen);
+    r.dstIP = ((d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3]) &
+      prefix_mask(r.dstLen);
+    r.srcPortLo = splo;
+    r.srcPortHi = sphi;
+    r.dstPortLo = dplo;
+    r.dstPortHi = dphi;
+    r.protocol = proto;
+    r.anyProtocol = (0 == pmask);
+    r.action = RULE_DROP;
+    rules.push_back(r);
+  }
+  fclose(fp);
+  rules.push_back(wildcard_rule(RULE_ACCEPT));
+  return true;
+}
+
+void gen_rules(size_t n, uint32_t seed, std::vector<Rule> &rules) {
+  static const uint8_t prefixes[] = { 0, 8, 16, 16, 24, 24, 24, 28, 32, 32 };
+  static const uint16_t ports[] = { 20, 21, 22, 25, 53, 80, 123, 443, 8080 };
+  const size_t nblocks = 64; // shared /16 blocks, so rules overlap
+  uint32_t blocks[nblocks];
+  uint32_t state = seed ? seed : 1;
+
+  for (size_t i = 0; nblocks > i; ++i) {
+    blocks[i] = xorshift32(&state) & 0xFFFF0000;
+  }
+  rules.clear();
+  for (size_t i = 0; n > i + 1; ++i) {
+    Rule r;
+    uint32_t rnd;
+    r.srcLen = prefixes[xorshift32(&state) % sizeof(prefixes)];
+    r.dstLen = prefixes[xorshift32(&state) % sizeof(prefixes)];
+    r.srcIP = (blocks[xorshift32(&state) % nblocks] |
+               (xorshift32(&state) & 0xFFFF)) & prefix_mask(r.srcLen);
+    r.dstIP = (blocks[xorshift32(&state) % nblocks] |
+               (xorshift32(&state) & 0xFFFF)) & prefix_mask(r.dstLen);
+    // clients use ephemeral source ports, services well-known destinations
+    rnd = xorshift32(&state) % 4;
+    r.srcPortLo = (0 == rnd) ? 1024 : 0;
+    r.srcPortHi = 0xFFFF;
+    rnd = xorshift32(&state) % 8;
+    if (4 > rnd) {
+      r.dstPortLo = r.dstPortHi =
+        ports[xorshift32(&state) % (sizeof(ports) / sizeof(ports[0]))];
+    } else if (6 > rnd) {
+      r.dstPortLo = 1024 + xorshift32(&state) % 30000;
+      r.dstPortHi = r.dstPortLo + xorshift32(&state) % 4096;
+    } else {
+      r.dstPortLo = 0;
+      r.dstPortHi = 0xFFFF;
+    }
+    rnd = xorshift32(&state) % 10;
+    r.anyProtocol = (8 <= rnd);
+    r.protocol = (5 > rnd) ? 6 : 17; // TCP : UDP
+    r.action = (3 > xorshift32(&state) % 10) ? RULE_DROP : RULE_ACCEPT;
+    rules.push_back(r);
+  }
+  rules.push_back(wildcard_rule(RULE_ACCEPT));
+}
+
+static inline uint32_t pick(uint32_t lo, uint32_t hi, uint32_t *state) {
+  const uint32_t span = hi - lo;
+  return (0xFFFFFFFF == span) ? xorshift32(state) :
+    lo + xorshift32(state) % (span + 1);
+}
+
+void gen_trace(const std::vector<Rule> &rules, size_t n, uint32_t seed,
+               std::vector<FiveTuple> &trace) {
+  uint32_t state = seed ? seed : 1;
+
+  trace.resize(n);
+  for (size_t i = 0; n > i; ++i) {
+    FiveTuple &t = trace[i];
+    if (0 == xorshift32(&state) % 8) {
+      t.srcIP = xorshift32(&state);
+      t.dstIP = xorshift32(&state);
+      t.srcPort = xorshift32(&state);
+      t.dstPort = xorshift32(&state);
+      t.protocol = (xorshift32(&state) & 1) ? 6 : 17;
+      continue;
+    }
+    const Rule &r = rules[xorshift32(&state) % rules.size()];
+    t.srcIP = r.srcIP | (xorshift32(&state) & ~prefix_mask(r.srcLen));
+    t.dstIP = r.dstIP | (xorshift32(&state) & ~prefix_mask(r.dstLen));
+    t.srcPort = pick(r.srcPortLo, r.srcPortHi, &state);
+    t.dstPort = pick(r.dstPortLo, r.dstPortHi, &state);
+    t.protocol = r.anyProtocol ? ((xorshift32(&state) & 1) ? 6 : 17) :
+      r.protocol;
+  }
+}
+
+void Classifier::classify(Packet **pkts, size_t cnt, int *results) const {
+  FiveTuple tuples[BULK_SIZE];
+
+  for (size_t i = 0; cnt > i; ++i) {
+    __builtin_prefetch(&pkts[i]->ipheader);
+    __builtin_prefetch(&pkts[i]->tcpheader);
+  }
+  for (size_t i = 0; cnt > i; ++i) {
+    get_tuple(pkts[i], &tuples[i]);
+  }
+  for (size_t i = 0; cnt > i; ++i) {
+    results[i] = match(tuples[i]);
+  }
+}
+
+int LinearClassifier::match(const FiveTuple &t) const {
+  const size_t n = rules.size();
+  for (size_t i = 0; n > i; ++i) {
+    if (rule_match(rules[i], t)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint32_t TupleSpaceClassifier::hash(uint32_t src, uint32_t dst,
+                                    uint8_t protocol) {
+  uint64_t h = ((uint64_t)src << 32 | dst) * 0x9E3779B97F4A7C15ULL;
+  h ^= (h >> 29) + protocol;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  return h >> 32;
+}
+
+TupleSpaceClassifier::TupleSpaceClassifier(const std::vector<Rule> &rules)
+  : rules(rules) {
+  const size_t n = rules.size();
+  std::vector<int> order(n);
+
+  // group the rules by tuple, then by masked key, in priority order
+  for (size_t i = 0; n > i; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&rules](int a, int b) {
+    const Rule &ra = rules[a], &rb = rules[b];
+    if (ra.srcLen != rb.srcLen) return ra.srcLen < rb.srcLen;
+    if (ra.dstLen != rb.dstLen) return ra.dstLen < rb.dstLen;
+    if (ra.anyProtocol != rb.anyProtocol) return ra.anyProtocol < rb.anyProtocol;
+    if (ra.srcIP != rb.srcIP) return ra.srcIP < rb.srcIP;
+    if (ra.dstIP != rb.dstIP) return ra.dstIP < rb.dstIP;
+    return ra.anyProtocol ? false : ra.protocol < rb.protocol;
+  });
+  chain = order;
+
+  for (size_t beg = 0; n > beg;) {
+    const Rule &r = rules[order[beg]];
+    size_t end = beg, nkeys = 0;
+    while (n > end && rules[order[end]].srcLen == r.srcLen &&
+           rules[order[end]].dstLen == r.dstLen &&
+           rules[order[end]].anyProtocol == r.anyProtocol) {
+      ++end;
+    }
+    Table tab;
+    tab.srcMask = prefix_mask(r.srcLen);
+    tab.dstMask = prefix_mask(r.dstLen);
+    tab.anyProtocol = r.anyProtocol;
+    tab.best = INT_MAX;
+    for (size_t i = beg; end > i; ++i) {
+      nkeys++;
+      tab.best = std::min(tab.best, order[i]);
+    }
+    // at most half full
+    uint32_t nbuckets = 2;
+    while (nbuckets < 2 * nkeys) {
+      nbuckets <<= 1;
+    }
+    tab.mask = nbuckets - 1;
+    tab.buckets.assign(nbuckets, Bucket());
+    for (size_t i = beg; end > i;) {
+      const Rule &k = rules[order[i]];
+      const uint8_t protocol = tab.anyProtocol ? 0 : k.protocol;
+      size_t j = i;
+      while (end > j && rules[order[j]].srcIP == k.srcIP &&
+             rules[order[j]].dstIP == k.dstIP &&
+             (tab.anyProtocol || rules[order[j]].protocol == k.protocol)) {
+        ++j;
+      }
+      // chain[i, j) shares the key; keep it in priority order
+      std::sort(chain.begin() + i, chain.begin() + j);
+      uint32_t h = hash(k.srcIP, k.dstIP, protocol) & tab.mask;
+      while (tab.buckets[h].used) {
+        h = (h + 1) & tab.mask;
+      }
+      Bucket &b = tab.buckets[h];
+      b.srcIP = k.srcIP;
+      b.dstIP = k.dstIP;
+      b.protocol = protocol;
+      b.used = true;
+      b.first = i;
+      b.count = j - i;
+      i = j;
+    }
+    tables.push_back(tab);
+    beg = end;
+  }
+  std::sort(tables.begin(), tables.end(), [](const Table &a, const Table &b) {
+    return a.best < b.best;
+  });
+}
+
+const TupleSpaceClassifier::Bucket *
+TupleSpaceClassifier::find(const Table &tab, const FiveTuple &t,
+                           uint32_t h) const {
+  const uint32_t src = t.srcIP & tab.srcMask;
+  const uint32_t dst = t.dstIP & tab.dstMask;
+  const uint8_t protocol = tab.anyProtocol ? 0 : t.protocol;
+  for (h &= tab.mask; tab.buckets[h].used; h = (h + 1) & tab.mask) {
+    const Bucket &b = tab.buckets[h];
+    if (b.srcIP == src && b.dstIP == dst && b.protocol == protocol) {
+      return &b;
+    }
+  }
+  return NULL;
+}
+
+int TupleSpaceClassifier::search(const Bucket *b, const FiveTuple &t,
+                                 int best) const {
+  for (uint32_t i = 0; b->count > i; ++i) {
+    const int idx = chain[b->first + i];
+    if (idx >= best) {
+      break; // sorted, nothing better left in this bucket
+    }
+    const Rule &r = rules[idx];
+    if (r.srcPortLo <= t.srcPort && t.srcPort <= r.srcPortHi &&
+        r.dstPortLo <= t.dstPort && t.dstPort <= r.dstPortHi) {
+      return idx;
+    }
+  }
+  return best;
+}
+
+int TupleSpaceClassifier::match(const FiveTuple &t) const {
+  int best = INT_MAX;
+  for (const Table &tab : tables) {
+    if (tab.best >= best) {
+      break;
+    }
+    const Bucket *b = find(tab, t, hash(t.srcIP & tab.srcMask,
+                                        t.dstIP & tab.dstMask,
+                                        tab.anyProtocol ? 0 : t.protocol));
+    if (b) {
+      best = search(b, t, best);
+    }
+  }
+  return (INT_MAX == best) ? -1 : best;
+}
+
+void TupleSpaceClassifier::classify(Packet **pkts, size_t cnt,
+                                    int *results) const {
+  FiveTuple tuples[BULK_SIZE];
+  uint32_t h[BULK_SIZE];
+  int best[BULK_SIZE];
+  int worst;
+
+  for (size_t i = 0; cnt > i; ++i) {
+    __builtin_prefetch(&pkts[i]->ipheader);
+    __builtin_prefetch(&pkts[i]->tcpheader);
+  }
+  for (size_t i = 0; cnt > i; ++i) {
+    get_tuple(pkts[i], &tuples[i]);
+    best[i] = INT_MAX;
+  }
+  // one table at a time for the whole batch: hash and prefetch the
+  // buckets of all packets, then probe them
+  for (const Table &tab : tables) {
+    worst = 0;
+    for (size_t i = 0; cnt > i; ++i) {
+      worst = std::max(worst, best[i]);
+    }
+    if (tab.best >= worst) {
+      break;
+    }
+    for (size_t i = 0; cnt > i; ++i) {
+      h[i] = hash(tuples[i].srcIP & tab.srcMask, tuples[i].dstIP & tab.dstMask,
+                  tab.anyProtocol ? 0 : tuples[i].protocol);
+      __builtin_prefetch(&tab.buckets[h[i] & tab.mask]);
+    }
+    for (size_t i = 0; cnt > i; ++i) {
+      if (tab.best < best[i]) {
+        const Bucket *b = find(tab, tuples[i], h[i]);
+        if (b) {
+          best[i] = search(b, tuples[i], best[i]);
+        }
+      }
+    }
+  }
+  for (size_t i = 0; cnt > i; ++i) {
+    results[i] = (INT_MAX == best[i]) ? -1 : best[i];
+  }
+}
+
+void BitVectorClassifier::field_values(const FiveTuple &t, uint64_t *v) {
+  v[0] = t.srcIP;
+  v[1] = t.dstIP;
+  v[2] = t.srcPort;
+  v[3] = t.dstPort;
+  v[4] = t.protocol;
+}
+
+BitVectorClassifier::BitVectorClassifier(const std::vector<Rule> &rules) {
+  const size_t n = rules.size();
+  std::vector<uint64_t> lo(n * NUM_FIELDS), hi(n * NUM_FIELDS);
+
+  nwords = (n + 63) / 64;
+  naggr = (nwords + 63) / 64;
+  for (size_t i = 0; n > i; ++i) {
+    const Rule &r = rules[i];
+    uint64_t *l = &lo[i * NUM_FIELDS], *u = &hi[i * NUM_FIELDS];
+    l[0] = r.srcIP;
+    u[0] = r.srcIP | ~prefix_mask(r.srcLen);
+    l[1] = r.dstIP;
+    u[1] = r.dstIP | ~prefix_mask(r.dstLen);
+    l[2] = r.srcPortLo;
+    u[2] = r.srcPortHi;
+    l[3] = r.dstPortLo;
+    u[3] = r.dstPortHi;
+    l[4] = r.anyProtocol ? 0 : r.protocol;
+    u[4] = r.anyProtocol ? 0xFF : r.protocol;
+  }
+
+  for (int f = 0; NUM_FIELDS > f; ++f) {
+    Field &fld = fields[f];
+    // elementary intervals start at 0 and at every rule's lo and hi + 1
+    fld.bounds.push_back(0);
+    for (size_t i = 0; n > i; ++i) {
+      fld.bounds.push_back(lo[i * NUM_FIELDS + f]);
+      fld.bounds.push_back(hi[i * NUM_FIELDS + f] + 1);
+    }
+    std::sort(fld.bounds.begin(), fld.bounds.end());
+    fld.bounds.erase(std::unique(fld.bounds.begin(), fld.bounds.end()),
+                     fld.bounds.end());
+    const size_t nintervals = fld.bounds.size();
+    fld.bits.assign(nintervals * nwords, 0);
+    fld.aggr.assign(nintervals * naggr, 0);
+    for (size_t i = 0; n > i; ++i) {
+      size_t k = std::lower_bound(fld.bounds.begin(), fld.bounds.end(),
+                                  lo[i * NUM_FIELDS + f]) - fld.bounds.begin();
+      for (; nintervals > k && hi[i * NUM_FIELDS + f] >= fld.bounds[k]; ++k) {
+        fld.bits[k * nwords + i / 64] |= 1ULL << (i % 64);
+        fld.aggr[k * naggr + i / 4096] |= 1ULL << ((i / 64) % 64);
+      }
+    }
+  }
+}
+
+void BitVectorClassifier::interval(const FiveTuple &t, uint32_t *idx) const {
+  uint64_t v[NUM_FIELDS];
+  field_values(t, v);
+  for (int f = 0; NUM_FIELDS > f; ++f) {
+    const std::vector<uint64_t> &b = fields[f].bounds;
+    idx[f] = std::upper_bound(b.begin(), b.end(), v[f]) - b.begin() - 1;
+  }
+}
+
+int BitVectorClassifier::lookup(const uint32_t *idx) const {
+  for (size_t a = 0; naggr > a; ++a) {
+    uint64_t aggr = ~0ULL;
+    for (int f = 0; NUM_FIELDS > f; ++f) {
+      aggr &= fields[f].aggr[idx[f] * naggr + a];
+    }
+    while (aggr) {
+      const size_t w = a * 64 + __builtin_ctzll(aggr);
+      uint64_t word = ~0ULL;
+      for (int f = 0; NUM_FIELDS > f; ++f) {
+        word &= fields[f].bits[idx[f] * nwords + w];
+      }
+      if (word) {
+        return w * 64 + __builtin_ctzll(word);
+      }
+      aggr &= aggr - 1;
+    }
+  }
+  return -1;
+}
+
+int BitVectorClassifier::match(const FiveTuple &t) const {
+  uint32_t idx[NUM_FIELDS];
+  interval(t, idx);
+  return lookup(idx);
+}
+
+void BitVectorClassifier::classify(Packet **pkts, size_t cnt,
+                                   int *results) const {
+  FiveTuple tuple;
+  uint32_t idx[BULK_SIZE][NUM_FIELDS];
+
+  for (size_t i = 0; cnt > i; ++i) {
+    __builtin_prefetch(&pkts[i]->ipheader);
+    __builtin_prefetch(&pkts[i]->tcpheader);
+  }
+  // binary searches for the whole batch first, prefetching the aggregate
+  // and first bit-vector words that the ANDs will start with
+  for (size_t i = 0; cnt > i; ++i) {
+    get_tuple(pkts[i], &tuple);
+    interval(tuple, idx[i]);
+    for (int f = 0; NUM_FIELDS > f; ++f) {
+      __builtin_prefetch(&fields[f].aggr[idx[i][f] * naggr]);
+      __builtin_prefetch(&fields[f].bits[idx[i][f] * nwords]);
+    }
+  }
+  for (size_t i = 0; cnt > i; ++i) {
+    results[i] = lookup(idx[i]);
+  }
+}
+
+Classifier *make_classifier(const char *name, const std::vector<Rule> &rules) {
+  if (0 == strcmp("linear", name)) {
+    return new LinearClassifier(rules);
+  } else if (0 == strcmp("tuple", name)) {
+    return new TupleSpaceClassifier(rules);
+  } else if (0 == strcmp("bitvector", name)) {
+    return new BitVectorClassifier(rules);
+  }
+  return nullptr;
+}
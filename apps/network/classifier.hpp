@@ -0,0 +1,151 @@
+#ifndef _NETWORK_CLASSIFIER_HPP__
+#define _NETWORK_CLASSIFIER_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "utils.hpp"
+
+#ifndef NUM_RULES
+#define NUM_RULES 4096
+#endif
+
+enum RuleAction {
+  RULE_ACCEPT = 0,
+  RULE_DROP = 1
+};
+
+// A rule matches prefixes on the addresses, inclusive ranges on the ports
+// and either one protocol or any. Rules are kept in priority order: the
+// matching rule with the lowest index wins.
+struct Rule {
+  uint32_t srcIP;
+  uint32_t dstIP;
+  uint8_t srcLen; // prefix lengths, 0 is a wildcard
+  uint8_t dstLen;
+  uint16_t srcPortLo;
+  uint16_t srcPortHi;
+  uint16_t dstPortLo;
+  uint16_t dstPortHi;
+  uint8_t protocol;
+  bool anyProtocol;
+  uint8_t action;
+};
+
+static inline uint32_t prefix_mask(uint8_t len) {
+  return len ? ~0U << (32 - len) : 0;
+}
+
+static inline bool rule_match(const Rule &r, const FiveTuple &t) {
+  return 0 == ((t.srcIP ^ r.srcIP) & prefix_mask(r.srcLen)) &&
+         0 == ((t.dstIP ^ r.dstIP) & prefix_mask(r.dstLen)) &&
+         r.srcPortLo <= t.srcPort && t.srcPort <= r.srcPortHi &&
+         r.dstPortLo <= t.dstPort && t.dstPort <= r.dstPortHi &&
+         (r.anyProtocol || r.protocol == t.protocol);
+}
+
+// Load a ClassBench filter set. The rules of the file deny, and a final
+// wildcard rule accepts everything else. Returns false if unreadable.
+bool load_rules(const char *path, std::vector<Rule> &rules);
+
+// Generate n rules in the style of a ClassBench seed: addresses drawn from
+// a few shared blocks so rules overlap, a mix of wildcard, exact and range
+// ports, TCP/UDP/any protocol. The last rule is the wildcard accept.
+void gen_rules(size_t n, uint32_t seed, std::vector<Rule> &rules);
+
+// Generate n header tuples, most of them inside a random rule so that the
+// whole rule set is exercised, the rest uniformly random.
+void gen_trace(const std::vector<Rule> &rules, size_t n, uint32_t seed,
+               std::vector<FiveTuple> &trace);
+
+class Classifier {
+ public:
+  virtual ~Classifier() {}
+  virtual const char *name() const = 0;
+  // Index of the first matching rule, -1 if none matches
+  virtual int match(const FiveTuple &t) const = 0;
+  // Classify cnt (at most BULK_SIZE) packets, prefetching their headers
+  // and, where the classifier allows, its own tables ahead of the lookups.
+  virtual void classify(Packet **pkts, size_t cnt, int *results) const;
+};
+
+// Scan the rules in priority order
+class LinearClassifier : public Classifier {
+ public:
+  LinearClassifier(const std::vector<Rule> &rules) : rules(rules) {}
+  const char *name() const { return "linear"; }
+  int match(const FiveTuple &t) const;
+ private:
+  const std::vector<Rule> &rules;
+};
+
+// Tuple space search (Srinivasan et al.): one hash table per combination
+// of prefix lengths and protocol wildcard, probed with the masked header.
+// Ports are ranges, so a bucket holds the rules sharing the masked key and
+// they are checked in priority order. Tables are searched in order of
+// their best rule, stopping once no table can beat the current match.
+class TupleSpaceClassifier : public Classifier {
+ public:
+  TupleSpaceClassifier(const std::vector<Rule> &rules);
+  const char *name() const { return "tuple"; }
+  int match(const FiveTuple &t) const;
+  void classify(Packet **pkts, size_t cnt, int *results) const;
+  size_t num_tables() const { return tables.size(); }
+ private:
+  struct Bucket {
+    uint32_t srcIP;
+    uint32_t dstIP;
+    uint8_t protocol;
+    bool used;
+    uint32_t first; // rule indices in chain[first, first + count)
+    uint32_t count;
+  };
+  struct Table {
+    uint32_t srcMask;
+    uint32_t dstMask;
+    bool anyProtocol;
+    int best;
+    uint32_t mask; // number of buckets - 1
+    std::vector<Bucket> buckets;
+  };
+  static uint32_t hash(uint32_t src, uint32_t dst, uint8_t protocol);
+  const Bucket *find(const Table &tab, const FiveTuple &t, uint32_t h) const;
+  int search(const Bucket *b, const FiveTuple &t, int best) const;
+
+  const std::vector<Rule> &rules;
+  std::vector<Table> tables;
+  std::vector<int> chain;
+};
+
+// Bit-vector classifier (Lakshman and Stiliadis) with aggregation (Baboescu
+// and Varghese). Each field is cut into elementary intervals, each holding
+// the bit vector of rules that cover it; a lookup is a binary search per
+// field and an AND of five vectors, whose first set bit is the match. The
+// aggregate bit per 64-bit word lets the AND skip empty words.
+class BitVectorClassifier : public Classifier {
+ public:
+  BitVectorClassifier(const std::vector<Rule> &rules);
+  const char *name() const { return "bitvector"; }
+  int match(const FiveTuple &t) const;
+  void classify(Packet **pkts, size_t cnt, int *results) const;
+ private:
+  static const int NUM_FIELDS = 5;
+  struct Field {
+    std::vector<uint64_t> bounds; // start of each elementary interval
+    std::vector<uint64_t> bits; // nwords per interval
+    std::vector<uint64_t> aggr; // naggr per interval
+  };
+  static void field_values(const FiveTuple &t, uint64_t *v);
+  int lookup(const uint32_t *idx) const;
+  void interval(const FiveTuple &t, uint32_t *idx) const;
+
+  size_t nwords;
+  size_t naggr;
+  Field fields[NUM_FIELDS];
+};
+
+// "linear", "tuple" or "bitvector", nullptr for an unknown name
+Classifier *make_classifier(const char *name, const std::vector<Rule> &rules);
+
+#endif // end of ifndef _NETWORK_CLASSIFIER_HPP__
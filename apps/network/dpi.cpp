@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+// the SSSE3 and AVX2 prefilters are compiled for their ISA whatever the
+// target flags are, and picked at runtime
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DPI_HAVE_X86 1
+#endif
+
+#include "dpi.hpp"
+#include "checksum.hpp"
+
+static inline uint32_t xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+int parse_dpi_args(int argc, char **argv, DpiConfig &cfg) {
+  int nargs = 1;
+  for (int i = 1; argc > i; ++i) {
+    const char *arg = argv[i];
+    if (!strncmp(arg, "--signatures=", 13)) {
+      cfg.signatures = arg + 13;
+      if (0 == *cfg.signatures) {
+        printf("\033[91mFAILED:\033[0m bad dpi option %s\n", arg);
+        return -1;
+      }
+    } else if (!strncmp(arg, "--matcher=", 10)) {
+      cfg.matcher = arg + 10;
+    } else { // not ours, keep it
+      argv[nargs++] = argv[i];
+    }
+  }
+  argv[nargs] = NULL;
+  return nargs;
+}
+
+bool load_signatures(const char *path, std::vector<std::string> &sigs) {
+  FILE *fp = fopen(path, "r");
+  char line[1024];
+
+  if (NULL == fp) {
+    return false;
+  }
+  sigs.clear();
+  while (fgets(line, sizeof(line), fp)) {
+    std::string sig;
+    if ('#' == line[0]) {
+      continue;
+    }
+    for (const char *c = line; *c && '\n' != *c && '\r' != *c; ++c) {
+      unsigned byte;
+      if ('\\' == c[0] && 'x' == c[1] && 1 == sscanf(c + 2, "%2x", &byte)) {
+        sig.push_back((char)byte);
+        c += 3;
+      } else if ('\\' == c[0] && '\\' == c[1]) {
+        sig.push_back('\\');
+        c++;
+      } else {
+        sig.push_back(*c);
+      }
+    }
+    if (!sig.empty()) {
+      sigs.push_back(sig);
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+void gen_signatures(size_t n, uint32_t seed, std::vector<std::string> &sigs) {
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789./_-=?&%";
+  uint32_t state = seed ? seed : 1;
+
+  sigs.clear();
+  for (size_t i = 0; n > i; ++i) {
+    const size_t len = 5 + xorshift32(&state) % 12;
+    std::string sig;
+    for (size_t j = 0; len > j; ++j) {
+      sig.push_back(alphabet[xorshift32(&state) % (sizeof(alphabet) - 1)]);
+    }
+    sigs.push_back(sig);
+  }
+}
+
+void Matcher::match_bulk(Packet **pkts, size_t cnt, int *results) const {
+  for (size_t i = 0; cnt > i; ++i) {
+    if (cnt > i + 1) {
+      __builtin_prefetch(pkts[i + 1]->payload);
+    }
+    results[i] = match((const uint8_t*)pkts[i]->payload,
+                       tcp_payload_len(pkts[i]));
+  }
+}
+
+AhoCorasickMatcher::AhoCorasickMatcher(const std::vector<std::string> &sigs) {
+  // one class for each byte some signature uses, class 0 for all the others
+  memset(classes, 0, sizeof(classes));
+  nclasses = 1;
+  for (size_t i = 0; sigs.size() > i; ++i) {
+    for (size_t j = 0; sigs[i].size() > j; ++j) {
+      const uint8_t c = sigs[i][j];
+      if (0 == classes[c]) {
+        classes[c] = nclasses++;
+      }
+    }
+  }
+
+  // the trie of the signatures, -1 for a missing edge
+  std::vector<int> trie(nclasses, -1);
+  ids.assign(1, -1);
+  for (size_t i = 0; sigs.size() > i; ++i) {
+    uint32_t s = 0;
+    for (size_t j = 0; sigs[i].size() > j; ++j) {
+      const size_t edge = s * nclasses + classes[(uint8_t)sigs[i][j]];
+      if (0 > trie[edge]) {
+        trie[edge] = ids.size();
+        ids.push_back(-1);
+        trie.resize(trie.size() + nclasses, -1);
+      }
+      s = trie[edge];
+    }
+    if (s && 0 > ids[s]) { // a duplicate keeps the first index
+      ids[s] = i;
+    }
+  }
+
+  // breadth first, a missing edge goes where the failure link of the state
+  // goes, which is already complete, and a state ending no signature still
+  // reports one ending at its failure link
+  std::vector<uint32_t> next(trie.size(), 0);
+  std::vector<uint32_t> fail(ids.size(), 0);
+  std::vector<uint32_t> queue;
+  for (uint32_t c = 0; nclasses > c; ++c) {
+    if (0 <= trie[c]) {
+      next[c] = trie[c];
+      queue.push_back(trie[c]);
+    }
+  }
+  for (size_t q = 0; queue.size() > q; ++q) {
+    const uint32_t s = queue[q];
+    if (0 > ids[s]) {
+      ids[s] = ids[fail[s]];
+    }
+    for (uint32_t c = 0; nclasses > c; ++c) {
+      const int t = trie[s * nclasses + c];
+      if (0 > t) {
+        next[s * nclasses + c] = next[fail[s] * nclasses + c];
+      } else {
+        fail[t] = next[fail[s] * nclasses + c];
+        next[s * nclasses + c] = t;
+        queue.push_back(t);
+      }
+    }
+  }
+
+  delta.resize(next.size());
+  for (size_t i = 0; next.size() > i; ++i) {
+    delta[i] = next[i] * nclasses | ((0 <= ids[next[i]]) ? MATCH : 0);
+  }
+}
+
+int AhoCorasickMatcher::match(const uint8_t *buf, size_t len) const {
+  uint32_t s = 0;
+  for (size_t i = 0; len > i; ++i) {
+    s = delta[s + classes[buf[i]]];
+    if (s & MATCH) {
+      return ids[(s & ~MATCH) / nclasses];
+    }
+  }
+  return -1;
+}
+
+TeddyMatcher::TeddyMatcher(const std::vector<std::string> &sigs)
+    : sigs(sigs) {
+  width = 1;
+  kernel = "teddy";
+#ifdef DPI_HAVE_X86
+  if (__builtin_cpu_supports("avx2")) {
+    width = 32;
+    kernel = "teddy/avx2";
+  } else if (__builtin_cpu_supports("ssse3")) {
+    width = 16;
+    kernel = "teddy/ssse3";
+  }
+#endif
+  std::vector<int> order;
+  prefix = MAX_PREFIX;
+  for (size_t i = 0; sigs.size() > i; ++i) {
+    if (!sigs[i].empty()) {
+      order.push_back(i);
+      prefix = std::min(prefix, (int)sigs[i].size());
+    }
+  }
+  if (order.empty()) {
+    prefix = 0;
+  }
+
+  // signatures sharing their first bytes go to the same bucket, where their
+  // nibbles overlap, so the masks of a bucket stay tight
+  std::sort(order.begin(), order.end(), [&sigs](int a, int b) {
+    return sigs[a] < sigs[b];
+  });
+  memset(lo, 0, sizeof(lo));
+  memset(hi, 0, sizeof(hi));
+  for (size_t i = 0; order.size() > i; ++i) {
+    const int b = i * NUM_BUCKETS / order.size();
+    const std::string &sig = sigs[order[i]];
+    buckets[b].push_back(order[i]);
+    for (int k = 0; prefix > k; ++k) {
+      lo[k][(uint8_t)sig[k] & 0xF] |= 1 << b;
+      hi[k][(uint8_t)sig[k] >> 4] |= 1 << b;
+    }
+  }
+  // the first index wins among signatures found at the same position
+  for (int b = 0; NUM_BUCKETS > b; ++b) {
+    std::sort(buckets[b].begin(), buckets[b].end());
+  }
+}
+
+int TeddyMatcher::verify(const uint8_t *buf, size_t len, size_t pos,
+                         uint8_t cand) const {
+  int found = -1;
+  for (; cand; cand &= cand - 1) {
+    const int b = __builtin_ctz(cand);
+    for (size_t i = 0; buckets[b].size() > i; ++i) {
+      const std::string &sig = sigs[buckets[b][i]];
+      if (len - pos >= sig.size() &&
+          0 == memcmp(buf + pos, sig.data(), sig.size())) {
+        if (0 > found || found > buckets[b][i]) {
+          found = buckets[b][i];
+        }
+        break;
+      }
+    }
+  }
+  return found;
+}
+
+#ifdef DPI_HAVE_X86
+__attribute__((target("avx2")))
+size_t TeddyMatcher::scan_avx2(const uint8_t *buf, size_t len, size_t end,
+                               int *found) const {
+  const __m256i nibble = _mm256_set1_epi8(0xF);
+  __m256i tlo[MAX_PREFIX], thi[MAX_PREFIX];
+  for (int k = 0; prefix > k; ++k) {
+    tlo[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)lo[k]));
+    thi[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)hi[k]));
+  }
+  size_t i = 0;
+  for (; end >= i + 32; i += 32) {
+    __m256i cand = _mm256_set1_epi8(-1);
+    for (int k = 0; prefix > k; ++k) {
+      const __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i + k));
+      const __m256i l = _mm256_and_si256(v, nibble);
+      const __m256i h = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+      cand = _mm256_and_si256(cand, _mm256_and_si256(
+          _mm256_shuffle_epi8(tlo[k], l), _mm256_shuffle_epi8(thi[k], h)));
+    }
+    uint32_t mask = ~_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(cand, _mm256_setzero_si256()));
+    if (mask) {
+      uint8_t c[32];
+      _mm256_storeu_si256((__m256i*)c, cand);
+      for (; mask; mask &= mask - 1) {
+        const int lane = __builtin_ctz(mask);
+        *found = verify(buf, len, i + lane, c[lane]);
+        if (0 <= *found) {
+          return i;
+        }
+      }
+    }
+  }
+  return i;
+}
+
+__attribute__((target("ssse3")))
+size_t TeddyMatcher::scan_ssse3(const uint8_t *buf, size_t len, size_t i,
+                                size_t end, int *found) const {
+  const __m128i nibble = _mm_set1_epi8(0xF);
+  __m128i tlo[MAX_PREFIX], thi[MAX_PREFIX];
+  for (int k = 0; prefix > k; ++k) {
+    tlo[k] = _mm_loadu_si128((__m128i*)lo[k]);
+    thi[k] = _mm_loadu_si128((__m128i*)hi[k]);
+  }
+  for (; end >= i + 16; i += 16) {
+    __m128i cand = _mm_set1_epi8(-1);
+    for (int k = 0; prefix > k; ++k) {
+      const __m128i v = _mm_loadu_si128((const __m128i*)(buf + i + k));
+      const __m128i l = _mm_and_si128(v, nibble);
+      const __m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+      cand = _mm_and_si128(cand, _mm_and_si128(
+          _mm_shuffle_epi8(tlo[k], l), _mm_shuffle_epi8(thi[k], h)));
+    }
+    uint32_t mask = 0xFFFF & ~_mm_movemask_epi8(
+        _mm_cmpeq_epi8(cand, _mm_setzero_si128()));
+    if (mask) {
+      uint8_t c[16];
+      _mm_storeu_si128((__m128i*)c, cand);
+      for (; mask; mask &= mask - 1) {
+        const int lane = __builtin_ctz(mask);
+        *found = verify(buf, len, i + lane, c[lane]);
+        if (0 <= *found) {
+          return i;
+        }
+      }
+    }
+  }
+  return i;
+}
+#endif
+
+int TeddyMatcher::match(const uint8_t *buf, size_t len) const {
+  if (0 == prefix || (size_t)prefix > len) {
+    return -1;
+  }
+  // positions a signature may start at
+  const size_t end = len - prefix + 1;
+  size_t i = 0;
+  int found = -1;
+#ifdef DPI_HAVE_X86
+  if (32 == width) {
+    i = scan_avx2(buf, len, end, &found);
+  }
+  if (0 <= found) {
+    return found;
+  }
+  // the SSSE3 scan also takes the tail the AVX2 one left
+  if (16 <= width) {
+    i = scan_ssse3(buf, len, i, end, &found);
+  }
+  if (0 <= found) {
+    return found;
+  }
+#endif
+  for (; end > i; ++i) {
+    uint8_t cand = 0xFF;
+    for (int k = 0; prefix > k; ++k) {
+      cand &= lo[k][buf[i + k] & 0xF] & hi[k][buf[i + k] >> 4];
+    }
+    if (cand) {
+      found = verify(buf, len, i, cand);
+      if (0 <= found) {
+        return found;
+      }
+    }
+  }
+  return -1;
+}
+
+Matcher *make_matcher(const char *name, const std::vector<std::string> &sigs) {
+  if (0 == strcmp("ac", name)) {
+    return new AhoCorasickMatcher(sigs);
+  } else if (0 == strcmp("teddy", name)) {
+    return new TeddyMatcher(sigs);
+  }
+  return nullptr;
+}
@@ -0,0 +1,108 @@
+#ifndef _NETWORK_DPI_HPP__
+#define _NETWORK_DPI_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+#ifndef NUM_SIGNATURES
+#define NUM_SIGNATURES 256
+#endif
+
+// Deep packet inspection settings, set with --options on the command line,
+// see parse_dpi_args()
+struct DpiConfig {
+  const char *signatures = NULL; // file of signatures, or how many to generate
+  const char *matcher = "ac";
+};
+
+// Consume the DPI options of argv, leaving the others in place; returns the
+// new argc, -1 on a bad option.
+//   --signatures=FILE|N  literal signatures, one a line with \xNN escapes,
+//                        or N generated ones
+//   --matcher=NAME       ac or teddy
+int parse_dpi_args(int argc, char **argv, DpiConfig &cfg);
+
+// Load literal signatures, one a line, \xNN for any byte. Returns false if
+// unreadable.
+bool load_signatures(const char *path, std::vector<std::string> &sigs);
+
+// Generate n signatures in the style of IDS content strings: 5 to 16 bytes
+// of lowercase letters, digits and URL punctuation.
+void gen_signatures(size_t n, uint32_t seed, std::vector<std::string> &sigs);
+
+class Matcher {
+ public:
+  virtual ~Matcher() {}
+  virtual const char *name() const = 0;
+  // Index of a signature found in buf, the first one the scan comes
+  // across, -1 if none
+  virtual int match(const uint8_t *buf, size_t len) const = 0;
+  // Match the TCP payloads of cnt (at most BULK_SIZE) packets, prefetching
+  // the next payload while one is scanned
+  void match_bulk(Packet **pkts, size_t cnt, int *results) const;
+};
+
+// Aho-Corasick automaton compiled to a DFA. To keep it small enough for the
+// caches, bytes that appear in no signature share one input class, rows
+// are only as wide as the number of classes, and a transition holds the
+// row offset of its target, premultiplied, with the top bit set when the
+// target ends a signature: one load and one add a byte, no output check.
+class AhoCorasickMatcher : public Matcher {
+ public:
+  AhoCorasickMatcher(const std::vector<std::string> &sigs);
+  const char *name() const { return "ac"; }
+  int match(const uint8_t *buf, size_t len) const;
+  size_t num_states() const { return ids.size(); }
+  size_t num_classes() const { return nclasses; }
+ private:
+  static const uint32_t MATCH = 0x80000000;
+
+  uint8_t classes[256];
+  uint32_t nclasses;
+  std::vector<uint32_t> delta; // nclasses per state
+  std::vector<int> ids; // a signature ending at each state, -1 if none
+};
+
+// Teddy-style prefilter (Hyperscan): signatures go to 8 buckets, and the
+// low and high nibbles of the first bytes of a bucket's signatures are
+// recorded in 16-entry tables, one bit per bucket. A pshufb per nibble and
+// leading byte then yields, for 16 (32 with AVX2) positions at once, the
+// buckets that may start there; candidates are verified with memcmp.
+// The widest scan the CPU runs is picked when the matcher is built, and
+// named by name(); without SSSE3 the same tables are looked up a position
+// at a time.
+class TeddyMatcher : public Matcher {
+ public:
+  TeddyMatcher(const std::vector<std::string> &sigs);
+  const char *name() const { return kernel; }
+  int match(const uint8_t *buf, size_t len) const;
+ private:
+  static const int NUM_BUCKETS = 8;
+  static const int MAX_PREFIX = 3;
+
+  int verify(const uint8_t *buf, size_t len, size_t pos, uint8_t cand) const;
+  // Scan positions from i (0 for AVX2) while a whole vector of them is
+  // before end; return where they stopped, with the signature found there
+  // in found, if any
+  size_t scan_avx2(const uint8_t *buf, size_t len, size_t end,
+                   int *found) const;
+  size_t scan_ssse3(const uint8_t *buf, size_t len, size_t i, size_t end,
+                    int *found) const;
+
+  const std::vector<std::string> &sigs;
+  int width; // positions the prefilter looks at at once: 32, 16 or 1
+  const char *kernel; // "teddy", with the ISA of the prefilter
+  int prefix; // leading bytes in the masks, at most the shortest signature
+  uint8_t lo[MAX_PREFIX][16]; // buckets by low nibble of each leading byte
+  uint8_t hi[MAX_PREFIX][16];
+  std::vector<int> buckets[NUM_BUCKETS];
+};
+
+// "ac" or "teddy", nullptr for an unknown name
+Matcher *make_matcher(const char *name, const std::vector<std::string> &sigs);
+
+#endif // end of ifndef _NETWORK_DPI_HPP__
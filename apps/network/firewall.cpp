@@ -3,6 +3,7 @@
 #include <chrono>
 #include <atomic>
 #include <vector>
+#include <algorithm>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -11,6 +12,12 @@
 #include "threading.h"
 #include "timing.h"
 #include "utils.hpp"
+#include "classifier.hpp"
+#include "checksum.hpp"
+#include "mempool.hpp"
+#include "traffic.hpp"
+#include "telemetry.hpp"
+#include "dpi.hpp"
 
 using std::thread;
 using std::chrono::high_resolution_clock;
@@ -30,10 +37,60 @@ using std::chrono::nanoseconds;
 int q01 = 1; // id for the queue connecting stage 0 and stage 1, 1:N
 int q1c = 2; // id for the queue connecting stage 1 and correct, N:1
 int q1m = 3; // id for the queue connecting stage 1 and mistake, N:1
-int qp0 = 4; // id for the memory pool queue, 2:1
+#if 0 < NUM_DPI
+// with DPI workers, stage 1 sends the packets it accepts to them, and they
+// send the clean ones to correct, the infected ones to mistake
+int q1d = 4; // id for the queue connecting stage 1 and DPI, N:D
+#define Q1_ACCEPT q1d
+#else
+#define Q1_ACCEPT q1c
+#endif
 uint64_t num_packets = 16;
-uint64_t num_correct;
-uint64_t num_mistake;
+// packets seen by each stage 2, one writer each
+alignas(64) std::atomic<uint64_t> num_correct(0);
+alignas(64) std::atomic<uint64_t> num_mistake(0);
+// ticks from ingress to each stage 2, correct and mistake
+Histogram latency[2];
+#ifdef TELEMETRY
+// ticks spent in each stage and queue up to each stage 2, from the stage
+// boundary stamps
+enum { SEG_STAGE0, SEG_Q01, SEG_STAGE1, SEG_Q12, NUM_SEGMENTS };
+const char *segment_names[2][NUM_SEGMENTS] = {
+#if 0 < NUM_DPI
+  { "stage 0", "q01", "stage 1", "q1d+dpi+q1c" },
+  { "stage 0", "q01", "stage 1", "(dpi+)q1m" }
+#else
+  { "stage 0", "q01", "stage 1", "q1c" },
+  { "stage 0", "q01", "stage 1", "q1m" }
+#endif
+};
+Histogram segments[2][NUM_SEGMENTS];
+#endif
+
+// packets through and polls of every thread, see telemetry.hpp; stage 1
+// and DPI push to the correct path (stage 1 through DPI, if any) on port 0,
+// to the mistake path on port 1
+StageCounters stage0_ctr;
+StageCounters stage1_ctr[NUM_STAGE1];
+StageCounters stage2_ctr[2];
+#if 0 < NUM_DPI
+StageCounters dpi_ctr[NUM_DPI];
+#endif
+
+// packet buffers, both stage 2 put them back and stage 0 gets them through
+// the cache of their lcore
+Mempool *pool;
+enum { LCORE_STAGE0, LCORE_CORRECT, LCORE_MISTAKE, NUM_LCORES };
+
+std::vector<Rule> rules;
+std::vector<FiveTuple> trace; // flows of the synthetic traffic
+Classifier *classifier = nullptr;
+#if 0 < NUM_DPI
+Matcher *matcher;
+std::atomic<uint64_t> dpi_infected(0); // packets carrying a signature
+#endif
+TrafficSource *source; // what stage 0 sends
+Pacer *pacer; // and when
 
 std::atomic<int> ready;
 
@@ -49,24 +106,15 @@ void stage0(int desired_core) {
   Packet *pkts[BULK_SIZE] = { NULL };
 
 #ifdef VL
-  vlendpt_t cons, prod;
+  vlendpt_t prod;
   // open endpoints
-  if (open_byte_vl_as_consumer(qp0, &cons, 1)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
-    return;
-  }
   if (open_byte_vl_as_producer(q01, &prod, 1)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
     return;
   }
-  const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
 #elif CAF
-  cafendpt_t cons, prod;
+  cafendpt_t prod;
   // open endpoints
-  if (open_caf(qp0, &cons)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
-    return;
-  }
   if (open_caf(q01, &prod)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
     return;
@@ -74,36 +122,17 @@ void stage0(int desired_core) {
 #endif
 
   ready++;
-  while ((3 + NUM_STAGE1) != ready.load()) { /** spin **/ };
+  while ((3 + NUM_STAGE1 + NUM_DPI) != ready.load()) { /** spin **/ };
 
   for (uint64_t i = 0; num_packets > i;) {
     // try to acquire packet header points from pool
-#ifdef VL
-    cnt = bulk_size;
-    line_vl_pop_non(&cons, (uint8_t*)pkts, &cnt);
-    if (cnt < bulk_size) {
-      size_t tmp = bulk_size - cnt;
-      line_vl_pop_non(&cons, (uint8_t*)&pkts[cnt], &tmp);
-      cnt += tmp;
-    }
-    cnt /= sizeof(Packet*);
-#elif CAF
-    cnt = caf_pop_bulk(&cons, (uint64_t*)pkts, BULK_SIZE);
-    if (cnt < BULK_SIZE) {
-        cnt += caf_pop_bulk(&cons, (uint64_t*)&pkts[cnt], BULK_SIZE - cnt);
-    }
-#endif
+    cnt = pool->get_bulk(LCORE_STAGE0, pkts, BULK_SIZE) ? BULK_SIZE : 0;
 
     if (cnt) { // pkts now have valid pointers
+      const uint64_t now = rdtsc();
       for (uint64_t j = 0; cnt > j; ++j) {
-        pkts[j]->ipheader.data.srcIP = i + j;
-        pkts[j]->ipheader.data.dstIP = ~i;
-        pkts[j]->ipheader.data.checksumIP =
-          pkts[j]->ipheader.data.srcIP ^ pkts[j]->ipheader.data.dstIP;
-        pkts[j]->tcpheader.data.srcPort = (uint16_t)num_packets;
-        pkts[j]->tcpheader.data.dstPort = (uint16_t)num_packets;
-        pkts[j]->tcpheader.data.checksumTCP =
-          pkts[j]->tcpheader.data.srcPort ^ pkts[j]->tcpheader.data.dstPort;
+        source->next(pkts[j]);
+        packet_meta(pkts[j])->ingress = now;
 #ifdef CAF_PREPUSH
         caf_prepush((void*)pkts[j], HEADER_SIZE);
 #endif
@@ -128,19 +157,24 @@ void stage0(int desired_core) {
 
 }
 
-void stage1(int desired_core) {
+void stage1(int desired_core, int worker) {
   setAffinity(desired_core);
 
   uint16_t checksum = 0;
   uint64_t corrupted = 0;
+  uint64_t busy = 0, idle = 0; // polls
+  StageCounters &ctr = stage1_ctr[worker];
   size_t cnt = 0;
   bool done = false;
   uint64_t pktscidx = 0;
   uint64_t pktsmidx = 0;
   uint64_t mistake_cnt = 0;
+  int results[BULK_SIZE]; // matching rule of each packet
   Packet *pkts[BULK_SIZE] = { NULL };
   Packet *pktsc[BULK_SIZE] = { NULL }; // packets to stage2 correct
-  Packet *pktsm[BULK_SIZE] = { NULL }; // packets to stage2 mistake
+  // packets to stage2 mistake, gathered until a bulk is full, so there is
+  // room for the overflow of one more incoming bulk
+  Packet *pktsm[2 * BULK_SIZE] = { NULL };
 
   // get rid of unused warning
   checksum = checksum;
@@ -153,7 +187,7 @@ void stage1(int desired_core) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
-  if (open_byte_vl_as_producer(q1c, &prodc, 1)) {
+  if (open_byte_vl_as_producer(Q1_ACCEPT, &prodc, 1)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d prodc\n", __func__, desired_core);
     return;
   }
@@ -169,7 +203,7 @@ void stage1(int desired_core) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
-  if (open_caf(q1c, &prodc)) {
+  if (open_caf(Q1_ACCEPT, &prodc)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d prodc\n", __func__, desired_core);
     return;
   }
@@ -180,7 +214,7 @@ void stage1(int desired_core) {
 #endif
 
   ready++;
-  while ((3 + NUM_STAGE1) != ready.load()) { /** spin **/ };
+  while ((3 + NUM_STAGE1 + NUM_DPI) != ready.load()) { /** spin **/ };
 
   while (!done) {
     // try to acquire a packet
@@ -193,13 +227,17 @@ void stage1(int desired_core) {
 #endif
 
     if (cnt) { // pkts has valid pointers
-      // process header information
+      stamp_pkts(pkts, cnt, STAMP_STAGE1_IN);
+      ctr.popped(cnt);
+      busy++;
+      // match the whole bulk against the rules, then process the headers,
+      // packets either corrupted or denied by their rule take the mistake path
+      classifier->classify(pkts, cnt, results);
+      const uint64_t valid = ipv4_valid_bulk(pkts, cnt) &
+                             tcp_valid_bulk(pkts, cnt);
       for (uint64_t i = 0; cnt > i; ++i) {
-        if (pkts[i]->ipheader.data.checksumIP !=
-            (pkts[i]->ipheader.data.srcIP ^ pkts[i]->ipheader.data.dstIP) ||
-            pkts[i]->tcpheader.data.checksumTCP !=
-            (pkts[i]->tcpheader.data.srcPort ^
-             pkts[i]->tcpheader.data.dstPort)) {
+        if (!((valid >> i) & 1) ||
+            0 > results[i] || RULE_DROP == rules[results[i]].action) {
           pktsm[pktsmidx++] = pkts[i];
         } else {
           pktsc[pktscidx++] = pkts[i];
@@ -211,6 +249,7 @@ void stage1(int desired_core) {
 
       // after processing, propogate the packet to the next stage
       if (pktscidx) {
+        stamp_pkts(pktsc, pktscidx, STAMP_STAGE1_OUT);
 #ifdef VL
         line_vl_push_weak(&prodc, (uint8_t*)pktsc, pktscidx * sizeof(Packet*));
 #elif CAF
@@ -219,9 +258,11 @@ void stage1(int desired_core) {
           i += caf_push_bulk(&prodc, (uint64_t*)&pktsc[i], pktscidx - i);
         } while (i < pktscidx);
 #endif
+        ctr.pushed(pktscidx, 0);
         pktscidx = 0;
       }
-      if (BULK_SIZE == pktsmidx || MISTAKE_GATHER_RETRY <= mistake_cnt) {
+      if (BULK_SIZE <= pktsmidx || MISTAKE_GATHER_RETRY <= mistake_cnt) {
+        stamp_pkts(pktsm, pktsmidx, STAMP_STAGE1_OUT);
 #ifdef VL
         line_vl_push_weak(&prodm, (uint8_t*)pktsm, pktsmidx * sizeof(Packet*));
 #elif CAF
@@ -230,6 +271,7 @@ void stage1(int desired_core) {
           i += caf_push_bulk(&prodm, (uint64_t*)&pktsm[i], pktsmidx - i);
         } while (i < pktsmidx);
 #endif
+        ctr.pushed(pktsmidx, 1);
         pktsmidx = 0;
         mistake_cnt = 0;
       } else {
@@ -238,6 +280,7 @@ void stage1(int desired_core) {
       continue;
     }
 
+    idle++;
     done = lock.done;
 #ifdef VL
     line_vl_push_non(&prodc, (uint8_t*)pktsc, 0); // help flushing
@@ -245,8 +288,131 @@ void stage1(int desired_core) {
 #endif
   }
 
+  ctr.busy = busy;
+  ctr.idle = idle;
 }
 
+#if 0 < NUM_DPI
+void stage_dpi(int desired_core, int worker) {
+  setAffinity(desired_core);
+
+  uint64_t infected = 0;
+  uint64_t busy = 0, idle = 0; // polls
+  StageCounters &ctr = dpi_ctr[worker];
+  size_t cnt = 0;
+  bool done = false;
+  uint64_t pktscidx = 0;
+  uint64_t pktsmidx = 0;
+  int results[BULK_SIZE]; // matching signature of each packet
+  Packet *pkts[BULK_SIZE] = { NULL };
+  Packet *pktsc[BULK_SIZE] = { NULL }; // clean packets to stage2 correct
+  Packet *pktsm[BULK_SIZE] = { NULL }; // infected packets to stage2 mistake
+
+#ifdef VL
+  vlendpt_t cons, prodc, prodm;
+  // open endpoints
+  if (open_byte_vl_as_consumer(q1d, &cons, 1)) {
+    printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
+    return;
+  }
+  if (open_byte_vl_as_producer(q1c, &prodc, 1)) {
+    printf("\033[91mFAILED:\033[0m %s(), T%d prodc\n", __func__, desired_core);
+    return;
+  }
+  if (open_byte_vl_as_producer(q1m, &prodm, 1)) {
+    printf("\033[91mFAILED:\033[0m %s(), T%d prodm\n", __func__, desired_core);
+    return;
+  }
+  const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
+#elif CAF
+  cafendpt_t cons, prodc, prodm;
+  // open endpoints
+  if (open_caf(q1d, &cons)) {
+    printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
+    return;
+  }
+  if (open_caf(q1c, &prodc)) {
+    printf("\033[91mFAILED:\033[0m %s(), T%d prodc\n", __func__, desired_core);
+    return;
+  }
+  if (open_caf(q1m, &prodm)) {
+    printf("\033[91mFAILED:\033[0m %s(), T%d prodm\n", __func__, desired_core);
+    return;
+  }
+#endif
+
+  ready++;
+  while ((3 + NUM_STAGE1 + NUM_DPI) != ready.load()) { /** spin **/ };
+
+  while (!done) {
+    // try to acquire a packet
+#ifdef VL
+    cnt = bulk_size;
+    line_vl_pop_non(&cons, (uint8_t*)pkts, &cnt);
+    cnt /= sizeof(Packet*);
+#elif CAF
+    cnt = caf_pop_bulk(&cons, (uint64_t*)pkts, BULK_SIZE);
+#endif
+
+    if (cnt) { // pkts has valid pointers
+      ctr.popped(cnt);
+      busy++;
+      // scan the payloads, packets carrying a signature take the mistake path
+      matcher->match_bulk(pkts, cnt, results);
+      for (uint64_t i = 0; cnt > i; ++i) {
+        if (0 <= results[i]) {
+          pktsm[pktsmidx++] = pkts[i];
+        } else {
+          pktsc[pktscidx++] = pkts[i];
+        }
+#ifdef CAF_PREPUSH
+        caf_prepush((void*)pkts[i], HEADER_SIZE);
+#endif
+      }
+
+      // after processing, propogate the packet to the next stage
+      if (pktscidx) {
+#ifdef VL
+        line_vl_push_weak(&prodc, (uint8_t*)pktsc, pktscidx * sizeof(Packet*));
+#elif CAF
+        uint64_t i = 0; // sucessufully pushed count
+        do {
+          i += caf_push_bulk(&prodc, (uint64_t*)&pktsc[i], pktscidx - i);
+        } while (i < pktscidx);
+#endif
+        ctr.pushed(pktscidx, 0);
+        pktscidx = 0;
+      }
+      if (pktsmidx) {
+#ifdef VL
+        line_vl_push_weak(&prodm, (uint8_t*)pktsm, pktsmidx * sizeof(Packet*));
+#elif CAF
+        uint64_t i = 0; // sucessufully pushed count
+        do {
+          i += caf_push_bulk(&prodm, (uint64_t*)&pktsm[i], pktsmidx - i);
+        } while (i < pktsmidx);
+#endif
+        ctr.pushed(pktsmidx, 1);
+        infected += pktsmidx;
+        pktsmidx = 0;
+      }
+      continue;
+    }
+
+    idle++;
+    done = lock.done;
+#ifdef VL
+    line_vl_push_non(&prodc, (uint8_t*)pktsc, 0); // help flushing
+    line_vl_push_non(&prodm, (uint8_t*)pktsm, 0); // help flushing
+#endif
+  }
+
+  ctr.busy = busy;
+  ctr.idle = idle;
+  dpi_infected += infected;
+}
+#endif
+
 void stage2correct(int desired_core) {
   setAffinity(desired_core);
 
@@ -254,6 +420,12 @@ void stage2correct(int desired_core) {
   uint64_t corrupted = 0;
   size_t cnt = 0;
   size_t cnt_sum = 0;
+  uint64_t busy = 0, idle = 0; // polls
+  StageCounters &ctr = stage2_ctr[0];
+  Histogram path_latency;
+#ifdef TELEMETRY
+  Histogram path_segments[NUM_SEGMENTS];
+#endif
   bool done = false;
   Packet *pkts[BULK_SIZE] = { NULL };
 
@@ -262,32 +434,24 @@ void stage2correct(int desired_core) {
   corrupted = corrupted;
 
 #ifdef VL
-  vlendpt_t cons, prod;
+  vlendpt_t cons;
   // open endpoints
   if (open_byte_vl_as_consumer(q1c, &cons, 1)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
-  if (open_byte_vl_as_producer(qp0, &prod, 1)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
-    return;
-  }
   const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
 #elif CAF
-  cafendpt_t cons, prod;
+  cafendpt_t cons;
   // open endpoints
   if (open_caf(q1c, &cons)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
-  if (open_caf(qp0, &prod)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
-    return;
-  }
 #endif
 
   ready++;
-  while ((3 + NUM_STAGE1) != ready.load()) { /** spin **/ };
+  while ((3 + NUM_STAGE1 + NUM_DPI) != ready.load()) { /** spin **/ };
 
   while (!done) {
     // try to acquire a packet
@@ -300,45 +464,59 @@ void stage2correct(int desired_core) {
 #endif
 
     if (cnt) { // pkts has valid pointers
+      const uint64_t now = rdtsc();
       cnt_sum += cnt;
+#ifdef CORRECT_READ
+      const uint64_t valid = tcp_valid_bulk(pkts, cnt);
+#endif
       // process header information
-      num_correct += cnt;
       for (uint64_t i = 0; cnt > i; ++i) {
+        const uint64_t ingress = packet_meta(pkts[i])->ingress;
+        path_latency.add(now - ingress);
+#ifdef TELEMETRY
+        const uint64_t *stamps = packet_stamps(pkts[i]);
+        path_segments[SEG_STAGE0].add(stamps[STAMP_STAGE0] - ingress);
+        path_segments[SEG_Q01].add(stamps[STAMP_STAGE1_IN] -
+                                   stamps[STAMP_STAGE0]);
+        path_segments[SEG_STAGE1].add(stamps[STAMP_STAGE1_OUT] -
+                                      stamps[STAMP_STAGE1_IN]);
+        path_segments[SEG_Q12].add(now - stamps[STAMP_STAGE1_OUT]);
+#endif
 #ifdef CORRECT_READ
-        if (pkts[i]->tcpheader.data.checksumTCP !=
-            (pkts[i]->tcpheader.data.srcPort ^
-             pkts[i]->tcpheader.data.dstPort)) {
+        if (!((valid >> i) & 1)) {
           corrupted++;
         }
 #endif
 #ifdef CORRECT_WRITE
-        pkts[i]->tcpheader.data.checksumTCP = (uint16_t)corrupted;
+        tcp_set_window(pkts[i], std::min<uint16_t>(
+            pkts[i]->tcpheader.data.winSize, TCP_WINDOW_CLAMP));
 #endif
 #ifdef CAF_PREPUSH
         caf_prepush((void*)pkts[i], HEADER_SIZE);
 #endif
       }
 
-      // after processing, propogate the packet to the next stage
-#ifdef VL
-      line_vl_push_weak(&prod, (uint8_t*)pkts, cnt * sizeof(Packet*));
-#elif CAF
-      uint64_t i = 0; // sucessufully pushed count
-      do {
-        i += caf_push_bulk(&prod, (uint64_t*)&pkts[i], cnt - i);
-      } while (i < cnt);
-#endif
+      // after processing, give the packets back to the pool
+      pool->put_bulk(LCORE_CORRECT, pkts, cnt);
+      num_correct.store(cnt_sum, std::memory_order_release);
+      ctr.popped(cnt);
+      busy++;
       continue;
     }
 
+    idle++;
     done = lock.done;
-#ifdef VL
-    line_vl_push_non(&prod, (uint8_t*)pkts, 0); // help flushing
-#endif
+    pool->flush(LCORE_CORRECT); // stage 0 may be short of packets
   }
 
-  num_correct = cnt_sum;
-
+  ctr.busy = busy;
+  ctr.idle = idle;
+  latency[0] = path_latency;
+#ifdef TELEMETRY
+  for (int s = 0; NUM_SEGMENTS > s; ++s) {
+    segments[0][s] = path_segments[s];
+  }
+#endif
 }
 
 void stage2mistake(int desired_core) {
@@ -348,6 +526,12 @@ void stage2mistake(int desired_core) {
   uint64_t corrupted = 0;
   size_t cnt = 0;
   size_t cnt_sum = 0;
+  uint64_t busy = 0, idle = 0; // polls
+  StageCounters &ctr = stage2_ctr[1];
+  Histogram path_latency;
+#ifdef TELEMETRY
+  Histogram path_segments[NUM_SEGMENTS];
+#endif
   bool done = false;
   Packet *pkts[BULK_SIZE] = { NULL };
 
@@ -356,33 +540,25 @@ void stage2mistake(int desired_core) {
   corrupted = corrupted;
 
 #ifdef VL
-  vlendpt_t cons, prod;
+  vlendpt_t cons;
   // open endpoints
   if (open_byte_vl_as_consumer(q1m, &cons, 1)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
-  if (open_byte_vl_as_producer(qp0, &prod, 1)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
-    return;
-  }
   const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
   uint8_t *pktsbyte = (uint8_t*)pkts;
 #elif CAF
-  cafendpt_t cons, prod;
+  cafendpt_t cons;
   // open endpoints
   if (open_caf(q1m, &cons)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
-  if (open_caf(qp0, &prod)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
-    return;
-  }
 #endif
 
   ready++;
-  while ((3 + NUM_STAGE1) != ready.load()) { /** spin **/ };
+  while ((3 + NUM_STAGE1 + NUM_DPI) != ready.load()) { /** spin **/ };
 
   while (!done) {
     // try to acquire a packet
@@ -400,44 +576,59 @@ void stage2mistake(int desired_core) {
 #endif
 
     if (cnt) { // pkts has valid pointers
+      const uint64_t now = rdtsc();
       cnt_sum += cnt;
+#ifdef MISTAKE_READ
+      const uint64_t valid = tcp_valid_bulk(pkts, cnt);
+#endif
       // process header information
       for (uint64_t i = 0; cnt > i; ++i) {
+        const uint64_t ingress = packet_meta(pkts[i])->ingress;
+        path_latency.add(now - ingress);
+#ifdef TELEMETRY
+        const uint64_t *stamps = packet_stamps(pkts[i]);
+        path_segments[SEG_STAGE0].add(stamps[STAMP_STAGE0] - ingress);
+        path_segments[SEG_Q01].add(stamps[STAMP_STAGE1_IN] -
+                                   stamps[STAMP_STAGE0]);
+        path_segments[SEG_STAGE1].add(stamps[STAMP_STAGE1_OUT] -
+                                      stamps[STAMP_STAGE1_IN]);
+        path_segments[SEG_Q12].add(now - stamps[STAMP_STAGE1_OUT]);
+#endif
 #ifdef MISTAKE_READ
-        if (pkts[i]->tcpheader.data.checksumTCP !=
-            (pkts[i]->tcpheader.data.srcPort ^
-             pkts[i]->tcpheader.data.dstPort)) {
+        if (!((valid >> i) & 1)) {
           corrupted++;
         }
 #endif
 #ifdef MISTAKE_WRITE
-        pkts[i]->tcpheader.data.checksumTCP = (uint16_t)corrupted;
+        tcp_set_window(pkts[i], std::min<uint16_t>(
+            pkts[i]->tcpheader.data.winSize, TCP_WINDOW_CLAMP));
 #endif
 #ifdef CAF_PREPUSH
         caf_prepush((void*)pkts[i], HEADER_SIZE);
 #endif
       }
 
-      // after processing, propogate the packet to the next stage
-#ifdef VL
-      line_vl_push_weak(&prod, (uint8_t*)pkts, cnt * sizeof(Packet*));
-#elif CAF
-      uint64_t i = 0; // sucessufully pushed count
-      do {
-        i += caf_push_bulk(&prod, (uint64_t*)&pkts[i], cnt - i);
-      } while (i < cnt);
-#endif
+      // after processing, give the packets back to the pool
+      pool->put_bulk(LCORE_MISTAKE, pkts, cnt);
+      num_mistake.store(cnt_sum, std::memory_order_release);
+      ctr.popped(cnt);
+      busy++;
       continue;
     }
 
+    idle++;
     done = lock.done;
-#ifdef VL
-    line_vl_push_non(&prod, (uint8_t*)pkts, 0); // help flushing
-#endif
+    pool->flush(LCORE_MISTAKE); // stage 0 may be short of packets
   }
 
-  num_mistake = cnt_sum;
-
+  ctr.busy = busy;
+  ctr.idle = idle;
+  latency[1] = path_latency;
+#ifdef TELEMETRY
+  for (int s = 0; NUM_SEGMENTS > s; ++s) {
+    segments[1][s] = path_segments[s];
+  }
+#endif
 }
 
 int main(int argc, char *argv[]) {
@@ -446,14 +637,88 @@ int main(int argc, char *argv[]) {
 
   int core_id = 1;
   size_t cnt = 0;
+  uint64_t dropped = 0; // open loop, no buffer when it was due
+  uint64_t busy = 0, idle = 0; // polls of stage 0
   Packet *pkts[BULK_SIZE] = { NULL };
-
+#ifdef TELEMETRY
+  // packets in each queue, sampled every TELEMETRY_SAMPLE polls of stage 0:
+  // q01, q1c, q1m, then q1d with DPI workers
+  Histogram depths[4];
+  uint64_t polls = 0;
+#endif
+
+  TrafficConfig traffic;
+  traffic.malformed = 0.125;
+#if 0 < NUM_DPI
+  DpiConfig dpi;
+  traffic.infected = 0.01;
+  argc = parse_dpi_args(argc, argv, dpi);
+  if (0 > argc) {
+    return -1;
+  }
+#endif
+  argc = parse_traffic_args(argc, argv, traffic);
+  if (0 > argc) {
+    return -1;
+  }
   if (1 < argc) {
     num_packets = atoi(argv[1]);
   }
   printf("%s 1-%d-1-1 %d bulk %lu pkts %d pool\n",
          argv[0], NUM_STAGE1, BULK_SIZE, num_packets, POOL_SIZE);
 
+  // rules: a ClassBench filter file, or the number of rules to generate
+  const char *rule_arg = (2 < argc) ? argv[2] : NULL;
+  const char *classifier_name = (3 < argc) ? argv[3] : "tuple";
+  if (NULL == rule_arg || 0 < atoi(rule_arg)) {
+    gen_rules(rule_arg ? atoi(rule_arg) : NUM_RULES, 1, rules);
+  } else if (!load_rules(rule_arg, rules)) {
+    printf("\033[91mFAILED:\033[0m cannot read rules from %s\n", rule_arg);
+    return -1;
+  }
+  gen_trace(rules, traffic.flows, 2, trace);
+  classifier = make_classifier(classifier_name, rules);
+  if (nullptr == classifier) {
+    printf("\033[91mFAILED:\033[0m unknown classifier %s, "
+           "use linear, tuple or bitvector\n", classifier_name);
+    return -1;
+  }
+  printf("%lu rules %s classifier\n", rules.size(), classifier->name());
+#if 0 < NUM_DPI
+  // signatures: a file of them, or the number to generate
+  std::vector<std::string> signatures;
+  if (NULL == dpi.signatures || 0 < atoi(dpi.signatures)) {
+    gen_signatures(dpi.signatures ? atoi(dpi.signatures) : NUM_SIGNATURES, 1,
+                   signatures);
+  } else if (!load_signatures(dpi.signatures, signatures)) {
+    printf("\033[91mFAILED:\033[0m cannot read signatures from %s\n",
+           dpi.signatures);
+    return -1;
+  }
+  matcher = make_matcher(dpi.matcher, signatures);
+  if (nullptr == matcher) {
+    printf("\033[91mFAILED:\033[0m unknown matcher %s, use ac or teddy\n",
+           dpi.matcher);
+    return -1;
+  }
+  printf("%d dpi worker(s), %lu signatures %s matcher\n",
+         NUM_DPI, signatures.size(), matcher->name());
+  traffic.signatures = &signatures;
+#endif
+  source = make_traffic(traffic, trace, 1);
+  if (NULL == source) {
+    printf("\033[91mFAILED:\033[0m cannot replay %s\n", traffic.pcap);
+    return -1;
+  }
+  source->print();
+  Pacer pace(traffic.rate);
+  pacer = &pace;
+  if (pacer->open_loop()) {
+    printf("open loop at %.3f Mpps\n", traffic.rate);
+  } else {
+    printf("closed loop\n");
+  }
+
 #ifdef VL
   q01 = mkvl();
   if (0 > q01) {
@@ -470,116 +735,131 @@ int main(int argc, char *argv[]) {
     printf("\033[91mFAILED:\033[0m q1m = mkvl() return %d\n", q1m);
     return -1;
   }
-  qp0 = mkvl();
-  if (0 > qp0) {
-    printf("\033[91mFAILED:\033[0m qp0 = mkvl() return %d\n", qp0);
+#if 0 < NUM_DPI
+  q1d = mkvl();
+  if (0 > q1d) {
+    printf("\033[91mFAILED:\033[0m q1d = mkvl() return %d\n", q1d);
     return -1;
   }
+#endif
   // open endpoints
-  vlendpt_t cons, prod;
-  if (open_byte_vl_as_consumer(qp0, &cons, 1)) {
-    printf("\033[91mFAILED:\033[0m %s(), cons\n", __func__);
-    return -1;
-  }
+  vlendpt_t prod;
   if (open_byte_vl_as_producer(q01, &prod, 1)) {
     printf("\033[91mFAILED:\033[0m %s(), prod\n", __func__);
     return -1;
   }
-  const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
-  uint8_t *pktsbyte = (uint8_t*)pkts;
 #elif CAF
-  cafendpt_t cons, prod;
-  if (open_caf(qp0, &cons)) {
-    printf("\033[91mFAILED:\033[0m %s(), cons\n", __func__);
-    return -1;
-  }
+  cafendpt_t prod;
   if (open_caf(q01, &prod)) {
     printf("\033[91mFAILED:\033[0m %s(), prod\n", __func__);
     return -1;
   }
-  cnt = cnt;
 #endif
 
+  // POOL_SIZE 2KB memory blocks and their headers, on the node of stage 0
+  Mempool mempool(POOL_SIZE, MEMPOOL_CACHE_SIZE, NUM_LCORES, core_node(0));
+  pool = &mempool;
+
   ready = 0;
   std::vector<thread> slave_threads;
   for (int i = 0; NUM_STAGE1 > i; ++i) {
-    slave_threads.push_back(thread(stage1, core_id++));
+    slave_threads.push_back(thread(stage1, core_id++, i));
+  }
+#if 0 < NUM_DPI
+  for (int i = 0; NUM_DPI > i; ++i) {
+    slave_threads.push_back(thread(stage_dpi, core_id++, i));
   }
+#endif
   slave_threads.push_back(thread(stage2correct, core_id++));
   slave_threads.push_back(thread(stage2mistake, core_id++));
 
-  void *mempool = malloc(POOL_SIZE << 11); // POOL_SIZE 2KB memory blocks
-  void *headerpool = malloc(POOL_SIZE * HEADER_SIZE);
-
-  // add allocated memory blocks into pool
-  for (int i = 0; POOL_SIZE > i;) {
+  // closed loop injects the whole pool, stage 0 then only gets packets back
+  // from stage 2
+  for (int i = 0; !pacer->open_loop() && POOL_SIZE > i;) {
     size_t j = 0;
-    while (BULK_SIZE > j && POOL_SIZE > i) {
-      pkts[j] = (Packet*)((uint64_t)headerpool + ((i + j) * HEADER_SIZE));
-      pkts[j]->payload = (void*)((uint64_t)mempool + ((i + j) << 11));
-      pkts[j]->ipheader.data.srcIP = (uint16_t)i;
-      pkts[j]->ipheader.data.dstIP = (uint16_t)j;
-      pkts[j]->ipheader.data.checksumIP =
-        (0 == (i + j) % 8) ? i ^ (j + 1) : i ^ j;
-      pkts[j]->tcpheader.data.srcPort = (uint16_t)num_packets;
-      pkts[j]->tcpheader.data.dstPort = (uint16_t)num_packets;
-      pkts[j]->tcpheader.data.checksumTCP =
-        pkts[j]->tcpheader.data.srcPort ^ pkts[j]->tcpheader.data.dstPort;
+    cnt = (POOL_SIZE - i < BULK_SIZE) ? POOL_SIZE - i : BULK_SIZE;
+    if (!pool->get_bulk(LCORE_STAGE0, pkts, cnt)) {
+      printf("\033[91mFAILED:\033[0m %s(), pool\n", __func__);
+      return -1;
+    }
+    while (cnt > j) {
+      source->next(pkts[j]);
+      packet_meta(pkts[j])->ingress = rdtsc();
 #ifdef CAF_PREPUSH
       caf_prepush((void*)pkts[j], HEADER_SIZE);
 #endif
       j++;
     }
+    stamp_pkts(pkts, j, STAMP_STAGE0);
 #ifdef VL
     line_vl_push_strong(&prod, (uint8_t*)pkts, sizeof(Packet*) * j);
 #elif CAF
     assert(j == caf_push_bulk(&prod, (uint64_t*)pkts, j));
 #endif
+    stage0_ctr.pushed(j);
     i += j;
   }
 
-  while ((2 + NUM_STAGE1) != ready.load()) { /** spin **/ };
+  while ((2 + NUM_STAGE1 + NUM_DPI) != ready.load()) { /** spin **/ };
   ready++;
 
   const uint64_t beg_tsc = rdtsc();
   const auto beg(high_resolution_clock::now());
+  pacer->start();
 
 #ifndef NOGEM5
   m5_reset_stats(0, 0);
 #endif
 
   for (uint64_t i = 0; num_packets > i;) {
-    // try to acquire a packet
-#ifdef VL
-    cnt = bulk_size;
-    line_vl_pop_non(&cons, (uint8_t*)pkts, &cnt);
-    for (uint64_t j = 0; cnt < bulk_size && BULK_SIZE > j; ++j) {
-      size_t tmp = bulk_size - cnt;
-      line_vl_pop_non(&cons, &pktsbyte[cnt], &tmp);
-      cnt += tmp;
-    }
-    cnt /= sizeof(Packet*);
-#elif CAF
-    cnt = caf_pop_bulk(&cons, (uint64_t*)pkts, BULK_SIZE);
-    if (cnt < BULK_SIZE) {
-        cnt += caf_pop_bulk(&cons, (uint64_t*)&pkts[cnt], BULK_SIZE - cnt);
+#ifdef TELEMETRY
+    if (0 == ++polls % TELEMETRY_SAMPLE) {
+      // consumers first, see queue_depth()
+      const uint64_t inm = stage2_ctr[1].in.load(std::memory_order_relaxed);
+      const uint64_t inc = stage2_ctr[0].in.load(std::memory_order_relaxed);
+#if 0 < NUM_DPI
+      const uint64_t ind = sum_in(dpi_ctr, NUM_DPI);
+#endif
+      const uint64_t in1 = sum_in(stage1_ctr, NUM_STAGE1);
+      depths[0].add(queue_depth(stage0_ctr.out[0].load(), in1));
+#if 0 < NUM_DPI
+      depths[3].add(queue_depth(sum_out(stage1_ctr, NUM_STAGE1, 0), ind));
+      depths[1].add(queue_depth(sum_out(dpi_ctr, NUM_DPI, 0), inc));
+      depths[2].add(queue_depth(sum_out(stage1_ctr, NUM_STAGE1, 1) +
+                                sum_out(dpi_ctr, NUM_DPI, 1), inm));
+#else
+      depths[1].add(queue_depth(sum_out(stage1_ctr, NUM_STAGE1, 0), inc));
+      depths[2].add(queue_depth(sum_out(stage1_ctr, NUM_STAGE1, 1), inm));
+#endif
     }
 #endif
+    // closed loop sends a bulk whenever there are buffers, open loop only
+    // the packets due by now
+    cnt = BULK_SIZE;
+    if (pacer->open_loop()) {
+      const uint64_t due = pacer->due();
+      if (due <= i) {
+#ifdef VL
+        line_vl_push_non(&prod, (uint8_t*)pkts, 0); // help flushing
+#endif
+        idle++;
+        continue;
+      }
+      cnt = (due - i < cnt) ? due - i : cnt;
+    }
 
-    if (cnt) { // valid packets pointers in pkts
+    // try to acquire a packet
+    if (pool->get_bulk(LCORE_STAGE0, pkts, cnt)) { // valid packets pointers
+      const uint64_t now = rdtsc();
       for (uint64_t j = 0; cnt > j; ++j) {
-        pkts[j]->ipheader.data.srcIP = (uint16_t)i;
-        pkts[j]->ipheader.data.dstIP = (uint16_t)j;
-        pkts[j]->ipheader.data.checksumIP =
-          (0 == (i + j) % 8) ? i ^ (j + 1) : i ^ j;
-        pkts[j]->tcpheader.data.srcPort = (uint16_t)num_packets;
-        pkts[j]->tcpheader.data.dstPort = (uint16_t)num_packets;
-        pkts[j]->tcpheader.data.checksumTCP =
-          pkts[j]->tcpheader.data.srcPort ^ pkts[j]->tcpheader.data.dstPort;
+        source->next(pkts[j]);
+        packet_meta(pkts[j])->ingress =
+          pacer->open_loop() ? pacer->when(i + j) : now;
 #ifdef CAF_PREPUSH
         caf_prepush((void*)pkts[j], HEADER_SIZE);
 #endif
       }
+      stamp_pkts(pkts, cnt, STAMP_STAGE0);
 #ifdef VL
       line_vl_push_weak(&prod, (uint8_t*)pkts, cnt * sizeof(Packet*));
 #elif CAF
@@ -588,14 +868,23 @@ int main(int argc, char *argv[]) {
         j += caf_push_bulk(&prod, (uint64_t*)&pkts[j], cnt - j);
       } while (j < cnt);
 #endif
+      stage0_ctr.pushed(cnt);
+      busy++;
       i += cnt;
       continue;
     }
 
+    if (pacer->open_loop()) { // out of buffers, as a NIC we drop them
+      dropped += cnt;
+      i += cnt;
+    }
 #ifdef VL
     line_vl_push_non(&prod, (uint8_t*)pkts, 0); // help flushing
 #endif
+    idle++;
   }
+  stage0_ctr.busy = busy;
+  stage0_ctr.idle = idle;
 
   lock.done = true;
 
@@ -610,13 +899,53 @@ int main(int argc, char *argv[]) {
   std::cout << (end_tsc - beg_tsc) << " ticks elapsed\n";
   std::cout << elapsed.count() << " ns elapsed\n";
 
-  for (int i = 0; (2 + NUM_STAGE1) > i; ++i) {
+  for (int i = 0; (2 + NUM_STAGE1 + NUM_DPI) > i; ++i) {
     slave_threads[i].join();
   }
 
   std::cout << num_correct << " correct packet(s) and " <<
-      num_mistake << " corrupted packet(s)\n";
+      num_mistake << " corrupted or denied packet(s)\n";
+  std::cout << dropped << " packet(s) dropped at stage 0\n";
+#if 0 < NUM_DPI
+  std::cout << dpi_infected << " packet(s) carrying a signature at dpi\n";
+#endif
+  const char *path_names[2] = { "correct", "mistake" };
+  for (int p = 0; 2 > p; ++p) {
+    printf("%s latency from ingress\n", path_names[p]);
+    latency[p].print("end-to-end", tsc_per_ns(), "ns");
+#ifdef TELEMETRY
+    for (int s = 0; NUM_SEGMENTS > s; ++s) {
+      segments[p][s].print(segment_names[p][s], tsc_per_ns(), "ns");
+    }
+#endif
+  }
+#ifdef TELEMETRY
+  printf("queue depth\n");
+  depths[0].print("q01", 1, "pkts");
+#if 0 < NUM_DPI
+  depths[3].print("q1d", 1, "pkts");
+#endif
+  depths[1].print("q1c", 1, "pkts");
+  depths[2].print("q1m", 1, "pkts");
+#endif
+  printf("polls\n");
+  stage0_ctr.print("stage 0", 0);
+  for (int i = 0; NUM_STAGE1 > i; ++i) {
+    stage1_ctr[i].print("stage 1", i);
+  }
+#if 0 < NUM_DPI
+  for (int i = 0; NUM_DPI > i; ++i) {
+    dpi_ctr[i].print("dpi", i);
+  }
+#endif
+  stage2_ctr[0].print("correct", 0);
+  stage2_ctr[1].print("mistake", 0);
+  pool->print_stats();
 
-  free(mempool);
+  delete source;
+  delete classifier;
+#if 0 < NUM_DPI
+  delete matcher;
+#endif
   return 0;
 }
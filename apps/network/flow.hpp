@@ -0,0 +1,189 @@
+#ifndef _NETWORK_FLOW_HPP__
+#define _NETWORK_FLOW_HPP__
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "utils.hpp"
+
+#ifndef NUM_FLOWS
+#define NUM_FLOWS 1024
+#endif
+
+// Shards of the flow table shared by all stage 1 workers
+#ifndef FLOW_SHARDS
+#define FLOW_SHARDS 64
+#endif
+
+// The default Microsoft RSS key, also used by most NIC drivers
+static const uint8_t rss_key[40] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+  0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+  0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+  0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+  0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+// Toeplitz hash over srcIP, dstIP, srcPort, dstPort in network order, as
+// RSS hashes TCP/IPv4: every set input bit XORs in the 32-bit window of
+// the key starting at that bit.
+static inline uint32_t toeplitz_hash(const FiveTuple &t) {
+  uint8_t input[12];
+  uint32_t hash = 0;
+  uint64_t window = 0;
+  input[0] = t.srcIP >> 24;
+  input[1] = t.srcIP >> 16;
+  input[2] = t.srcIP >> 8;
+  input[3] = t.srcIP;
+  input[4] = t.dstIP >> 24;
+  input[5] = t.dstIP >> 16;
+  input[6] = t.dstIP >> 8;
+  input[7] = t.dstIP;
+  input[8] = t.srcPort >> 8;
+  input[9] = t.srcPort;
+  input[10] = t.dstPort >> 8;
+  input[11] = t.dstPort;
+  for (int i = 0; 8 > i; ++i) {
+    window = (window << 8) | rss_key[i];
+  }
+  for (int i = 0; 12 > i; ++i) {
+    for (int b = 7; 0 <= b; --b) {
+      if (input[i] & (1 << b)) {
+        hash ^= (uint32_t)(window >> (25 + b));
+      }
+    }
+    window = (window << 8) | rss_key[i + 8];
+  }
+  return hash;
+}
+
+static inline uint32_t crc32c_u32(uint32_t crc, uint32_t v) {
+#ifdef __SSE4_2__
+  return _mm_crc32_u32(crc, v);
+#else
+  crc ^= v;
+  for (int i = 0; 32 > i; ++i) {
+    crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+  }
+  return crc;
+#endif
+}
+
+// CRC32C of the 5-tuple, the hash of software dispatchers such as OVS
+static inline uint32_t crc32c_hash(const FiveTuple &t) {
+  uint32_t crc = ~0U;
+  crc = crc32c_u32(crc, t.srcIP);
+  crc = crc32c_u32(crc, t.dstIP);
+  crc = crc32c_u32(crc, ((uint32_t)t.srcPort << 16) | t.dstPort);
+  crc = crc32c_u32(crc, t.protocol);
+  return ~crc;
+}
+
+static inline uint32_t rss_hash(const FiveTuple &t) {
+#ifdef RSS_CRC32C
+  return crc32c_hash(t);
+#else
+  return toeplitz_hash(t);
+#endif
+}
+
+// Connection-tracking style state of one flow
+struct FlowState {
+  FiveTuple key;
+  bool used;
+  uint32_t lastSeq;
+  uint64_t pkts;
+  uint64_t reordered; // packets seen after a later one of the same flow
+};
+
+// Open-addressing table of flows keyed by the 5-tuple, indexed with the
+// RSS hash. Never shrinks; sized for twice the expected flows.
+class FlowTable {
+ public:
+  FlowTable(uint32_t nflows) {
+    mask = 1;
+    while (mask < 2 * nflows) {
+      mask <<= 1;
+    }
+    flows = new FlowState[mask];
+    memset((void*)flows, 0, mask * sizeof(FlowState));
+    mask--;
+    size = 0;
+  }
+  ~FlowTable() { delete[] flows; }
+
+  // Find the flow, inserting it if new; NULL if the table is full
+  FlowState *lookup(const FiveTuple &t, uint32_t hash) {
+    for (uint32_t i = 0, h = hash & mask; mask >= i; ++i, h = (h + 1) & mask) {
+      FlowState *f = &flows[h];
+      if (!f->used) {
+        f->key = t;
+        f->used = true;
+        size++;
+        return f;
+      }
+      if (f->key.srcIP == t.srcIP && f->key.dstIP == t.dstIP &&
+          f->key.srcPort == t.srcPort && f->key.dstPort == t.dstPort &&
+          f->key.protocol == t.protocol) {
+        return f;
+      }
+    }
+    return NULL;
+  }
+
+  // Account a packet of seq to flow f, true if it came out of order
+  static inline bool update(FlowState *f, uint32_t seq) {
+    const bool reordered = seq < f->lastSeq;
+    if (reordered) {
+      f->reordered++;
+    } else {
+      f->lastSeq = seq;
+    }
+    f->pkts++;
+    return reordered;
+  }
+
+  uint32_t size;
+ private:
+  FlowState *flows;
+  uint32_t mask;
+};
+
+// The same table shared by all workers, split into shards by hash, each
+// under its own spinlock, as a shared connection tracker would be.
+class SharedFlowTable {
+ public:
+  SharedFlowTable(uint32_t nflows) {
+    for (int i = 0; FLOW_SHARDS > i; ++i) {
+      shards[i].table = new FlowTable(nflows / FLOW_SHARDS + 1);
+      shards[i].lock.clear();
+    }
+  }
+  ~SharedFlowTable() {
+    for (int i = 0; FLOW_SHARDS > i; ++i) {
+      delete shards[i].table;
+    }
+  }
+
+  bool update(const FiveTuple &t, uint32_t hash, uint32_t seq) {
+    // the low bits index within a shard, use the high ones to pick it
+    Shard &s = shards[(hash >> 24) % FLOW_SHARDS];
+    while (s.lock.test_and_set(std::memory_order_acquire)) { /** spin **/ };
+    FlowState *f = s.table->lookup(t, hash);
+    const bool reordered = f && FlowTable::update(f, seq);
+    s.lock.clear(std::memory_order_release);
+    return reordered;
+  }
+ private:
+  struct Shard {
+    std::atomic_flag lock;
+    FlowTable *table;
+  } __attribute__((aligned(64)));
+  Shard shards[FLOW_SHARDS];
+};
+
+#endif // end of ifndef _NETWORK_FLOW_HPP__
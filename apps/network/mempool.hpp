@@ -0,0 +1,236 @@
+#ifndef _NETWORK_MEMPOOL_HPP__
+#define _NETWORK_MEMPOOL_HPP__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#ifdef NUMA_AVAILABLE
+#include <numa.h>
+#endif
+
+#include "utils.hpp"
+
+// Packets an lcore keeps for itself before going to the shared ring
+#ifndef MEMPOOL_CACHE_SIZE
+#define MEMPOOL_CACHE_SIZE 16
+#endif
+
+#define MEMPOOL_CACHE_MAX 512
+
+// Lock-free multi-producer multi-consumer ring of packet pointers in the
+// style of rte_ring: a producer claims slots by moving prod.head with a
+// CAS, fills them, then publishes in claim order by moving prod.tail; the
+// consumer side mirrors it. Bulk operations move all n or nothing.
+class PacketRing {
+ public:
+  PacketRing(uint32_t count) {
+    size = 1;
+    while (size < count) {
+      size <<= 1;
+    }
+    mask = size - 1;
+    slots = new Packet*[size];
+    prod.head = prod.tail = 0;
+    cons.head = cons.tail = 0;
+  }
+  ~PacketRing() { delete[] slots; }
+
+  bool enqueue_bulk(Packet **pkts, uint32_t n) {
+    uint32_t head = prod.head.load(std::memory_order_relaxed);
+    do {
+      if (size - (head - cons.tail.load(std::memory_order_acquire)) < n) {
+        return false;
+      }
+    } while (!prod.head.compare_exchange_weak(head, head + n,
+                                              std::memory_order_relaxed));
+    for (uint32_t i = 0; n > i; ++i) {
+      slots[(head + i) & mask] = pkts[i];
+    }
+    // wait for the producers that claimed earlier slots
+    while (head != prod.tail.load(std::memory_order_relaxed)) { /** spin **/ };
+    prod.tail.store(head + n, std::memory_order_release);
+    return true;
+  }
+
+  bool dequeue_bulk(Packet **pkts, uint32_t n) {
+    uint32_t head = cons.head.load(std::memory_order_relaxed);
+    do {
+      if (prod.tail.load(std::memory_order_acquire) - head < n) {
+        return false;
+      }
+    } while (!cons.head.compare_exchange_weak(head, head + n,
+                                              std::memory_order_relaxed));
+    for (uint32_t i = 0; n > i; ++i) {
+      pkts[i] = slots[(head + i) & mask];
+    }
+    while (head != cons.tail.load(std::memory_order_relaxed)) { /** spin **/ };
+    cons.tail.store(head + n, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  struct HeadTail {
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+  } __attribute__((aligned(64)));
+  HeadTail prod;
+  HeadTail cons;
+  Packet **slots;
+  uint32_t size;
+  uint32_t mask;
+};
+
+// DPDK-style pool of packet buffers (rte_mempool): a shared ring of free
+// packets fronted by a cache per lcore. An lcore gets and puts packets in
+// its own cache and only touches the ring in bulk, to refill the cache
+// when it runs dry or flush the excess once it grows past 1.5x its size.
+// Headers and payloads are allocated on the NUMA node given, that of the
+// lcores using the pool.
+class Mempool {
+ public:
+  Mempool(uint32_t count, uint32_t cache_size, int nlcores, int node)
+      : ring(count), count(count), nlcores(nlcores), node(node) {
+    if (MEMPOOL_CACHE_MAX < cache_size) {
+      cache_size = MEMPOOL_CACHE_MAX;
+    }
+    size = cache_size;
+    flushthresh = cache_size + cache_size / 2;
+    caches = (Cache*)alloc(nlcores * sizeof(Cache));
+    memset((void*)caches, 0, nlcores * sizeof(Cache));
+
+    headers = alloc(count * HEADER_SIZE);
+    payloads = alloc((size_t)count << 11); // 2KB memory blocks
+    for (uint32_t i = 0; count > i; ++i) {
+      Packet *pkt = (Packet*)((uint64_t)headers + (i * HEADER_SIZE));
+      pkt->payload = (void*)((uint64_t)payloads + ((uint64_t)i << 11));
+      ring.enqueue_bulk(&pkt, 1);
+    }
+  }
+  ~Mempool() {
+    release(headers, count * HEADER_SIZE);
+    release(payloads, (size_t)count << 11);
+    release(caches, nlcores * sizeof(Cache));
+  }
+
+  // Take n packets, all or none, through the cache of lcore
+  bool get_bulk(int lcore, Packet **pkts, uint32_t n) {
+    Cache &c = caches[lcore];
+    if (c.len < n) {
+      // refill to the cache size on top of the request, or at least n
+      if (ring.dequeue_bulk(&c.objs[c.len], n + size - c.len)) {
+        c.len += n + size - c.len;
+      } else if (ring.dequeue_bulk(&c.objs[c.len], n - c.len)) {
+        c.len = n;
+      } else {
+        c.misses++;
+        return false;
+      }
+      c.refills++;
+    }
+    // hand out the most recently put, the ones still warm in the cache
+    for (uint32_t i = 0; n > i; ++i) {
+      pkts[i] = c.objs[--c.len];
+    }
+    return true;
+  }
+
+  // Return n packets through the cache of lcore
+  void put_bulk(int lcore, Packet **pkts, uint32_t n) {
+    Cache &c = caches[lcore];
+    if (size < n) { // too many to cache, straight to the ring
+      while (!ring.enqueue_bulk(pkts, n)) { /** spin **/ };
+      return;
+    }
+    memcpy(&c.objs[c.len], pkts, n * sizeof(Packet*));
+    c.len += n;
+    if (flushthresh <= c.len) {
+      while (!ring.enqueue_bulk(&c.objs[size], c.len - size)) { /** spin **/ };
+      c.len = size;
+      c.flushes++;
+    }
+  }
+
+  // Give all the cached packets of lcore back to the ring, for an lcore
+  // going idle while others may be waiting for packets
+  void flush(int lcore) {
+    Cache &c = caches[lcore];
+    if (c.len) {
+      while (!ring.enqueue_bulk(c.objs, c.len)) { /** spin **/ };
+      c.len = 0;
+      c.flushes++;
+    }
+  }
+
+  void print_stats() const {
+    printf("mempool %u pkts node %d cache %u\n", count, node, size);
+    for (int i = 0; nlcores > i; ++i) {
+      printf("  lcore %d: %lu refill(s) %lu flush(es) %lu miss(es)\n", i,
+             caches[i].refills, caches[i].flushes, caches[i].misses);
+    }
+  }
+
+ private:
+  struct Cache {
+    uint32_t len;
+    uint64_t refills; // bulk dequeues from the ring
+    uint64_t flushes; // bulk enqueues to the ring
+    uint64_t misses; // gets the ring could not serve
+    // a put may land on a cache just under the flush threshold
+    Packet *objs[3 * MEMPOOL_CACHE_MAX];
+  } __attribute__((aligned(64)));
+
+  // every block of the pool is allocated up front, fail without one
+  void *alloc(size_t bytes) {
+    void *ptr = NULL;
+#ifdef NUMA_AVAILABLE
+    if (-1 != numa_available()) {
+      ptr = numa_alloc_onnode(bytes, node);
+    } else
+#endif
+    if (posix_memalign(&ptr, 64, bytes)) {
+      ptr = NULL;
+    }
+    if (NULL == ptr) {
+      printf("\033[91mFAILED:\033[0m cannot allocate %lu bytes for the mempool\n",
+             bytes);
+      exit(1);
+    }
+    return ptr;
+  }
+
+  void release(void *ptr, size_t bytes) {
+#ifdef NUMA_AVAILABLE
+    if (-1 != numa_available()) {
+      numa_free(ptr, bytes);
+      return;
+    }
+#endif
+    bytes = bytes;
+    free(ptr);
+  }
+
+  PacketRing ring;
+  Cache *caches;
+  void *headers;
+  void *payloads;
+  uint32_t count;
+  uint32_t size;
+  uint32_t flushthresh;
+  int nlcores;
+  int node;
+};
+
+// NUMA node of a core, 0 without libnuma
+static inline int core_node(int core) {
+#ifdef NUMA_AVAILABLE
+  if (-1 != numa_available()) {
+    return numa_node_of_cpu(core);
+  }
+#endif
+  core = core;
+  return 0;
+}
+
+#endif // end of ifndef _NETWORK_MEMPOOL_HPP__
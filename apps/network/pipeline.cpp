@@ -3,6 +3,7 @@
 #include <chrono>
 #include <atomic>
 #include <vector>
+#include <algorithm>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -11,6 +12,12 @@
 #include "threading.h"
 #include "timing.h"
 #include "utils.hpp"
+#include "flow.hpp"
+#include "checksum.hpp"
+#include "dpi.hpp"
+#include "mempool.hpp"
+#include "traffic.hpp"
+#include "telemetry.hpp"
 
 using std::thread;
 using std::chrono::high_resolution_clock;
@@ -27,14 +34,130 @@ using std::chrono::nanoseconds;
 #include "caf.h"
 #endif
 
-int q01 = 1; // id for the queue connecting stage 0 and stage 1, 1:N
-int q12 = 2; // id for the queue connecting stage 1 and stage 2, N:M
+#ifdef RSS_DISPATCH
+// one queue per stage 1, DPI and stage 2 worker, picked by the RSS hash of
+// the packet, so every packet of a flow goes through the same workers.
+// Only q01 is SPSC: every stage 1 worker pushes into each q1d, and every
+// stage 1 or DPI worker into each q12, so those stay MPSC with one consumer
+// each. VL and CAF queues take several producers, which is what this
+// benchmark measures, and a flow still has a single producer per queue, so
+// its packets stay in order without a queue per (producer, consumer) pair.
+#define NUM_Q01 NUM_STAGE1
+#define NUM_Q1D NUM_DPI
+#define NUM_Q12 NUM_STAGE2
+#else
+#define NUM_Q01 1
+#define NUM_Q1D 1
+#define NUM_Q12 1
+#endif
+
+int q01[NUM_Q01] = { 1 }; // id for the queue connecting stage 0 and stage 1, 1:N
+int q12[NUM_Q12] = { 2 }; // id for the queue connecting stage 1 and stage 2, N:M
 int q23 = 3; // id for the queue connecting stage 2 and stage 3, M:1
-int q30 = 4; // id for the queue connecting stage 3 and mempool, 1:1
+#if 0 < NUM_DPI
+// with DPI workers, stage 1 feeds them and they feed stage 2 through q12
+int q1d[NUM_Q1D]; // id for the queue connecting stage 1 and DPI, N:D
+#define Q1_OUT q1d
+#define NUM_Q1_OUT NUM_Q1D
+#else
+#define Q1_OUT q12
+#define NUM_Q1_OUT NUM_Q12
+#endif
 uint64_t num_packets = 16;
 
+// packet buffers, stage 3 puts them back and stage 0 gets them through the
+// cache of their lcore
+Mempool *pool;
+enum { LCORE_STAGE0, LCORE_STAGE3, NUM_LCORES };
+
 std::atomic<int> ready;
 
+// what stage 0 sends and when
+TrafficSource *source;
+Pacer *pacer;
+std::atomic<uint64_t> dropped(0); // open loop, no buffer when it was due
+
+#ifdef RSS_DISPATCH
+uint32_t worker_flows[NUM_STAGE1]; // flows seen by each stage 1 worker
+#else
+SharedFlowTable *shared_flows;
+#endif
+std::atomic<uint64_t> stage1_reordered(0);
+#if 0 < NUM_DPI
+Matcher *matcher;
+std::atomic<uint64_t> dpi_infected(0); // packets carrying a signature
+#endif
+
+// packets through and polls of every thread, see telemetry.hpp
+StageCounters stage0_ctr;
+StageCounters stage1_ctr[NUM_STAGE1];
+StageCounters stage2_ctr[NUM_STAGE2];
+#if 0 < NUM_DPI
+StageCounters dpi_ctr[NUM_DPI];
+#endif
+StageCounters sink_ctr;
+
+#ifdef VL
+typedef vlendpt_t endpt_t;
+#elif CAF
+typedef cafendpt_t endpt_t;
+#endif
+
+static inline void push_pkts(endpt_t *prod, Packet **pkts, size_t cnt) {
+#ifdef VL
+  line_vl_push_weak(prod, (uint8_t*)pkts, cnt * sizeof(Packet*));
+#elif CAF
+  uint64_t i = 0; // sucessufully pushed count
+  do {
+    i += caf_push_bulk(prod, (uint64_t*)&pkts[i], cnt - i);
+  } while (i < cnt);
+#endif
+}
+
+// Push the packets to the queue of their flow, hash modulo nqueues
+static inline void dispatch_pkts(endpt_t *prods, int nqueues,
+                                 Packet **pkts, size_t cnt) {
+  if (1 == nqueues) {
+    push_pkts(prods, pkts, cnt);
+    return;
+  }
+  // pick every queue before the first push: once pushed, a packet may go
+  // through the next stages and come back from the pool as another one
+  Packet *out[BULK_SIZE];
+  int qs[BULK_SIZE];
+  for (size_t i = 0; cnt > i; ++i) {
+    qs[i] = packet_meta(pkts[i])->hash % nqueues;
+  }
+  for (int q = 0; nqueues > q; ++q) {
+    size_t n = 0;
+    for (size_t i = 0; cnt > i; ++i) {
+      if (q == qs[i]) {
+        out[n++] = pkts[i];
+      }
+    }
+    if (n) {
+      push_pkts(&prods[q], out, n);
+    }
+  }
+}
+
+static inline void flush_pkts(endpt_t *prods, int nqueues, Packet **pkts) {
+#ifdef VL
+  for (int q = 0; nqueues > q; ++q) {
+    line_vl_push_non(&prods[q], (uint8_t*)pkts, 0); // help flushing
+  }
+#endif
+}
+
+// Flow f: distinct client addresses and ports towards a few servers
+static void flow_tuple(uint32_t f, FiveTuple *t) {
+  t->srcIP = 0x0A000000 | f; // 10.0.0.0/8
+  t->dstIP = 0xC0A80000 | (f % 251); // 192.168.0.0/16
+  t->srcPort = 1024 + f % 60000;
+  t->dstPort = 80;
+  t->protocol = 6; // TCP
+}
+
 union {
   bool done; // to tell other threads we are done, only stage 4 thread writes
   char pad[64];
@@ -44,119 +167,133 @@ void stage0(int desired_core) {
   setAffinity(desired_core);
 
   size_t cnt = 0;
+  uint64_t busy = 0, idle = 0; // polls
   Packet *pkts[BULK_SIZE] = { NULL };
 
+  endpt_t prods[NUM_Q01];
 #ifdef VL
-  vlendpt_t cons, prod;
   // open endpoints
-  if (open_byte_vl_as_consumer(q30, &cons, 1)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
-    return;
-  }
-  if (open_byte_vl_as_producer(q01, &prod, 1)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
-    return;
+  for (int q = 0; NUM_Q01 > q; ++q) {
+    if (open_byte_vl_as_producer(q01[q], &prods[q], 1)) {
+      printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
+      return;
+    }
   }
-  const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
 #elif CAF
-  cafendpt_t cons, prod;
   // open endpoints
-  if (open_caf(q30, &cons)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
-    return;
-  }
-  if (open_caf(q01, &prod)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
-    return;
+  for (int q = 0; NUM_Q01 > q; ++q) {
+    if (open_caf(q01[q], &prods[q])) {
+      printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
+      return;
+    }
   }
 #endif
 
   ready++;
-  while ((2 + NUM_STAGE1 + NUM_STAGE2) != ready.load()) { /** spin **/ };
+  while ((2 + NUM_STAGE1 + NUM_DPI + NUM_STAGE2) != ready.load()) { /** spin **/ };
+  pacer->start();
 
   for (uint64_t i = 0; num_packets > i;) {
-    // try to acquire packet header points from pool
-#ifdef VL
-    cnt = bulk_size;
-    line_vl_pop_non(&cons, (uint8_t*)pkts, &cnt);
-    cnt /= sizeof(Packet*);
-#elif CAF
-    cnt = caf_pop_bulk(&cons, (uint64_t*)pkts, BULK_SIZE);
-#endif
+    // closed loop sends a bulk whenever there are buffers, open loop only
+    // the packets due by now
+    cnt = (num_packets - i < BULK_SIZE) ? num_packets - i : BULK_SIZE;
+    if (pacer->open_loop()) {
+      const uint64_t due = pacer->due();
+      if (due <= i) {
+        flush_pkts(prods, NUM_Q01, pkts);
+        idle++;
+        continue;
+      }
+      cnt = (due - i < cnt) ? due - i : cnt;
+    }
 
-    if (cnt) { // pkts now have valid pointers
+    // try to acquire packet header points from pool
+    if (pool->get_bulk(LCORE_STAGE0, pkts, cnt)) { // pkts have valid pointers
+      const uint64_t now = rdtsc();
       for (uint64_t j = 0; cnt > j; ++j) {
-        pkts[j]->ipheader.data.srcIP = i + j;
-        pkts[j]->ipheader.data.dstIP = ~i;
-        pkts[j]->ipheader.data.checksumIP =
-          pkts[j]->ipheader.data.srcIP ^ pkts[j]->ipheader.data.dstIP;
-        pkts[j]->tcpheader.data.srcPort = (uint16_t)num_packets;
-        pkts[j]->tcpheader.data.dstPort = (uint16_t)num_packets;
-        pkts[j]->tcpheader.data.checksumTCP =
-          pkts[j]->tcpheader.data.srcPort ^ pkts[j]->tcpheader.data.dstPort;
+        source->next(pkts[j]);
+        packet_meta(pkts[j])->ingress =
+          pacer->open_loop() ? pacer->when(i + j) : now;
 #ifdef CAF_PREPUSH
         caf_prepush((void*)pkts[j], HEADER_SIZE);
 #endif
       }
-#ifdef VL
-      line_vl_push_weak(&prod, (uint8_t*)pkts, cnt * sizeof(Packet*));
-#elif CAF
-      uint64_t j = 0; // successfully pushed count
-      do {
-        j += caf_push_bulk(&prod, (uint64_t*)&pkts[j], cnt - j);
-      } while (j < cnt);
-#endif
+      stamp_pkts(pkts, cnt, STAMP_STAGE0);
+      dispatch_pkts(prods, NUM_Q01, pkts, cnt);
+      stage0_ctr.pushed(cnt);
+      busy++;
       i += cnt;
       continue;
     }
 
-#ifdef VL
-    line_vl_push_non(&prod, (uint8_t*)pkts, 0); // help flushing
-#endif
+    if (pacer->open_loop()) { // out of buffers, as a NIC we drop them
+      dropped += cnt;
+      i += cnt;
+    }
+    flush_pkts(prods, NUM_Q01, pkts);
+    idle++;
   }
 
+  stage0_ctr.busy = busy;
+  stage0_ctr.idle = idle;
+
 }
 
-void stage1(int desired_core) {
+void stage1(int desired_core, int worker) {
   setAffinity(desired_core);
 
   uint16_t checksum = 0;
   uint64_t corrupted = 0;
+  uint64_t reordered = 0;
+  uint64_t busy = 0, idle = 0; // polls
   size_t cnt = 0;
   bool done = false;
   Packet *pkts[BULK_SIZE] = { NULL };
+  FiveTuple t;
+  StageCounters &ctr = stage1_ctr[worker];
+#ifdef RSS_DISPATCH
+  // every flow of this worker is only ever seen here, no locking needed
+  FlowTable table(source->num_flows());
+  const int qid = worker;
+#else
+  const int qid = 0;
+  worker = worker;
+#endif
 
   // get rid of unused warning
   checksum = checksum;
   corrupted = corrupted;
 
+  endpt_t cons, prods[NUM_Q1_OUT];
 #ifdef VL
-  vlendpt_t cons, prod;
   // open endpoints
-  if (open_byte_vl_as_consumer(q01, &cons, 1)) {
+  if (open_byte_vl_as_consumer(q01[qid], &cons, 1)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
-  if (open_byte_vl_as_producer(q12, &prod, 1)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
-    return;
+  for (int q = 0; NUM_Q1_OUT > q; ++q) {
+    if (open_byte_vl_as_producer(Q1_OUT[q], &prods[q], 1)) {
+      printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
+      return;
+    }
   }
   const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
 #elif CAF
-  cafendpt_t cons, prod;
   // open endpoints
-  if (open_caf(q01, &cons)) {
+  if (open_caf(q01[qid], &cons)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
-  if (open_caf(q12, &prod)) {
-    printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
-    return;
+  for (int q = 0; NUM_Q1_OUT > q; ++q) {
+    if (open_caf(Q1_OUT[q], &prods[q])) {
+      printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
+      return;
+    }
   }
 #endif
 
   ready++;
-  while ((2 + NUM_STAGE1 + NUM_STAGE2) != ready.load()) { /** spin **/ };
+  while ((2 + NUM_STAGE1 + NUM_DPI + NUM_STAGE2) != ready.load()) { /** spin **/ };
 
   while (!done) {
     // try to acquire a packet
@@ -169,16 +306,34 @@ void stage1(int desired_core) {
 #endif
 
     if (cnt) { // pkts has valid pointers
+      stamp_pkts(pkts, cnt, STAMP_STAGE1_IN);
+      ctr.popped(cnt);
+      busy++;
+#ifdef STAGE1_READ
+      const uint64_t valid = ipv4_valid_bulk(pkts, cnt);
+#endif
       // process header information
       for (uint64_t i = 0; cnt > i; ++i) {
 #ifdef STAGE1_READ
-        if (pkts[i]->ipheader.data.checksumIP !=
-            (pkts[i]->ipheader.data.srcIP ^ pkts[i]->ipheader.data.dstIP)) {
+        if (!((valid >> i) & 1)) {
           corrupted++;
         }
 #endif
 #ifdef STAGE1_WRITE
-        pkts[i]->ipheader.data.checksumIP = (uint16_t)corrupted;
+        ipv4_dec_ttl(pkts[i]);
+#endif
+        // track the connection the packet belongs to
+        get_tuple(pkts[i], &t);
+#ifdef RSS_DISPATCH
+        FlowState *f = table.lookup(t, packet_meta(pkts[i])->hash);
+        if (f && FlowTable::update(f, packet_meta(pkts[i])->seq)) {
+          reordered++;
+        }
+#else
+        if (shared_flows->update(t, packet_meta(pkts[i])->hash,
+                                 packet_meta(pkts[i])->seq)) {
+          reordered++;
+        }
 #endif
 #ifdef CAF_PREPUSH
         caf_prepush((void*)pkts[i], HEADER_SIZE);
@@ -186,30 +341,131 @@ void stage1(int desired_core) {
       }
 
       // after processing, propogate the packet to the next stage
+      stamp_pkts(pkts, cnt, STAMP_STAGE1_OUT);
+      dispatch_pkts(prods, NUM_Q1_OUT, pkts, cnt);
+      ctr.pushed(cnt);
+      continue;
+    }
+
+    flush_pkts(prods, NUM_Q1_OUT, pkts);
+    idle++;
+    done = lock.done;
+  }
+
+  ctr.busy = busy;
+  ctr.idle = idle;
+  stage1_reordered += reordered;
+#ifdef RSS_DISPATCH
+  worker_flows[worker] = table.size;
+#endif
+}
+
+#if 0 < NUM_DPI
+// Scan the payloads against the signatures, passing every packet on
+void stage_dpi(int desired_core, int worker) {
+  setAffinity(desired_core);
+
+  uint64_t infected = 0;
+  uint64_t busy = 0, idle = 0; // polls
+  size_t cnt = 0;
+  bool done = false;
+  int results[BULK_SIZE]; // matching signature of each packet
+  Packet *pkts[BULK_SIZE] = { NULL };
+  StageCounters &ctr = dpi_ctr[worker];
+
+#ifdef RSS_DISPATCH
+  const int qid = worker;
+#else
+  const int qid = 0;
+#endif
+
+  endpt_t cons, prods[NUM_Q12];
 #ifdef VL
-      line_vl_push_weak(&prod, (uint8_t*)pkts, cnt * sizeof(Packet*));
+  // open endpoints
+  if (open_byte_vl_as_consumer(q1d[qid], &cons, 1)) {
+    printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
+    return;
+  }
+  for (int q = 0; NUM_Q12 > q; ++q) {
+    if (open_byte_vl_as_producer(q12[q], &prods[q], 1)) {
+      printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
+      return;
+    }
+  }
+  const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
 #elif CAF
-      uint64_t i = 0; // sucessufully pushed count
-      do {
-        i += caf_push_bulk(&prod, (uint64_t*)&pkts[i], cnt - i);
-      } while (i < cnt);
+  // open endpoints
+  if (open_caf(q1d[qid], &cons)) {
+    printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
+    return;
+  }
+  for (int q = 0; NUM_Q12 > q; ++q) {
+    if (open_caf(q12[q], &prods[q])) {
+      printf("\033[91mFAILED:\033[0m %s(), T%d prod\n", __func__, desired_core);
+      return;
+    }
+  }
+#endif
+
+  ready++;
+  while ((2 + NUM_STAGE1 + NUM_DPI + NUM_STAGE2) != ready.load()) { /** spin **/ };
+
+  while (!done) {
+    // try to acquire a packet
+#ifdef VL
+    cnt = bulk_size;
+    line_vl_pop_non(&cons, (uint8_t*)pkts, &cnt);
+    cnt /= sizeof(Packet*);
+#elif CAF
+    cnt = caf_pop_bulk(&cons, (uint64_t*)pkts, BULK_SIZE);
+#endif
+
+    if (cnt) { // pkts has valid pointers
+      ctr.popped(cnt);
+      busy++;
+      matcher->match_bulk(pkts, cnt, results);
+      for (uint64_t i = 0; cnt > i; ++i) {
+        if (0 <= results[i]) {
+          infected++;
+        }
+#ifdef CAF_PREPUSH
+        caf_prepush((void*)pkts[i], HEADER_SIZE);
 #endif
+      }
+
+      // after processing, propogate the packet to the next stage
+      dispatch_pkts(prods, NUM_Q12, pkts, cnt);
+      ctr.pushed(cnt);
       continue;
     }
 
+    flush_pkts(prods, NUM_Q12, pkts);
+    idle++;
     done = lock.done;
   }
 
+  ctr.busy = busy;
+  ctr.idle = idle;
+  dpi_infected += infected;
 }
+#endif
 
-void stage2(int desired_core) {
+void stage2(int desired_core, int worker) {
   setAffinity(desired_core);
 
   uint16_t checksum = 0;
   uint64_t corrupted = 0;
+  uint64_t busy = 0, idle = 0; // polls
   size_t cnt = 0;
   bool done = false;
   Packet *pkts[BULK_SIZE] = { NULL };
+  StageCounters &ctr = stage2_ctr[worker];
+
+#ifdef RSS_DISPATCH
+  const int qid = worker;
+#else
+  const int qid = 0;
+#endif
 
   // get rid of unused warning
   checksum = checksum;
@@ -218,7 +474,7 @@ void stage2(int desired_core) {
 #ifdef VL
   vlendpt_t cons, prod;
   // open endpoints
-  if (open_byte_vl_as_consumer(q12, &cons, 1)) {
+  if (open_byte_vl_as_consumer(q12[qid], &cons, 1)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
@@ -230,7 +486,7 @@ void stage2(int desired_core) {
 #elif CAF
   cafendpt_t cons, prod;
   // open endpoints
-  if (open_caf(q12, &cons)) {
+  if (open_caf(q12[qid], &cons)) {
     printf("\033[91mFAILED:\033[0m %s(), T%d cons\n", __func__, desired_core);
     return;
   }
@@ -241,7 +497,7 @@ void stage2(int desired_core) {
 #endif
 
   ready++;
-  while ((2 + NUM_STAGE1 + NUM_STAGE2) != ready.load()) { /** spin **/ };
+  while ((2 + NUM_STAGE1 + NUM_DPI + NUM_STAGE2) != ready.load()) { /** spin **/ };
 
   while (!done) {
     // try to acquire a packet
@@ -254,17 +510,22 @@ void stage2(int desired_core) {
 #endif
 
     if (cnt) { // pkts has valid pointers
+      stamp_pkts(pkts, cnt, STAMP_STAGE2_IN);
+      ctr.popped(cnt);
+      busy++;
+#ifdef STAGE2_READ
+      const uint64_t valid = tcp_valid_bulk(pkts, cnt);
+#endif
       // process header information
       for (uint64_t i = 0; cnt > i; ++i) {
 #ifdef STAGE2_READ
-        if (pkts[i]->tcpheader.data.checksumTCP !=
-            (pkts[i]->tcpheader.data.srcPort ^
-             pkts[i]->tcpheader.data.dstPort)) {
+        if (!((valid >> i) & 1)) {
           corrupted++;
         }
 #endif
 #ifdef STAGE2_WRITE
-        pkts[i]->tcpheader.data.checksumTCP = (uint16_t)corrupted;
+        tcp_set_window(pkts[i], std::min<uint16_t>(
+            pkts[i]->tcpheader.data.winSize, TCP_WINDOW_CLAMP));
 #endif
 #ifdef CAF_PREPUSH
         caf_prepush((void*)pkts[i], HEADER_SIZE);
@@ -272,6 +533,7 @@ void stage2(int desired_core) {
       }
 
       // after processing, propogate the packet to the next stage
+      stamp_pkts(pkts, cnt, STAMP_STAGE2_OUT);
 #ifdef VL
       line_vl_push_weak(&prod, (uint8_t*)pkts, cnt * sizeof(Packet*));
 #elif CAF
@@ -280,12 +542,17 @@ void stage2(int desired_core) {
         i += caf_push_bulk(&prod, (uint64_t*)&pkts[i], cnt - i);
       } while (i < cnt);
 #endif
+      ctr.pushed(cnt);
       continue;
     }
 
+    idle++;
     done = lock.done;
   }
 
+  ctr.busy = busy;
+  ctr.idle = idle;
+
 }
 
 int main(int argc, char *argv[]) {
@@ -295,87 +562,175 @@ int main(int argc, char *argv[]) {
   int core_id = 1;
   size_t cnt = 0;
   Packet *pkts[BULK_SIZE] = { NULL };
+  uint64_t reordered = 0;
+  uint64_t reordered_flows = 0;
+  Histogram latency; // ticks from ingress to the sink
+#ifdef TELEMETRY
+  // ticks spent in each stage and queue, from the stage boundary stamps
+  const char *segment_names[NUM_STAMPS + 1] = {
+#if 0 < NUM_DPI
+    "stage 0", "q01", "stage 1", "q1d+dpi+q12", "stage 2", "q23"
+#else
+    "stage 0", "q01", "stage 1", "q12", "stage 2", "q23"
+#endif
+  };
+  Histogram segments[NUM_STAMPS + 1];
+  // packets in each queue, sampled every TELEMETRY_SAMPLE polls of the sink:
+  // q01, q12, q23, then q1d with DPI workers
+  Histogram depths[4];
+  uint64_t polls = 0;
+#endif
 
+  TrafficConfig traffic;
+#if 0 < NUM_DPI
+  DpiConfig dpi;
+  traffic.infected = 0.01;
+  argc = parse_dpi_args(argc, argv, dpi);
+  if (0 > argc) {
+    return -1;
+  }
+#endif
+  argc = parse_traffic_args(argc, argv, traffic);
+  if (0 > argc) {
+    return -1;
+  }
   if (1 < argc) {
     num_packets = atoi(argv[1]);
   }
   printf("%s 1-%d-%d-1 %d bulk %lu pkts %d pool\n",
          argv[0], NUM_STAGE1, NUM_STAGE2, BULK_SIZE, num_packets, POOL_SIZE);
+#ifdef RSS_DISPATCH
+#ifdef RSS_CRC32C
+  printf("rss dispatch, crc32c hash\n");
+#else
+  printf("rss dispatch, toeplitz hash\n");
+#endif
+#else
+  printf("shared queue dispatch\n");
+#endif
 
-#ifdef VL
-  q01 = mkvl();
-  if (0 > q01) {
-    printf("\033[91mFAILED:\033[0m q01 = mkvl() return %d\n", q01);
+#if 0 < NUM_DPI
+  // signatures: a file of them, or the number to generate
+  std::vector<std::string> signatures;
+  if (NULL == dpi.signatures || 0 < atoi(dpi.signatures)) {
+    gen_signatures(dpi.signatures ? atoi(dpi.signatures) : NUM_SIGNATURES, 1,
+                   signatures);
+  } else if (!load_signatures(dpi.signatures, signatures)) {
+    printf("\033[91mFAILED:\033[0m cannot read signatures from %s\n",
+           dpi.signatures);
     return -1;
   }
-  q12 = mkvl();
-  if (0 > q12) {
-    printf("\033[91mFAILED:\033[0m q12 = mkvl() return %d\n", q12);
+  matcher = make_matcher(dpi.matcher, signatures);
+  if (nullptr == matcher) {
+    printf("\033[91mFAILED:\033[0m unknown matcher %s, use ac or teddy\n",
+           dpi.matcher);
+    return -1;
+  }
+  printf("%d dpi worker(s), %lu signatures %s matcher\n",
+         NUM_DPI, signatures.size(), matcher->name());
+  traffic.signatures = &signatures;
+#endif
+
+  std::vector<FiveTuple> tuples(traffic.flows);
+  for (uint32_t f = 0; traffic.flows > f; ++f) {
+    flow_tuple(f, &tuples[f]);
+  }
+  source = make_traffic(traffic, tuples, 1);
+  if (NULL == source) {
+    printf("\033[91mFAILED:\033[0m cannot replay %s\n", traffic.pcap);
     return -1;
   }
+  source->print();
+  Pacer pace(traffic.rate);
+  pacer = &pace;
+  if (pacer->open_loop()) {
+    printf("open loop at %.3f Mpps\n", traffic.rate);
+  } else {
+    printf("closed loop\n");
+  }
+  uint32_t *sink_seqs = new uint32_t[source->num_flows()](); // highest seq
+  bool *sink_reordered = new bool[source->num_flows()]();
+#ifndef RSS_DISPATCH
+  SharedFlowTable flow_table(source->num_flows());
+  shared_flows = &flow_table;
+#endif
+
+#ifdef VL
+  for (int q = 0; NUM_Q01 > q; ++q) {
+    q01[q] = mkvl();
+    if (0 > q01[q]) {
+      printf("\033[91mFAILED:\033[0m q01 = mkvl() return %d\n", q01[q]);
+      return -1;
+    }
+  }
+  for (int q = 0; NUM_Q12 > q; ++q) {
+    q12[q] = mkvl();
+    if (0 > q12[q]) {
+      printf("\033[91mFAILED:\033[0m q12 = mkvl() return %d\n", q12[q]);
+      return -1;
+    }
+  }
   q23 = mkvl();
   if (0 > q23) {
     printf("\033[91mFAILED:\033[0m q23 = mkvl() return %d\n", q23);
     return -1;
   }
-  q30 = mkvl();
-  if (0 > q30) {
-    printf("\033[91mFAILED:\033[0m q30 = mkvl() return %d\n", q30);
-    return -1;
+#if 0 < NUM_DPI
+  for (int q = 0; NUM_Q1D > q; ++q) {
+    q1d[q] = mkvl();
+    if (0 > q1d[q]) {
+      printf("\033[91mFAILED:\033[0m q1d = mkvl() return %d\n", q1d[q]);
+      return -1;
+    }
   }
+#endif
   // open endpoints
-  vlendpt_t cons, prod;
+  vlendpt_t cons;
   if (open_byte_vl_as_consumer(q23, &cons, 1)) {
     printf("\033[91mFAILED:\033[0m %s(), cons\n", __func__);
     return -1;
   }
-  if (open_byte_vl_as_producer(q30, &prod, 1)) {
-    printf("\033[91mFAILED:\033[0m %s(), prod\n", __func__);
-    return -1;
-  }
   const size_t bulk_size = BULK_SIZE * sizeof(Packet*);
 #elif CAF
-  cafendpt_t cons, prod;
+  // the first queue of each keeps its id, the others follow q23
+  for (int q = 1; NUM_Q01 > q; ++q) {
+    q01[q] = q23 + q;
+  }
+  for (int q = 1; NUM_Q12 > q; ++q) {
+    q12[q] = q23 + NUM_Q01 - 1 + q;
+  }
+#if 0 < NUM_DPI
+  for (int q = 0; NUM_Q1D > q; ++q) {
+    q1d[q] = q23 + NUM_Q01 - 1 + NUM_Q12 + q;
+  }
+#endif
+  cafendpt_t cons;
   if (open_caf(q23, &cons)) {
     printf("\033[91mFAILED:\033[0m %s(), cons\n", __func__);
     return -1;
   }
-  if (open_caf(q30, &prod)) {
-    printf("\033[91mFAILED:\033[0m %s(), prod\n", __func__);
-    return -1;
-  }
 #endif
 
+  // POOL_SIZE 2KB memory blocks and their headers, on the node of the sink
+  Mempool mempool(POOL_SIZE, MEMPOOL_CACHE_SIZE, NUM_LCORES, core_node(0));
+  pool = &mempool;
+
   ready = 0;
   std::vector<thread> slave_threads;
   slave_threads.push_back(thread(stage0, core_id++));
   for (int i = 0; NUM_STAGE1 > i; ++i) {
-    slave_threads.push_back(thread(stage1, core_id++));
+    slave_threads.push_back(thread(stage1, core_id++, i));
   }
-  for (int i = 0; NUM_STAGE2 > i; ++i) {
-    slave_threads.push_back(thread(stage2, core_id++));
+#if 0 < NUM_DPI
+  for (int i = 0; NUM_DPI > i; ++i) {
+    slave_threads.push_back(thread(stage_dpi, core_id++, i));
   }
-
-  void *mempool = malloc(POOL_SIZE << 11); // POOL_SIZE 2KB memory blocks
-  void *headerpool = malloc(POOL_SIZE * HEADER_SIZE);
-
-  // add allocated memory blocks into pool
-  for (int i = 0; POOL_SIZE > i;) {
-    size_t j = 0;
-    while (BULK_SIZE > j && POOL_SIZE > i) {
-      pkts[j] = (Packet*)((uint64_t)headerpool + (i * HEADER_SIZE));
-      pkts[j]->payload = (void*)((uint64_t)mempool + (i << 11));
-      j++;
-    }
-#ifdef VL
-    line_vl_push_strong(&prod, (uint8_t*)pkts, sizeof(Packet*) * j);
-#elif CAF
-    assert(j == caf_push_bulk(&prod, (uint64_t*)pkts, j));
 #endif
-    i += j;
+  for (int i = 0; NUM_STAGE2 > i; ++i) {
+    slave_threads.push_back(thread(stage2, core_id++, i));
   }
 
-  while ((1 + NUM_STAGE1 + NUM_STAGE2) != ready.load()) { /** spin **/ };
+  while ((1 + NUM_STAGE1 + NUM_DPI + NUM_STAGE2) != ready.load()) { /** spin **/ };
   ready++;
 
   const uint64_t beg_tsc = rdtsc();
@@ -385,31 +740,70 @@ int main(int argc, char *argv[]) {
   m5_reset_stats(0, 0);
 #endif
 
-  for (uint64_t i = 0; num_packets > i;) {
+  uint64_t delivered = 0;
+  while (num_packets > delivered + dropped.load()) {
     // try to acquire a packet
 #ifdef VL
     cnt = bulk_size;
     line_vl_pop_non(&cons, (uint8_t*)pkts, &cnt);
+    cnt /= sizeof(Packet*);
 #elif CAF
     cnt = caf_pop_bulk(&cons, (uint64_t*)pkts, BULK_SIZE);
 #endif
 
     if (cnt) { // valid packets pointers in pkts
-#ifdef VL
-      line_vl_push_weak(&prod, (uint8_t*)pkts, cnt);
-      cnt /= sizeof(Packet*);
-#elif CAF
-      uint64_t j = 0; // successfully pushed count
-      do {
-        j += caf_push_bulk(&prod, (uint64_t*)&pkts[j], cnt - j);
-      } while (j < cnt);
+      const uint64_t now = rdtsc();
+      // a packet behind a later one of its flow arrives out of order
+      for (uint64_t j = 0; cnt > j; ++j) {
+        const uint64_t ingress = packet_meta(pkts[j])->ingress;
+        const uint32_t f = packet_meta(pkts[j])->flow;
+        const uint32_t seq = packet_meta(pkts[j])->seq;
+        latency.add(now - ingress);
+#ifdef TELEMETRY
+        const uint64_t *stamps = packet_stamps(pkts[j]);
+        segments[0].add(stamps[STAMP_STAGE0] - ingress);
+        for (int s = 1; NUM_STAMPS > s; ++s) {
+          segments[s].add(stamps[s] - stamps[s - 1]);
+        }
+        segments[NUM_STAMPS].add(now - stamps[NUM_STAMPS - 1]);
 #endif
-      i += cnt;
-      continue;
+        if (seq < sink_seqs[f]) {
+          reordered++;
+          if (!sink_reordered[f]) {
+            sink_reordered[f] = true;
+            reordered_flows++;
+          }
+        } else {
+          sink_seqs[f] = seq;
+        }
+      }
+      pool->put_bulk(LCORE_STAGE3, pkts, cnt);
+      delivered += cnt;
+      sink_ctr.busy++;
+    } else {
+      // stage 0 may be short of packets sitting in this cache
+      pool->flush(LCORE_STAGE3);
+      sink_ctr.idle++;
     }
 
-#ifdef VL
-    line_vl_push_non(&prod, (uint8_t*)pkts, 0); // help flushing
+#ifdef TELEMETRY
+    if (0 == ++polls % TELEMETRY_SAMPLE) {
+      // consumers first, see queue_depth()
+      const uint64_t in3 = delivered;
+      const uint64_t in2 = sum_in(stage2_ctr, NUM_STAGE2);
+#if 0 < NUM_DPI
+      const uint64_t ind = sum_in(dpi_ctr, NUM_DPI);
+#endif
+      const uint64_t in1 = sum_in(stage1_ctr, NUM_STAGE1);
+      depths[0].add(queue_depth(stage0_ctr.out[0].load(), in1));
+#if 0 < NUM_DPI
+      depths[3].add(queue_depth(sum_out(stage1_ctr, NUM_STAGE1), ind));
+      depths[1].add(queue_depth(sum_out(dpi_ctr, NUM_DPI), in2));
+#else
+      depths[1].add(queue_depth(sum_out(stage1_ctr, NUM_STAGE1), in2));
+#endif
+      depths[2].add(queue_depth(sum_out(stage2_ctr, NUM_STAGE2), in3));
+    }
 #endif
   }
 
@@ -425,11 +819,60 @@ int main(int argc, char *argv[]) {
 
   std::cout << (end_tsc - beg_tsc) << " ticks elapsed\n";
   std::cout << elapsed.count() << " ns elapsed\n";
+  printf("%.3f Mpps, %lu packet(s) dropped at stage 0\n",
+         (double)delivered * 1e3 / elapsed.count(), dropped.load());
+  printf("latency from ingress\n");
+  latency.print("end-to-end", tsc_per_ns(), "ns");
+#ifdef TELEMETRY
+  for (int s = 0; NUM_STAMPS >= s; ++s) {
+    segments[s].print(segment_names[s], tsc_per_ns(), "ns");
+  }
+  printf("queue depth\n");
+  depths[0].print("q01", 1, "pkts");
+#if 0 < NUM_DPI
+  depths[3].print("q1d", 1, "pkts");
+#endif
+  depths[1].print("q12", 1, "pkts");
+  depths[2].print("q23", 1, "pkts");
+#endif
 
-  for (int i = 0; (1 + NUM_STAGE1 + NUM_STAGE2) > i; ++i) {
+  for (int i = 0; (1 + NUM_STAGE1 + NUM_DPI + NUM_STAGE2) > i; ++i) {
     slave_threads[i].join();
   }
 
-  free(mempool);
+  printf("polls\n");
+  stage0_ctr.print("stage 0", 0);
+  for (int i = 0; NUM_STAGE1 > i; ++i) {
+    stage1_ctr[i].print("stage 1", i);
+  }
+#if 0 < NUM_DPI
+  for (int i = 0; NUM_DPI > i; ++i) {
+    dpi_ctr[i].print("dpi", i);
+  }
+#endif
+  for (int i = 0; NUM_STAGE2 > i; ++i) {
+    stage2_ctr[i].print("stage 2", i);
+  }
+  sink_ctr.print("stage 3", 0);
+
+  printf("%lu packet(s) out of order at stage 1\n", stage1_reordered.load());
+  printf("%lu packet(s) of %lu flow(s) out of order at the sink\n",
+         reordered, reordered_flows);
+#if 0 < NUM_DPI
+  printf("%lu packet(s) carrying a signature at dpi\n", dpi_infected.load());
+#endif
+#ifdef RSS_DISPATCH
+  for (int i = 0; NUM_STAGE1 > i; ++i) {
+    printf("stage 1 worker %d: %u flow(s)\n", i, worker_flows[i]);
+  }
+#endif
+  pool->print_stats();
+
+  delete[] sink_seqs;
+  delete[] sink_reordered;
+  delete source;
+#if 0 < NUM_DPI
+  delete matcher;
+#endif
   return 0;
 }
@@ -0,0 +1,189 @@
+#ifndef _NETWORK_TELEMETRY_HPP__
+#define _NETWORK_TELEMETRY_HPP__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+#include "utils.hpp"
+#include "timing.h"
+
+// Sink polls between two samples of the queue depths
+#ifndef TELEMETRY_SAMPLE
+#define TELEMETRY_SAMPLE 64
+#endif
+
+// Timestamps a packet collects at the stage boundaries, stored in the spare
+// bytes of the IPv4 header pad. Only written with -DTELEMETRY, as they add
+// a store to every packet in stages that may not touch the header at all.
+enum {
+  STAMP_STAGE0, // left stage 0
+  STAMP_STAGE1_IN,
+  STAMP_STAGE1_OUT,
+  STAMP_STAGE2_IN,
+  STAMP_STAGE2_OUT,
+  NUM_STAMPS
+};
+
+#define STAMP_OFFSET ((sizeof(IPv4Header) + 7) & ~7)
+
+STATIC_ASSERT(64 >= STAMP_OFFSET + NUM_STAMPS * sizeof(uint64_t), StampSize);
+
+static inline uint64_t *packet_stamps(Packet *pkt) {
+  return (uint64_t*)&pkt->ipheader.pad[STAMP_OFFSET];
+}
+
+// One rdtsc for the whole bulk, at the boundary it crosses
+static inline void stamp_pkts(Packet **pkts, size_t cnt, int stamp) {
+#ifdef TELEMETRY
+  const uint64_t now = rdtsc();
+  for (size_t i = 0; cnt > i; ++i) {
+    packet_stamps(pkts[i])[stamp] = now;
+  }
+#else
+  pkts = pkts;
+  cnt = cnt;
+  stamp = stamp;
+#endif
+}
+
+// Log-linear histogram: values under 8 exactly, above that 8 buckets per
+// power of two, so a bucket spans at most 12.5% of its values.
+class Histogram {
+ public:
+  Histogram() { memset((void*)this, 0, sizeof(*this)); }
+
+  void add(uint64_t v) {
+    counts[bucket(v)]++;
+    total++;
+    sum += v;
+    max = (max < v) ? v : max;
+  }
+
+  void merge(const Histogram &h) {
+    for (int b = 0; NUM_BUCKETS > b; ++b) {
+      counts[b] += h.counts[b];
+    }
+    total += h.total;
+    sum += h.sum;
+    max = (max < h.max) ? h.max : max;
+  }
+
+  uint64_t count() const { return total; }
+
+  // Upper bound of the bucket holding the p-th percentile
+  uint64_t percentile(double p) const {
+    const uint64_t rank = (uint64_t)(p / 100 * total);
+    uint64_t seen = 0;
+    for (int b = 0; NUM_BUCKETS > b; ++b) {
+      seen += counts[b];
+      if (seen > rank) {
+        const uint64_t upper = lower(b + 1) - 1;
+        return (upper < max) ? upper : max;
+      }
+    }
+    return max;
+  }
+
+  // One line of avg and percentiles, divided by scale (e.g. ticks per ns)
+  void print(const char *name, double scale, const char *unit) const {
+    if (0 == total) {
+      printf("  %-10s -\n", name);
+      return;
+    }
+    printf("  %-10s avg %9.0f p50 %9.0f p90 %9.0f p99 %9.0f "
+           "p99.9 %9.0f max %9.0f %s\n", name, sum / scale / total,
+           percentile(50) / scale, percentile(90) / scale,
+           percentile(99) / scale, percentile(99.9) / scale, max / scale,
+           unit);
+  }
+
+ private:
+  static const int NUM_BUCKETS = 62 * 8;
+
+  static int bucket(uint64_t v) {
+    if (8 > v) {
+      return v;
+    }
+    const int msb = 63 - __builtin_clzll(v);
+    return (msb - 2) * 8 + ((v >> (msb - 3)) & 7);
+  }
+
+  static uint64_t lower(int b) {
+    if (8 > b) {
+      return b;
+    }
+    if (NUM_BUCKETS <= b) {
+      return UINT64_MAX;
+    }
+    return (uint64_t)(8 + b % 8) << (b / 8 - 1);
+  }
+
+  uint64_t counts[NUM_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+};
+
+// Counters of one stage thread, each thread on its own line. in and out
+// (per output queue) are kept as the stage goes, with -DTELEMETRY, so that
+// the depth of a queue is what its producers pushed less what its consumers
+// popped. Only the owner writes them; the poll counts, kept apart until the
+// thread ends, would otherwise bounce the line on every spin.
+struct StageCounters {
+  std::atomic<uint64_t> in;
+  std::atomic<uint64_t> out[2];
+  uint64_t busy; // polls that found packets
+  uint64_t idle; // polls that found nothing, spinning
+
+  void popped(uint64_t n) {
+#ifdef TELEMETRY
+    in.store(in.load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
+#else
+    n = n;
+#endif
+  }
+
+  void pushed(uint64_t n, int port = 0) {
+#ifdef TELEMETRY
+    out[port].store(out[port].load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+#else
+    n = n;
+    port = port;
+#endif
+  }
+
+  void print(const char *name, int i) const {
+    const uint64_t polls = busy + idle;
+    printf("  %s worker %d: %lu busy %lu idle poll(s), %.1f%% busy\n", name, i,
+           busy, idle, polls ? 100.0 * busy / polls : 0.0);
+  }
+} __attribute__((aligned(64)));
+
+// Sum of a counter over the threads of a stage
+static inline uint64_t sum_in(const StageCounters *c, int n) {
+  uint64_t s = 0;
+  for (int i = 0; n > i; ++i) {
+    s += c[i].in.load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+static inline uint64_t sum_out(const StageCounters *c, int n, int port = 0) {
+  uint64_t s = 0;
+  for (int i = 0; n > i; ++i) {
+    s += c[i].out[port].load(std::memory_order_relaxed);
+  }
+  return s;
+}
+
+// Packets in a queue from its counts; the consumers are read before the
+// producers, so a racing sample errs high, never below zero
+static inline uint64_t queue_depth(uint64_t pushed, uint64_t popped) {
+  return (pushed > popped) ? pushed - popped : 0;
+}
+
+#endif // end of ifndef _NETWORK_TELEMETRY_HPP__
@@ -0,0 +1,397 @@
+#include "traffic.hpp"
+#include "checksum.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <tuple>
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+
+#define ETHER_OVERHEAD 18 // Ethernet header and FCS around the IP packet
+
+static bool parse_imix(const char *s, TrafficConfig &cfg) {
+  cfg.imix.clear();
+  while (*s) {
+    char *end;
+    const long size = strtol(s, &end, 10);
+    long weight = 1;
+    if (end == s || ETHER_OVERHEAD + 40 > size || 9000 < size) {
+      return false;
+    }
+    if (':' == *end) {
+      s = end + 1;
+      weight = strtol(s, &end, 10);
+      if (end == s || 0 >= weight) {
+        return false;
+      }
+    }
+    cfg.imix.push_back(std::make_pair((uint16_t)size, (uint32_t)weight));
+    s = (',' == *end) ? end + 1 : end;
+    if (*end && ',' != *end) {
+      return false;
+    }
+  }
+  return !cfg.imix.empty();
+}
+
+int parse_traffic_args(int argc, char **argv, TrafficConfig &cfg) {
+  int nargs = 1;
+  for (int i = 1; argc > i; ++i) {
+    const char *arg = argv[i];
+    const char *val = strchr(arg, '=');
+    bool good = true;
+    if (strncmp(arg, "--", 2)) { // positional, keep it
+      argv[nargs++] = argv[i];
+      continue;
+    }
+    if (NULL == val) {
+      good = false;
+    } else if (!strncmp(arg, "--pcap=", 7)) {
+      cfg.pcap = val + 1;
+    } else if (!strncmp(arg, "--flows=", 8)) {
+      cfg.flows = atoi(val + 1);
+      good = 0 < atoi(val + 1);
+    } else if (!strncmp(arg, "--zipf=", 7)) {
+      cfg.zipf = atof(val + 1);
+      good = 0 <= cfg.zipf;
+    } else if (!strncmp(arg, "--imix=", 7)) {
+      good = parse_imix(val + 1, cfg);
+    } else if (!strncmp(arg, "--malformed=", 12)) {
+      cfg.malformed = atof(val + 1);
+      good = 0 <= cfg.malformed && 1 >= cfg.malformed;
+    } else if (!strncmp(arg, "--rate=", 7)) {
+      cfg.rate = atof(val + 1);
+      good = 0 <= cfg.rate;
+    } else if (!strncmp(arg, "--infected=", 11)) {
+      cfg.infected = atof(val + 1);
+      good = 0 <= cfg.infected && 1 >= cfg.infected;
+    } else {
+      good = false;
+    }
+    if (!good) {
+      printf("\033[91mFAILED:\033[0m bad traffic option %s\n", arg);
+      return -1;
+    }
+  }
+  argv[nargs] = NULL;
+  return nargs;
+}
+
+SyntheticSource::SyntheticSource(const std::vector<FiveTuple> &tuples,
+                                 const TrafficConfig &cfg, uint64_t seed)
+    : tuples(tuples), zipf(cfg.zipf), malformed(cfg.malformed),
+      infected(cfg.signatures && !cfg.signatures->empty() ? cfg.infected : 0),
+      signatures(cfg.signatures),
+      state(seed * 0x9E3779B97F4A7C15ULL + 1), id(0) {
+  double sum = 0;
+  for (size_t f = 0; tuples.size() > f; ++f) {
+    hashes.push_back(rss_hash(tuples[f]));
+    sum += 1.0 / pow((double)(f + 1), zipf);
+    popularity.push_back(sum);
+  }
+  for (size_t f = 0; tuples.size() > f; ++f) {
+    popularity[f] /= sum;
+  }
+  seqs.assign(tuples.size(), 0);
+  tcpseqs.assign(tuples.size(), 0);
+  for (size_t i = 0; cfg.imix.size() > i; ++i) {
+    sizes.insert(sizes.end(), cfg.imix[i].second, cfg.imix[i].first);
+  }
+  bytes.resize(2 * MAX_PAYLOAD);
+  for (size_t i = 0; bytes.size() > i; ++i) {
+    bytes[i] = rand();
+  }
+}
+
+// xorshift64*
+uint64_t SyntheticSource::rand() {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ULL;
+}
+
+double SyntheticSource::uniform() {
+  return (rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void SyntheticSource::print() const {
+  printf("synthetic traffic: %lu flows zipf %.2f malformed %.3f "
+         "infected %.3f imix", tuples.size(), zipf, malformed, infected);
+  for (size_t i = 0; sizes.size() > i; ++i) {
+    if (0 == i || sizes[i] != sizes[i - 1]) {
+      printf(" %u", sizes[i]);
+    }
+  }
+  printf("\n");
+}
+
+void SyntheticSource::next(Packet *pkt) {
+  const uint32_t f = std::lower_bound(popularity.begin(), popularity.end(),
+                                      uniform()) - popularity.begin();
+  const FiveTuple &t = tuples[std::min(f, (uint32_t)tuples.size() - 1)];
+  const uint32_t flow = &t - &tuples[0];
+  const uint16_t len = sizes[rand() % sizes.size()] - ETHER_OVERHEAD;
+  const uint16_t payload = std::min(len - 40, MAX_PAYLOAD);
+
+  pkt->ipheader.data.version = 0x45;
+  pkt->ipheader.data.service = 0;
+  pkt->ipheader.data.len = len;
+  pkt->ipheader.data.id = id++;
+  pkt->ipheader.data.flagsIP = 0x4000; // don't fragment
+  pkt->ipheader.data.TTL = 64;
+  pkt->ipheader.data.protocol = t.protocol;
+  pkt->ipheader.data.srcIP = t.srcIP;
+  pkt->ipheader.data.dstIP = t.dstIP;
+  pkt->ipheader.data.checksumIP = 0;
+  pkt->tcpheader.data.srcPort = t.srcPort;
+  pkt->tcpheader.data.dstPort = t.dstPort;
+  pkt->tcpheader.data.seqNum = tcpseqs[flow];
+  pkt->tcpheader.data.ackNum = 0;
+  pkt->tcpheader.data.flagsTCP = 0x5010; // 20B header, ACK
+  pkt->tcpheader.data.winSize = 65535;
+  pkt->tcpheader.data.checksumTCP = 0;
+  pkt->tcpheader.data.urgentPtr = 0;
+  tcpseqs[flow] += payload;
+
+  memcpy(pkt->payload, &bytes[rand() % MAX_PAYLOAD], payload);
+  if (0 < infected && infected > uniform()) {
+    const std::string &sig = (*signatures)[rand() % signatures->size()];
+    if (sig.size() <= payload) {
+      memcpy((uint8_t*)pkt->payload + rand() % (payload - sig.size() + 1),
+             sig.data(), sig.size());
+    }
+  }
+  set_checksums(pkt);
+
+  if (0 < malformed && malformed > uniform()) {
+    if (rand() & 1) {
+      pkt->ipheader.data.checksumIP++;
+    } else {
+      pkt->tcpheader.data.checksumTCP++;
+    }
+  }
+
+  PacketMeta *meta = packet_meta(pkt);
+  meta->flow = flow;
+  meta->hash = hashes[flow];
+  meta->seq = ++seqs[flow];
+}
+
+PcapSource::PcapSource(const char *path)
+    : path(path), base(NULL), size(0), nflows(0), cursor(0) {
+  struct stat st;
+  const int fd = open(path, O_RDONLY);
+  if (0 > fd) {
+    return;
+  }
+  if (0 == fstat(fd, &st) && 24 <= st.st_size) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED != map) {
+      base = (const uint8_t*)map;
+      size = st.st_size;
+      madvise(map, size, MADV_WILLNEED); // fault it in before the run
+    }
+  }
+  close(fd);
+  if (base && !index()) {
+    records.clear();
+  }
+}
+
+PcapSource::~PcapSource() {
+  if (base) {
+    munmap((void*)base, size);
+  }
+}
+
+static inline uint32_t load32(const uint8_t *p, bool swap) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t be16(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+bool PcapSource::index() {
+  const uint32_t magic = load32(base, false);
+  const bool swap = PCAP_MAGIC_US == __builtin_bswap32(magic) ||
+                    PCAP_MAGIC_NS == __builtin_bswap32(magic);
+  if (!swap && PCAP_MAGIC_US != magic && PCAP_MAGIC_NS != magic) {
+    return false;
+  }
+  const uint32_t linktype = load32(base + 20, swap) & 0xFFFF;
+  std::map<std::tuple<uint32_t, uint32_t, uint16_t, uint16_t, uint8_t>,
+           uint32_t> flows;
+
+  for (size_t off = 24; size >= off + 16;) {
+    const uint32_t incl = load32(base + off + 8, swap);
+    const uint8_t *frame = base + off + 16;
+    off += 16 + incl;
+    if (size < off) {
+      break;
+    }
+
+    // find the IPv4 header
+    size_t l3 = 0;
+    uint16_t ethertype = 0x0800;
+    if (LINKTYPE_ETHERNET == linktype) {
+      if (14 > incl) {
+        continue;
+      }
+      ethertype = be16(frame + 12);
+      l3 = 14;
+      while ((0x8100 == ethertype || 0x88A8 == ethertype) && incl >= l3 + 4) {
+        ethertype = be16(frame + l3 + 2); // VLAN tags
+        l3 += 4;
+      }
+    } else if (LINKTYPE_LINUX_SLL == linktype) {
+      if (16 > incl) {
+        continue;
+      }
+      ethertype = be16(frame + 14);
+      l3 = 16;
+    } else if (LINKTYPE_RAW != linktype) {
+      return false;
+    }
+    if (0x0800 != ethertype || incl < l3 + 20 || 4 != (frame[l3] >> 4)) {
+      continue;
+    }
+
+    Record r;
+    const uint8_t *ip = frame + l3;
+    const size_t ihl = (ip[0] & 0xF) * 4;
+    r.ip = ip;
+    r.caplen = std::min(incl - l3, (size_t)UINT16_MAX);
+    r.tuple.protocol = ip[9];
+    r.tuple.srcIP = be32(ip + 12);
+    r.tuple.dstIP = be32(ip + 16);
+    r.tuple.srcPort = 0;
+    r.tuple.dstPort = 0;
+    r.l4off = ihl;
+    if ((6 == r.tuple.protocol || 17 == r.tuple.protocol) &&
+        r.caplen >= ihl + 8) {
+      r.tuple.srcPort = be16(ip + ihl);
+      r.tuple.dstPort = be16(ip + ihl + 2);
+      if (6 == r.tuple.protocol && r.caplen >= ihl + 20) {
+        r.l4off = ihl + (ip[ihl + 12] >> 4) * 4;
+      } else {
+        r.l4off = ihl + 8;
+      }
+    }
+    r.l4off = std::min(r.l4off, r.caplen);
+
+    auto key = std::make_tuple(r.tuple.srcIP, r.tuple.dstIP, r.tuple.srcPort,
+                               r.tuple.dstPort, r.tuple.protocol);
+    auto it = flows.find(key);
+    if (flows.end() == it) {
+      it = flows.insert(std::make_pair(key, (uint32_t)flows.size())).first;
+    }
+    r.flow = it->second;
+    r.hash = rss_hash(r.tuple);
+    records.push_back(r);
+  }
+
+  nflows = flows.size();
+  seqs.assign(nflows, 0);
+  return true;
+}
+
+void PcapSource::print() const {
+  printf("pcap traffic: %s, %lu packets %u flows\n",
+         path, records.size(), nflows);
+}
+
+void PcapSource::next(Packet *pkt) {
+  const Record &r = records[cursor];
+  const uint8_t *ip = r.ip;
+  const size_t l4 = (ip[0] & 0xF) * 4;
+  cursor = (records.size() == cursor + 1) ? 0 : cursor + 1;
+
+  pkt->ipheader.data.version = ip[0];
+  pkt->ipheader.data.service = ip[1];
+  pkt->ipheader.data.len = be16(ip + 2);
+  pkt->ipheader.data.id = be16(ip + 4);
+  pkt->ipheader.data.flagsIP = be16(ip + 6);
+  pkt->ipheader.data.TTL = ip[8];
+  pkt->ipheader.data.protocol = r.tuple.protocol;
+  pkt->ipheader.data.srcIP = r.tuple.srcIP;
+  pkt->ipheader.data.dstIP = r.tuple.dstIP;
+  pkt->ipheader.data.checksumIP = 0;
+  pkt->tcpheader.data.srcPort = r.tuple.srcPort;
+  pkt->tcpheader.data.dstPort = r.tuple.dstPort;
+  if (6 == r.tuple.protocol && r.caplen >= l4 + 20) {
+    pkt->tcpheader.data.seqNum = be32(ip + l4 + 4);
+    pkt->tcpheader.data.ackNum = be32(ip + l4 + 8);
+    pkt->tcpheader.data.flagsTCP = be16(ip + l4 + 12);
+    pkt->tcpheader.data.winSize = be16(ip + l4 + 14);
+    pkt->tcpheader.data.urgentPtr = be16(ip + l4 + 18);
+  } else {
+    pkt->tcpheader.data.seqNum = 0;
+    pkt->tcpheader.data.ackNum = 0;
+    pkt->tcpheader.data.flagsTCP = 0;
+    pkt->tcpheader.data.winSize = 0;
+    pkt->tcpheader.data.urgentPtr = 0;
+  }
+  pkt->tcpheader.data.checksumTCP = 0;
+
+  // what was not captured of the payload reads as zeros
+  const int payload = tcp_payload_len(pkt);
+  const int captured = std::min(r.caplen - r.l4off, payload);
+  memcpy(pkt->payload, ip + r.l4off, captured);
+  memset((uint8_t*)pkt->payload + captured, 0, payload - captured);
+  set_checksums(pkt);
+
+  PacketMeta *meta = packet_meta(pkt);
+  meta->flow = r.flow;
+  meta->hash = r.hash;
+  meta->seq = ++seqs[r.flow];
+}
+
+TrafficSource *make_traffic(const TrafficConfig &cfg,
+                            const std::vector<FiveTuple> &tuples,
+                            uint64_t seed) {
+  if (NULL == cfg.pcap) {
+    return new SyntheticSource(tuples, cfg, seed);
+  }
+  PcapSource *src = new PcapSource(cfg.pcap);
+  if (!src->ok()) {
+    delete src;
+    return NULL;
+  }
+  return src;
+}
+
+double tsc_per_ns() {
+  static double ratio = 0;
+  if (0 == ratio) {
+    const auto beg(std::chrono::steady_clock::now());
+    const uint64_t beg_tsc = rdtsc();
+    while (std::chrono::steady_clock::now() - beg <
+           std::chrono::milliseconds(50)) { /** spin **/ };
+    const uint64_t end_tsc = rdtsc();
+    const auto end(std::chrono::steady_clock::now());
+    ratio = (double)(end_tsc - beg_tsc) /
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - beg).count();
+  }
+  return ratio;
+}
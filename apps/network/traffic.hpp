@@ -0,0 +1,137 @@
+#ifndef _NETWORK_TRAFFIC_HPP__
+#define _NETWORK_TRAFFIC_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+#include "flow.hpp"
+#include "timing.h"
+
+// What stage 0 feeds the benchmark with, set with --options on the command
+// line, see parse_traffic_args()
+struct TrafficConfig {
+  const char *pcap = NULL; // replay this capture instead of synthetic flows
+  uint32_t flows = NUM_FLOWS; // synthetic flows
+  double zipf = 1.0; // skew of the flow popularity, 0 for uniform
+  double malformed = 0.0; // fraction of packets with a bad checksum
+  double rate = 0.0; // offered load in Mpps, 0 runs closed loop
+  double infected = 0.0; // fraction of packets carrying a signature
+  const std::vector<std::string> *signatures = NULL; // for DPI, see dpi.hpp
+  // frame sizes and their weights, the simple IMIX by default
+  std::vector<std::pair<uint16_t, uint32_t> > imix = {
+    {64, 7}, {594, 4}, {1518, 1}
+  };
+};
+
+// Consume the traffic options of argv, leaving the positional arguments in
+// place; returns the new argc, -1 on a bad option.
+//   --pcap=FILE       replay FILE, looping at its end
+//   --flows=N         number of synthetic flows
+//   --zipf=S          Zipf exponent of the flow popularity
+//   --imix=B:W[,B:W]  frame sizes in bytes and their weights
+//   --malformed=R     fraction of malformed synthetic packets
+//   --rate=MPPS       open-loop offered load
+//   --infected=R      fraction of synthetic packets carrying a signature
+int parse_traffic_args(int argc, char **argv, TrafficConfig &cfg);
+
+class TrafficSource {
+ public:
+  virtual ~TrafficSource() {}
+  virtual void print() const = 0;
+  virtual uint32_t num_flows() const = 0;
+  // Write the next packet into pkt: headers, payload and metadata except
+  // the ingress timestamp, which belongs to whoever paces the source.
+  virtual void next(Packet *pkt) = 0;
+};
+
+// Packets of the given flows, picked with Zipf popularity, sized after the
+// IMIX, a fraction of them malformed, with random payload bytes, a fraction
+// of which carry one of the signatures somewhere
+class SyntheticSource : public TrafficSource {
+ public:
+  SyntheticSource(const std::vector<FiveTuple> &tuples,
+                  const TrafficConfig &cfg, uint64_t seed);
+  void print() const;
+  uint32_t num_flows() const { return tuples.size(); }
+  void next(Packet *pkt);
+ private:
+  uint64_t rand();
+  double uniform();
+
+  std::vector<FiveTuple> tuples;
+  std::vector<uint32_t> hashes;
+  std::vector<uint32_t> seqs; // packets sent per flow
+  std::vector<uint32_t> tcpseqs; // bytes sent per flow
+  std::vector<double> popularity; // cumulative, over the flows
+  std::vector<uint16_t> sizes; // one entry per unit of IMIX weight
+  std::vector<uint8_t> bytes; // payload contents
+  double zipf;
+  double malformed;
+  double infected;
+  const std::vector<std::string> *signatures;
+  uint64_t state;
+  uint16_t id;
+};
+
+// A pcap file mapped in memory, indexed once at load, then replayed in a
+// loop. Only IPv4 over Ethernet, Linux cooked or raw IP links is kept. The
+// checksums are computed again over the headers as the bench lays them out.
+class PcapSource : public TrafficSource {
+ public:
+  PcapSource(const char *path);
+  ~PcapSource();
+  bool ok() const { return !records.empty(); }
+  void print() const;
+  uint32_t num_flows() const { return nflows; }
+  void next(Packet *pkt);
+ private:
+  struct Record {
+    const uint8_t *ip; // IPv4 header in the mapping
+    uint16_t caplen; // captured bytes from the IPv4 header on
+    uint16_t l4off; // offset of the payload from the IPv4 header
+    FiveTuple tuple;
+    uint32_t flow;
+    uint32_t hash;
+  };
+  bool index();
+
+  const char *path;
+  const uint8_t *base;
+  size_t size;
+  std::vector<Record> records;
+  std::vector<uint32_t> seqs; // packets replayed per flow
+  uint32_t nflows;
+  size_t cursor;
+};
+
+// Synthetic flows out of tuples, or the capture of cfg.pcap; NULL if the
+// capture cannot be used
+TrafficSource *make_traffic(const TrafficConfig &cfg,
+                            const std::vector<FiveTuple> &tuples,
+                            uint64_t seed);
+
+// Timestamp counter ticks per ns, measured once against the steady clock
+double tsc_per_ns();
+
+// Open-loop schedule of a source: packet n is due n intervals after the
+// start, regardless of whether the system has kept up. Its ingress
+// timestamp is when it was due, so a stalled stage 0 shows up as latency.
+class Pacer {
+ public:
+  Pacer(double mpps) : interval(0 < mpps ? tsc_per_ns() * 1e3 / mpps : 0),
+                       beg(0) {}
+  bool open_loop() const { return 0 < interval; }
+  void start() { beg = rdtsc(); }
+  // Number of packets due by now
+  uint64_t due() const { return (uint64_t)((rdtsc() - beg) / interval); }
+  uint64_t when(uint64_t n) const { return beg + (uint64_t)(n * interval); }
+ private:
+  double interval; // ticks between two packets
+  uint64_t beg;
+};
+
+#endif // end of ifndef _NETWORK_TRAFFIC_HPP__
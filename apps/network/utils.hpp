@@ -11,6 +11,11 @@
 #define NUM_STAGE2 1
 #endif
 
+// workers of the deep packet inspection stage, none by default
+#ifndef NUM_DPI
+#define NUM_DPI 0
+#endif
+
 #ifndef POOL_SIZE
 #define POOL_SIZE 56 // #2KB packets
 #endif
@@ -24,6 +29,7 @@
 #endif
 
 #define HEADER_SIZE 192
+#define MAX_PAYLOAD 2048 // the memory block of a packet
 
 struct IPv4Header {
     uint8_t version;
@@ -64,8 +70,40 @@ struct Packet {
     void * payload;
 } __attribute__((packed, aligned(64)));
 
+struct FiveTuple {
+    uint32_t srcIP;
+    uint32_t dstIP;
+    uint16_t srcPort;
+    uint16_t dstPort;
+    uint8_t protocol;
+};
+
+static inline void get_tuple(const Packet *pkt, FiveTuple *t) {
+    t->srcIP = pkt->ipheader.data.srcIP;
+    t->dstIP = pkt->ipheader.data.dstIP;
+    t->srcPort = pkt->tcpheader.data.srcPort;
+    t->dstPort = pkt->tcpheader.data.dstPort;
+    t->protocol = pkt->ipheader.data.protocol;
+}
+
+// Benchmark metadata travels in the spare bytes of the TCP header pad
+struct PacketMeta {
+    uint32_t flow; // flow index at the traffic source
+    uint32_t hash; // RSS hash of the 5-tuple, as a NIC would deliver it
+    uint32_t seq; // packet number within its flow, from 1
+    uint32_t reserved;
+    uint64_t ingress; // rdtsc when the packet entered stage 0
+};
+
+#define PACKET_META_OFFSET ((sizeof(TCPHeader) + 7) & ~7)
+
+static inline PacketMeta *packet_meta(Packet *pkt) {
+    return (PacketMeta*)&pkt->tcpheader.pad[PACKET_META_OFFSET];
+}
+
 #define STATIC_ASSERT(COND,MSG) typedef char static_assert_##MSG[(COND)?1:-1]
 
 STATIC_ASSERT(HEADER_SIZE >= sizeof(Packet), PacketSize);
+STATIC_ASSERT(64 >= PACKET_META_OFFSET + sizeof(PacketMeta), PacketMetaSize);
 
 #endif // end of ifndef _NETWORK_UTILS_HPP__
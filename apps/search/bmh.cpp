@@ -23,63 +23,92 @@
 #include <cstdlib>
 #include <cstdint>
 #include <string>
+#include <vector>
 #include <iterator>
 #include <algorithm>
 #include <chrono> 
+#include <sys/stat.h>
 
 using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
 using std::chrono::nanoseconds;
 
 #include "timing.h"
+#include "strsearch.hpp"
+#include "multisearch.hpp"
 
 template < class T > class search : public raft::kernel
 {
 public:
-   search( const std::string && term ) : raft::kernel(),
-                                         term_length( term.length() ),
-                                         term( term )
+   search( const std::string &term,
+           const strsearch::algo kernel = strsearch::algo::automatic ) :
+      raft::kernel(),
+      matcher( term, kernel )
    {
       input.addPort<  T >( "0" );
       output.addPort< std::size_t >( "0" );
    }
-   
-   search( const std::string &term ) : raft::kernel(),
-                                       term_length( term.length() ),
-                                       term( term )
+
+   virtual ~search() = default;
+
+   virtual raft::kstatus run() override
+   {
+      auto &chunk( input[ "0" ].template peek< T >() );
+      matcher.each( chunk.buffer, chunk.length,
+                    [ & ]( const std::size_t offset )
+      {
+         output[ "0" ].push( chunk.start_position + offset );
+      } );
+      input[ "0" ].unpeek();
+      input[ "0" ].recycle( );
+      return( raft::proceed );
+   }
+private:
+   const strsearch::Searcher matcher;
+};
+
+/**
+ * multisearch - every term of a list at once, occurrences out as ( term
+ * index, offset ). Chunks overlap by `overlap' bytes, the longest term,
+ * and an occurrence lying wholly in the bytes a chunk shares with the one
+ * before was reported by that one already.
+ */
+template < class T > class multisearch : public raft::kernel
+{
+public:
+   multisearch( const std::vector< std::string > &terms,
+                const strsearch::multi_algo kernel,
+                const std::size_t overlap ) :
+      raft::kernel(),
+      matcher( terms, kernel ),
+      overlap( overlap )
    {
       input.addPort<  T >( "0" );
-      output.addPort< std::size_t >( "0" );
+      output.addPort< strsearch::hit >( "0" );
    }
 
-   virtual ~search() = default;
+   virtual ~multisearch() = default;
 
    virtual raft::kstatus run() override
    {
       auto &chunk( input[ "0" ].template peek< T >() );
-      auto it( chunk.begin() );
-      do
+      matcher.each( chunk.buffer, chunk.length,
+                    [ & ]( const std::size_t id, const std::size_t offset )
       {
-         it = std::search( it, chunk.end(),
-                           term.begin(), term.end() );
-         if( it != chunk.end() )
+         if( chunk.start_position == 0 ||
+             offset + matcher.length( id ) > overlap )
          {
-            output[ "0" ].push( it.location() );
-            it += 1;
+            output[ "0" ].push(
+               strsearch::hit{ id, chunk.start_position + offset } );
          }
-         else
-         {
-            break;
-         }
-      }
-      while( true );
+      } );
       input[ "0" ].unpeek();
       input[ "0" ].recycle( );
       return( raft::proceed );
    }
 private:
-   const std::size_t term_length;
-   const std::string term;
+   const strsearch::MultiSearcher matcher;
+   const std::size_t overlap;
 };
 
 int
@@ -89,27 +118,72 @@ main( int argc, char **argv )
     std::cerr << "chunk size: " << sizeof( chunk ) << "\n";
     using fr    = raft::filereader< chunk, false >;
     using search = search< chunk >;
+    using multisearch = multisearch< chunk >;
     using print = raft::print< std::size_t, '\n'>;
+    using print_hits = raft::print< strsearch::hit, '\n' >;
     
-    const std::string term( argv[ 2 ] );
     int kernel_count = 1;
     raft::map m;
     if( argc < 3 )
     {
-        std::cerr << "Usage: ./search <file.txt> <token> [#threads=1]\n";
+        std::cerr << "Usage: ./search <file.txt> <token|@terms.txt> "
+                     "[#threads=1] "
+                     "[std|horspool|twoway|avx2|auto=auto, "
+                     "each|ac|auto=auto with @terms.txt]\n";
         exit( EXIT_FAILURE );
-    } else if ( 4 <= argc )
+    }
+    if ( 4 <= argc )
     {
         kernel_count = atoi( argv[ 3 ] );
     }
+    std::vector< std::string > terms;
+    if( ! strsearch::load_terms( argv[ 2 ], terms ) || terms.empty() )
+    {
+        std::cerr << "Cannot read terms from " << argv[ 2 ] + 1 << "\n";
+        exit( EXIT_FAILURE );
+    }
+    const std::string kernel( 5 <= argc ? argv[ 4 ] : "auto" );
+    const bool many( argv[ 2 ][ 0 ] == '@' );
+    strsearch::algo algo = strsearch::algo::automatic;
+    strsearch::multi_algo multi_algo = strsearch::multi_algo::automatic;
+    if( many ? ! strsearch::parse_multi_algo( kernel, multi_algo ) :
+               ! strsearch::parse_algo( kernel, algo ) )
+    {
+        std::cerr << "Unknown search kernel " << kernel << "\n";
+        exit( EXIT_FAILURE );
+    }
+    std::size_t overlap( terms[ 0 ].length() );
+    if( many )
+    {
+        const strsearch::MultiSearcher probe( terms, multi_algo );
+        overlap = probe.longest();
+        std::cerr << "search kernel: " << probe.name() << "\n";
+    }
+    else
+    {
+        std::cerr << "search kernel: " <<
+            strsearch::Searcher( terms[ 0 ], algo ).name() << "\n";
+    }
 
-    fr   read( argv[ 1 ], (fr::offset_type) term.length(), kernel_count );
+    fr   read( argv[ 1 ], (fr::offset_type) overlap, kernel_count );
 
     print p( kernel_count );
+    print_hits ph( kernel_count );
     for( auto i( 0 ); i < kernel_count; i++ )
     {
-        m += read[ std::to_string( i ) ] >> 
-                raft::kernel::make< search >( term ) >> p[ std::to_string( i ) ];
+        if( many )
+        {
+            m += read[ std::to_string( i ) ] >> 
+                    raft::kernel::make< multisearch >( terms, multi_algo,
+                                                       overlap ) >>
+                    ph[ std::to_string( i ) ];
+        }
+        else
+        {
+            m += read[ std::to_string( i ) ] >> 
+                    raft::kernel::make< search >( terms[ 0 ], algo ) >>
+                    p[ std::to_string( i ) ];
+        }
     }
 
     const uint64_t beg_tsc = rdtsc();
@@ -128,5 +202,11 @@ main( int argc, char **argv )
     const auto elapsed( duration_cast< nanoseconds >( end - beg ) );
     std::cout << ( end_tsc - beg_tsc ) << " ticks elapsed\n";
     std::cout << elapsed.count() << " ns elapsed\n";
+    struct stat st;
+    if( stat( argv[ 1 ], &st ) == 0 && elapsed.count() > 0 )
+    {
+        std::cerr << terms.size() << " terms, " << st.st_size << " bytes, " <<
+            (double) st.st_size / elapsed.count() << " GB/s\n";
+    }
     return( EXIT_SUCCESS );
 }
@@ -0,0 +1,289 @@
+/**
+ * mmsearch.cpp - the search benchmark without RaftLib: the input is mmap'd
+ * and cut into chunks overlapped by term.length() - 1 bytes, so that an
+ * occurrence straddling two chunks is found once, by the chunk it starts
+ * in. Each thread of the pool scans a contiguous run of chunks into its
+ * own vector of offsets, and the vectors are merged in thread order, which
+ * is file order. With the chunk size set to that of bmh.cpp (48 bytes) the
+ * difference in time is what the streaming framework costs.
+ *
+ * Given "@file" for a token, the lines of file are all searched for at
+ * once (see multisearch.hpp) and an occurrence is printed as the index of
+ * its term and its offset. The bandwidth reported against the number of
+ * terms tells when to switch kernels, see scripts/search_sweep.sh.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <iostream>
+#include <chrono>
+
+using std::chrono::high_resolution_clock;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+
+#include "timing.h"
+#include "threading.h"
+#include "strsearch.hpp"
+#include "multisearch.hpp"
+
+/** default chunk size, large enough for the per-chunk cost to vanish **/
+static constexpr std::size_t default_chunk = 1 << 20;
+
+/**
+ * scan chunks [ first, last ) of buf, a chunk of `chunk' bytes plus the
+ * m - 1 following ones, and append the offsets found to `found'
+ */
+static void scan( const strsearch::Searcher &matcher,
+                  const char *buf,
+                  const std::size_t size,
+                  const std::size_t chunk,
+                  const std::size_t first,
+                  const std::size_t last,
+                  std::vector< std::size_t > &found )
+{
+   const std::size_t overlap( matcher.length() - 1 );
+   for( std::size_t c( first ); c < last; c++ )
+   {
+      const std::size_t start( c * chunk );
+      const std::size_t length( std::min( chunk + overlap, size - start ) );
+      matcher.each( buf + start, length, [ & ]( const std::size_t offset )
+      {
+         found.push_back( start + offset );
+      } );
+   }
+}
+
+/**
+ * the same for many terms, chunks overlapped by the longest one less a
+ * byte; an occurrence belongs to the chunk it starts in, and the
+ * occurrences of a chunk are sorted by offset, then term
+ */
+static void scan_multi( const strsearch::MultiSearcher &matcher,
+                        const char *buf,
+                        const std::size_t size,
+                        const std::size_t chunk,
+                        const std::size_t first,
+                        const std::size_t last,
+                        std::vector< strsearch::hit > &found )
+{
+   const std::size_t overlap( matcher.longest() - 1 );
+   for( std::size_t c( first ); c < last; c++ )
+   {
+      const std::size_t start( c * chunk );
+      const std::size_t length( std::min( chunk + overlap, size - start ) );
+      const std::size_t from( found.size() );
+      matcher.each( buf + start, length,
+                    [ & ]( const std::size_t id, const std::size_t offset )
+      {
+         if( offset < chunk )
+         {
+            found.push_back( { id, start + offset } );
+         }
+      } );
+      std::sort( found.begin() + from, found.end() );
+   }
+}
+
+/**
+ * run scan_one over the chunks on thread_count threads, returning the
+ * occurrences in file order and the time taken
+ */
+template < class Hit, class Scan >
+static std::vector< Hit > run_pool( const int thread_count,
+                                    const std::size_t chunk_count,
+                                    Scan &&scan_one,
+                                    uint64_t &ticks,
+                                    nanoseconds &elapsed )
+{
+    std::vector< std::vector< Hit > > found( thread_count );
+    std::vector< std::thread > pool;
+    const int cores( std::max( 1u, std::thread::hardware_concurrency() ) );
+
+    const uint64_t beg_tsc = rdtsc();
+    const auto beg( high_resolution_clock::now() );
+
+    for( auto i( 0 ); i < thread_count; i++ )
+    {
+        /** a contiguous run of chunks each, so thread order is file order **/
+        const std::size_t first( chunk_count * i / thread_count );
+        const std::size_t last( chunk_count * ( i + 1 ) / thread_count );
+        pool.emplace_back( [ &, i, first, last ]()
+        {
+            setAffinity( i % cores );
+            scan_one( first, last, found[ i ] );
+        } );
+    }
+    for( auto &t : pool )
+    {
+        t.join();
+    }
+    std::vector< Hit > hits;
+    std::size_t total( 0 );
+    for( const auto &f : found )
+    {
+        total += f.size();
+    }
+    hits.reserve( total );
+    for( const auto &f : found )
+    {
+        hits.insert( hits.end(), f.begin(), f.end() );
+    }
+
+    const uint64_t end_tsc = rdtsc();
+    const auto end( high_resolution_clock::now() );
+    ticks = end_tsc - beg_tsc;
+    elapsed = duration_cast< nanoseconds >( end - beg );
+    return( hits );
+}
+
+template < class Hit >
+static void report( const std::vector< Hit > &hits,
+                    const std::size_t term_count,
+                    const std::size_t size,
+                    const uint64_t ticks,
+                    const nanoseconds elapsed )
+{
+    for( const auto &h : hits )
+    {
+        std::cout << h << '\n';
+    }
+    std::cout << ticks << " ticks elapsed\n";
+    std::cout << elapsed.count() << " ns elapsed\n";
+    std::cerr << term_count << " terms, " << hits.size() << " matches in " <<
+        size << " bytes, " <<
+        ( elapsed.count() ? (double) size / elapsed.count() : 0.0 ) <<
+        " GB/s\n";
+}
+
+int
+main( int argc, char **argv )
+{
+    int thread_count = 1;
+    std::size_t chunk = default_chunk;
+    if( argc < 3 )
+    {
+        std::cerr << "Usage: ./search_mmap <file.txt> <token|@terms.txt> "
+                     "[#threads=1] "
+                     "[std|horspool|twoway|avx2|auto=auto, "
+                     "each|ac|auto=auto with @terms.txt] "
+                     "[chunk bytes=" << default_chunk << "]\n";
+        exit( EXIT_FAILURE );
+    }
+    if( 4 <= argc )
+    {
+        thread_count = atoi( argv[ 3 ] );
+    }
+    if( 6 <= argc )
+    {
+        chunk = strtoull( argv[ 5 ], nullptr, 0 );
+    }
+    if( thread_count < 1 || chunk == 0 )
+    {
+        std::cerr << "Need at least one thread and one byte a chunk\n";
+        exit( EXIT_FAILURE );
+    }
+    std::vector< std::string > terms;
+    if( ! strsearch::load_terms( argv[ 2 ], terms ) )
+    {
+        std::cerr << "Cannot read terms from " << argv[ 2 ] + 1 << "\n";
+        exit( EXIT_FAILURE );
+    }
+    if( terms.empty() || std::any_of( terms.begin(), terms.end(),
+            []( const std::string &t ){ return( t.empty() ); } ) )
+    {
+        std::cerr << "Empty search term\n";
+        exit( EXIT_FAILURE );
+    }
+    const std::string kernel( 5 <= argc ? argv[ 4 ] : "auto" );
+    std::unique_ptr< strsearch::Searcher > single;
+    std::unique_ptr< strsearch::MultiSearcher > multi;
+    if( argv[ 2 ][ 0 ] == '@' )
+    {
+        strsearch::multi_algo algo;
+        if( ! strsearch::parse_multi_algo( kernel, algo ) )
+        {
+            std::cerr << "Unknown multi-term search kernel " << kernel << "\n";
+            exit( EXIT_FAILURE );
+        }
+        multi.reset( new strsearch::MultiSearcher( terms, algo ) );
+        std::cerr << "search kernel: " << multi->name() << "\n";
+    }
+    else
+    {
+        strsearch::algo algo;
+        if( ! strsearch::parse_algo( kernel, algo ) )
+        {
+            std::cerr << "Unknown search kernel " << kernel << "\n";
+            exit( EXIT_FAILURE );
+        }
+        single.reset( new strsearch::Searcher( terms[ 0 ], algo ) );
+        std::cerr << "search kernel: " << single->name() << "\n";
+    }
+    std::cerr << "chunk size: " << chunk << "\n";
+
+    const int fd( open( argv[ 1 ], O_RDONLY ) );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) != 0 )
+    {
+        std::cerr << "Cannot open " << argv[ 1 ] << ": " <<
+            strerror( errno ) << "\n";
+        exit( EXIT_FAILURE );
+    }
+    const std::size_t size( st.st_size );
+    const char *buf( nullptr );
+    if( size > 0 )
+    {
+        void *map( mmap( nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0 ) );
+        if( map == MAP_FAILED )
+        {
+            std::cerr << "Cannot map " << argv[ 1 ] << ": " <<
+                strerror( errno ) << "\n";
+            exit( EXIT_FAILURE );
+        }
+        madvise( map, size, MADV_SEQUENTIAL );
+        buf = (const char*) map;
+    }
+    close( fd );
+
+    const std::size_t chunk_count( ( size + chunk - 1 ) / chunk );
+    uint64_t ticks( 0 );
+    nanoseconds elapsed( 0 );
+    if( multi )
+    {
+        const auto hits( run_pool< strsearch::hit >( thread_count, chunk_count,
+            [ & ]( const std::size_t first, const std::size_t last,
+                   std::vector< strsearch::hit > &found )
+        {
+            scan_multi( *multi, buf, size, chunk, first, last, found );
+        }, ticks, elapsed ) );
+        report( hits, multi->count(), size, ticks, elapsed );
+    }
+    else
+    {
+        const auto hits( run_pool< std::size_t >( thread_count, chunk_count,
+            [ & ]( const std::size_t first, const std::size_t last,
+                   std::vector< std::size_t > &found )
+        {
+            scan( *single, buf, size, chunk, first, last, found );
+        }, ticks, elapsed ) );
+        report( hits, 1, size, ticks, elapsed );
+    }
+
+    if( size > 0 )
+    {
+        munmap( (void*) buf, size );
+    }
+    return( EXIT_SUCCESS );
+}
@@ -0,0 +1,302 @@
+/**
+ * multisearch.hpp - many terms in one pass, for grep-like workloads
+ * matching hundreds of literal tokens at once.
+ *
+ *   ac   - Aho-Corasick automaton compiled to a DFA, one table lookup a
+ *          byte whatever the number of terms
+ *   each - a strsearch::Searcher per term, one pass over the buffer each,
+ *          cheaper than the automaton for a few dozen terms
+ *   auto - each up to multi_threshold terms, ac above
+ */
+#ifndef _SEARCH_MULTISEARCH_HPP__
+#define _SEARCH_MULTISEARCH_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ostream>
+#include <algorithm>
+
+#include "strsearch.hpp"
+
+namespace strsearch
+{
+
+enum class multi_algo { each, ac, automatic };
+
+/**
+ * more terms than this go to the automaton under auto; with AVX2 the
+ * passes of each stay ahead of ac up to a few dozen words of English-like
+ * text, see scripts/search_sweep.sh
+ */
+static constexpr std::size_t multi_threshold = 32;
+
+/** kernel by name, false for an unknown one **/
+static inline bool parse_multi_algo( const std::string &name, multi_algo &a )
+{
+   if( name == "each" ) { a = multi_algo::each; }
+   else if( name == "ac" ) { a = multi_algo::ac; }
+   else if( name == "auto" ) { a = multi_algo::automatic; }
+   else { return( false ); }
+   return( true );
+}
+
+/**
+ * terms of a search, "@file" for one a line of file, empty lines skipped,
+ * anything else for that term alone; false if the file is unreadable
+ */
+static inline bool load_terms( const std::string &arg,
+                               std::vector< std::string > &terms )
+{
+   terms.clear();
+   if( arg.empty() || arg[ 0 ] != '@' )
+   {
+      terms.push_back( arg );
+      return( true );
+   }
+   std::ifstream in( arg.substr( 1 ) );
+   if( ! in )
+   {
+      return( false );
+   }
+   std::string line;
+   while( std::getline( in, line ) )
+   {
+      if( ! line.empty() && line.back() == '\r' )
+      {
+         line.pop_back();
+      }
+      if( ! line.empty() )
+      {
+         terms.push_back( line );
+      }
+   }
+   return( true );
+}
+
+/** an occurrence of term id at offset **/
+struct hit
+{
+   std::size_t id;
+   std::size_t offset;
+
+   bool operator < ( const hit &other ) const
+   {
+      return( offset < other.offset ||
+              ( offset == other.offset && id < other.id ) );
+   }
+};
+
+static inline std::ostream& operator << ( std::ostream &stream, const hit &h )
+{
+   return( stream << h.id << ' ' << h.offset );
+}
+
+/**
+ * MultiSearcher - terms and the kernel picked for them. each() calls
+ * f( id, offset ) for every occurrence of every term in a buffer, id
+ * being the index of the term, overlapping ones included. ac reports
+ * them by end, each term by term.
+ */
+class MultiSearcher
+{
+public:
+   MultiSearcher( const std::vector< std::string > &terms,
+                  const multi_algo requested = multi_algo::automatic )
+      : kernel( requested )
+   {
+      if( kernel == multi_algo::automatic )
+      {
+         kernel = terms.size() > multi_threshold ? multi_algo::ac :
+                                                   multi_algo::each;
+      }
+      for( const auto &term : terms )
+      {
+         lengths.push_back( term.length() );
+         longest_term = std::max( longest_term, term.length() );
+      }
+      if( kernel == multi_algo::ac )
+      {
+         init_ac( terms );
+      }
+      else
+      {
+         for( const auto &term : terms )
+         {
+            searchers.emplace_back( term );
+         }
+      }
+   }
+
+   multi_algo which() const { return( kernel ); }
+   const char* name() const
+   {
+      return( kernel == multi_algo::ac ? "ac" : "each" );
+   }
+   std::size_t count() const { return( lengths.size() ); }
+   std::size_t length( const std::size_t id ) const { return( lengths[ id ] ); }
+   std::size_t longest() const { return( longest_term ); }
+
+   template < class F > void each( const char *buf,
+                                   const std::size_t n,
+                                   F &&f ) const
+   {
+      if( kernel == multi_algo::ac )
+      {
+         ac( buf, n, f );
+         return;
+      }
+      for( std::size_t id( 0 ); id < searchers.size(); id++ )
+      {
+         searchers[ id ].each( buf, n, [ & ]( const std::size_t offset )
+         {
+            f( id, offset );
+         } );
+      }
+   }
+
+private:
+   /** top bit of a transition, its target ends at least one term **/
+   static constexpr std::uint32_t MATCH = 0x80000000;
+
+   /**
+    * bytes in no term share input class 0, so rows are only as wide as the
+    * number of classes; a transition holds the row offset of its target,
+    * with MATCH set when terms end there, listed in
+    * outputs[ first[ s ]..first[ s + 1 ] ) for state s
+    */
+   void init_ac( const std::vector< std::string > &terms )
+   {
+      std::fill( classes, classes + 256, 0 );
+      nclasses = 1;
+      for( const auto &term : terms )
+      {
+         for( const auto c : term )
+         {
+            if( classes[ (std::uint8_t) c ] == 0 )
+            {
+               classes[ (std::uint8_t) c ] = nclasses++;
+            }
+         }
+      }
+
+      /** the trie of the terms, -1 for a missing edge **/
+      std::vector< std::int64_t > trie( nclasses, -1 );
+      std::vector< std::vector< std::uint32_t > > ends( 1 );
+      for( std::size_t id( 0 ); id < terms.size(); id++ )
+      {
+         if( terms[ id ].empty() )
+         {
+            continue;
+         }
+         std::size_t s( 0 );
+         for( const auto c : terms[ id ] )
+         {
+            const std::size_t edge( s * nclasses + classes[ (std::uint8_t) c ] );
+            if( trie[ edge ] < 0 )
+            {
+               trie[ edge ] = ends.size();
+               ends.emplace_back();
+               trie.resize( trie.size() + nclasses, -1 );
+            }
+            s = trie[ edge ];
+         }
+         ends[ s ].push_back( id );
+      }
+
+      /**
+       * breadth first, a missing edge goes where the failure link of the
+       * state goes, which is already complete, and a state also ends the
+       * terms its failure link ends
+       */
+      const std::size_t nstates( ends.size() );
+      std::vector< std::uint32_t > next( trie.size(), 0 );
+      std::vector< std::uint32_t > fail( nstates, 0 );
+      std::vector< std::uint32_t > queue;
+      for( std::uint32_t c( 0 ); c < nclasses; c++ )
+      {
+         if( trie[ c ] >= 0 )
+         {
+            next[ c ] = trie[ c ];
+            queue.push_back( trie[ c ] );
+         }
+      }
+      for( std::size_t q( 0 ); q < queue.size(); q++ )
+      {
+         const std::uint32_t s( queue[ q ] );
+         const auto &inherited( ends[ fail[ s ] ] );
+         ends[ s ].insert( ends[ s ].end(), inherited.begin(), inherited.end() );
+         for( std::uint32_t c( 0 ); c < nclasses; c++ )
+         {
+            const std::int64_t t( trie[ s * nclasses + c ] );
+            if( t < 0 )
+            {
+               next[ s * nclasses + c ] = next[ fail[ s ] * nclasses + c ];
+            }
+            else
+            {
+               fail[ t ] = next[ fail[ s ] * nclasses + c ];
+               next[ s * nclasses + c ] = t;
+               queue.push_back( t );
+            }
+         }
+      }
+
+      first.assign( 1, 0 );
+      for( std::size_t s( 0 ); s < nstates; s++ )
+      {
+         outputs.insert( outputs.end(), ends[ s ].begin(), ends[ s ].end() );
+         first.push_back( outputs.size() );
+      }
+      delta.resize( next.size() );
+      for( std::size_t i( 0 ); i < next.size(); i++ )
+      {
+         delta[ i ] = next[ i ] * nclasses |
+                      ( ends[ next[ i ] ].empty() ? 0 : MATCH );
+      }
+   }
+
+   template < class F > void ac( const char *buf,
+                                 const std::size_t n,
+                                 F &f ) const
+   {
+      if( delta.empty() )
+      {
+         return;
+      }
+      std::uint32_t s( 0 );
+      for( std::size_t i( 0 ); i < n; i++ )
+      {
+         s = delta[ s + classes[ (std::uint8_t) buf[ i ] ] ];
+         if( s & MATCH )
+         {
+            s &= ~MATCH;
+            const std::size_t state( s / nclasses );
+            for( auto o( first[ state ] ); o < first[ state + 1 ]; o++ )
+            {
+               const std::uint32_t id( outputs[ o ] );
+               f( id, i + 1 - lengths[ id ] );
+            }
+         }
+      }
+   }
+
+   multi_algo kernel;
+   std::vector< std::size_t > lengths;
+   std::size_t longest_term = 0;
+   /** each **/
+   std::vector< Searcher > searchers;
+   /** ac **/
+   std::uint8_t classes[ 256 ];
+   std::uint32_t nclasses = 1;
+   std::vector< std::uint32_t > delta;
+   std::vector< std::uint32_t > first;
+   std::vector< std::uint32_t > outputs;
+};
+
+} /** end namespace strsearch **/
+
+#endif /* END _SEARCH_MULTISEARCH_HPP__ */
@@ -0,0 +1,358 @@
+/**
+ * strsearch.hpp - substring search kernels for the search benchmark,
+ * picked at runtime so the cost of the matcher can be told apart from
+ * that of the queues feeding it.
+ *
+ *   std      - std::search, the naive matcher the benchmark started with
+ *   horspool - Boyer-Moore-Horspool, last byte first with a skip table
+ *   twoway   - Crochemore-Perrin two-way, linear time in the worst case
+ *   avx2     - 32 positions at a time filtered on the first and last byte
+ *              of the term, candidates verified with memcmp
+ *   auto     - avx2 when the CPU has it, otherwise horspool, and twoway
+ *              for terms long enough for horspool to degrade
+ */
+#ifndef _SEARCH_STRSEARCH_HPP__
+#define _SEARCH_STRSEARCH_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define STRSEARCH_HAVE_AVX2 1
+#endif
+
+namespace strsearch
+{
+
+enum class algo { std, horspool, twoway, avx2, automatic };
+
+/** terms at least this long go to two-way under auto **/
+static constexpr std::size_t twoway_threshold = 256;
+
+static inline bool cpu_has_avx2()
+{
+#ifdef STRSEARCH_HAVE_AVX2
+   return( __builtin_cpu_supports( "avx2" ) );
+#else
+   return( false );
+#endif
+}
+
+/** kernel by name, false for an unknown one **/
+static inline bool parse_algo( const std::string &name, algo &a )
+{
+   if( name == "std" ) { a = algo::std; }
+   else if( name == "horspool" ) { a = algo::horspool; }
+   else if( name == "twoway" ) { a = algo::twoway; }
+   else if( name == "avx2" ) { a = algo::avx2; }
+   else if( name == "auto" ) { a = algo::automatic; }
+   else { return( false ); }
+   return( true );
+}
+
+static inline const char* algo_name( const algo a )
+{
+   switch( a )
+   {
+      case( algo::std ):      return( "std" );
+      case( algo::horspool ): return( "horspool" );
+      case( algo::twoway ):   return( "twoway" );
+      case( algo::avx2 ):     return( "avx2" );
+      default:                return( "auto" );
+   }
+}
+
+#ifdef STRSEARCH_HAVE_AVX2
+/**
+ * bit i of the result is set when a term starting at buf + i may match:
+ * its first byte at i and its last byte at i + m - 1, for 32 positions
+ */
+__attribute__(( target( "avx2" ) ))
+static inline std::uint32_t avx2_candidates( const char *buf,
+                                             const std::size_t m,
+                                             const __m256i first,
+                                             const __m256i last )
+{
+   const __m256i a( _mm256_loadu_si256( (const __m256i*) buf ) );
+   const __m256i b( _mm256_loadu_si256( (const __m256i*) ( buf + m - 1 ) ) );
+   return( _mm256_movemask_epi8(
+      _mm256_and_si256( _mm256_cmpeq_epi8( a, first ),
+                        _mm256_cmpeq_epi8( b, last ) ) ) );
+}
+#endif
+
+/**
+ * Searcher - a term and the tables of the kernel picked for it. each()
+ * calls f( offset ) for every occurrence of the term in a buffer, in
+ * order, overlapping ones included.
+ */
+class Searcher
+{
+public:
+   Searcher( const std::string &term, const algo requested = algo::automatic )
+      : term( term ), m( term.length() ), kernel( requested )
+   {
+      if( kernel == algo::automatic )
+      {
+         if( m >= twoway_threshold )
+         {
+            kernel = algo::twoway;
+         }
+         else
+         {
+            kernel = cpu_has_avx2() ? algo::avx2 : algo::horspool;
+         }
+      }
+      else if( kernel == algo::avx2 && ! cpu_has_avx2() )
+      {
+         kernel = algo::horspool;
+      }
+      if( m == 0 )
+      {
+         kernel = algo::std;
+      }
+      switch( kernel )
+      {
+         case( algo::horspool ):
+            init_horspool();
+            break;
+         case( algo::twoway ):
+            init_twoway();
+            break;
+         default:
+            break;
+      }
+   }
+
+   algo which() const { return( kernel ); }
+   const char* name() const { return( algo_name( kernel ) ); }
+   std::size_t length() const { return( m ); }
+
+   template < class F > void each( const char *buf,
+                                   const std::size_t n,
+                                   F &&f ) const
+   {
+      if( m == 0 || n < m )
+      {
+         return;
+      }
+      switch( kernel )
+      {
+         case( algo::horspool ):
+            horspool( buf, n, f );
+            break;
+         case( algo::twoway ):
+            twoway( buf, n, f );
+            break;
+#ifdef STRSEARCH_HAVE_AVX2
+         case( algo::avx2 ):
+            avx2( buf, n, f );
+            break;
+#endif
+         default:
+            naive( buf, n, f );
+            break;
+      }
+   }
+
+private:
+   template < class F > void naive( const char *buf,
+                                    const std::size_t n,
+                                    F &f ) const
+   {
+      const char *end( buf + n );
+      for( const char *it( buf ); it != end; ++it )
+      {
+         it = std::search( it, end, term.begin(), term.end() );
+         if( it == end )
+         {
+            break;
+         }
+         f( it - buf );
+      }
+   }
+
+   /** distance to shift for each byte found under the last byte of the term **/
+   void init_horspool()
+   {
+      std::fill( skip, skip + 256, m );
+      for( std::size_t i( 0 ); i + 1 < m; i++ )
+      {
+         skip[ (std::uint8_t) term[ i ] ] = m - 1 - i;
+      }
+   }
+
+   template < class F > void horspool( const char *buf,
+                                       const std::size_t n,
+                                       F &f ) const
+   {
+      const char *x( term.data() );
+      const std::size_t last( m - 1 );
+      std::size_t j( 0 );
+      while( j + m <= n )
+      {
+         const std::uint8_t c( buf[ j + last ] );
+         if( c == (std::uint8_t) x[ last ] &&
+             0 == std::memcmp( buf + j, x, last ) )
+         {
+            f( j );
+         }
+         j += skip[ c ];
+      }
+   }
+
+   /**
+    * start of the maximal suffix of the term, under the byte order or its
+    * reverse, and the period of that suffix
+    */
+   std::ptrdiff_t maximal_suffix( const bool reverse, std::size_t &period ) const
+   {
+      const std::uint8_t *x( (const std::uint8_t*) term.data() );
+      std::ptrdiff_t ms( -1 );
+      std::size_t j( 0 ), k( 1 );
+      period = 1;
+      while( j + k < m )
+      {
+         const std::uint8_t a( x[ j + k ] );
+         const std::uint8_t b( x[ ms + k ] );
+         if( reverse ? ( a > b ) : ( a < b ) )
+         {
+            j += k;
+            k = 1;
+            period = j - ms;
+         }
+         else if( a == b )
+         {
+            if( k != period )
+            {
+               k++;
+            }
+            else
+            {
+               j += period;
+               k = 1;
+            }
+         }
+         else
+         {
+            ms = j;
+            j = ms + 1;
+            k = period = 1;
+         }
+      }
+      return( ms );
+   }
+
+   /** critical factorization of the term, x = x[ 0..ell ] x[ ell+1..m ) **/
+   void init_twoway()
+   {
+      std::size_t p, q;
+      const std::ptrdiff_t i( maximal_suffix( false, p ) );
+      const std::ptrdiff_t j( maximal_suffix( true, q ) );
+      if( i > j )
+      {
+         ell = i;
+         period = p;
+      }
+      else
+      {
+         ell = j;
+         period = q;
+      }
+      periodic = 0 == std::memcmp( term.data(), term.data() + period, ell + 1 );
+      if( ! periodic )
+      {
+         period = std::max< std::size_t >( ell + 1, m - ell - 1 ) + 1;
+      }
+   }
+
+   template < class F > void twoway( const char *buf,
+                                     const std::size_t n,
+                                     F &f ) const
+   {
+      const char *x( term.data() );
+      const std::ptrdiff_t len( m );
+      std::size_t j( 0 );
+      /** prefix already known to match after a shift by the period **/
+      std::ptrdiff_t memory( -1 );
+      while( j + m <= n )
+      {
+         const char *y( buf + j );
+         /** right half left to right, after what is remembered **/
+         std::ptrdiff_t i( std::max( ell, memory ) + 1 );
+         while( i < len && x[ i ] == y[ i ] )
+         {
+            i++;
+         }
+         if( i < len )
+         {
+            j += i - ell;
+            memory = -1;
+            continue;
+         }
+         /** then the left half right to left **/
+         i = ell;
+         while( i > memory && x[ i ] == y[ i ] )
+         {
+            i--;
+         }
+         if( i <= memory )
+         {
+            f( j );
+         }
+         j += period;
+         memory = periodic ? len - period - 1 : -1;
+      }
+   }
+
+#ifdef STRSEARCH_HAVE_AVX2
+   template < class F >
+   __attribute__(( target( "avx2" ) ))
+   void avx2( const char *buf, const std::size_t n, F &f ) const
+   {
+      const char *x( term.data() );
+      const std::size_t middle( m > 2 ? m - 2 : 0 );
+      const __m256i first( _mm256_set1_epi8( x[ 0 ] ) );
+      const __m256i last( _mm256_set1_epi8( x[ m - 1 ] ) );
+      std::size_t i( 0 );
+      /** both loads of a block stay within the buffer **/
+      for( ; i + m - 1 + 32 <= n; i += 32 )
+      {
+         std::uint32_t mask( avx2_candidates( buf + i, m, first, last ) );
+         for( ; mask != 0; mask &= mask - 1 )
+         {
+            const std::size_t pos( i + __builtin_ctz( mask ) );
+            if( 0 == std::memcmp( buf + pos + 1, x + 1, middle ) )
+            {
+               f( pos );
+            }
+         }
+      }
+      /** fewer than 32 positions left **/
+      for( ; i + m <= n; i++ )
+      {
+         if( buf[ i ] == x[ 0 ] && 0 == std::memcmp( buf + i, x, m ) )
+         {
+            f( i );
+         }
+      }
+   }
+#endif
+
+   const std::string term;
+   const std::size_t m;
+   algo kernel;
+   /** horspool **/
+   std::size_t skip[ 256 ];
+   /** two-way **/
+   std::ptrdiff_t ell = -1;
+   std::size_t period = 1;
+   bool periodic = false;
+};
+
+} /** end namespace strsearch **/
+
+#endif /* END _SEARCH_STRSEARCH_HPP__ */
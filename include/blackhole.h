@@ -0,0 +1,43 @@
+#ifndef _BLACKHOLE_H__
+#define _BLACKHOLE_H__  1
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TOKENS_MAX_HIGH    1000000        /* good for ~41500 cntvct cycles */
+
+/*
+ * Burn cpu time in a tight loop of iters iterations (tokens), without
+ * touching memory or the clock.
+ */
+extern void blackhole(unsigned long iters);
+
+/*
+ * Binary search for the number of tokens between tokens_low and
+ * tokens_high that makes blackhole() last target timer ticks.
+ */
+extern unsigned long calibrate_blackhole(unsigned long target,
+                                         unsigned long tokens_low,
+                                         unsigned long tokens_high,
+                                         unsigned long core_id);
+
+extern int64_t evaluate_loop_overhead(const unsigned long NUMTRIES);
+extern int64_t evaluate_timer_overhead(void);
+extern int64_t evaluate_blackhole(const unsigned long tokens_mid,
+                                  const unsigned long NUMTRIES);
+
+/*
+ * Calibrated tokens for a blackhole() of about nsec nanoseconds on the
+ * calling core.
+ */
+extern unsigned long blackhole_tokens_ns(unsigned long nsec,
+                                         unsigned long core_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* END _BLACKHOLE_H__ */
@@ -35,8 +35,9 @@
 
 /* 
  * perf_timer.h
- * Functions to read hardware timers, query timer frequency, and a
+ * Functions to read hardware timers and query timer frequency, the
  * blackhole function that wastes cpu time (useful for nanosecond waits)
+ * and its calibration are declared in blackhole.h
  * Supports x86 and AArch64 platforms
  *
  * Define DEBUG in makefile or here if you desire debug output,
@@ -54,7 +55,7 @@
 #include <unistd.h>    /* for access() */
 #include <math.h>
 
-#include "atomics.h"
+#include <stdio.h>
 
 extern __thread uint64_t prev_tsc;
 
@@ -307,188 +308,7 @@ timer_get_cnt_freq(void)
 #endif
     return cnt_freq;
 }
-#endif
 
-#define TOKENS_MAX_HIGH    1000000        /* good for ~41500 cntvct cycles */
-#define THRESHOLD    1.05            // if the ratio of cycles to do the total eval loop  to  the sum of the individual
-                                     // calls (e.g. due to context switch), rerun
+#include "blackhole.h"
 
-void __attribute__((noinline, optimize("no-unroll-loops"))) blackhole(unsigned long iters) {
-    if (! iters) { return; }
-#ifdef __aarch64__
-    __asm__ volatile (".p2align 4; 1: add %0, %0, -1; cbnz  %0, 1b" : "+r" (iters));
-#elif __x86_64__
-    __asm__ volatile (".p2align 4; 1: add $-1, %0; jne 1b" : "+r" (iters) );
 #endif
-}
-
-
-int64_t __attribute__((noinline, optimize("no-unroll-loops"))) evaluate_loop_overhead(const unsigned long NUMTRIES)
-{
-    uint64_t LOOP_TEST_OVERHEAD = 0;
-    int64_t outer_cycles_start, outer_cycles_end;
-    unsigned long i, j;
-    int64_t outer_elapsed_total = 0;
-
-    for (j = 0; j < 1000; j++) {
-        int64_t elapsed_total = 0;
-        outer_cycles_start = timer_get_counter_start();
-        for (i = 0; i < NUMTRIES; i++) {
-
-            uint64_t cycles_start, cycles_end;
-            cycles_start = timer_get_counter_start();
-            cycles_end = timer_get_counter_end();
-
-            int64_t elapsed  = MAX((int64_t)(cycles_end - cycles_start), 0);
-            elapsed_total += elapsed;
-        }
-        outer_cycles_end = timer_get_counter_end();
-        outer_elapsed_total = outer_cycles_end - outer_cycles_start;
-        LOOP_TEST_OVERHEAD += (outer_elapsed_total - elapsed_total);
-    }
-    LOOP_TEST_OVERHEAD = LOOP_TEST_OVERHEAD/j;
-    return LOOP_TEST_OVERHEAD;
-}
-
-
-int64_t evaluate_timer_overhead(void)
-{
-    uint64_t TIMER_OVERHEAD = 0;
-    int64_t outer_cycles_start, outer_cycles_end;
-    outer_cycles_start = timer_get_counter_start();
-    outer_cycles_end = timer_get_counter_end();
-    // Force measurement to 0 if it somehow goes negative
-    int64_t elapsed  = MAX(outer_cycles_end - outer_cycles_start, 0);
-    TIMER_OVERHEAD = elapsed;
-    return TIMER_OVERHEAD;
-}
-
-
-int64_t  __attribute__((noinline, optimize("no-unroll-loops"))) evaluate_blackhole(
-        const unsigned long tokens_mid, const unsigned long NUMTRIES)
-{
-    unsigned long i, j;
-    int64_t sum_elapsed_total = 0;
-    int64_t avg_elapsed_total = 0;
-#ifdef DDEBUG
-    int64_t outer_cycles_start, outer_cycles_end;
-    int64_t outer_elapsed_total;
-    int64_t outer_inner_diff;
-    int64_t elapsed_total_diff;
-    double percent;
-    int64_t LOOP_TEST_OVERHEAD = evaluate_loop_overhead(NUMTRIES);
-#endif
-
-    int64_t TIMER_OVERHEAD = evaluate_timer_overhead();
-
-    for (j = 0; j < NUMTRIES; j++) {
-
-        int64_t elapsed_total = 0;
-
-#ifdef DDEBUG
-        outer_cycles_start = timer_get_counter_start();
-#endif
-        for (i = 0; i < NUMTRIES; i++) {
-
-            uint64_t cycles_start, cycles_end;
-            cycles_start = timer_get_counter_start();
-            blackhole(tokens_mid);
-            cycles_end = timer_get_counter_end();
-
-            uint64_t elapsed  = cycles_end - cycles_start;
-                    // printf("elapsed = %lu\n", elapsed);
-
-            elapsed_total += elapsed;
-        }
-#ifdef DDEBUG
-        outer_cycles_end = timer_get_counter_end();
-#endif
-
-
-        // Force measurements to zero if overhead swamps loop run time, in this
-        // case we can't measure this low of a requested time accurately.
-        sum_elapsed_total += MAX((int64_t)(elapsed_total - TIMER_OVERHEAD*NUMTRIES), 0);
-        avg_elapsed_total = sum_elapsed_total / (j + 1);
-
-#ifdef DDEBUG
-        outer_elapsed_total = outer_cycles_end - outer_cycles_start;
-        outer_inner_diff = abs(outer_elapsed_total - elapsed_total);
-        elapsed_total_diff = abs(avg_elapsed_total - elapsed_total);
-        if (outer_inner_diff > LOOP_TEST_OVERHEAD) {
-            percent = outer_inner_diff / (double) LOOP_TEST_OVERHEAD;
-        } else {
-            percent =  LOOP_TEST_OVERHEAD/ (double) outer_inner_diff;
-        }
-
-        printf("outer_elapsed_total = %lu "
-               "elapsed_total = %lu "
-               "outer_inner_diff = %lu percent_oh = %f percent_loop = %f\n",
-               outer_elapsed_total, elapsed_total, outer_inner_diff, percent,
-               (double) elapsed_total_diff / avg_elapsed_total);
-#endif
-    }
-
-    // returns average duration of NUMTRIES calls to blackhole with tokens_mid
-    long result = avg_elapsed_total;
-    return result;
-}
-
-unsigned long calibrate_blackhole(unsigned long target, unsigned long tokens_low, unsigned long tokens_high,
-        unsigned long core_id)
-{
-    unsigned long tokens_diff = tokens_high - tokens_low;
-    unsigned long tokens_mid = (tokens_diff / 2) + tokens_low;
-    unsigned long NUMTRIES = 15;
-    unsigned long target_elapsed_total = NUMTRIES * target;
-
-#ifdef DDEBUG
-    printf("target = %lu, target_elapsed_total = %lu, tokens_low = %lu, tokens_high = %lu, "
-           "tokens_diff = %lu, tokens_mid = %lu\n",
-            target, target_elapsed_total, tokens_low, tokens_high, tokens_diff, tokens_mid);
-#endif
-
-    if (tokens_diff == 1) {
-        // the answer is either tokens_low or tokens_high
-
-        unsigned long ret_low = evaluate_blackhole(tokens_low, NUMTRIES);
-        unsigned long ret_high = evaluate_blackhole(tokens_high, NUMTRIES);
-
-#ifdef DEBUG
-    printf("t(%lu) = %lu, tokens_mid = %lu target_elapsed_total = %lu\n",
-            core_id, ret_low, tokens_low, target_elapsed_total);
-    printf("t(%lu) = %lu, tokens_mid = %lu target_elapsed_total = %lu\n",
-            core_id, ret_high, tokens_high, target_elapsed_total);
-#endif
-        long low_diff = abs(ret_low - target_elapsed_total);    
-        long high_diff = abs(ret_high - target_elapsed_total);
-
-        if (low_diff < high_diff) {
-            if (tokens_low >= (TOKENS_MAX_HIGH-1)) {
-                printf("tokens is TOKENS_MAX_HIGH or TOKENS_MAX_HIGH -1.  requested delay is too long or too short.\n");
-            }
-
-            return tokens_low;
-        }
-
-        if (tokens_high >= (TOKENS_MAX_HIGH-1)) {
-            printf("tokens is TOKENS_MAX_HIGH or TOKENS_MAX_HIGH -1.  requested delay is too long or too short.\n");
-        }
-
-        return tokens_high;
-    }
-
-    // Measure if this # of tokens is the proper #.
-    unsigned long t = evaluate_blackhole(tokens_mid, NUMTRIES);
- 
-#ifdef DEBUG
-    printf("t(%lu) = %lu, tokens_mid = %lu target_elapsed_total = %lu\n", core_id, t, tokens_mid, target_elapsed_total);
-#endif
-
-    if (t > target_elapsed_total) {
-        tokens_mid = calibrate_blackhole(target, tokens_low, tokens_mid, core_id);
-    } else if (t < target_elapsed_total) {
-        tokens_mid = calibrate_blackhole(target, tokens_mid, tokens_high, core_id);
-    }
-
-    return tokens_mid;
-}
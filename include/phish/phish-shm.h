@@ -0,0 +1,126 @@
+#ifndef PHISH_SHM_H
+#define PHISH_SHM_H
+
+// Layout of the shared memory segment used by the shm backend.  The bait
+// creates one segment per run, holding a doorbell for each minnow and a
+// single-producer, single-consumer ring for each (sender, receiver) pair of
+// minnows that are connected.  Minnows map the segment and exchange datums by
+// copying them through the rings, without any system call while both sides
+// are busy.  An idle consumer sleeps on its doorbell with a futex, a producer
+// facing a full ring sleeps on the space word of that ring.
+
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <stdint.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PHISH_SHM_MAGIC "PHISHSHM"
+#define PHISH_SHM_ALIGN 64
+/// Ring size in kilobytes when the bait setting "ring-size" is not given.
+#define PHISH_SHM_RING_SIZE 256
+/// Number of times an empty or full ring is polled before sleeping on a futex.
+#define PHISH_SHM_SPIN 4096
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "the shm backend needs lock-free atomics");
+
+/// Stores the segment header, at offset zero.
+struct phish_shm_header
+{
+  char magic[8];
+  /// Bytes mapped by every process.
+  uint64_t segment_size;
+  uint32_t minnow_count;
+  uint32_t ring_count;
+  /// Bytes of data in each ring, a power of two.
+  uint64_t ring_size;
+  /// Offsets of the minnow and ring tables from the start of the segment.
+  uint64_t minnow_offset;
+  uint64_t ring_offset;
+  /// Counts the minnows that have mapped the segment.
+  std::atomic<uint32_t> ready;
+  /// Set by the bait once every minnow is ready.
+  std::atomic<uint32_t> start;
+};
+
+/// Stores the doorbell of a minnow, rung by producers when it sleeps.
+struct alignas(PHISH_SHM_ALIGN) phish_shm_minnow
+{
+  std::atomic<uint32_t> doorbell;
+  std::atomic<uint32_t> waiting;
+};
+
+/// Stores the state of a ring.  head and tail count bytes since the start of the run,
+/// so the data of a record begins at (position & (ring_size - 1)).
+struct phish_shm_ring
+{
+  uint32_t sender;
+  uint32_t receiver;
+  uint64_t data_offset;
+  /// Written by the producer only ...
+  alignas(PHISH_SHM_ALIGN) std::atomic<uint64_t> tail;
+  /// Written by the consumer only ...
+  alignas(PHISH_SHM_ALIGN) std::atomic<uint64_t> head;
+  /// Raised by a producer waiting for room, and the futex word it sleeps on ...
+  alignas(PHISH_SHM_ALIGN) std::atomic<uint32_t> full;
+  std::atomic<uint32_t> space;
+};
+
+/// Precedes each datum in a ring; records are padded to 8 bytes, so headers never wrap.
+struct phish_shm_record
+{
+  uint32_t size;
+  uint32_t frame;
+};
+
+inline uint64_t phish_shm_record_size(uint32_t size)
+{
+  return sizeof(phish_shm_record) + ((size + 7) & ~uint64_t(7));
+}
+
+inline uint64_t phish_shm_align(uint64_t offset, uint64_t alignment)
+{
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+inline phish_shm_minnow* phish_shm_minnows(phish_shm_header* header)
+{
+  return reinterpret_cast<phish_shm_minnow*>(reinterpret_cast<char*>(header) + header->minnow_offset);
+}
+
+inline phish_shm_ring* phish_shm_rings(phish_shm_header* header)
+{
+  return reinterpret_cast<phish_shm_ring*>(reinterpret_cast<char*>(header) + header->ring_offset);
+}
+
+inline char* phish_shm_data(phish_shm_header* header, phish_shm_ring* ring)
+{
+  return reinterpret_cast<char*>(header) + ring->data_offset;
+}
+
+/// Sleeps while *word == value, for at most timeout if one is given.  The segment is shared
+/// between processes, so the futex must not be private.
+inline void phish_shm_futex_wait(std::atomic<uint32_t>* word, uint32_t value, const struct timespec* timeout = 0)
+{
+  ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value, timeout, 0, 0);
+}
+
+inline void phish_shm_futex_wake(std::atomic<uint32_t>* word, int count = INT_MAX)
+{
+  ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, count, 0, 0, 0);
+}
+
+inline void phish_shm_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+#endif // !PHISH_SHM_H
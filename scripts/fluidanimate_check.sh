@@ -0,0 +1,44 @@
+#!/bin/bash
+#
+# Checks that fluidanimate builds which share cells between workers in
+# different ways compute the same fluid, e.g. fluidanimate_pthreads_atomic
+# and fluidanimate_pthreads_ghost against fluidanimate_pthreads (mutexes),
+# or fluidanimate_std_atomic and fluidanimate_std_ghost against
+# fluidanimate_std. REFERENCE and each binary simulate FRAMES frames of
+# INPUT on THREADS threads; the outputs are compared with the fluidcmp of
+# REFERENCE, pairing particles by position as threads add contributions in a
+# different order in every run.
+#
+# Usage: fluidanimate_check.sh <in.fluid> <#threads> <#frames> <reference> <fluidanimate>...
+
+if [ $# -lt 5 ]
+then
+    echo "Usage: $0 <in.fluid> <#threads> <#frames> <reference> <fluidanimate>..."
+    exit 1
+fi
+INPUT=$1
+THREADS=$2
+FRAMES=$3
+REFERENCE=$4
+shift 4
+PTOL=${PTOL:-1e-5}
+VTOL=${VTOL:-1e-3}
+DIR=`mktemp -d`
+trap "rm -rf $DIR" EXIT
+
+$REFERENCE 1 $THREADS $FRAMES $INPUT $DIR/ref.fluid > /dev/null || exit 1
+STATUS=0
+for BIN in "$@"
+do
+    $BIN 1 $THREADS $FRAMES $INPUT $DIR/out.fluid > /dev/null || exit 1
+    $REFERENCE 2 $DIR/out.fluid $DIR/ref.fluid --ptol $PTOL --vtol $VTOL --match > $DIR/cmp.log
+    if grep -q FAIL $DIR/cmp.log
+    then
+        echo `basename $BIN` FAIL
+        cat $DIR/cmp.log
+        STATUS=1
+    else
+        echo `basename $BIN` PASS
+    fi
+done
+exit $STATUS
@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Frame time and L2 misses of fluidanimate builds with different cell
+# layouts, e.g. fluidanimate_std (row-major cells) against
+# fluidanimate_std_morton (Z-order cells, particles re-sorted every frame).
+# Each binary simulates FRAMES frames of INPUT on THREADS threads under
+# perf stat; L2 misses are counted with the generic cache events of perf
+# when the CPU has no l2_rqsts.miss.
+#
+# Usage: fluidanimate_layout.sh <in.fluid> <#threads> <#frames> <fluidanimate>...
+
+if [ $# -lt 4 ]
+then
+    echo "Usage: $0 <in.fluid> <#threads> <#frames> <fluidanimate>..."
+    exit 1
+fi
+INPUT=$1
+THREADS=$2
+FRAMES=$3
+shift 3
+EVENT=l2_rqsts.miss
+if ! perf list 2>/dev/null | grep -q $EVENT
+then
+    EVENT=cache-misses
+fi
+OUT=`mktemp`
+LOG=`mktemp`
+trap "rm -f $OUT $LOG" EXIT
+
+echo "binary order ns/frame $EVENT"
+for BIN in "$@"
+do
+    perf stat -x, -e $EVENT -o $OUT $BIN 1 $THREADS $FRAMES $INPUT > $LOG
+    ORDER=`sed -n 's/.*cell order: \([a-z-]*\).*/\1/p' $LOG`
+    NS=`sed -n 's/.* \([0-9.e+-]*\) ns\/frame.*/\1/p' $LOG`
+    MISSES=`grep $EVENT $OUT | cut -d, -f1`
+    echo `basename $BIN` $ORDER $NS $MISSES
+done
@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# Bandwidth of the multi-term search kernels against the number of terms:
+# search_mmap over FILE with the first N lines of TERMS, N doubling, for
+# each kernel. Where ac overtakes each is where auto should switch, see
+# multi_threshold in apps/search/multisearch.hpp.
+#
+# Usage: search_sweep.sh <search_mmap> <file> <terms.txt> [#threads=1]
+
+if [ $# -lt 3 ]
+then
+    echo "Usage: $0 <search_mmap> <file> <terms.txt> [#threads=1]"
+    exit 1
+fi
+SEARCH=$1
+FILE=$2
+TERMS=$3
+THREADS=${4:-1}
+MAX=`grep -c . $TERMS`
+SUBSET=`mktemp`
+trap "rm -f $SUBSET" EXIT
+
+echo "terms each(GB/s) ac(GB/s)"
+N=1
+while [ $N -le $MAX ]
+do
+    grep . $TERMS | head -n $N > $SUBSET
+    LINE="$N"
+    for KERNEL in each ac
+    do
+        GBS=`$SEARCH $FILE @$SUBSET $THREADS $KERNEL 2>&1 >/dev/null | \
+             sed -n 's/.* \([0-9.e+-]*\) GB\/s$/\1/p'`
+        LINE="$LINE $GBS"
+    done
+    echo $LINE
+    if [ $N -lt $MAX ] && [ $((N * 2)) -gt $MAX ]
+    then
+        N=$MAX
+    else
+        N=$((N * 2))
+    fi
+done
@@ -0,0 +1,256 @@
+#include "phish-bait.h"
+#include "phish-bait-common.h"
+#include "phish-shm.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <new>
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <unistd.h>
+
+/// Returns the ring size in bytes: the "ring-size" setting in kilobytes, rounded up to a power of two
+/// that holds at least two datums of the largest size.
+static uint64_t ring_size()
+{
+  uint64_t kilobytes = PHISH_SHM_RING_SIZE;
+  if(g_settings.count("ring-size"))
+    std::istringstream(g_settings["ring-size"]) >> kilobytes;
+  uint64_t memory = 1024;
+  if(g_settings.count("memory"))
+    std::istringstream(g_settings["memory"]) >> memory;
+
+  const uint64_t minimum = std::max(kilobytes * 1024, 2 * phish_shm_record_size(memory * 1024));
+  uint64_t size = PHISH_SHM_ALIGN;
+  while(size < minimum)
+    size *= 2;
+  return size;
+}
+
+extern "C"
+{
+
+int phish_bait_start()
+{
+  std::string name;
+  std::vector<pid_t> processes;
+  try
+  {
+    const bool verbose = (g_settings.count("verbose") != 0) && (g_settings["verbose"] == "true");
+
+    // Assign a ring to each pair of connected minnows ...
+    std::map<std::pair<int, int>, int> ring_index;
+    std::vector<std::pair<int, int> > rings;
+    for(unsigned int i = 0; i != g_minnows.size(); ++i)
+    {
+      for(std::vector<connection>::const_iterator connection = g_minnows[i].outgoing.begin(); connection != g_minnows[i].outgoing.end(); ++connection)
+      {
+        for(std::vector<int>::const_iterator j = connection->input_indices.begin(); j != connection->input_indices.end(); ++j)
+        {
+          const std::pair<int, int> pair(i, *j);
+          if(ring_index.count(pair))
+            continue;
+          ring_index[pair] = rings.size();
+          rings.push_back(pair);
+        }
+      }
+    }
+
+    // Lay out the segment ...
+    const uint64_t data_size = ring_size();
+    const uint64_t minnow_offset = phish_shm_align(sizeof(phish_shm_header), PHISH_SHM_ALIGN);
+    const uint64_t ring_offset = phish_shm_align(minnow_offset + g_minnows.size() * sizeof(phish_shm_minnow), PHISH_SHM_ALIGN);
+    const uint64_t data_offset = phish_shm_align(ring_offset + rings.size() * sizeof(phish_shm_ring), ::sysconf(_SC_PAGESIZE));
+    const uint64_t segment_size = data_offset + rings.size() * data_size;
+
+    // Create the segment.  Its pages start out zeroed, which is the initial state of every counter ...
+    name = "/phish-" + string_cast(::getpid());
+    const int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0)
+      throw std::runtime_error(name + ": " + strerror(errno));
+    if(::ftruncate(fd, segment_size) < 0)
+    {
+      ::close(fd);
+      throw std::runtime_error(name + ": " + strerror(errno));
+    }
+    void* const segment = ::mmap(0, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(segment == MAP_FAILED)
+      throw std::runtime_error(name + ": " + strerror(errno));
+
+    phish_shm_header* const header = new(segment) phish_shm_header();
+    ::memcpy(header->magic, PHISH_SHM_MAGIC, sizeof(header->magic));
+    header->segment_size = segment_size;
+    header->minnow_count = g_minnows.size();
+    header->ring_count = rings.size();
+    header->ring_size = data_size;
+    header->minnow_offset = minnow_offset;
+    header->ring_offset = ring_offset;
+    for(unsigned int i = 0; i != g_minnows.size(); ++i)
+      new(&phish_shm_minnows(header)[i]) phish_shm_minnow();
+    for(unsigned int i = 0; i != rings.size(); ++i)
+    {
+      phish_shm_ring* const ring = new(&phish_shm_rings(header)[i]) phish_shm_ring();
+      ring->sender = rings[i].first;
+      ring->receiver = rings[i].second;
+      ring->data_offset = data_offset + i * data_size;
+    }
+
+    if(verbose)
+      std::cerr << "BAIT SHM: Segment " << name << " with " << rings.size() << " rings of " << data_size << " bytes." << std::endl;
+
+    // Create each of the minnow processes ...
+    if(verbose)
+      std::cerr << "BAIT SHM: Creating minnows." << std::endl;
+
+    for(unsigned int i = 0; i != g_minnows.size(); ++i)
+    {
+      const school& school = g_schools[g_minnows[i].school_index];
+      const minnow& minnow = g_minnows[i];
+      const std::string host = school.hosts[minnow.local_id];
+
+      std::vector<std::string> arguments;
+      arguments.insert(arguments.end(), school.arguments.begin(), school.arguments.end());
+      arguments.push_back("--phish-backend");
+      arguments.push_back("shm");
+      arguments.push_back("--phish-host");
+      arguments.push_back(host);
+      arguments.push_back("--phish-school-id");
+      arguments.push_back(school.id);
+      arguments.push_back("--phish-local-id");
+      arguments.push_back(string_cast(minnow.local_id));
+      arguments.push_back("--phish-local-count");
+      arguments.push_back(string_cast(school.count));
+      arguments.push_back("--phish-global-id");
+      arguments.push_back(string_cast(i));
+      arguments.push_back("--phish-global-count");
+      arguments.push_back(string_cast(g_minnows.size()));
+      arguments.push_back("--phish-memory");
+      arguments.push_back(g_settings.count("memory") ? g_settings["memory"] : "1024");
+      arguments.push_back("--phish-shm");
+      arguments.push_back(name);
+
+      for(std::map<int, int>::const_iterator incoming = minnow.incoming.begin(); incoming != minnow.incoming.end(); ++incoming)
+      {
+        const int port = incoming->first;
+        const int count = incoming->second;
+
+        std::ostringstream buffer;
+        buffer << port << "+" << count;
+
+        arguments.push_back("--phish-input-connections");
+        arguments.push_back(buffer.str());
+      }
+
+      // Recipients are named by the index of the ring leading to them ...
+      for(std::vector<connection>::const_iterator connection = minnow.outgoing.begin(); connection != minnow.outgoing.end(); ++connection)
+      {
+        std::ostringstream buffer;
+        buffer << string_cast(connection->output_port) << "+" << connection->send_pattern << "+" << string_cast(connection->input_port);
+        for(std::vector<int>::const_iterator j = connection->input_indices.begin(); j != connection->input_indices.end(); ++j)
+          buffer << "+" << ring_index[std::make_pair(int(i), *j)];
+
+        arguments.push_back("--phish-output-connection");
+        arguments.push_back(buffer.str());
+      }
+
+      if(verbose)
+      {
+        std::cerr << "BAIT SHM Command: ";
+        std::copy(arguments.begin(), arguments.end(), std::ostream_iterator<std::string>(std::cerr, " "));
+        std::cerr << std::endl;
+      }
+
+      switch(int pid = ::fork())
+      {
+        case -1:
+        {
+          throw std::runtime_error(strerror(errno));
+        }
+        case 0:
+        {
+          std::vector<char*> argv;
+          for(unsigned int i = 0; i != arguments.size(); ++i)
+            argv.push_back(const_cast<char*>(arguments[i].c_str()));
+          argv.push_back(0);
+
+          ::execvp(arguments[0].c_str(), argv.data());
+          std::cerr << "PHISH BAIT ERROR: " << arguments[0] << ": " << strerror(errno) << std::endl;
+          ::_exit(-1); // Only reached if execvp() fails.
+        }
+        default:
+        {
+          processes.push_back(pid);
+          continue;
+        }
+      }
+    }
+
+    // Wait for every minnow to map the segment, then tell them to begin processing ...
+    if(verbose)
+      std::cerr << "BAIT SHM: Starting minnows." << std::endl;
+
+    while(true)
+    {
+      const uint32_t ready = header->ready.load();
+      if(ready == processes.size())
+        break;
+      for(unsigned int i = 0; i != processes.size(); ++i)
+      {
+        int status = 0;
+        if(::waitpid(processes[i], &status, WNOHANG) == processes[i])
+        {
+          processes.erase(processes.begin() + i);
+          throw std::runtime_error("Minnow failed to start.");
+        }
+      }
+      const struct timespec timeout = { 0, 100000000 };
+      phish_shm_futex_wait(&header->ready, ready, &timeout);
+    }
+
+    // Every minnow holds a mapping now, so the name is no longer needed ...
+    ::shm_unlink(name.c_str());
+    name.clear();
+
+    header->start.store(1);
+    phish_shm_futex_wake(&header->start);
+    if(verbose)
+      std::cerr << "BAIT SHM: Minnows started." << std::endl;
+
+    // Wait for processes to terminate ...
+    for(unsigned int i = 0; i != processes.size(); ++i)
+    {
+      int status = 0;
+      int options = 0;
+      ::waitpid(processes[i], &status, options);
+    }
+    ::munmap(segment, segment_size);
+  }
+  catch(std::exception& e)
+  {
+    std::cerr << "PHISH BAIT ERROR: " << e.what() << std::endl;
+    for(unsigned int i = 0; i != processes.size(); ++i)
+    {
+      int status = 0;
+      ::kill(processes[i], SIGTERM);
+      ::waitpid(processes[i], &status, 0);
+    }
+    if(!name.empty())
+      ::shm_unlink(name.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+} // extern "C"
@@ -0,0 +1,1365 @@
+/* ----------------------------------------------------------------------
+   PHISH = Parallel Harness for Informatic Stream Hashing
+   http://www.sandia.gov/~sjplimp/phish.html
+   Steve Plimpton, sjplimp@sandia.gov, Sandia National Laboratories
+
+   Copyright (2012) Sandia Corporation.  Under the terms of Contract
+   DE-AC04-94AL85000 with Sandia Corporation, the U.S. Government retains
+   certain rights in this software.  This software is distributed under 
+   the modified Berkeley Software Distribution (BSD) License.
+
+   See the README file in the top-level PHISH directory.
+------------------------------------------------------------------------- */
+
+#include <iostream>
+#include <cstring>
+#include <map>
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "phish/hashlittle.h"
+#include "phish/phish.h"
+#include "phish/phish-bait-common.h"
+#include "phish/phish-common.h"
+#include "phish/phish-shm.h"
+
+#define phish_return_error(message, code) { phish_error(message); return code; }
+
+///////////////////////////////////////////////////////////////////////////////////
+// Internal state
+
+// Shared memory segment created by the bait ...
+static phish_shm_header* g_segment = 0;
+static size_t g_segment_size = 0;
+// Doorbell of this minnow ...
+static phish_shm_minnow* g_doorbell = 0;
+
+// Input port configuration ...
+
+// Stores a message callback for each input port ...
+static std::map<int, void(*)(int)> g_input_port_message_callback;
+// Stores a port-closed callback for each input port ...
+static std::map<int, void(*)()> g_input_port_closed_callback;
+// Stores whether an input port is optional ...
+static std::map<int, bool> g_input_port_required;
+// Stores the number of incoming connections for each input port ...
+static std::map<int, int> g_input_port_connection_count;
+
+// Stores the maximum size of a datum, in bytes ...
+static int g_datum_size = 1024;
+// Keeps pointers to every allocated datum ...
+static std::vector<char*> g_datum_pool;
+// Keeps pointers to unused datums ...
+static std::vector<char*> g_unused_datum_pool;
+
+char* use_datum()
+{
+  if(g_unused_datum_pool.empty())
+  {
+    g_datum_pool.push_back(new char[g_datum_size]());
+    return g_datum_pool.back();
+  }
+
+  char* const result = g_unused_datum_pool.back();
+  g_unused_datum_pool.pop_back();
+  return result;
+}
+
+void release_datum(char* datum)
+{
+  g_unused_datum_pool.push_back(datum);
+}
+
+// Temporary storage for packing outgoing datums ...
+static char* g_pack_begin = 0;
+static char* g_pack_end = 0;
+
+inline uint32_t& pack_count()
+{
+  return *reinterpret_cast<uint32_t*>(g_pack_begin);
+}
+
+// Temporary storage for packing incoming datums ...
+static char* g_unpack_begin = 0;
+static char* g_unpack_current = 0;
+static char* g_unpack_end = 0;
+
+inline uint32_t& unpack_count()
+{
+  return *reinterpret_cast<uint32_t*>(g_unpack_begin);
+}
+
+// Keeps track of whether a message loop is running ...
+static bool g_running = false;
+
+/// Producer end of a ring.  Every output connection leading to the same minnow shares it.
+class ring_writer
+{
+public:
+  ring_writer(phish_shm_ring* ring);
+  void write(uint8_t frame, const char* data, uint32_t size);
+
+private:
+  phish_shm_ring* const m_ring;
+  char* const m_data;
+  const uint64_t m_mask;
+  phish_shm_minnow* const m_receiver;
+  uint64_t m_tail;
+  // Last head read, so the consumer's cache line is only read when the ring looks full ...
+  uint64_t m_head;
+};
+
+/// Consumer end of a ring.
+class ring_reader
+{
+public:
+  ring_reader(phish_shm_ring* ring);
+  bool read(uint8_t* frame);
+
+private:
+  phish_shm_ring* const m_ring;
+  const char* const m_data;
+  const uint64_t m_mask;
+  uint64_t m_head;
+  // Last tail read, so the producer's cache line is only read when the ring looks empty ...
+  uint64_t m_tail;
+};
+
+// Stores the producer end of each output ring, by ring index ...
+static std::map<int, ring_writer*> g_ring_writers;
+// Stores the consumer end of each input ring ...
+static std::vector<ring_reader*> g_ring_readers;
+// Stores the input ring to poll first ...
+static unsigned int g_next_reader = 0;
+
+/// Defines a collection of message recipients (rings).
+typedef std::vector<ring_writer*> recipients_t;
+/// Abstract interface for classes that route messages to their destination(s).
+class output_connection
+{
+public:
+  output_connection(int input_port, const recipients_t& recipients);
+  virtual ~output_connection();
+  virtual void send() = 0;
+  virtual void send_hashed(char* key, int key_length) = 0;
+  virtual void send_direct(int destination) = 0;
+
+  int recipient_count();
+
+protected:
+  const int m_input_port;
+  const recipients_t m_recipients;
+  void raw_send(ring_writer* recipient);
+};
+
+static std::map<int, std::vector<output_connection*> > g_output_connections;
+static std::set<int> g_defined_output_ports;
+
+//////////////////////////////////////////////////////////////////////////////////
+// Internal implementation details
+
+template<typename T>
+static inline void pack_value(const T& data, uint8_t type)
+{
+  if(g_pack_end + sizeof(uint8_t) + sizeof(T) > g_pack_begin + g_datum_size)
+    phish_error("Send buffer overflow.");
+  pack_count() += 1;
+  *reinterpret_cast<uint8_t*>(g_pack_end) = type;
+  g_pack_end += sizeof(uint8_t);
+  *reinterpret_cast<T*>(g_pack_end) = data;
+  g_pack_end += sizeof(T);
+}
+
+template<typename T>
+static inline void pack_array(const T* data, int32_t count, uint8_t type)
+{
+  if(g_pack_end + sizeof(uint8_t) + sizeof(uint32_t) + (count * sizeof(T)) > g_pack_begin + g_datum_size)
+    phish_error("Send buffer overflow.");
+  pack_count() += 1;
+  *reinterpret_cast<uint8_t*>(g_pack_end) = type;
+  g_pack_end += sizeof(uint8_t);
+  *reinterpret_cast<uint32_t*>(g_pack_end) = count;
+  g_pack_end += sizeof(uint32_t);
+  ::memcpy(g_pack_end, data, count * sizeof(T));
+  g_pack_end += count * sizeof(T);
+}
+
+template <typename T>
+static inline void unpack_value(char** data, int32_t* count)
+{
+  *count = 1;
+
+  *data = g_unpack_current;
+  g_unpack_current += sizeof(T);
+}
+
+template <typename T>
+static inline void unpack_array(char** data, int32_t* count)
+{
+  *count = *reinterpret_cast<uint32_t*>(g_unpack_current);
+  g_unpack_current += sizeof(uint32_t);
+
+  *data = g_unpack_current;
+  g_unpack_current += *count * sizeof(T);
+}
+
+/// Defines a container for a collection of ports.
+typedef std::vector<int> port_collection;
+const port_collection output_ports()
+{
+  port_collection ports;
+  for(std::map<int, std::vector<output_connection*> >::iterator i = g_output_connections.begin(); i != g_output_connections.end(); ++i)
+    ports.push_back(i->first);
+  return ports;
+}
+
+/// Defines constants for managing message framing & control.
+enum message_frame
+{
+  PORT_MASK = 0x7f,
+  TYPE_MASK = 0x80,
+  CLOSE_MESSAGE = 0x80
+};
+
+// ring_writer implementation.
+ring_writer::ring_writer(phish_shm_ring* ring) :
+  m_ring(ring),
+  m_data(phish_shm_data(g_segment, ring)),
+  m_mask(g_segment->ring_size - 1),
+  m_receiver(&phish_shm_minnows(g_segment)[ring->receiver]),
+  m_tail(ring->tail.load()),
+  m_head(ring->head.load())
+{
+}
+
+void ring_writer::write(uint8_t frame, const char* data, uint32_t size)
+{
+  const uint64_t record_size = phish_shm_record_size(size);
+  if(record_size > m_mask + 1)
+    throw std::runtime_error("Datum larger than the ring.");
+
+  // Wait for room, spinning first and then sleeping until the consumer rings the space word ...
+  for(int spin = 0; m_tail + record_size - m_head > m_mask + 1; ++spin)
+  {
+    m_head = m_ring->head.load(std::memory_order_acquire);
+    if(m_tail + record_size - m_head <= m_mask + 1)
+      break;
+    if(spin < PHISH_SHM_SPIN)
+    {
+      phish_shm_pause();
+      continue;
+    }
+
+    const uint32_t space = m_ring->space.load(std::memory_order_acquire);
+    m_ring->full.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    m_head = m_ring->head.load(std::memory_order_acquire);
+    if(m_tail + record_size - m_head > m_mask + 1)
+      phish_shm_futex_wait(&m_ring->space, space);
+    m_ring->full.store(0, std::memory_order_relaxed);
+  }
+
+  phish_shm_record* const record = reinterpret_cast<phish_shm_record*>(m_data + (m_tail & m_mask));
+  record->size = size;
+  record->frame = frame;
+
+  // The payload may wrap around the end of the ring ...
+  const uint64_t begin = (m_tail + sizeof(phish_shm_record)) & m_mask;
+  const uint64_t first = std::min<uint64_t>(size, m_mask + 1 - begin);
+  ::memcpy(m_data + begin, data, first);
+  ::memcpy(m_data, data + first, size - first);
+
+  m_tail += record_size;
+  m_ring->tail.store(m_tail, std::memory_order_release);
+
+  // Ring the doorbell if the receiver went to sleep ...
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(m_receiver->waiting.load(std::memory_order_relaxed))
+  {
+    m_receiver->doorbell.fetch_add(1, std::memory_order_release);
+    phish_shm_futex_wake(&m_receiver->doorbell, 1);
+  }
+}
+
+// ring_reader implementation.
+ring_reader::ring_reader(phish_shm_ring* ring) :
+  m_ring(ring),
+  m_data(phish_shm_data(g_segment, ring)),
+  m_mask(g_segment->ring_size - 1),
+  m_head(ring->head.load()),
+  m_tail(ring->tail.load())
+{
+}
+
+/// Takes the next record into the unpack buffer, returning false if the ring is empty.
+bool ring_reader::read(uint8_t* frame)
+{
+  if(m_head == m_tail)
+  {
+    m_tail = m_ring->tail.load(std::memory_order_acquire);
+    if(m_head == m_tail)
+      return false;
+  }
+
+  const phish_shm_record* const record = reinterpret_cast<const phish_shm_record*>(m_data + (m_head & m_mask));
+  const uint32_t size = record->size;
+  *frame = record->frame;
+  if(size > uint32_t(g_datum_size))
+    throw std::runtime_error("Receive buffer overflow.");
+
+  unpack_count() = 0;
+  const uint64_t begin = (m_head + sizeof(phish_shm_record)) & m_mask;
+  const uint64_t first = std::min<uint64_t>(size, m_mask + 1 - begin);
+  ::memcpy(g_unpack_begin, m_data + begin, first);
+  ::memcpy(g_unpack_begin + first, m_data, size - first);
+  g_unpack_current = g_unpack_begin + sizeof(uint32_t);
+  g_unpack_end = g_unpack_begin + std::max<uint32_t>(size, sizeof(uint32_t));
+
+  m_head += phish_shm_record_size(size);
+  m_ring->head.store(m_head, std::memory_order_release);
+
+  // Wake the producer if it waits for room ...
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(m_ring->full.load(std::memory_order_relaxed))
+  {
+    m_ring->space.fetch_add(1, std::memory_order_release);
+    phish_shm_futex_wake(&m_ring->space, 1);
+  }
+
+  return true;
+}
+
+/// Takes the next record from the input rings, visiting them in turn so that no sender starves the others.
+/// Returns false if every input ring is empty.
+static bool poll_input(uint8_t* frame)
+{
+  const unsigned int count = g_ring_readers.size();
+  for(unsigned int i = 0; i != count; ++i)
+  {
+    const unsigned int reader = (g_next_reader + i) % count;
+    if(g_ring_readers[reader]->read(frame))
+    {
+      g_next_reader = (reader + 1) % count;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Blocks until a record arrives, spinning first and then sleeping on the doorbell of this minnow.
+static void wait_input(uint8_t* frame)
+{
+  while(true)
+  {
+    for(int spin = 0; spin != PHISH_SHM_SPIN; ++spin)
+    {
+      if(poll_input(frame))
+        return;
+      phish_shm_pause();
+    }
+
+    const uint32_t doorbell = g_doorbell->doorbell.load(std::memory_order_acquire);
+    g_doorbell->waiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const bool received = poll_input(frame);
+    if(!received)
+      phish_shm_futex_wait(&g_doorbell->doorbell, doorbell);
+    g_doorbell->waiting.store(0, std::memory_order_relaxed);
+    if(received)
+      return;
+  }
+}
+
+// output_connection implementation.
+output_connection::output_connection(int input_port, const recipients_t& recipients) :
+  m_input_port(input_port),
+  m_recipients(recipients)
+{
+}
+
+output_connection::~output_connection()
+{
+  const uint8_t frame = (m_input_port & PORT_MASK) | CLOSE_MESSAGE;
+  for(recipients_t::const_iterator recipient = m_recipients.begin(); recipient != m_recipients.end(); ++recipient)
+  {
+    (*recipient)->write(frame, 0, 0);
+  }
+}
+
+int output_connection::recipient_count()
+{
+  return m_recipients.size();
+}
+
+void output_connection::raw_send(ring_writer* recipient)
+{
+  const uint8_t frame = (m_input_port & PORT_MASK);
+  if(pack_count())
+  {
+    recipient->write(frame, g_pack_begin, g_pack_end - g_pack_begin);
+  }
+  else
+  {
+    recipient->write(frame, 0, 0);
+  }
+}
+
+/// output_connection implementation that broadcasts messages to every recipient.
+class broadcast_connection :
+  public output_connection
+{
+public:
+  broadcast_connection(int input_port, const recipients_t& recipients) :
+    output_connection(input_port, recipients)
+  {
+  }
+
+  void send()
+  {
+    for(recipients_t::const_iterator recipient = m_recipients.begin(); recipient != m_recipients.end(); ++recipient)
+    {
+      raw_send(*recipient);
+    }
+  }
+
+  void send_hashed(char* key, int key_length)
+  {
+    phish_warn("Cannot send hashed with broadcast connection.");
+  }
+
+  void send_direct(int destination)
+  {
+    phish_warn("Cannot send direct with broadcast connection.");
+  }
+};
+
+/// output_connection implementation that sends a message to one recipient, choosing recipients in round-robin order.
+class round_robin_connection :
+  public output_connection
+{
+  int m_index;
+
+public:
+  round_robin_connection(int input_port, const recipients_t& recipients) :
+    output_connection(input_port, recipients),
+    m_index(0)
+  {
+  }
+
+  void send()
+  {
+    ring_writer* const recipient = m_recipients[m_index];
+    m_index = (m_index + 1) % m_recipients.size();
+    raw_send(recipient);
+  }
+
+  void send_hashed(char* key, int key_length)
+  {
+    phish_warn("Cannot send hashed with roundrobin connection.");
+  }
+
+  void send_direct(int destination)
+  {
+    phish_warn("Cannot send direct with roundrobin connection.");
+  }
+};
+
+/// output_connection implementation that sends a message to one recipient, choosing recipients using a hashed key supplied by the caller.
+class hashed_connection :
+  public output_connection
+{
+public:
+  hashed_connection(int input_port, const recipients_t& recipients) :
+    output_connection(input_port, recipients)
+  {
+  }
+
+  void send()
+  {
+    phish_warn("Cannot send over hashed connection without key.");
+  }
+
+  void send_hashed(char* key, int key_length)
+  {
+    int index = hashlittle(key, key_length, 0) % m_recipients.size();
+    ring_writer* const recipient = m_recipients[index];
+    raw_send(recipient);
+  }
+
+  void send_direct(int destination)
+  {
+    phish_warn("Cannot send direct with hashed connection.");
+  }
+};
+
+/// output_connection implementation that sends a two-part message to one recipient, which is specified by the caller.
+class direct_connection :
+  public output_connection
+{
+public:
+  direct_connection(int input_port, const recipients_t& recipients) :
+    output_connection(input_port, recipients)
+  {
+  }
+
+  void send()
+  {
+    phish_warn("Cannot send over direct connection without recipient.");
+  }
+
+  void send_hashed(char* key, int key_length)
+  {
+    phish_warn("Cannot send hashed with direct connection.");
+  }
+
+  void send_direct(int destination)
+  {
+    int index = destination % m_recipients.size();
+    ring_writer* const recipient = m_recipients[index];
+    raw_send(recipient);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////////
+// Public API
+
+// Compatibility API for minnows written in C ...
+extern "C"
+{
+
+int phish_init(int* argc, char*** argv)
+{
+  try
+  {
+    phish_assert_not_initialized();
+    g_initialized = true;
+
+    std::vector<std::string> arguments(*argv, *argv + *argc);
+    std::vector<std::string> kept_arguments;
+
+    g_executable = arguments[0];
+
+    while(arguments.size())
+    {
+      const std::string argument = pop_argument(arguments);
+      if(argument == "--phish-backend")
+      {
+        g_backend = pop_argument(arguments);
+        if(g_backend != "shm")
+        {
+          std::ostringstream message;
+          message << "Incompatible backend: expected shm, using " << g_backend << ".";
+          phish_return_error(message.str().c_str(), -1);
+        }
+      }
+      else if(argument == "--phish-host")
+      {
+        g_host = pop_argument(arguments);
+      }
+      else if(argument == "--phish-school-id")
+      {
+        g_school_id = pop_argument(arguments);
+      }
+      else if(argument == "--phish-local-id")
+      {
+        std::istringstream stream(pop_argument(arguments));
+        stream >> g_local_id;
+      }
+      else if(argument == "--phish-local-count")
+      {
+        std::istringstream stream(pop_argument(arguments));
+        stream >> g_local_count;
+      }
+      else if(argument == "--phish-global-id")
+      {
+        std::istringstream stream(pop_argument(arguments));
+        stream >> g_global_id;
+      }
+      else if(argument == "--phish-global-count")
+      {
+        std::istringstream stream(pop_argument(arguments));
+        stream >> g_global_count;
+      }
+      else if(argument == "--phish-memory")
+      {
+        std::istringstream stream(pop_argument(arguments));
+        int kilobytes = 1;
+        stream >> kilobytes;
+
+        g_datum_size = kilobytes * 1024;
+      }
+      else if(argument == "--phish-shm")
+      {
+        const std::string name = pop_argument(arguments);
+        const int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+        if(fd < 0)
+          throw std::runtime_error(name + ": " + strerror(errno));
+
+        // Map the header to learn the size of the segment, then the whole of it ...
+        void* const header = ::mmap(0, sizeof(phish_shm_header), PROT_READ, MAP_SHARED, fd, 0);
+        if(header == MAP_FAILED)
+        {
+          ::close(fd);
+          throw std::runtime_error(name + ": " + strerror(errno));
+        }
+        g_segment_size = static_cast<const phish_shm_header*>(header)->segment_size;
+        ::munmap(header, sizeof(phish_shm_header));
+
+        void* const segment = ::mmap(0, g_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(segment == MAP_FAILED)
+          throw std::runtime_error(name + ": " + strerror(errno));
+        g_segment = static_cast<phish_shm_header*>(segment);
+        if(::memcmp(g_segment->magic, PHISH_SHM_MAGIC, sizeof(g_segment->magic)))
+          phish_return_error("Not a phish shared memory segment.", -1);
+      }
+      else if(argument == "--phish-input-connections")
+      {
+        std::string spec = pop_argument(arguments);
+        std::replace(spec.begin(), spec.end(), '+', ' ');
+        int port = 0;
+        int connection_count = 0;
+        std::istringstream stream(spec);
+        stream >> port >> connection_count;
+
+        g_input_port_connection_count[port] = connection_count;
+
+      }
+      else if(argument == "--phish-output-connection")
+      {
+        std::string spec = pop_argument(arguments);
+        std::replace(spec.begin(), spec.end(), '+', ' ');
+        int output_port = 0;
+        std::string pattern;
+        int input_port = 0;
+        std::vector<std::string> recipients;
+        std::istringstream stream(spec);
+        stream >> output_port >> pattern >> input_port;
+        while(true)
+        {
+          std::string recipient;
+          stream >> recipient;
+          if(!stream)
+            break;
+          recipients.push_back(recipient);
+        }
+
+        if(!g_output_connections.count(output_port))
+          g_output_connections[output_port] = std::vector<output_connection*>();
+
+        if(!g_segment)
+          phish_return_error("Output connections need --phish-shm first.", -1);
+
+        recipients_t recipient_rings;
+        for(std::vector<std::string>::iterator recipient = recipients.begin(); recipient != recipients.end(); ++recipient)
+        {
+          std::istringstream stream(*recipient);
+          int index = -1;
+          stream >> index;
+          if(index < 0 || uint32_t(index) >= g_segment->ring_count)
+            phish_return_error("Invalid ring index.", -1);
+          if(!g_ring_writers.count(index))
+            g_ring_writers[index] = new ring_writer(&phish_shm_rings(g_segment)[index]);
+          recipient_rings.push_back(g_ring_writers[index]);
+        }
+
+        if(pattern == PHISH_BAIT_SEND_PATTERN_BROADCAST)
+        {
+          g_output_connections[output_port].push_back(new broadcast_connection(input_port, recipient_rings));
+        }
+        else if(pattern == PHISH_BAIT_SEND_PATTERN_ROUND_ROBIN)
+        {
+          g_output_connections[output_port].push_back(new round_robin_connection(input_port, recipient_rings));
+        }
+        else if(pattern == PHISH_BAIT_SEND_PATTERN_HASHED)
+        {
+          g_output_connections[output_port].push_back(new hashed_connection(input_port, recipient_rings));
+        }
+        else if(pattern == PHISH_BAIT_SEND_PATTERN_DIRECT)
+        {
+          g_output_connections[output_port].push_back(new direct_connection(input_port, recipient_rings));
+        }
+        else
+        {
+          std::ostringstream message;
+          message << "Unknown send pattern: " << pattern;
+          phish_return_error(message.str().c_str(), -1);
+        }
+      }
+      else
+      {
+        kept_arguments.push_back(argument);
+      }
+    }
+
+    // Do some sanity checking on our command-line arguments ...
+    if(g_backend.empty() || g_host.empty() || g_school_id.empty() || !g_segment)
+      phish_return_error("Missing required phish arguments.  You must use the phish bait system to execute a minnow.", -1);
+
+    // Find the rings leading to this minnow ...
+    g_doorbell = &phish_shm_minnows(g_segment)[g_global_id];
+    for(uint32_t i = 0; i != g_segment->ring_count; ++i)
+    {
+      if(phish_shm_rings(g_segment)[i].receiver == uint32_t(g_global_id))
+        g_ring_readers.push_back(new ring_reader(&phish_shm_rings(g_segment)[i]));
+    }
+
+    // Setup send and receive buffers ...
+    g_pack_begin = use_datum();
+    pack_count() = 0;
+    g_pack_end = g_pack_begin + sizeof(uint32_t);
+
+    g_unpack_begin = use_datum();
+    g_unpack_current = g_unpack_begin;
+    g_unpack_end = g_unpack_begin;
+
+    // Tell the bait we are ready and wait to hear from it ...
+    g_segment->ready.fetch_add(1);
+    phish_shm_futex_wake(&g_segment->ready);
+    while(!g_segment->start.load())
+      phish_shm_futex_wait(&g_segment->start, 0);
+
+    // Cleanup argc & argv ...
+    *argc = get_argc(kept_arguments);
+    *argv = get_argv(kept_arguments);
+
+    return 0;
+  }
+  catch(std::exception& e)
+  {
+    std::ostringstream message;
+    message << "Uncaught exception: " << e.what();
+    phish_return_error(message.str().c_str(), -1);
+  }
+}
+
+int phish_exit()
+{
+  phish_assert_initialized();
+  phish_assert_checked();
+
+  // Close output ports ...
+  const port_collection ports = output_ports();
+  for(port_collection::const_iterator port = ports.begin(); port != ports.end(); ++port)
+    phish_close(*port);
+
+  // Cancel any running loop ...
+  g_running = false;
+
+  // Delete the ends of the rings ...
+  for(std::map<int, ring_writer*>::iterator writer = g_ring_writers.begin(); writer != g_ring_writers.end(); ++writer)
+    delete writer->second;
+  g_ring_writers.clear();
+  for(std::vector<ring_reader*>::iterator reader = g_ring_readers.begin(); reader != g_ring_readers.end(); ++reader)
+    delete *reader;
+  g_ring_readers.clear();
+
+  std::ostringstream message;
+  message << "Allocated " << g_datum_pool.size() << " datums.";
+  phish_message("Stats", message.str().c_str());
+  phish_stats();
+
+  // Cleanup the datum pool ...
+  for(std::vector<char*>::iterator datum = g_datum_pool.begin(); datum != g_datum_pool.end(); ++datum)
+    delete [] *datum;
+
+  // Unmap the segment, the bait removed its name once every minnow had mapped it ...
+  ::munmap(g_segment, g_segment_size);
+  g_segment = 0;
+  g_doorbell = 0;
+
+  return 0;
+}
+
+void phish_abort()
+{
+  if(!phish_abort_internal())
+    return;
+
+  phish_warn("Currently, phish_abort() doesn't shut-down the entire school.");
+  exit(-1);
+}
+
+int phish_input(int port, void(*message_callback)(int), void(*port_closed_callback)(), int required)
+{
+  phish_assert_initialized();
+  phish_assert_not_checked();
+
+  g_input_port_message_callback[port] = message_callback;
+  g_input_port_closed_callback[port] = port_closed_callback;
+  g_input_port_required[port] = required;
+
+  return 0;
+}
+
+int phish_output(int port)
+{
+  phish_assert_initialized();
+  phish_assert_not_checked();
+
+  g_defined_output_ports.insert(port);
+
+  return 0;
+}
+
+int phish_check()
+{
+  phish_assert_initialized();
+  phish_assert_not_checked();
+  g_checked = true;
+
+  for(std::map<int, int>::iterator port = g_input_port_connection_count.begin(); port != g_input_port_connection_count.end(); ++port)
+  {
+    if(!g_input_port_message_callback.count(port->first))
+    {
+      std::ostringstream message;
+      message << g_school_id << ": unexpected connection to undefined input port " << port->first;
+      phish_return_error(message.str().c_str(), -1);
+    }
+  }
+  for(std::map<int, void(*)(int)>::iterator port = g_input_port_message_callback.begin(); port != g_input_port_message_callback.end(); ++port)
+  {
+    if(!g_input_port_connection_count.count(port->first) && g_input_port_required[port->first])
+    {
+      std::ostringstream message;
+      message << g_school_id << ": required input port " << port->first << " does not have a connection.";
+      phish_return_error(message.str().c_str(), -1);
+    }
+  }
+  for(std::map<int, std::vector<output_connection*> >::iterator port = g_output_connections.begin(); port != g_output_connections.end(); ++port)
+  {
+    if(!g_defined_output_ports.count(port->first))
+    {
+      std::ostringstream message;
+      message << g_school_id << ": unexpected connection from undefined output port " << port->first;
+      phish_return_error(message.str().c_str(), -1);
+    }
+  }
+
+  return 0;
+}
+
+int phish_close(int port)
+{
+  phish_assert_initialized();
+  phish_assert_checked();
+
+  if(!g_output_connections.count(port))
+    return 0;
+  for(unsigned int i = 0; i != g_output_connections[port].size(); ++i)
+    delete g_output_connections[port][i];
+  g_output_connections.erase(port);
+
+  return 0;
+}
+
+int phish_loop()
+{
+  phish_assert_initialized();
+  phish_assert_checked();
+
+  if(g_running)
+  {
+    phish_warn("Cannot call phish_loop() while a loop is already running.");
+    return 0;
+  }
+  g_running = true;
+
+  while(g_running)
+  {
+    try
+    {
+      uint8_t frame = 0;
+      wait_input(&frame);
+      const int port = (frame & PORT_MASK);
+
+      if((frame & TYPE_MASK) == CLOSE_MESSAGE)
+      {
+        g_input_port_connection_count[port] -= 1;
+        if(g_input_port_connection_count[port] == 0)
+        {
+          g_input_port_connection_count.erase(port);
+          if(g_input_port_closed_callback.count(port) && g_input_port_closed_callback[port])
+          {
+            g_input_port_closed_callback[port]();
+          }
+          if(g_input_port_connection_count.size() == 0)
+          {
+            g_running = false;
+            if(g_all_input_ports_closed)
+              g_all_input_ports_closed();
+          }
+        }
+      }
+      else
+      {
+        g_received_count += 1;
+
+        if(g_input_port_message_callback[port])
+          g_input_port_message_callback[port](unpack_count());
+      }
+    }
+    catch(std::exception& e)
+    {
+      phish_warn(e.what());
+    }
+  }
+
+  return 0;
+}
+
+int phish_probe(void (*idle_callback)())
+{
+  phish_assert_initialized();
+  phish_assert_checked();
+
+  if(g_running)
+  {
+    phish_warn("Cannot call phish_probe() while a loop is already running.");
+    return 0;
+  }
+  g_running = true;
+
+  while(g_running)
+  {
+    try
+    {
+      uint8_t frame = 0;
+      if(poll_input(&frame))
+      {
+        const int port = (frame & PORT_MASK);
+
+        if((frame & TYPE_MASK) == CLOSE_MESSAGE)
+        {
+          g_input_port_connection_count[port] -= 1;
+          if(g_input_port_connection_count[port] == 0)
+          {
+            g_input_port_connection_count.erase(port);
+            if(g_input_port_closed_callback.count(port))
+            {
+              g_input_port_closed_callback[port]();
+            }
+            if(g_input_port_connection_count.size() == 0)
+            {
+              g_running = false;
+              if(g_all_input_ports_closed)
+                g_all_input_ports_closed();
+            }
+          }
+        }
+        else
+        {
+          g_received_count += 1;
+
+          if(g_input_port_message_callback[port])
+            g_input_port_message_callback[port](unpack_count());
+        }
+      }
+      else
+      {
+        idle_callback();
+      }
+    }
+    catch(std::exception& e)
+    {
+      phish_warn(e.what());
+    }
+  }
+
+  return 0;
+}
+
+int phish_recv()
+{
+  phish_assert_initialized();
+  phish_assert_checked();
+
+  if(g_running)
+  {
+    phish_warn("Cannot call phish_recv() while a loop is running.");
+    return 0;
+  }
+
+  uint8_t frame = 0;
+  if(poll_input(&frame))
+  {
+    const int port = (frame & PORT_MASK);
+
+    if((frame & TYPE_MASK) == CLOSE_MESSAGE)
+    {
+      g_input_port_connection_count[port] -= 1;
+      if(g_input_port_connection_count[port] == 0)
+      {
+        g_input_port_connection_count.erase(port);
+        if(g_input_port_closed_callback.count(port) && g_input_port_closed_callback[port])
+        {
+          g_input_port_closed_callback[port]();
+        }
+        if(g_input_port_connection_count.size() == 0)
+        {
+          if(g_all_input_ports_closed)
+            g_all_input_ports_closed();
+          return -1;
+        }
+      }
+    }
+    else
+    {
+      g_received_count += 1;
+
+      if(g_input_port_message_callback[port])
+        g_input_port_message_callback[port](unpack_count());
+      return unpack_count();
+    }
+  }
+
+  return 0;
+}
+
+void phish_send(int port)
+{
+  if(!g_output_connections.count(port))
+  {
+    std::ostringstream message;
+    message << "Cannot send message to closed port: " << port;
+    phish_warn(message.str().c_str());
+    return;
+  }
+
+  const int end = g_output_connections[port].size();
+  for(int i = 0; i != end; ++i)
+    g_output_connections[port][i]->send();
+
+  g_sent_count += 1;
+
+  pack_count() = 0;
+  g_pack_end = g_pack_begin + sizeof(uint32_t);
+}
+
+void phish_send_key(int port, char* key, int key_length)
+{
+  if(!g_output_connections.count(port))
+  {
+    std::ostringstream message;
+    message << "Cannot send message to closed port: " << port;
+    phish_warn(message.str().c_str());
+    return;
+  }
+
+  const int end = g_output_connections[port].size();
+  for(int i = 0; i != end; ++i)
+    g_output_connections[port][i]->send_hashed(key, key_length);
+
+  g_sent_count += 1;
+
+  pack_count() = 0;
+  g_pack_end = g_pack_begin + sizeof(uint32_t);
+}
+
+void phish_send_direct(int port, int receiver)
+{
+  if(!g_output_connections.count(port))
+  {
+    std::ostringstream message;
+    message << "Cannot send message to closed port: " << port;
+    phish_warn(message.str().c_str());
+    return;
+  }
+
+  const int end = g_output_connections[port].size();
+  for(int i = 0; i != end; ++i)
+    g_output_connections[port][i]->send_direct(receiver);
+
+  g_sent_count += 1;
+
+  pack_count() = 0;
+  g_pack_end = g_pack_begin + sizeof(uint32_t);
+}
+
+void phish_reset_receiver(int, int)
+{
+  phish_warn("phish_reset_receiver() Not implemented.");
+}
+
+void phish_repack()
+{
+  release_datum(g_pack_begin);
+
+  g_pack_begin = g_unpack_begin;
+  g_pack_end = g_unpack_end;
+
+  g_unpack_begin = use_datum();
+  g_unpack_current = g_unpack_begin;
+  g_unpack_end = g_unpack_begin;
+}
+
+void phish_pack_raw(char* data, int32_t length)
+{
+  pack_array(data, length, PHISH_RAW);
+}
+
+void phish_pack_char(char value)
+{
+  pack_value(value, PHISH_CHAR);
+}
+
+void phish_pack_int8(int8_t value)
+{
+  pack_value(value, PHISH_INT8);
+}
+
+void phish_pack_int16(int16_t value)
+{
+  pack_value(value, PHISH_INT16);
+}
+
+void phish_pack_int32(int32_t value)
+{
+  pack_value(value, PHISH_INT32);
+}
+
+void phish_pack_int64(int64_t value)
+{
+  pack_value(value, PHISH_INT64);
+}
+
+void phish_pack_uint8(uint8_t value)
+{
+  pack_value(value, PHISH_UINT8);
+}
+
+void phish_pack_uint16(uint16_t value)
+{
+  pack_value(value, PHISH_UINT16);
+}
+
+void phish_pack_uint32(uint32_t value)
+{
+  pack_value(value, PHISH_UINT32);
+}
+
+void phish_pack_uint64(uint64_t value)
+{
+  pack_value(value, PHISH_UINT64);
+}
+
+void phish_pack_float(float value)
+{
+  pack_value(value, PHISH_FLOAT);
+}
+
+void phish_pack_double(double value)
+{
+  pack_value(value, PHISH_DOUBLE);
+}
+
+void phish_pack_string(char* value)
+{
+  pack_array(value, strlen(value) + 1, PHISH_STRING);
+}
+
+void phish_pack_int8_array(int8_t* array, int32_t count)
+{
+  pack_array(array, count, PHISH_INT8_ARRAY);
+}
+
+void phish_pack_int16_array(int16_t* array, int32_t count)
+{
+  pack_array(array, count, PHISH_INT16_ARRAY);
+}
+
+void phish_pack_int32_array(int32_t* array, int32_t count)
+{
+  pack_array(array, count, PHISH_INT32_ARRAY);
+}
+
+void phish_pack_int64_array(int64_t* array, int32_t count)
+{
+  pack_array(array, count, PHISH_INT64_ARRAY);
+}
+
+void phish_pack_uint8_array(uint8_t* array, int32_t count)
+{
+  pack_array(array, count, PHISH_UINT8_ARRAY);
+}
+
+void phish_pack_uint16_array(uint16_t* array, int32_t count)
+{
+  pack_array(array, count, PHISH_UINT16_ARRAY);
+}
+
+void phish_pack_uint32_array(uint32_t* array, int32_t count)
+{
+  pack_array(array, count, PHISH_UINT32_ARRAY);
+}
+
+void phish_pack_uint64_array(uint64_t* array, int32_t count)
+{
+  pack_array(array, count, PHISH_UINT64_ARRAY);
+}
+
+void phish_pack_float_array(float* array, int32_t count)
+{
+  pack_array(array, count, PHISH_FLOAT_ARRAY);
+}
+
+void phish_pack_double_array(double* array, int32_t count)
+{
+  pack_array(array, count, PHISH_DOUBLE_ARRAY);
+}
+
+void phish_pack_pickle(char* data, int32_t count)
+{
+  pack_array(data, count, PHISH_PICKLE);
+}
+
+int phish_unpack(char** data, int32_t* count)
+{
+  if(g_unpack_current >= g_unpack_end)
+    phish_return_error("No data to unpack.", -1);
+
+  const uint8_t type = *reinterpret_cast<uint8_t*>(g_unpack_current);
+  g_unpack_current += sizeof(uint8_t);
+
+  switch(type)
+  {
+    case PHISH_CHAR:
+      unpack_value<char>(data, count);
+      return type;
+
+    case PHISH_INT8:
+      unpack_value<int8_t>(data, count);
+      return type;
+
+    case PHISH_INT16:
+      unpack_value<int16_t>(data, count);
+      return type;
+
+    case PHISH_INT32:
+      unpack_value<int32_t>(data, count);
+      return type;
+
+    case PHISH_INT64:
+      unpack_value<int64_t>(data, count);
+      return type;
+
+    case PHISH_UINT8:
+      unpack_value<uint8_t>(data, count);
+      return type;
+
+    case PHISH_UINT16:
+      unpack_value<uint16_t>(data, count);
+      return type;
+
+    case PHISH_UINT32:
+      unpack_value<uint32_t>(data, count);
+      return type;
+
+    case PHISH_UINT64:
+      unpack_value<uint64_t>(data, count);
+      return type;
+
+    case PHISH_FLOAT:
+      unpack_value<float>(data, count);
+      return type;
+
+    case PHISH_DOUBLE:
+      unpack_value<double>(data, count);
+      return type;
+
+    case PHISH_RAW:
+      unpack_array<char>(data, count);
+      return type;
+
+    case PHISH_STRING:
+      unpack_array<char>(data, count);
+      return type;
+
+    case PHISH_INT8_ARRAY:
+      unpack_array<int8_t>(data, count);
+      return type;
+
+    case PHISH_INT16_ARRAY:
+      unpack_array<int16_t>(data, count);
+      return type;
+
+    case PHISH_INT32_ARRAY:
+      unpack_array<int32_t>(data, count);
+      return type;
+
+    case PHISH_INT64_ARRAY:
+      unpack_array<int64_t>(data, count);
+      return type;
+
+    case PHISH_UINT8_ARRAY:
+      unpack_array<uint8_t>(data, count);
+      return type;
+
+    case PHISH_UINT16_ARRAY:
+      unpack_array<uint16_t>(data, count);
+      return type;
+
+    case PHISH_UINT32_ARRAY:
+      unpack_array<uint32_t>(data, count);
+      return type;
+
+    case PHISH_UINT64_ARRAY:
+      unpack_array<uint64_t>(data, count);
+      return type;
+
+    case PHISH_FLOAT_ARRAY:
+      unpack_array<float>(data, count);
+      return type;
+
+    case PHISH_DOUBLE_ARRAY:
+      unpack_array<double>(data, count);
+      return type;
+
+    case PHISH_PICKLE:
+      unpack_array<char>(data, count);
+      return type;
+  }
+
+  phish_return_error("Unknown datum type.", -1);
+}
+
+int phish_query(const char* kw, int flag1, int flag2)
+{
+  const std::string keyword(kw);
+
+  if(keyword == "idlocal")
+    return g_local_id;
+  else if(keyword == "nlocal")
+    return g_local_count;
+  else if(keyword == "idglobal")
+    return g_global_id;
+  else if(keyword == "nglobal")
+    return g_global_count;
+  else if(keyword == "outport/connections")
+  {
+    if(0 == g_output_connections.count(flag1))
+      phish_return_error("Invalid phish_query flags", -3);
+    return g_output_connections[flag1].size(); 
+  }
+  else if(keyword == "outport/nminnows")
+  {
+    if(0 == g_output_connections.count(flag1))
+      phish_return_error("Invalid phish_query port", -3);
+    if(flag2 < 0 || (unsigned)flag2 >= g_output_connections[flag1].size())
+      phish_return_error("Invalid phish_query connection", -3);
+    return g_output_connections[flag1][flag2]->recipient_count();
+  }
+  else
+    phish_return_error("Invalid phish_query keyword.", -1);
+}
+
+} // extern "C"